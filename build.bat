@@ -2,20 +2,26 @@
 
 IF "%1"=="PORT" (
 del /F .\uart_port.exe
-g++ -Wall -o .\uart_port.exe uart_port.c uart_win32.c
+g++ -Wall -o .\uart_port.exe uart_port.c uart_win32.c -lws2_32
 goto :EOF
 )
 
 IF "%1"=="DLL" (
 del /F .\uart.dll
 g++ -D MAKE_DLL -O3 -Wall -c uart_win32.c 
-gcc -shared -s -o .\uart.dll uart_win32.o
+gcc -shared -s -o .\uart.dll uart_win32.o -lws2_32
 goto :EOF
 )
 
 IF "%1"=="EXE" (
 del /F .\uart.exe
-g++ -Wall -s -o .\uart.exe uart_main.c uart_win32.c 
+g++ -Wall -s -o .\uart.exe uart_main.c uart_bridge.c uart_load.c uart_modbus.c uart_win32.c -lws2_32
+goto :EOF
+)
+
+IF "%1"=="BENCH" (
+del /F .\uart_bench.exe
+g++ -Wall -O2 -o .\uart_bench.exe uart_bench.c uart_bench_check.c uart_modbus.c uart_win32.c -lws2_32
 goto :EOF
 )
 
@@ -23,5 +29,6 @@ echo usage:
 echo     build.bat PORT
 echo     build.bat DLL
 echo     build.bat EXE
+echo     build.bat BENCH
 
 :EOF
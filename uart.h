@@ -0,0 +1,452 @@
+#ifndef _uart_h
+#define _uart_h
+
+#include <stdint.h>
+
+// the most a port's I/O profile can ask for, see uart_io_profile
+#ifndef COMM_READ_BUF_SIZE
+#define COMM_READ_BUF_SIZE      (16 * 1024)    // -D to compare sizes, e.g. with uart_bench suite
+#endif
+#define COMM_WRITE_BUF_SIZE     (64 * 1024)
+
+#ifdef _WIN32
+
+#ifdef MAKE_DLL
+#ifdef __cplusplus
+#define EXPORT_DLL extern "C" __declspec(dllexport) __stdcall
+#else
+#define EXPORT_DLL __declspec(dllexport) __stdcall
+#endif
+#define CB_CALL __stdcall
+#else
+#define EXPORT_DLL
+#define CB_CALL
+#endif
+
+#else
+
+#ifdef MAKE_DLL
+#ifdef __cplusplus
+#define EXPORT_DLL extern "C" __attribute__((visibility("default")))
+#else
+#define EXPORT_DLL __attribute__((visibility("default")))
+#endif
+#else
+#define EXPORT_DLL
+#endif
+#define CB_CALL
+
+#endif
+
+#if  _MSC_VER > 1800
+#define gets gets_s
+#endif
+
+typedef enum
+{
+    cc_shutdown,
+    cc_error
+} enum_comm_close;
+
+typedef CB_CALL void (*f_on_comm_read)(void *param, const char *p, const int l);
+typedef CB_CALL void (*f_on_comm_close)(void *param, const enum_comm_close reason);
+typedef CB_CALL void (*f_on_comm_writable)(void *param, const int space);
+typedef CB_CALL void (*f_on_watch)(void *param, const intptr_t fd, const int events);
+typedef CB_CALL void (*f_on_comm_line)(void *param, const int line, const int changed);
+typedef CB_CALL void (*f_on_frame)(void *param, const char *p, const int l);
+
+// uart_watch events
+#define UART_WATCH_IN       1
+#define UART_WATCH_OUT      2
+#define UART_WATCH_ERR      4   // reported only
+#define UART_MAX_WATCHES    60
+
+// line state: modem inputs (levels),
+#define UART_LINE_CTS       0x01
+#define UART_LINE_DSR       0x02
+#define UART_LINE_RI        0x04
+#define UART_LINE_DCD       0x08
+// line events since the last report (BREAK is also the output of uart_set_line),
+#define UART_LINE_BREAK     0x10
+#define UART_LINE_FRAMING   0x20
+#define UART_LINE_PARITY    0x40
+#define UART_LINE_OVERRUN   0x80
+// outputs
+#define UART_LINE_DTR       0x100
+#define UART_LINE_RTS       0x200
+#define UART_LINE_INPUTS    (UART_LINE_CTS | UART_LINE_DSR | UART_LINE_RI | UART_LINE_DCD)
+
+typedef struct _uart_obj uart_obj, *p_uart_obj;
+typedef struct _uart_reactor uart_reactor;
+typedef struct _uart_capture uart_capture;
+typedef struct _uart_expect uart_expect;
+
+// RX delivery policy, see uart_rx.h. All zero: every read is delivered as is.
+typedef struct
+{
+    int min_chunk;      // deliver once this many bytes are held,
+    int idle_us;        // or once the line has been quiet this long,
+    int max_hold_us;    // or once the first held byte is this old (0: no limit)
+} uart_rx_policy;
+
+// Buffer sizes and timeouts of a port, see uart_set_io_profile. uart_io_preset
+// fills one in for a baud rate and the size of the messages on the line.
+typedef struct
+{
+    int             read_size;      // bytes per read and per batch, at most COMM_READ_BUF_SIZE
+    int             tx_queue;       // bytes uart_send can queue, at most COMM_WRITE_BUF_SIZE
+    int             driver_queue;   // Win32 driver queues (0: 100 ms at the baud rate, 10 KB at
+                                    // least); the tty layer's are fixed
+    uart_rx_policy  rx;
+    int             tx_coalesce;    // while the line is busy, sends leaving fewer bytes queued wait
+                                    // for the next write (0: off, at most tx_queue); see uart_flush
+    int             tx_delay_us;    // POSIX: they wait no longer than this (0: the line time of
+                                    // the write before them)
+} uart_io_profile;
+
+typedef enum
+{
+    io_balanced,        // what a port opens with
+    io_low_latency,     // request/response control links: every read delivered at once, short queues
+    io_bulk             // streaming: large reads and queues, batches of 20 ms or more, TX coalescing
+} enum_io_preset;
+
+// Per port counters, see uart_get_stats. Line errors are counted by the driver
+// on POSIX (none on a pty) and from ClearCommError on Win32.
+typedef struct
+{
+    uint64_t rx_bytes;          // delivered to on_comm_read
+    uint64_t rx_chunks;         // on_comm_read calls
+    uint64_t tx_bytes;          // taken by the driver
+    uint64_t tx_chunks;         // writes that took data
+    uint64_t tx_dropped;        // bytes uart_send / uart_send_timeout did not queue
+    uint64_t rx_syscalls;       // reads (and on POSIX re-arms) made for RX
+    uint64_t tx_syscalls;       // writes made for TX
+    uint64_t breaks;
+    uint64_t framing_errors;
+    uint64_t parity_errors;
+    uint64_t overruns;          // the UART's FIFO
+    uint64_t rx_overflows;      // the driver's input buffer
+    uint64_t tx_high_water;     // most bytes queued in the TX ring at once
+    uint64_t tx_pending_us;     // time queued TX data waited for the device to take it
+    uint64_t tx_pending_max_us; // the longest such wait
+    uint64_t rx_frames;         // delivered to on_frame
+    uint64_t rx_frame_errors;   // frames dropped: too long, or they did not decode
+    uint64_t rx_crc_errors;     // frames dropped: their CRC did not match
+    uint64_t tx_throttled_us;   // of tx_pending_us, what the baud rate does not explain: TX held by
+                                // flow control, or by a peer not reading (a pty)
+    uint64_t tx_wakeups;        // sends (and flushes) that woke the I/O thread
+} uart_stats;
+
+// flow control, see uart_set_flow
+typedef enum
+{
+    flow_none,
+    flow_rtscts,        // RTS/CTS handshake, the driver drives RTS
+    flow_dsrdtr,        // DSR/DTR handshake, the driver drives DTR (Win32 only)
+    flow_xonxoff        // XON/XOFF (DC1/DC3) both ways, by the driver; not for binary data
+} enum_flow_control;
+
+// a segment of uart_sendv
+typedef struct
+{
+    const char *p;
+    int         l;
+} uart_iovec;
+
+// CRCs, see uart_crc.h
+typedef enum
+{
+    crc_none,
+    crc_modbus,         // CRC-16/MODBUS, low byte first on the line
+    crc_ccitt,          // CRC-16/CCITT-FALSE, high byte first
+    crc_32              // CRC-32 as zlib's, low byte first
+} enum_crc_kind;
+
+// A match of uart_expect_wait, see uart_expect.h
+typedef struct
+{
+    int      pattern;   // its index in the patterns given to uart_expect_create
+    int      length;
+    uint64_t offset;    // of its first byte in the RX stream since uart_set_expect
+    int64_t  time_us;   // arrival of its last byte, as uart_rx_time_us
+} uart_expect_match;
+
+#define UART_EXPECT_NOCASE  1   // letters match either case
+
+// RX framing, see uart_frame.h
+typedef enum
+{
+    frame_none,         // chunks as read, to on_comm_read
+    frame_delimiter,    // frames end with delimiter, which is not delivered
+    frame_length,       // a big endian length of length_bytes (1, 2 or 4), then the frame
+    frame_slip,         // RFC 1055
+    frame_cobs          // consistent overhead byte stuffing, frames end with 0
+} enum_frame_kind;
+
+typedef struct
+{
+    int kind;           // enum_frame_kind
+    int delimiter;      // frame_delimiter: the byte ending a frame
+    int length_bytes;   // frame_length
+    int max_frame;      // longest frame as it is on the line, 0: 4 KB
+    int crc;            // enum_crc_kind: appended to each frame sent, checked and
+                        // stripped from each received; not with frame_delimiter
+} uart_framing;
+
+#ifdef _WIN32
+#include "uart_win32.h"
+#else
+#include "uart_posix.h"
+#endif
+
+// portnr is mapped to "\\.\COMn" on Windows and "/dev/ttySn" elsewhere
+EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
+            const int portnr,
+            int  baud,          // baudrate
+            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
+            int  databits,      // databits
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param,
+            const bool       async_io);
+
+// same as uart_open, but the device is given by path, such as "COM12",
+// "/dev/ttyUSB0" or the slave side of a pty
+EXPORT_DLL uart_obj *uart_open_dev(uart_obj *uart,
+            const char *dev,
+            int  baud,
+            const char *parity,
+            int  databits,
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param,
+            const bool       async_io);
+
+// safe to call from any thread. Returns the number of bytes accepted, which is
+// less than l when the TX buffer is full; the rest is left to the caller.
+// l = 0 arms the writable callback, which fires as soon as pending TX is at
+// its mark, right away if it already is.
+EXPORT_DLL int uart_send(uart_obj *uart, const char *buf, const int l);
+
+// With TX coalescing (uart_io_profile.tx_coalesce) a small send while the port
+// is still sending earlier bytes leaves the I/O thread asleep: it takes the
+// bytes with its next write, once tx_coalesce bytes are queued, or when the
+// earlier ones should be out (POSIX: by the baud rate, at most tx_delay_us;
+// Win32: when the WriteFile in flight completes). A send to an idle port goes
+// out at once, so an odd keystroke or request is not delayed. uart_flush hands
+// what is queued to the driver now, e.g. at the end of a message.
+EXPORT_DLL void uart_flush(uart_obj *uart);
+
+// blocks until all of buf is accepted, the port closes, or timeout_ms elapses
+// (< 0: wait forever). Returns the number of bytes accepted.
+EXPORT_DLL int uart_send_timeout(uart_obj *uart, const char *buf, const int l, const int timeout_ms);
+
+// Queues the count segments of v as one block, e.g. a header, a payload and a
+// trailer without concatenating them first: all of them, back to back, with
+// nothing another thread sends in between, or none. Waits for room as
+// uart_send_timeout does (0: not at all). Returns the bytes queued, the sum of
+// the segments' lengths or 0; 0 as well for more than the port's tx_queue.
+EXPORT_DLL int uart_sendv(uart_obj *uart, const uart_iovec *v, const int count, const int timeout_ms);
+
+// on_comm_writable is called from the I/O thread when pending TX data drops to
+// low_watermark bytes or less, after a uart_send found the buffer full or
+// above the mark. space is the number of bytes uart_send can take right away.
+EXPORT_DLL void uart_set_writable_callback(uart_obj *uart,
+            f_on_comm_writable on_comm_writable,
+            void              *comm_writable_param,
+            const int          low_watermark);
+
+// a port fed by only one thread may skip the multi-producer claim in uart_send
+EXPORT_DLL void uart_set_single_producer(uart_obj *uart, const bool single);
+
+// Without a reactor the port closes before this returns. With one, the same,
+// except when called from a callback of the worker serving the port: then the
+// port closes once the callback returns.
+EXPORT_DLL void uart_shutdown(uart_obj *uart);
+
+// A reactor serves many ports from a few worker threads instead of one thread
+// (two on Win32 without async_io) per port. Each port is bound to the least
+// loaded worker when it opens; its callbacks run on that worker.
+// workers <= 0: one per online CPU. pin: worker i runs on CPU i (mod CPUs).
+EXPORT_DLL uart_reactor *uart_reactor_create(const int workers, const bool pin);
+
+// all ports served by the reactor must be shut down first
+EXPORT_DLL void uart_reactor_destroy(uart_reactor *reactor);
+
+// uart_open_dev for a port served by reactor. I/O is always asynchronous.
+EXPORT_DLL uart_obj *uart_reactor_open(uart_reactor *reactor,
+            uart_obj *uart,
+            const char *dev,
+            int  baud,
+            const char *parity,
+            int  databits,
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param);
+
+EXPORT_DLL int get_uart_obj_size(void);
+
+// any thread, applies from the next read on
+EXPORT_DLL void uart_set_rx_policy(uart_obj *uart, const uart_rx_policy *policy);
+
+// Fills in profile for preset at baud, message the usual size of a message
+// (<= 0: unknown). false: no such preset.
+EXPORT_DLL bool uart_io_preset(uart_io_profile *profile, const int preset, const int baud, const int message);
+
+// Any thread, on a live port: senders go by the new tx_queue at once, the I/O
+// thread takes the rest at its next wake, between two reads. A smaller
+// tx_queue keeps what is queued beyond it. false: a size out of range, nothing
+// changed.
+EXPORT_DLL bool uart_set_io_profile(uart_obj *uart, const uart_io_profile *profile);
+
+EXPORT_DLL void uart_get_io_profile(uart_obj *uart, uart_io_profile *profile);
+
+// Zero-copy RX from a pool of buffers (1 .. UART_RX_POOL_MAX), see uart_rx.h.
+// Every batch delivered after this returns (after the calling callback, when
+// called from one) comes from the pool: on_comm_read owns p until it calls
+// uart_rx_release(p). Once per port; false: no pool.
+EXPORT_DLL bool uart_set_rx_pool(uart_obj *uart, const int buffers);
+
+// one more reference on a pooled RX buffer, e.g. to hand it to two consumers
+EXPORT_DLL void uart_rx_retain(const char *p);
+
+// any thread, also after the port closed
+EXPORT_DLL void uart_rx_release(const char *p);
+
+// Watches a non-blocking fd (a socket on Win32) on the I/O thread of the port;
+// on_watch runs there like the other callbacks. Adds, or changes the events of
+// a watched fd; events 0 removes it. Call it from the port's callbacks, or
+// from another thread only to add a watch. Drop the watches before closing the
+// fds, at the latest in on_comm_close.
+// On Win32 OUT is edge triggered (after a send would have blocked), and ports
+// served by a reactor cannot watch.
+EXPORT_DLL bool uart_watch(uart_obj *uart,
+            const intptr_t   fd,
+            const int        events,
+            f_on_watch       on_watch,
+            void            *watch_param);
+
+// monotonic clock in microseconds
+EXPORT_DLL int64_t uart_time_us(void);
+
+// From on_comm_read: when byte i of the batch arrived, on the uart_time_us
+// clock. The I/O thread times each read as it returns; the bytes it got are
+// placed back from there at the byte rate of the baud rate. While an RX policy
+// holds a batch the port reads once per wait, which bounds the precision.
+EXPORT_DLL int64_t uart_rx_time_us(uart_obj *uart, const int i);
+
+// Opens the capture file at path to go on recording into it, or makes one with
+// ring_size bytes for records (<= 0: 16 MB), see uart_capture.h. NULL: failed.
+EXPORT_DLL uart_capture *uart_capture_open(const char *path, const int64_t ring_size);
+
+// after the ports recording into it are shut down or detached
+EXPORT_DLL void uart_capture_close(uart_capture *capture);
+
+// Records the port's traffic into capture (NULL: stops) tagged with port_id:
+// RX as delivered to on_comm_read, TX as handed to the driver. Call it before
+// the port carries traffic, or from its callbacks.
+EXPORT_DLL void uart_set_capture(uart_obj *uart, uart_capture *capture, const int port_id);
+
+// Delivers whole frames to on_frame instead of batches to on_comm_read;
+// framing NULL or frame_none: batches again. p is valid during the call only,
+// uart_rx_time_us does not apply. Call it before the port carries traffic, or
+// from its callbacks other than on_frame. false: bad framing.
+EXPORT_DLL bool uart_set_framing(uart_obj *uart,
+            const uart_framing *framing,
+            f_on_frame       on_frame,
+            void            *frame_param);
+
+// Encodes p as the port's framing wants it and queues the frame whole, waiting
+// for room up to timeout_ms like uart_send_timeout. Returns l; 0: no room in
+// time, dropped; -1: cannot be framed (see uart_frame_encode) or longer than
+// the TX buffer.
+EXPORT_DLL int uart_send_frame(uart_obj *uart, const char *p, const int l, const int timeout_ms);
+
+// The encoding of uart_send_frame into dst of max bytes (2 * l + 10 is always
+// enough), returns its length. -1: does not fit, or the data holds the
+// delimiter, or l is beyond the length prefix.
+EXPORT_DLL int uart_frame_encode(const uart_framing *framing, const char *p, const int l, char *dst, const int max);
+
+// The CRC (enum_crc_kind) of no bytes, to start uart_crc_update with.
+EXPORT_DLL uint32_t uart_crc_init(const int kind);
+
+// The CRC of the bytes crc was computed over followed by p, so a frame can be
+// checked chunk by chunk as on_comm_read delivers it.
+EXPORT_DLL uint32_t uart_crc_update(const int kind, const uint32_t crc, const char *p, const int l);
+
+// Compiles count NUL terminated patterns into one automaton, which any number
+// of ports may scan with. flags: UART_EXPECT_NOCASE. NULL: no patterns, an
+// empty one, over 64 KB of them, or no memory.
+EXPORT_DLL uart_expect *uart_expect_create(const char *const *patterns, const int count, const int flags);
+
+// once no port scans with it
+EXPORT_DLL void uart_expect_free(uart_expect *expect);
+
+// Scans the RX stream for the patterns of expect from the next byte read on,
+// before framing, across batches; NULL: stops. Each call starts over, with
+// offsets from 0 and the matches not taken yet dropped. Any thread; once it
+// returns the port no longer uses the automaton it had.
+EXPORT_DLL void uart_set_expect(uart_obj *uart, uart_expect *expect);
+
+// Takes the oldest match not taken yet, waiting up to timeout_ms for one (< 0:
+// no limit, 0: none). Returns its pattern; -1: timed out; -2: no expect set,
+// or the port closed. Matches past the last 16 not taken are dropped.
+EXPORT_DLL int uart_expect_wait(uart_obj *uart, const int timeout_ms, uart_expect_match *match);
+
+// Counters since the port opened or the last uart_reset_stats, any thread.
+// No lock; tx_high_water and tx_pending_max_us are since then too.
+EXPORT_DLL void uart_get_stats(uart_obj *uart, uart_stats *stats);
+
+EXPORT_DLL void uart_reset_stats(uart_obj *uart);
+
+// Also changes the settings of an open port, baud etc. <= 0 and parity ""
+// keep what is set. Non zero: failed, the port keeps its previous settings.
+EXPORT_DLL int uart_config(uart_obj *uart,
+            int  baud,
+            const char *parity,
+            int  databits,
+            int  stopbits);
+
+// current settings, parity is one of the names taken by uart_config
+EXPORT_DLL void uart_get_config(uart_obj *uart,
+            int         *baud,
+            const char **parity,
+            int         *databits,
+            int         *stopbits);     // 1 or 2, 15 for 1.5
+
+// Flow control (enum_flow_control) for the port, which uart_config keeps from
+// then on; a port opens with flow_none. The driver stops the peer while its
+// input queue is nearly full, so a consumer that stalls loses no bytes. On
+// Win32 XON/XOFF goes out with a quarter of that queue left (sized for 100 ms
+// at the baud rate, 10 KB at least); on POSIX the tty layer's limits apply.
+// Non zero: failed or not supported, the port keeps its previous mode.
+EXPORT_DLL int uart_set_flow(uart_obj *uart, const int flow);
+
+EXPORT_DLL int uart_get_flow(uart_obj *uart);
+
+// Drops what the driver and the port hold: rx, data received but not yet
+// delivered; tx, data accepted by uart_send but not yet written. Any thread;
+// from another thread than the port's it takes effect shortly after.
+EXPORT_DLL void uart_purge(uart_obj *uart, const bool rx, const bool tx);
+
+// on_comm_line is called from the I/O thread when a modem input changes
+// (changed: which) or a line event occurs, see UART_LINE_*. POSIX polls the
+// lines every few ms while a callback is set; a pty has none of them.
+EXPORT_DLL void uart_set_line_callback(uart_obj *uart,
+            f_on_comm_line  on_comm_line,
+            void           *comm_line_param);
+
+// sets UART_LINE_DTR, UART_LINE_RTS or UART_LINE_BREAK
+EXPORT_DLL bool uart_set_line(uart_obj *uart, const int line, const bool on);
+
+// modem inputs now, and the outputs as last set
+EXPORT_DLL int uart_get_line(uart_obj *uart);
+
+#endif
@@ -17,7 +17,11 @@ start(UartPort, {Ip, TcpPort}) when is_integer(TcpPort) ->
           pid
          }).
 
--define(UART_SETTING,  [{baud, 115200}, {stopbits, 1}, {databits, 8}]).
+% packet: 2 or 4 length bytes per message between uart_port and Erlang
+% latency_us: consecutive reads from the UART are sent as one message, held
+% for this long at most (0: every read is sent at once)
+-define(UART_SETTING,  [{baud, 115200}, {stopbits, 1}, {databits, 8},
+                        {packet, 4}, {latency_us, 2000}]).
 -define(show_progress, io:format(".", [])).
 
 -define(log(Fmt, Args), io:format(Fmt, Args)).
@@ -56,6 +60,8 @@ init(DeviceNo, Socket, Opts) ->
     ExtPrg = case os:type() of
         {win32, _} ->
             [$" | filename:join(filename:dirname(code:which(?MODULE)), "uart_port.exe\" ")];
+        {unix, _} ->
+            filename:join(filename:dirname(code:which(?MODULE)), "uart_port ");
         OSType ->
             throw(OSType)
     end,
@@ -63,7 +69,8 @@ init(DeviceNo, Socket, Opts) ->
     Args = build_args(Opts, [" -port " ++ integer_to_list(DeviceNo)]),
     Pid = spawn_link(fun () ->
             process_flag(trap_exit, true),
-            Port = open_port({spawn, ExtPrg ++ Args}, [{packet, 2}, binary]),
+            Packet = proplists:get_value(packet, Opts, 2),
+            Port = open_port({spawn, ExtPrg ++ Args}, [{packet, Packet}, binary]),
             loop(Port, #state{socket = Socket, pid = PidX})
         end),
     {ok, Pid}.
@@ -114,6 +121,10 @@ build_args([{stopbits, V} | Opts], Acc) ->
     build_args(Opts, [" -stopbits ", integer_to_list(V) | Acc]);
 build_args([{parity, V} | Opts], Acc) ->
     build_args(Opts, [" -parity ", atom_to_list(V) | Acc]);
+build_args([{packet, V} | Opts], Acc) ->
+    build_args(Opts, [" -packet ", integer_to_list(V) | Acc]);
+build_args([{latency_us, V} | Opts], Acc) ->
+    build_args(Opts, [" -latency_us ", integer_to_list(V) | Acc]);
 build_args([_X | Opts], Acc) ->
     build_args(Opts, Acc);
 build_args([], Acc) ->
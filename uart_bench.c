@@ -0,0 +1,1922 @@
+// Micro benchmarks for the library internals.
+//
+//   uart_bench ring [producers] [msg size]   TX ring vs. the old lock + double memcpy
+//   uart_bench rx [baud]                     RX delivery policies over a pty (POSIX)
+//   uart_bench profile [baud] [message]      the I/O profile presets: RX latency and
+//                                            syscalls, TX throughput over a pty (POSIX)
+//   uart_bench coalesce [baud] [size]       small sends with TX coalescing off and on:
+//                                            wakeups, writes and lone send latency (POSIX)
+//   uart_bench sendv [payload] [producers]  header + payload + trailer frames from several
+//                                            threads: concatenated vs. uart_sendv (POSIX)
+//   uart_bench pipe [payload] [2|4]          Erlang port framing over a pipe (POSIX)
+//   uart_bench hex [chunk]                   hex dump formatting and hex input parsing
+//   uart_bench capture [payload] [path]      records appended to a capture file
+//   uart_bench frame [payload]               RX framers against a bytewise splitter
+//   uart_bench crc [size]                    CRCs: bitwise, by table, sliced, PCLMULQDQ
+//   uart_bench expect [chunk]                multi-pattern expect: rescanning the text held
+//                                            against the automaton (uart_expect.h)
+//   uart_bench modbus [buses] [slaves] [s]   Modbus RTU master against simulated slaves
+//                                            over ptys (POSIX)
+//   uart_bench co [size]                     request/response round trips, a thread
+//                                            against coroutines (uart_bench_co.c, POSIX)
+//   uart_bench suite [seconds] [json]        port to port throughput, latency, CPU and
+//                                            syscalls over ptys, results also as JSON (POSIX)
+//   uart_bench check [name]                  self-checking tests, non-zero exit status on a
+//                                            failure (uart_bench_check.c)
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pty.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/resource.h>
+#endif
+#include "uart.h"
+#include "uart_packet.h"
+#include "uart_hex.h"
+#include "uart_capture.h"
+#include "uart_modbus.h"
+
+#ifdef _WIN32
+typedef HANDLE bench_thread;
+typedef CRITICAL_SECTION bench_lock;
+#define lock_init(l)    InitializeCriticalSection(l)
+#define lock_enter(l)   EnterCriticalSection(l)
+#define lock_leave(l)   LeaveCriticalSection(l)
+#define yield()         SwitchToThread()
+
+// a pthread style function run from a WINAPI one: the conventions differ on x86
+typedef struct
+{
+    void *(*f)(void *);
+    void   *param;
+} bench_thread_entry;
+
+static DWORD WINAPI bench_thread_main(LPVOID p)
+{
+    bench_thread_entry e = *(bench_thread_entry *)p;
+    free(p);
+    e.f(e.param);
+    return 0;
+}
+
+static void thread_start(bench_thread *t, void *(*f)(void *), void *param)
+{
+    bench_thread_entry *e = (bench_thread_entry *)malloc(sizeof(bench_thread_entry));
+    e->f = f;
+    e->param = param;
+    *t = CreateThread(NULL, 0, bench_thread_main, e, 0, NULL);
+}
+
+static void thread_join(bench_thread t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static double now_s(void)
+{
+    LARGE_INTEGER c, f;
+    QueryPerformanceCounter(&c);
+    QueryPerformanceFrequency(&f);
+    return (double)c.QuadPart / f.QuadPart;
+}
+#else
+typedef pthread_t bench_thread;
+typedef pthread_mutex_t bench_lock;
+#define lock_init(l)    pthread_mutex_init(l, NULL)
+#define lock_enter(l)   pthread_mutex_lock(l)
+#define lock_leave(l)   pthread_mutex_unlock(l)
+#define yield()         sched_yield()
+
+static void thread_start(bench_thread *t, void *(*f)(void *), void *param)
+{
+    pthread_create(t, NULL, f, param);
+}
+
+static void thread_join(bench_thread t)
+{
+    pthread_join(t, NULL);
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#endif
+
+#define MAX_PRODUCERS 16
+
+// ---------------------------------------------------------------- ring
+
+typedef struct
+{
+    bool        use_ring;
+    uart_ring   ring;
+
+    // the pre-ring TX path: uart_send appends under a lock, the writer copies
+    // everything into a second buffer under the same lock
+    bench_lock  cs;
+    char        write_buf[COMM_WRITE_BUF_SIZE];
+    char        send_buf[COMM_WRITE_BUF_SIZE];
+    int         write_buf_used;
+
+    int         msg_size;
+    long        msgs;           // per producer
+    long long   total;
+    volatile unsigned sink;
+} ring_bench;
+
+static void *ring_producer(void *param)
+{
+    ring_bench *b = (ring_bench *)param;
+    char msg[COMM_WRITE_BUF_SIZE];
+    memset(msg, 0x5a, b->msg_size);
+
+    for (long i = 0; i < b->msgs; i++)
+    {
+        if (b->use_ring)
+        {
+            while (!ring_put(&b->ring, msg, b->msg_size))
+                yield();
+            continue;
+        }
+
+        while (true)
+        {
+            bool ok = false;
+            lock_enter(&b->cs);
+            if (b->write_buf_used + b->msg_size <= COMM_WRITE_BUF_SIZE)
+            {
+                memcpy(b->write_buf + b->write_buf_used, msg, b->msg_size);
+                b->write_buf_used += b->msg_size;
+                ok = true;
+            }
+            lock_leave(&b->cs);
+            if (ok) break;
+            yield();
+        }
+    }
+    return NULL;
+}
+
+static void *ring_consumer(void *param)
+{
+    ring_bench *b = (ring_bench *)param;
+    long long got = 0;
+    unsigned sink = 0;
+
+    while (got < b->total)
+    {
+        uint32_t l;
+        const char *p;
+        if (b->use_ring)
+        {
+            p = ring_peek(&b->ring, &l);
+            if (l == 0) { yield(); continue; }
+            sink += p[0] + p[l - 1];        // stands in for WriteFile()/write()
+            ring_consume(&b->ring, l);
+        }
+        else
+        {
+            lock_enter(&b->cs);
+            l = b->write_buf_used;
+            memcpy(b->send_buf, b->write_buf, l);
+            b->write_buf_used = 0;
+            lock_leave(&b->cs);
+            if (l == 0) { yield(); continue; }
+            sink += b->send_buf[0] + b->send_buf[l - 1];
+        }
+        got += l;
+    }
+    b->sink = sink;
+    return NULL;
+}
+
+static void ring_run(const char *name, const bool use_ring, const bool mpsc,
+                     const int producers, const int msg_size)
+{
+    static ring_bench b;
+    bench_thread c;
+    bench_thread p[MAX_PRODUCERS];
+
+    memset(&b, 0, sizeof(b));
+    b.use_ring = use_ring;
+    ring_init(&b.ring, mpsc);
+    lock_init(&b.cs);
+    b.msg_size = msg_size;
+    b.msgs = (64L * 1024 * 1024 / msg_size) / producers;
+    b.total = (long long)b.msgs * producers * msg_size;
+
+    double t = now_s();
+    thread_start(&c, ring_consumer, &b);
+    for (int i = 0; i < producers; i++)
+        thread_start(&p[i], ring_producer, &b);
+    for (int i = 0; i < producers; i++)
+        thread_join(p[i]);
+    thread_join(c);
+    t = now_s() - t;
+
+    printf("%-12s producers=%-2d msg=%-5d %8.1f MB/s %8.2f Mmsg/s\n",
+           name, producers, msg_size, b.total / t / 1e6, b.msgs * producers / t / 1e6);
+}
+
+static int bench_ring(const int argc, const char *args[])
+{
+    int producers = argc > 2 ? atoi(args[2]) : 1;
+    int msg_size = argc > 3 ? atoi(args[3]) : 16;
+    if ((producers < 1) || (producers > MAX_PRODUCERS) || (msg_size < 1) || (msg_size > COMM_WRITE_BUF_SIZE))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    ring_run("lock+memcpy", false, false, producers, msg_size);
+    if (producers == 1)
+        ring_run("ring spsc", true, false, producers, msg_size);
+    ring_run("ring mpsc", true, true, producers, msg_size);
+    return 0;
+}
+
+// ---------------------------------------------------------------- rx
+
+#ifndef _WIN32
+
+#define RX_BENCH_BYTES  (24 * 1024)
+
+typedef struct
+{
+    int64_t     sent_us[RX_BENCH_BYTES];    // when each byte was written to the pty master
+    int         latency_us[RX_BENCH_BYTES];
+    volatile int received;
+    int         callbacks;
+} rx_bench;
+
+static void rx_on_read(void *param, const char *p, const int l)
+{
+    rx_bench *b = (rx_bench *)param;
+    int64_t now = uart_time_us();
+    for (int i = 0; (i < l) && (b->received < RX_BENCH_BYTES); i++, b->received++)
+        b->latency_us[b->received] = (int)(now - b->sent_us[b->received]);
+    b->callbacks++;
+}
+
+static void rx_on_close(void *param, const enum_comm_close reason)
+{
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// feeds the pty master at the byte rate of baud in 100 us ticks, close to
+// what a UART with a shallow FIFO hands the driver
+static void rx_run(const char *name, const uart_io_profile *io, const int baud)
+{
+    static rx_bench b;
+    static uart_obj uart;
+    struct termios tio;
+    char dev[256];
+    int master, slave;
+
+    memset(&b, 0, sizeof(b));
+    cfmakeraw(&tio);
+    if (openpty(&master, &slave, dev, &tio, NULL) != 0)
+    {
+        perror("openpty");
+        return;
+    }
+    if (uart_open_dev(&uart, dev, baud, "none", 8, 1, rx_on_read, &b, rx_on_close, NULL, false) == NULL)
+    {
+        fprintf(stderr, "failed to open %s\n", dev);
+        return;
+    }
+    uart_set_io_profile(&uart, io);
+
+    const double bytes_per_us = baud / (double)UART_BITS_PER_CHAR / 1e6;
+    char chunk[RX_BENCH_BYTES];
+    memset(chunk, 0x55, sizeof(chunk));
+
+    int64_t start = uart_time_us();
+    int sent = 0;
+    while (sent < RX_BENCH_BYTES)
+    {
+        int64_t now = uart_time_us();
+        int due = (int)((now - start) * bytes_per_us) + 1;
+        if (due > RX_BENCH_BYTES) due = RX_BENCH_BYTES;
+        if (due > sent)
+        {
+            for (int i = sent; i < due; i++) b.sent_us[i] = now;
+            if (write(master, chunk, due - sent) != due - sent)
+                break;
+            sent = due;
+        }
+        usleep(100);
+    }
+
+    for (int i = 0; (i < 2000) && (b.received < sent); i++)
+        usleep(1000);
+    uart_stats stats;
+    uart_get_stats(&uart, &stats);
+    uart_shutdown(&uart);
+    close(master);
+    close(slave);
+
+    if (b.received <= 0) return;
+    const double kb = b.received / 1024.0;
+    qsort(b.latency_us, b.received, sizeof(b.latency_us[0]), cmp_int);
+    double sum = 0;
+    for (int i = 0; i < b.received; i++) sum += b.latency_us[i];
+    printf("%-16s callbacks/KB %7.2f  syscalls/KB %7.2f  latency us: mean %7.0f  p99 %7d  max %7d\n",
+           name, b.callbacks / kb, stats.rx_syscalls / kb, sum / b.received,
+           b.latency_us[b.received * 99 / 100], b.latency_us[b.received - 1]);
+}
+
+static int bench_rx(const int argc, const char *args[])
+{
+    static const struct { const char *name; uart_rx_policy policy; } policies[] =
+    {
+        {"every read",      {0, 0, 0}},
+        {"64B/1ms/10ms",    {64, 1000, 10000}},
+        {"256B/2ms/20ms",   {256, 2000, 20000}},
+        {"1KB/5ms/50ms",    {1024, 5000, 50000}},
+        {"2KB/20ms/-",      {2048, 20000, 0}},
+    };
+    int baud = argc > 2 ? atoi(args[2]) : 115200;
+
+    printf("%d baud, %d bytes per policy\n", baud, RX_BENCH_BYTES);
+    for (unsigned i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        uart_io_profile io;
+        uart_io_preset(&io, io_balanced, baud, 0);
+        io.rx = policies[i].policy;
+        rx_run(policies[i].name, &io, baud);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------- profile
+
+// The presets of uart_io_preset: RX as bench rx has it, then TX as fast as
+// the pty takes it, in messages of the given size.
+
+#define PROFILE_TX_BYTES    (8 * 1024 * 1024)
+
+typedef struct
+{
+    int             fd;
+    volatile long long received;
+    volatile bool   stop;
+} profile_drain;
+
+static void *profile_drain_thread(void *param)
+{
+    profile_drain *d = (profile_drain *)param;
+    static char buf[64 * 1024];
+    struct pollfd pfd = {d->fd, POLLIN, 0};
+    while (!d->stop)
+    {
+        if (poll(&pfd, 1, 10) <= 0) continue;
+        int n = read(d->fd, buf, sizeof(buf));
+        if (n > 0) d->received += n;
+    }
+    return NULL;
+}
+
+static void profile_tx(const char *name, const uart_io_profile *io, const int baud, const int message)
+{
+    static uart_obj uart;
+    struct termios tio;
+    char dev[256];
+    int slave;
+    profile_drain d = {-1, 0, false};
+
+    cfmakeraw(&tio);
+    if (openpty(&d.fd, &slave, dev, &tio, NULL) != 0)
+    {
+        perror("openpty");
+        return;
+    }
+    if (uart_open_dev(&uart, dev, baud, "none", 8, 1, rx_on_read, NULL, rx_on_close, NULL, false) == NULL)
+    {
+        fprintf(stderr, "failed to open %s\n", dev);
+        return;
+    }
+    uart_set_io_profile(&uart, io);
+    bench_thread t;
+    thread_start(&t, profile_drain_thread, &d);
+
+    static char msg[COMM_WRITE_BUF_SIZE];
+    memset(msg, 0x55, sizeof(msg));
+    const double start = now_s();
+    for (long long sent = 0; sent < PROFILE_TX_BYTES; sent += message)
+        if (uart_send_timeout(&uart, msg, message, -1) < message)
+            break;
+    for (int i = 0; (i < 5000) && (d.received < PROFILE_TX_BYTES); i++)
+        usleep(1000);
+    const double seconds = now_s() - start;
+    uart_stats stats;
+    uart_get_stats(&uart, &stats);
+    uart_shutdown(&uart);
+    d.stop = true;
+    thread_join(t);
+    close(d.fd);
+    close(slave);
+
+    const double mb = d.received / (1024.0 * 1024.0);
+    printf("%-16s TX %7.1f MB/s  writes/MB %7.1f  queue max %6llu B\n", name, mb / seconds,
+           stats.tx_syscalls / mb, (unsigned long long)stats.tx_high_water);
+}
+
+static int bench_profile(const int argc, const char *args[])
+{
+    static const char *names[] = {"balanced", "low_latency", "bulk"};
+    const int baud = argc > 2 ? atoi(args[2]) : 115200;
+    const int message = argc > 3 ? atoi(args[3]) : 64;
+    if ((baud <= 0) || (message < 1) || (message > COMM_WRITE_BUF_SIZE))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    printf("%d baud, %d byte messages; RX %d bytes paced at the baud rate, TX %d MB\n", baud, message,
+           RX_BENCH_BYTES, PROFILE_TX_BYTES >> 20);
+    for (int preset = io_balanced; preset <= io_bulk; preset++)
+    {
+        uart_io_profile io;
+        uart_io_preset(&io, preset, baud, message);
+        printf("%s: read %d, tx queue %d, driver queue %d, rx policy %d B / %d us / %d us\n", names[preset],
+               io.read_size, io.tx_queue, io.driver_queue, io.rx.min_chunk, io.rx.idle_us, io.rx.max_hold_us);
+        rx_run(names[preset], &io, baud);
+        profile_tx(names[preset], &io, baud, message);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------- coalesce
+
+// Small sends with TX coalescing off and on (the bulk preset's): a burst as
+// fast as the ring takes it, sends paced at the line rate of the baud, and
+// lone sends to an idle port, whose latency coalescing should leave alone.
+
+#define COALESCE_BYTES      (256 * 1024)
+#define COALESCE_PACED      2000
+#define COALESCE_LONE       200
+
+static bool coalesce_wait(profile_drain *d, const long long bytes)
+{
+    for (int i = 0; (i < 2000000) && (d->received < bytes); i++)
+        sched_yield();
+    return d->received >= bytes;
+}
+
+static void coalesce_run(const char *name, const uart_io_profile *io, const int baud, const int size)
+{
+    static uart_obj uart;
+    struct termios tio;
+    char dev[256];
+    int slave;
+    profile_drain d = {-1, 0, false};
+
+    cfmakeraw(&tio);
+    if (openpty(&d.fd, &slave, dev, &tio, NULL) != 0)
+    {
+        perror("openpty");
+        return;
+    }
+    if (uart_open_dev(&uart, dev, baud, "none", 8, 1, rx_on_read, NULL, rx_on_close, NULL, false) == NULL)
+    {
+        fprintf(stderr, "failed to open %s\n", dev);
+        return;
+    }
+    uart_set_io_profile(&uart, io);
+    bench_thread t;
+    thread_start(&t, profile_drain_thread, &d);
+
+    static char msg[4096];
+    memset(msg, 0x55, sizeof(msg));
+    uart_stats s0, s1, s2;
+    long long target = 0;
+
+    // burst
+    uart_get_stats(&uart, &s0);
+    for (long long sent = 0; sent < COALESCE_BYTES; sent += size)
+        if (uart_send_timeout(&uart, msg, size, -1) < size)
+            break;
+    uart_flush(&uart);
+    coalesce_wait(&d, target += COALESCE_BYTES);
+
+    // paced: one send per line time of its bytes
+    uart_get_stats(&uart, &s1);
+    const int64_t step = rx_bytes_to_us(size, baud);
+    int64_t next = uart_time_us();
+    for (int i = 0; i < COALESCE_PACED; i++)
+    {
+        while (uart_time_us() < next)
+            ;
+        next += step;
+        uart_send(&uart, msg, size);
+    }
+    uart_flush(&uart);
+    coalesce_wait(&d, target += (long long)COALESCE_PACED * size);
+    uart_get_stats(&uart, &s2);
+
+    // lone sends, the line idle for 10 ms before each
+    static int lat[COALESCE_LONE];
+    int n = 0;
+    for (; n < COALESCE_LONE; n++)
+    {
+        usleep(10000);
+        const int64_t t0 = uart_time_us();
+        uart_send(&uart, msg, size);
+        if (!coalesce_wait(&d, target += size)) break;
+        lat[n] = (int)(uart_time_us() - t0);
+    }
+    qsort(lat, n, sizeof(lat[0]), cmp_int);
+
+    uart_shutdown(&uart);
+    d.stop = true;
+    thread_join(t);
+    close(d.fd);
+    close(slave);
+
+    const double burst_kb = COALESCE_BYTES / 1024.0;
+    const double paced_kb = (double)COALESCE_PACED * size / 1024.0;
+    printf("%-9s burst  wakeups/KB %7.2f  writes/KB %7.2f\n", name,
+           (s1.tx_wakeups - s0.tx_wakeups) / burst_kb, (s1.tx_syscalls - s0.tx_syscalls) / burst_kb);
+    printf("%-9s paced  wakeups/KB %7.2f  writes/KB %7.2f\n", name,
+           (s2.tx_wakeups - s1.tx_wakeups) / paced_kb, (s2.tx_syscalls - s1.tx_syscalls) / paced_kb);
+    if (n > 0)
+        printf("%-9s lone   latency p50 %5d us  p99 %5d us  max %5d us\n", name, lat[n / 2], lat[n * 99 / 100],
+               lat[n - 1]);
+}
+
+static int bench_coalesce(const int argc, const char *args[])
+{
+    const int baud = argc > 2 ? atoi(args[2]) : 115200;
+    const int size = argc > 3 ? atoi(args[3]) : 8;
+    if ((baud <= 0) || (size < 1) || (size > 4096))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    uart_io_profile io, bulk;
+    uart_io_preset(&io, io_balanced, baud, 0);
+    uart_io_preset(&bulk, io_bulk, baud, 0);
+    printf("%d baud, %d byte sends; coalescing on: %d bytes, at most %d us\n", baud, size, bulk.tx_coalesce,
+           bulk.tx_delay_us);
+    coalesce_run("off", &io, baud, size);
+    io.tx_coalesce = bulk.tx_coalesce;
+    io.tx_delay_us = bulk.tx_delay_us;
+    coalesce_run("on", &io, baud, size);
+    return 0;
+}
+
+// ---------------------------------------------------------------- sendv
+
+// Frames of a 4 byte header, the payload and a 2 byte trailer sent by several
+// threads at once: copied together and sent with uart_send_timeout, as callers
+// used to, or handed to uart_sendv as three segments. The peer checks that no
+// frame was cut into by another's bytes, which uart_send_timeout allows once
+// the queue is full and it takes a frame in parts.
+
+#define SENDV_BYTES         (32 * 1024 * 1024)
+#define SENDV_PRODUCERS     8
+
+typedef struct
+{
+    int             fd;
+    volatile long long received;
+    volatile bool   stop;
+    long long       frames;
+    long long       bad;            // bytes out of place
+} sendv_peer;
+
+static void *sendv_peer_thread(void *param)
+{
+    sendv_peer *d = (sendv_peer *)param;
+    static unsigned char buf[64 * 1024];
+    unsigned char hdr[4];
+    int state = 0;                  // header bytes seen, then 4 + payload bytes seen
+    int len = 0;
+    int id = 0;
+    struct pollfd pfd = {d->fd, POLLIN, 0};
+    while (!d->stop)
+    {
+        if (poll(&pfd, 1, 10) <= 0) continue;
+        int n = read(d->fd, buf, sizeof(buf));
+        if (n <= 0) continue;
+        d->received += n;
+        for (int i = 0; i < n; i++)
+        {
+            const unsigned char b = buf[i];
+            if (state < 4)
+            {
+                if ((state == 0) && (b != 0x7e))
+                {
+                    d->bad++;
+                    continue;
+                }
+                hdr[state++] = b;
+                if (state == 4)
+                {
+                    id = hdr[1];
+                    len = hdr[2] | hdr[3] << 8;
+                }
+            }
+            else if (state < 4 + len)
+            {
+                if (b != (unsigned char)id)
+                {
+                    d->bad++;
+                    state = 0;
+                    continue;
+                }
+                state++;
+            }
+            else if (state == 4 + len)
+            {
+                if (b != (unsigned char)~id)
+                {
+                    d->bad++;
+                    state = 0;
+                    continue;
+                }
+                state++;
+            }
+            else
+            {
+                if (b == '\n') d->frames++;
+                else d->bad++;
+                state = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    uart_obj   *uart;
+    int         id;
+    int         payload;
+    bool        vectored;
+    long long   frames;
+} sendv_producer;
+
+static void *sendv_producer_thread(void *param)
+{
+    sendv_producer *p = (sendv_producer *)param;
+    const unsigned char hdr[4] = {0x7e, (unsigned char)p->id, (unsigned char)p->payload,
+                                  (unsigned char)(p->payload >> 8)};
+    const unsigned char trailer[2] = {(unsigned char)~p->id, '\n'};
+    char *body = (char *)malloc(p->payload);
+    char *frame = (char *)malloc(p->payload + 6);
+    memset(body, p->id, p->payload);
+    const int l = p->payload + 6;
+    for (long long i = 0; i < p->frames; i++)
+    {
+        if (p->vectored)
+        {
+            uart_iovec v[3] = {{(const char *)hdr, 4}, {body, p->payload}, {(const char *)trailer, 2}};
+            if (uart_sendv(p->uart, v, 3, -1) < l) break;
+        }
+        else
+        {
+            memcpy(frame, hdr, 4);
+            memcpy(frame + 4, body, p->payload);
+            memcpy(frame + 4 + p->payload, trailer, 2);
+            if (uart_send_timeout(p->uart, frame, l, -1) < l) break;
+        }
+    }
+    free(body);
+    free(frame);
+    return NULL;
+}
+
+static void sendv_run(const char *name, const bool vectored, const int payload, const int producers)
+{
+    static uart_obj uart;
+    struct termios tio;
+    char dev[256];
+    int slave;
+    sendv_peer d = {-1, 0, false, 0, 0};
+
+    cfmakeraw(&tio);
+    if (openpty(&d.fd, &slave, dev, &tio, NULL) != 0)
+    {
+        perror("openpty");
+        return;
+    }
+    if (uart_open_dev(&uart, dev, 3000000, "none", 8, 1, rx_on_read, NULL, rx_on_close, NULL, false) == NULL)
+    {
+        fprintf(stderr, "failed to open %s\n", dev);
+        return;
+    }
+    bench_thread peer;
+    thread_start(&peer, sendv_peer_thread, &d);
+
+    const long long frames = SENDV_BYTES / (payload + 6) / producers;
+    const long long total = frames * producers * (payload + 6);
+    sendv_producer p[SENDV_PRODUCERS];
+    bench_thread t[SENDV_PRODUCERS];
+    const double start = now_s();
+    for (int i = 0; i < producers; i++)
+    {
+        p[i] = {&uart, i, payload, vectored, frames};
+        thread_start(&t[i], sendv_producer_thread, &p[i]);
+    }
+    for (int i = 0; i < producers; i++)
+        thread_join(t[i]);
+    for (int i = 0; (i < 5000) && (d.received < total); i++)
+        usleep(1000);
+    const double seconds = now_s() - start;
+    uart_shutdown(&uart);
+    d.stop = true;
+    thread_join(peer);
+    close(d.fd);
+    close(slave);
+
+    printf("%-12s payload=%-5d producers=%d  %7.1f MB/s  %8.0f frames/s  frames cut into %lld of %lld\n",
+           name, payload, producers, d.received / (1024.0 * 1024.0) / seconds, d.frames / seconds,
+           frames * producers - d.frames, frames * producers);
+}
+
+static int bench_sendv(const int argc, const char *args[])
+{
+    const int payload = argc > 2 ? atoi(args[2]) : 256;
+    const int producers = argc > 3 ? atoi(args[3]) : 4;
+    if ((payload < 1) || (payload > 4096) || (producers < 1) || (producers > SENDV_PRODUCERS))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+    sendv_run("concat+send", false, payload, producers);
+    sendv_run("sendv", true, payload, producers);
+    return 0;
+}
+
+// ---------------------------------------------------------------- pipe
+
+#define PIPE_BENCH_BYTES    (256LL * 1024 * 1024)
+#define PIPE_BENCH_PACKETS  (2L * 1024 * 1024)
+
+typedef struct
+{
+    int         fd;
+    bool        gather;         // packet_write, or the old copy + 3 writes
+    int         packet_bytes;
+    int         payload;
+    long        packets;
+} pipe_bench;
+
+static bool write_all(const int fd, const unsigned char *p, int len)
+{
+    while (len > 0)
+    {
+        int i = write(fd, p, len);
+        if (i <= 0) return false;
+        p += i;
+        len -= i;
+    }
+    return true;
+}
+
+// what uart_port did before: copy behind the command byte, then a write per
+// length byte and one for the packet
+static bool old_packet_write(const int fd, const int t, const unsigned char *s, const int len)
+{
+    static unsigned char out_buf[65536];
+    unsigned char li;
+
+    out_buf[0] = t;
+    memcpy(out_buf + 1, s, len);
+    li = ((len + 1) >> 8) & 0xff;
+    write_all(fd, &li, 1);
+    li = (len + 1) & 0xff;
+    write_all(fd, &li, 1);
+    return write_all(fd, out_buf, len + 1);
+}
+
+static void *pipe_writer(void *param)
+{
+    pipe_bench *b = (pipe_bench *)param;
+    unsigned char *data = (unsigned char *)malloc(b->payload);
+    memset(data, 0x33, b->payload);
+
+    for (long i = 0; i < b->packets; i++)
+    {
+        bool ok = b->gather
+            ? packet_write(b->fd, b->packet_bytes, 1, data, b->payload)
+            : old_packet_write(b->fd, 1, data, b->payload);
+        if (!ok) break;
+    }
+    close(b->fd);
+    free(data);
+    return NULL;
+}
+
+// MB/s, mpps: packets per s in millions
+static double pipe_run(const char *name, const bool gather, const int packet_bytes, const int payload,
+                       double *mpps)
+{
+    static unsigned char buf[256 * 1024];
+    pipe_bench b;
+    bench_thread t;
+    int fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return 0;
+    }
+    b.fd = fds[1];
+    b.gather = gather;
+    b.packet_bytes = packet_bytes;
+    b.payload = payload;
+    b.packets = PIPE_BENCH_BYTES / payload;
+    if (b.packets > PIPE_BENCH_PACKETS) b.packets = PIPE_BENCH_PACKETS;
+
+    double start = now_s();
+    thread_start(&t, pipe_writer, &b);
+
+    // the reader splits the stream into packets like erts does
+    long long bytes = 0;
+    long packets = 0;
+    uint32_t need = 0;      // bytes left of the current packet
+    int head = 0;           // length bytes seen
+    uint32_t len = 0;
+    int n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+    {
+        bytes += n;
+        for (int i = 0; i < n; )
+        {
+            if (need > 0)
+            {
+                uint32_t k = (uint32_t)(n - i) < need ? (uint32_t)(n - i) : need;
+                i += k;
+                if ((need -= k) == 0) packets++;
+                continue;
+            }
+            len = (len << 8) | buf[i++];
+            if (++head == packet_bytes)
+            {
+                need = len;
+                head = 0;
+                len = 0;
+            }
+        }
+    }
+    thread_join(t);
+    close(fds[0]);
+    double s = now_s() - start;
+
+    printf("%-14s packet=%d payload=%-6d %8.1f MB/s %8.3f Mpkt/s %s\n",
+           name, packet_bytes, payload, bytes / s / 1e6, packets / s / 1e6,
+           packets == b.packets ? "" : "(packets lost)");
+    if (NULL != mpps) *mpps = packets / s / 1e6;
+    return bytes / s / 1e6;
+}
+
+static int bench_pipe(const int argc, const char *args[])
+{
+    int payload = argc > 2 ? atoi(args[2]) : COMM_READ_BUF_SIZE;
+    int packet_bytes = argc > 3 ? atoi(args[3]) : 2;
+    if ((payload < 1) || ((packet_bytes != 2) && (packet_bytes != 4))
+        || ((uint32_t)payload + 1 > packet_max(packet_bytes)))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    if ((packet_bytes == 2) && (payload < 65536))
+        pipe_run("copy+3 writes", false, 2, payload, NULL);
+    pipe_run("writev", true, packet_bytes, payload, NULL);
+    return 0;
+}
+
+// ---------------------------------------------------------------- suite
+
+// Both ends are ports opened through the API on two ptys, a relay thread
+// copies between the masters like a null modem cable. A pty does not pace to
+// the baud, so this measures the software path only.
+
+#define SUITE_PINGS     2000
+#define SUITE_RELAY_BUF (64 * 1024)
+
+typedef struct
+{
+    int         from, to;       // pty masters
+    volatile bool stop;
+    bench_thread thread;
+    double      cpu_s;          // of the relay, left out of the ports' CPU
+} suite_relay;
+
+typedef struct
+{
+    volatile long long received;
+    volatile long callbacks;
+    volatile int64_t last_us;   // of the last callback
+
+    // ping: the callback that completes ping_target bytes times it
+    volatile long long ping_target;
+    int64_t     ping_us;
+    int         latency_us[SUITE_PINGS];
+    int         pings;
+} suite_bench;
+
+typedef struct
+{
+    const char *mode;
+    int         payload;
+    long long   bytes;
+    double      seconds;
+    long        callbacks;
+    double      cpu_s;
+    uint64_t    tx_syscalls, rx_syscalls;
+    int         latency_us[SUITE_PINGS];
+    int         pings;
+} suite_result;
+
+static double thread_cpu_s(const int who)
+{
+    struct rusage ru;
+    getrusage(who, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static void *relay_thread(void *param)
+{
+    suite_relay *r = (suite_relay *)param;
+    static unsigned char buf[SUITE_RELAY_BUF];
+    struct pollfd pfd = {r->from, POLLIN, 0};
+    double cpu = thread_cpu_s(RUSAGE_THREAD);
+
+    while (!r->stop)
+    {
+        if (poll(&pfd, 1, 20) <= 0) continue;
+        int n = read(r->from, buf, sizeof(buf));
+        if ((n <= 0) || !write_all(r->to, buf, n)) break;
+    }
+    r->cpu_s = thread_cpu_s(RUSAGE_THREAD) - cpu;
+    return NULL;
+}
+
+static void suite_on_read(void *param, const char *p, const int l)
+{
+    suite_bench *b = (suite_bench *)param;
+    int64_t now = uart_time_us();
+    b->received += l;
+    b->callbacks++;
+    b->last_us = now;
+    if ((b->ping_target > 0) && (b->received >= b->ping_target))
+    {
+        if (b->pings < SUITE_PINGS)
+            b->latency_us[b->pings++] = (int)(now - b->ping_us);
+        b->ping_target = 0;
+    }
+}
+
+static bool wait_received(suite_bench *b, const long long bytes)
+{
+    for (int i = 0; (i < 5000) && (b->received < bytes); i++)
+        usleep(1000);
+    return b->received >= bytes;
+}
+
+static uart_obj *suite_open(uart_reactor *reactor, uart_obj *uart, const char *dev, suite_bench *b)
+{
+    if (NULL != reactor)
+        return uart_reactor_open(reactor, uart, dev, 115200, "none", 8, 1, suite_on_read, b, rx_on_close, NULL);
+    return uart_open_dev(uart, dev, 115200, "none", 8, 1, suite_on_read, b, rx_on_close, NULL, false);
+}
+
+static bool suite_run(suite_result *res, const char *mode, const bool use_reactor,
+                      const int payload, const double seconds)
+{
+    static suite_bench b;
+    static uart_obj tx, rx;
+    suite_relay relay;
+    struct termios tio;
+    char dev_tx[256], dev_rx[256];
+    int master_tx, slave_tx, master_rx, slave_rx;
+    uart_reactor *reactor = NULL;
+    bool ok = false;
+
+    memset(&b, 0, sizeof(b));
+    memset(res, 0, sizeof(*res));
+    res->mode = mode;
+    res->payload = payload;
+
+    cfmakeraw(&tio);
+    if ((openpty(&master_tx, &slave_tx, dev_tx, &tio, NULL) != 0)
+        || (openpty(&master_rx, &slave_rx, dev_rx, &tio, NULL) != 0))
+    {
+        perror("openpty");
+        return false;
+    }
+    if (use_reactor)
+        reactor = uart_reactor_create(2, false);
+    if ((suite_open(reactor, &rx, dev_rx, &b) == NULL) || (suite_open(reactor, &tx, dev_tx, &b) == NULL))
+    {
+        fprintf(stderr, "failed to open %s or %s\n", dev_tx, dev_rx);
+        return false;
+    }
+    memset(&relay, 0, sizeof(relay));
+    relay.from = master_tx;
+    relay.to = master_rx;
+    thread_start(&relay.thread, relay_thread, &relay);
+
+    char *data = (char *)malloc(payload);
+    memset(data, 0x5a, payload);
+
+    // throughput: as fast as uart_send takes it
+    uart_reset_stats(&tx);
+    uart_reset_stats(&rx);
+    double cpu = thread_cpu_s(RUSAGE_SELF);
+    int64_t start = uart_time_us();
+    int64_t end = start + (int64_t)(seconds * 1e6);
+    long long sent = 0;
+    while (uart_time_us() < end)
+    {
+        if (uart_send_timeout(&tx, data, payload, -1) < payload)
+            goto done;
+        sent += payload;
+    }
+    if (!wait_received(&b, sent))
+        goto done;
+    res->bytes = sent;
+    res->seconds = (b.last_us - start) / 1e6;
+    res->callbacks = b.callbacks;
+    res->cpu_s = thread_cpu_s(RUSAGE_SELF) - cpu;
+    uart_stats stats;
+    uart_get_stats(&tx, &stats);
+    res->tx_syscalls = stats.tx_syscalls;
+    uart_get_stats(&rx, &stats);
+    res->rx_syscalls = stats.rx_syscalls;
+
+    // latency: one payload in flight at a time
+    for (int i = 0; i < SUITE_PINGS; i++)
+    {
+        b.ping_us = uart_time_us();
+        b.ping_target = b.received + payload;
+        if ((uart_send(&tx, data, payload) < payload) || !wait_received(&b, b.ping_target))
+            goto done;
+        while (b.ping_target > 0)
+            yield();
+    }
+    ok = true;
+
+done:
+    relay.stop = true;
+    thread_join(relay.thread);
+    res->cpu_s -= relay.cpu_s;
+    uart_shutdown(&tx);
+    uart_shutdown(&rx);
+    if (NULL != reactor)
+        uart_reactor_destroy(reactor);
+    close(master_tx);
+    close(slave_tx);
+    close(master_rx);
+    close(slave_rx);
+    free(data);
+
+    res->pings = b.pings;
+    memcpy(res->latency_us, b.latency_us, sizeof(res->latency_us));
+    qsort(res->latency_us, res->pings, sizeof(res->latency_us[0]), cmp_int);
+    return ok;
+}
+
+static int bench_suite(const int argc, const char *args[])
+{
+    static const int payloads[] = {1, 16, 64, 256, 1024, 4096};
+    static const struct { const char *name; bool reactor; } modes[] =
+    {
+        {"thread",  false},     // uart_open_dev: an I/O thread per port
+        {"reactor", true},      // uart_reactor_open: both ports on 2 workers
+    };
+    static const int frames[] = {16, 256, 4096, 65000};
+    static suite_result res;
+
+    double seconds = argc > 2 ? atof(args[2]) : 2;
+    const char *path = argc > 3 ? args[3] : "uart_bench.json";
+    FILE *json = fopen(path, "w");
+    if ((seconds <= 0) || (NULL == json))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    fprintf(json, "{\n  \"suite\": 1,\n  \"read_buf\": %d,\n  \"write_buf\": %d,\n  \"cpus\": %ld,\n"
+            "  \"seconds\": %g,\n  \"pings\": %d,\n  \"runs\": [",
+            COMM_READ_BUF_SIZE, COMM_WRITE_BUF_SIZE, sysconf(_SC_NPROCESSORS_ONLN), seconds, SUITE_PINGS);
+    int failed = 0;
+    const char *sep = "";
+    for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        for (unsigned i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++)
+        {
+            if (!suite_run(&res, modes[m].name, modes[m].reactor, payloads[i], seconds))
+            {
+                fprintf(stderr, "%s payload=%d failed\n", modes[m].name, payloads[i]);
+                failed++;
+                continue;
+            }
+            const double mb = res.bytes / 1e6;
+            const int n = res.pings;
+            const int p50 = n > 0 ? res.latency_us[n / 2] : 0;
+            const int p90 = n > 0 ? res.latency_us[n * 9 / 10] : 0;
+            const int p99 = n > 0 ? res.latency_us[n * 99 / 100] : 0;
+            const int max = n > 0 ? res.latency_us[n - 1] : 0;
+
+            printf("%-8s payload=%-5d %8.2f MB/s %9.0f cb/s %7.0f B/cb %7.0f cpu us/MB %7.1f tx %7.1f rx syscalls/MB"
+                   "  latency us: p50 %5d p99 %5d max %5d\n",
+                   res.mode, res.payload, mb / res.seconds, res.callbacks / res.seconds,
+                   (double)res.bytes / res.callbacks, res.cpu_s * 1e6 / mb,
+                   res.tx_syscalls / mb, res.rx_syscalls / mb, p50, p99, max);
+            fprintf(json, "%s\n    {\"mode\": \"%s\", \"payload\": %d, \"bytes\": %lld, \"seconds\": %.6f, "
+                    "\"bytes_per_s\": %.0f, \"callbacks_per_s\": %.0f, \"bytes_per_callback\": %.1f, "
+                    "\"cpu_us_per_mb\": %.1f, \"tx_syscalls_per_mb\": %.2f, \"rx_syscalls_per_mb\": %.2f, "
+                    "\"latency_us\": {\"p50\": %d, \"p90\": %d, \"p99\": %d, \"max\": %d}}",
+                    sep, res.mode, res.payload, res.bytes, res.seconds,
+                    res.bytes / res.seconds, res.callbacks / res.seconds, (double)res.bytes / res.callbacks,
+                    res.cpu_s * 1e6 / mb, res.tx_syscalls / mb, res.rx_syscalls / mb, p50, p90, p99, max);
+            sep = ",";
+        }
+    }
+
+    // what uart_port adds on top: its {packet, 2} framing to erts
+    fprintf(json, "\n  ],\n  \"port_framing\": [");
+    sep = "";
+    for (unsigned i = 0; i < sizeof(frames) / sizeof(frames[0]); i++)
+    {
+        double mpps;
+        double mbps = pipe_run("writev", true, 2, frames[i], &mpps);
+        fprintf(json, "%s\n    {\"packet\": 2, \"payload\": %d, \"mb_per_s\": %.1f, \"mpackets_per_s\": %.3f}",
+                sep, frames[i], mbps, mpps);
+        sep = ",";
+    }
+    fprintf(json, "\n  ],\n  \"failed\": %d\n}\n", failed);
+    fclose(json);
+    printf("results in %s\n", path);
+    return failed > 0 ? 1 : 0;
+}
+
+#endif
+
+// ---------------------------------------------------------------- hex
+
+#define HEX_BENCH_BYTES     (64 * 1024 * 1024)
+
+// what -hex mode did before: a printf per byte
+static char *old_hex_encode(char *dst, const unsigned char *src, const int n)
+{
+    for (int i = 0; i < n; i++)
+        dst += sprintf(dst, "%02X ", src[i]);
+    return dst;
+}
+
+// what -hex mode parsed input with before (with the A-F fix): a number per token
+static int old_hex_decode(const char *s, const int l, unsigned char *dst, const int max)
+{
+    int n = 0;
+    for (int i = 0; (i < l) && (n < max); )
+    {
+        if (s[i] == ' ')
+        {
+            i++;
+            continue;
+        }
+        int r = 0;
+        for (; (i < l) && (s[i] != ' '); i++)
+        {
+            char c = s[i];
+            r *= 16;
+            if (('0' <= c) && (c <= '9')) r += c - '0';
+            else if (('A' <= c) && (c <= 'F')) r += c - 'A' + 10;
+            else if (('a' <= c) && (c <= 'f')) r += c - 'a' + 10;
+        }
+        dst[n++] = r;
+    }
+    return n;
+}
+
+static int scalar_hex_decode(const char *s, const int l, unsigned char *dst, const int max)
+{
+    const unsigned char *values = hex_values();
+    int n = 0;
+    for (int i = 0; (i + 1 < l) && (n < max); i += 3)
+        dst[n++] = (values[(unsigned char)s[i]] << 4) | values[(unsigned char)s[i + 1]];
+    return n;
+}
+
+static void hex_encode_run(const char *name, f_hex_encode f, const unsigned char *src, const int chunk,
+                           char *dst, const char *expect)
+{
+    const long rounds = HEX_BENCH_BYTES / chunk;
+    double start = now_s();
+    for (long i = 0; i < rounds; i++)
+        f(dst, src, chunk);
+    double s = now_s() - start;
+
+    printf("encode %-8s chunk=%-6d %8.1f MB/s %s\n", name, chunk, (double)rounds * chunk / s / 1e6,
+           memcmp(dst, expect, 3 * chunk) == 0 ? "" : "(wrong output)");
+}
+
+static void hex_decode_run(const char *name, int (*f)(const char *, int, unsigned char *, int),
+                           const char *text, const int l, unsigned char *dst, const unsigned char *expect,
+                           const int n)
+{
+    const long rounds = HEX_BENCH_BYTES / n;
+    double start = now_s();
+    for (long i = 0; i < rounds; i++)
+        f(text, l, dst, n);
+    double s = now_s() - start;
+
+    printf("decode %-8s chunk=%-6d %8.1f MB/s %s\n", name, n, (double)rounds * n / s / 1e6,
+           memcmp(dst, expect, n) == 0 ? "" : "(wrong output)");
+}
+
+static int bench_hex(const int argc, const char *args[])
+{
+    int chunk = argc > 2 ? atoi(args[2]) : COMM_READ_BUF_SIZE;
+    if (chunk < 1)
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    unsigned char *src = (unsigned char *)malloc(chunk);
+    unsigned char *bytes = (unsigned char *)malloc(chunk);
+    char *text = (char *)malloc(HEX_ENCODE_SIZE(chunk));
+    char *dst = (char *)malloc(HEX_ENCODE_SIZE(chunk));
+    for (int i = 0; i < chunk; i++) src[i] = rand();
+    int l = hex_encode_scalar(text, src, chunk) - text;
+
+    hex_encode_run("sprintf", old_hex_encode, src, chunk, dst, text);
+    hex_encode_run("table", hex_encode_scalar, src, chunk, dst, text);
+#ifdef HEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        hex_encode_run("ssse3", hex_encode_ssse3, src, chunk, dst, text);
+    if (__builtin_cpu_supports("avx2"))
+        hex_encode_run("avx2", hex_encode_avx2, src, chunk, dst, text);
+#endif
+
+    // "XX XX ..." is one token per byte, "XXXX..." a single token
+    hex_decode_run("tokens", old_hex_decode, text, l, bytes, src, chunk);
+    hex_decode_run("table", scalar_hex_decode, text, l, bytes, src, chunk);
+    hex_decode_run("spaced", hex_decode, text, l, bytes, src, chunk);
+    char *packed = dst;
+    for (int i = 0; i < chunk; i++)
+    {
+        packed[2 * i] = text[3 * i];
+        packed[2 * i + 1] = text[3 * i + 1];
+    }
+    hex_decode_run("packed", hex_decode, packed, 2 * chunk, bytes, src, chunk);
+
+    free(src);
+    free(bytes);
+    free(text);
+    free(dst);
+    return 0;
+}
+
+// ---------------------------------------------------------------- frame
+
+#define FRAME_BENCH_BYTES   (64 * 1024 * 1024)
+
+static long frame_bench_frames;
+
+static void frame_bench_on_frame(void *param, const char *p, const int l)
+{
+    frame_bench_frames++;
+}
+
+// what a client of on_comm_read does without a framer: a byte at a time into
+// its own buffer until the delimiter
+static void frame_bytewise(char *frame, int *held, const char *p, const int l)
+{
+    for (int i = 0; i < l; i++)
+    {
+        if (p[i] == '\n')
+        {
+            if (*held > 0) frame_bench_on_frame(NULL, frame, *held);
+            *held = 0;
+        }
+        else if (*held < UART_FRAME_MAX)
+            frame[(*held)++] = p[i];
+    }
+}
+
+static void frame_run(const char *name, const uart_framing *f, const bool bytewise, const int payload)
+{
+    static char stream[FRAME_BENCH_BYTES + UART_FRAME_ENCODE_MAX(UART_FRAME_MAX)];
+    static char frame[UART_FRAME_MAX];
+    char *data = (char *)malloc(payload);
+    char chunk[COMM_READ_BUF_SIZE];
+    uart_stats stats;
+    int n = 0;
+    long frames = 0;
+
+    // random payloads, the delimiter framer's without its delimiter
+    while (n < FRAME_BENCH_BYTES)
+    {
+        for (int i = 0; i < payload; i++)
+            data[i] = f->kind == frame_delimiter ? 'a' + rand() % 26 : rand();
+        n += frame_encode(f, data, payload, stream + n, UART_FRAME_ENCODE_MAX(payload));
+        frames++;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    uart_framer *fr = bytewise ? NULL : frame_create(f, frame_bench_on_frame, NULL);
+    int held = 0;
+    frame_bench_frames = 0;
+    double start = now_s();
+    for (int i = 0; i < n; i += COMM_READ_BUF_SIZE)
+    {
+        // stands in for the read into rx_buf; the framer decodes in place
+        const int l = n - i < COMM_READ_BUF_SIZE ? n - i : COMM_READ_BUF_SIZE;
+        memcpy(chunk, stream + i, l);
+        if (NULL == fr)
+            frame_bytewise(frame, &held, chunk, l);
+        else
+            frame_feed(fr, &stats, chunk, l);
+    }
+    double s = now_s() - start;
+    frame_free(fr);
+    free(data);
+
+    printf("%-12s payload=%-5d %8.1f MB/s %8.3f Mframes/s %s\n", name, payload, n / s / 1e6,
+           frame_bench_frames / s / 1e6, frame_bench_frames == frames ? "" : "(frames lost)");
+}
+
+static int bench_frame(const int argc, const char *args[])
+{
+    int payload = argc > 2 ? atoi(args[2]) : 64;
+    if ((payload < 1) || (payload > UART_FRAME_MAX / 2 - 8))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    static const struct { const char *name; uart_framing framing; } framers[] =
+    {
+        {"delimiter", {frame_delimiter, '\n', 0, 0}},
+        {"length 2", {frame_length, 0, 2, 0}},
+        {"slip", {frame_slip, 0, 0, 0}},
+        {"cobs", {frame_cobs, 0, 0, 0}},
+    };
+    frame_run("bytewise", &framers[0].framing, true, payload);
+    for (unsigned i = 0; i < sizeof(framers) / sizeof(framers[0]); i++)
+        frame_run(framers[i].name, &framers[i].framing, false, payload);
+    return 0;
+}
+
+// ---------------------------------------------------------------- crc
+
+#define CRC_BENCH_BYTES     (256 * 1024 * 1024)
+
+// what protocol code without tables does, a bit at a time
+static uint32_t old_crc(const int kind, uint32_t crc, const char *p, const int l)
+{
+    if (kind == crc_32) crc = ~crc;
+    for (int i = 0; i < l; i++)
+    {
+        if (kind == crc_ccitt)
+        {
+            crc ^= (unsigned char)p[i] << 8;
+            for (int j = 0; j < 8; j++)
+                crc = crc & 0x8000 ? ((crc << 1) ^ 0x1021) & 0xffff : (crc << 1) & 0xffff;
+            continue;
+        }
+        const uint32_t poly = kind == crc_32 ? 0xedb88320 : 0xa001;
+        crc ^= (unsigned char)p[i];
+        for (int j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+    }
+    return kind == crc_32 ? ~crc : crc;
+}
+
+static uint32_t crc_by_table(const int kind, uint32_t crc, const char *p, const int l)
+{
+    const uart_crc_tables *t = crc_tables();
+    if (kind == crc_modbus) return crc_reflected_bytes(t->modbus, crc, p, l);
+    if (kind == crc_ccitt) return crc_msb16_bytes(t->ccitt, crc, p, l);
+    return ~crc_reflected_bytes(t->crc32, ~crc, p, l);
+}
+
+static uint32_t crc_sliced(const int kind, uint32_t crc, const char *p, const int l)
+{
+    const uart_crc_tables *t = crc_tables();
+    if (kind == crc_modbus) return crc_reflected(t->modbus, crc, p, l);
+    if (kind == crc_ccitt) return crc_msb16(t->ccitt, crc, p, l);
+    return ~crc_reflected(t->crc32, ~crc, p, l);
+}
+
+static void crc_run(const char *name, const int kind, uint32_t (*f)(const int, uint32_t, const char *, const int),
+                    const char *data, const int size)
+{
+    // the old bitwise loop gets a smaller share, the result is per byte anyway
+    const long rounds = (f == old_crc ? CRC_BENCH_BYTES / 16 : CRC_BENCH_BYTES) / size;
+    const uint32_t expect = old_crc(kind, crc_init(kind), data, size);
+    uint32_t crc = 0;
+    double start = now_s();
+    for (long i = 0; i < rounds; i++)
+        crc = f(kind, crc_init(kind), data, size);
+    double s = now_s() - start;
+
+    static const char *kinds[] = {"", "modbus", "ccitt", "crc32"};
+    printf("%-7s %-8s size=%-6d %9.1f MB/s %s\n", kinds[kind], name, size, (double)rounds * size / s / 1e6,
+           crc == expect ? "" : "(wrong crc)");
+}
+
+static int bench_crc(const int argc, const char *args[])
+{
+    int size = argc > 2 ? atoi(args[2]) : 256;
+    if (size < 1)
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    char *data = (char *)malloc(size);
+    for (int i = 0; i < size; i++) data[i] = rand();
+    for (int kind = crc_modbus; kind <= crc_32; kind++)
+    {
+        crc_run("bitwise", kind, old_crc, data, size);
+        crc_run("table", kind, crc_by_table, data, size);
+        crc_run("slice8", kind, crc_sliced, data, size);
+#ifdef CRC_X86
+        if ((kind == crc_32) && crc_has_pclmul())
+            crc_run("pclmul", kind, crc_update, data, size);
+#endif
+    }
+
+    // the check values of the catalogue, and chunked updates against one pass
+    const char *check = "123456789";
+    const uint32_t checks[] = {0, 0x4b37, 0x29b1, 0xcbf43926};
+    for (int kind = crc_modbus; kind <= crc_32; kind++)
+    {
+        uint32_t crc = crc_init(kind);
+        for (int i = 0; i < size; i += 7)
+            crc = crc_update(kind, crc, data + i, size - i < 7 ? size - i : 7);
+        if ((crc_update(kind, crc_init(kind), check, 9) != checks[kind])
+            || (crc != crc_update(kind, crc_init(kind), data, size)))
+            printf("%d: wrong crc\n", kind);
+    }
+    free(data);
+    return 0;
+}
+
+// ---------------------------------------------------------------- expect
+
+#define EXPECT_BENCH_BYTES  (16 << 20)
+#define EXPECT_BENCH_GAP    (64 << 10)  // console text between two prompts, on average
+#define EXPECT_BENCH_HELD   (64 << 10)  // rescan: text held until a match, at most
+
+// none can occur in the text around them, lower case letters and blanks
+static const char *expect_bench_patterns[] = {"login:", "Password:", "OK\r\n", "ERROR", "U-Boot 20",
+                                              "Kernel panic", "Hit any key to stop autoboot", "# "};
+#define EXPECT_BENCH_COUNT  (int)(sizeof(expect_bench_patterns) / sizeof(expect_bench_patterns[0]))
+
+// the end of the first n in h, -1: none
+static int expect_bench_find(const char *h, const int hl, const char *n, const int nl)
+{
+    const char *last = h + hl - nl;
+    for (const char *p = h; (p <= last) && (p = (const char *)memchr(p, n[0], last - p + 1)) != NULL; p++)
+        if (memcmp(p, n, nl) == 0) return (int)(p - h) + nl;
+    return -1;
+}
+
+// What a callback does without an automaton: appends the chunk to the text
+// held and searches all of it for each pattern, every time.
+static long expect_rescan(const char *data, const int size, const int chunk)
+{
+    static char held[EXPECT_BENCH_HELD + 4096];
+    int len = 0;
+    long matches = 0;
+    for (int o = 0; o < size; o += chunk)
+    {
+        const int l = size - o < chunk ? size - o : chunk;
+        if (len + l > EXPECT_BENCH_HELD)
+        {
+            memmove(held, held + len / 2, len - len / 2);
+            len -= len / 2;
+        }
+        memcpy(held + len, data + o, l);
+        len += l;
+        for (;;)
+        {
+            int end = -1;
+            for (int k = 0; k < EXPECT_BENCH_COUNT; k++)
+            {
+                const int e = expect_bench_find(held, len, expect_bench_patterns[k],
+                                                (int)strlen(expect_bench_patterns[k]));
+                if ((e >= 0) && ((end < 0) || (e < end))) end = e;
+            }
+            if (end < 0) break;
+            matches++;
+            memmove(held, held + end, len - end);
+            len -= end;
+        }
+    }
+    return matches;
+}
+
+static long expect_automaton(const uart_expect *e, const char *data, const int size, const int chunk)
+{
+    uint32_t state = 0;
+    long matches = 0;
+    for (int o = 0; o < size; o += chunk)
+    {
+        const int l = size - o < chunk ? size - o : chunk;
+        for (int i = 0; i < l;)
+        {
+            int pattern;
+            i += expect_scan(e, &state, data + o + i, l - i, &pattern);
+            matches += pattern >= 0;
+        }
+    }
+    return matches;
+}
+
+static int bench_expect(const int argc, const char *args[])
+{
+    const int chunk = argc > 2 ? atoi(args[2]) : 64;
+    if (chunk < 1)
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    static const char text[] = "abcdefghijklmnopqrstuvwxyz      \n";
+    char *data = (char *)malloc(EXPECT_BENCH_BYTES);
+    long inserted = 0;
+    for (int i = 0; i < EXPECT_BENCH_BYTES;)
+    {
+        if (rand() % EXPECT_BENCH_GAP == 0)
+        {
+            const char *p = expect_bench_patterns[rand() % EXPECT_BENCH_COUNT];
+            const int n = (int)strlen(p);
+            if (i + n > EXPECT_BENCH_BYTES) break;
+            memcpy(data + i, p, n);
+            i += n;
+            inserted++;
+        }
+        else
+            data[i++] = text[rand() % (sizeof(text) - 1)];
+    }
+
+    uart_expect *e = uart_expect_create(expect_bench_patterns, EXPECT_BENCH_COUNT, 0);
+    uart_expect no_skip = *e;
+    no_skip.skip_count = 0;
+    printf("%d patterns, %d states, %d byte classes, %ld prompts in %d MB, chunk=%d\n", EXPECT_BENCH_COUNT,
+           e->states, e->classes, inserted, EXPECT_BENCH_BYTES >> 20, chunk);
+
+    for (int m = 0; m < 3; m++)
+    {
+        static const char *names[] = {"rescan", "automaton", "automaton+skip"};
+        // the rescan gets the first 1/64th, the result is per byte anyway
+        const int size = m == 0 ? EXPECT_BENCH_BYTES / 64 : EXPECT_BENCH_BYTES;
+        double start = now_s();
+        const long found = m == 0 ? expect_rescan(data, size, chunk)
+                                  : expect_automaton(m == 1 ? &no_skip : e, data, size, chunk);
+        double t = now_s() - start;
+        printf("%-15s %9.1f MB/s  %ld matches%s\n", names[m], size / t / 1e6, found,
+               found == expect_automaton(e, data, size, 1 << 20) ? "" : " (wrong)");
+    }
+    uart_expect_free(e);
+    free(data);
+    return 0;
+}
+
+// ---------------------------------------------------------------- modbus
+
+#ifndef _WIN32
+
+#define MODBUS_BENCH_REGS       10
+#define MODBUS_BENCH_BAD_ADDR   9999    // answered with exception 2
+#define MODBUS_BENCH_USER_FC    0x41    // echoed: a response of unknown length
+
+// the slaves of one bus on the far side of a pty; a request in 97 gets no
+// response, one in 101 a response with a bad CRC
+typedef struct
+{
+    int             fd;
+    int             slaves;
+    volatile bool   stop;
+    long            requests;
+} modbus_sim;
+
+static void modbus_sim_respond(modbus_sim *s, const unsigned char *q, const int l)
+{
+    char r[MODBUS_MAX_ADU];
+    int n = 0;
+    s->requests++;
+    if (!crc_check(crc_modbus, (const char *)q, l) || (q[0] == 0) || (q[0] > s->slaves)
+        || (s->requests % 97 == 0))
+        return;
+
+    r[n++] = q[0];
+    const int addr = (q[2] << 8) | q[3];
+    if (q[1] == MODBUS_BENCH_USER_FC)
+    {
+        memcpy(r, q, l - 2);
+        n = l - 2;
+    }
+    else if (addr == MODBUS_BENCH_BAD_ADDR)
+    {
+        r[n++] = q[1] | 0x80;
+        r[n++] = 2;
+    }
+    else
+    {
+        const int count = (q[4] << 8) | q[5];
+        r[n++] = q[1];
+        r[n++] = 2 * count;
+        for (int i = 0; i < count; i++)
+        {
+            r[n++] = (addr + i) >> 8;
+            r[n++] = addr + i;
+        }
+    }
+    n += crc_put(crc_modbus, crc_update(crc_modbus, crc_init(crc_modbus), r, n), r + n);
+    if (s->requests % 101 == 0) r[n - 1] ^= 1;
+    if (write(s->fd, r, n) != n)
+        perror("write");
+}
+
+static void *modbus_sim_thread(void *param)
+{
+    modbus_sim *s = (modbus_sim *)param;
+    unsigned char q[4 * MODBUS_MAX_ADU];
+    int held = 0;
+    while (!s->stop)
+    {
+        struct pollfd pfd = {s->fd, POLLIN, 0};
+        if (poll(&pfd, 1, 10) <= 0) continue;
+        int r = read(s->fd, q + held, sizeof(q) - held);
+        if (r <= 0) continue;
+        held += r;
+
+        // function 3: 8 bytes; the user function: slave, code, n, n bytes, CRC
+        while (held >= 3)
+        {
+            const int l = q[1] == MODBUS_BENCH_USER_FC ? 5 + q[2] : 8;
+            if (held < l) break;
+            modbus_sim_respond(s, q, l);
+            memmove(q, q + l, held - l);
+            held -= l;
+        }
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    long    wrong;
+    int     function;
+} modbus_check;
+
+static void modbus_bench_response(void *param, const int slave, const int status, const char *pdu, const int l)
+{
+    modbus_check *c = (modbus_check *)param;
+    const unsigned char *p = (const unsigned char *)pdu;
+    if (status == modbus_exception)
+        c->wrong += (l != 2) || (p[1] != 2);
+    else if ((status == modbus_ok) && (c->function == 3))
+    {
+        bool good = (l == 2 + 2 * MODBUS_BENCH_REGS) && (p[1] == 2 * MODBUS_BENCH_REGS);
+        for (int i = 0; good && (i < MODBUS_BENCH_REGS); i++)
+            good = ((p[2 + 2 * i] << 8) | p[3 + 2 * i]) == i;
+        c->wrong += !good;
+    }
+    else if (status == modbus_ok)
+        c->wrong += (l != 2 + p[1]) || (p[0] != MODBUS_BENCH_USER_FC);
+}
+
+static void modbus_run_bench(const int function, const int buses, const int slaves, const double seconds)
+{
+    static modbus_master master;
+    static uart_obj uarts[MODBUS_MAX_BUSES];
+    static modbus_sim sims[MODBUS_MAX_BUSES];
+    bench_thread threads[MODBUS_MAX_BUSES];
+    modbus_check check = {0, function};
+    struct termios tio;
+    char pdu[MODBUS_MAX_PDU];
+
+    modbus_init(&master);
+    cfmakeraw(&tio);
+    for (int b = 0; b < buses; b++)
+    {
+        int slave;
+        char dev[256];
+        if (openpty(&sims[b].fd, &slave, dev, &tio, NULL) != 0)
+        {
+            perror("openpty");
+            return;
+        }
+        sims[b].slaves = slaves;
+        sims[b].stop = false;
+        sims[b].requests = 0;
+        thread_start(threads + b, modbus_sim_thread, sims + b);
+
+        modbus_bus *bus = modbus_add_bus(&master, 115200, 20);
+        for (int s = 1; s <= slaves; s++)
+        {
+            int l = modbus_pdu(pdu, function, 0, MODBUS_BENCH_REGS);
+            if (function == MODBUS_BENCH_USER_FC)
+            {
+                l = 2 + s;
+                pdu[1] = s;
+                memset(pdu + 2, s, s);
+            }
+            modbus_add_poll(bus, s, pdu, l, 0, 2, modbus_bench_response, &check);
+        }
+        if (function == 3)
+            modbus_add_poll(bus, 1, pdu, modbus_pdu(pdu, 3, MODBUS_BENCH_BAD_ADDR, 1), 0, 2,
+                            modbus_bench_response, &check);
+
+        if (uart_open_dev(uarts + b, dev, 115200, "none", 8, 1, f_on_comm_read(modbus_on_comm_read), bus,
+                          rx_on_close, NULL, false) == NULL)
+        {
+            fprintf(stderr, "failed to open %s\n", dev);
+            return;
+        }
+        modbus_start_bus(bus, uarts + b);
+    }
+
+    modbus_run(&master, seconds);
+
+    modbus_stats t;
+    memset(&t, 0, sizeof(t));
+    for (int b = 0; b < buses; b++)
+    {
+        uart_shutdown(uarts + b);
+        sims[b].stop = true;
+        thread_join(threads[b]);
+        close(sims[b].fd);
+
+        const modbus_stats *s = &master.buses[b].stats;
+        t.requests += s->requests;
+        t.ok += s->ok;
+        t.exceptions += s->exceptions;
+        t.timeouts += s->timeouts;
+        t.bad_responses += s->bad_responses;
+        t.retries += s->retries;
+        t.crc_errors += s->crc_errors;
+        t.stray_bytes += s->stray_bytes;
+        t.latency_sum_us += s->latency_sum_us;
+        if (s->latency_max_us > t.latency_max_us) t.latency_max_us = s->latency_max_us;
+    }
+    modbus_close(&master);
+
+    const uint64_t done = t.ok + t.exceptions;
+    printf("fc %-3d buses=%-2d slaves=%-3d %8.0f transactions/s (%.0f per bus), latency avg %.0f us max %lld us\n",
+           function, buses, slaves, done / seconds, done / seconds / buses,
+           done > 0 ? (double)t.latency_sum_us / done : 0.0, (long long)t.latency_max_us);
+    printf("       requests %llu, exceptions %llu, timeouts %llu, bad %llu, retries %llu, crc errors %llu, "
+           "stray bytes %llu, wrong data %ld\n",
+           (unsigned long long)t.requests, (unsigned long long)t.exceptions, (unsigned long long)t.timeouts,
+           (unsigned long long)t.bad_responses, (unsigned long long)t.retries, (unsigned long long)t.crc_errors,
+           (unsigned long long)t.stray_bytes, check.wrong);
+}
+
+// function 3 responses end by their length, the user function's by silence
+static int bench_modbus(const int argc, const char *args[])
+{
+    int buses = argc > 2 ? atoi(args[2]) : 4;
+    int slaves = argc > 3 ? atoi(args[3]) : 8;
+    double seconds = argc > 4 ? atof(args[4]) : 3;
+    if ((buses < 1) || (buses > MODBUS_MAX_BUSES) || (slaves < 1) || (slaves > 247) || (seconds <= 0))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    modbus_run_bench(3, buses, slaves, seconds);
+    modbus_run_bench(MODBUS_BENCH_USER_FC, buses, slaves, seconds);
+    return 0;
+}
+
+#endif
+
+// ---------------------------------------------------------------- co
+
+#ifndef _WIN32
+// uart_bench_co.c, C++20
+int bench_co(const int argc, const char *args[]);
+#endif
+
+// ---------------------------------------------------------------- check
+
+// uart_bench_check.c
+int bench_check(const int argc, const char *args[]);
+
+// ---------------------------------------------------------------- capture
+
+#define CAPTURE_BENCH_BYTES (256 * 1024 * 1024)
+
+static int bench_capture(const int argc, const char *args[])
+{
+    int payload = argc > 2 ? atoi(args[2]) : 64;
+    const char *path = argc > 3 ? args[3] : "uart_bench.cap";
+    if ((payload < 1) || (payload > COMM_WRITE_BUF_SIZE))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    uart_capture *cap = capture_open(path, CAPTURE_DEFAULT_RING);
+    if (NULL == cap)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        return -1;
+    }
+
+    char *data = (char *)malloc(payload);
+    memset(data, 0x5a, payload);
+    const long records = CAPTURE_BENCH_BYTES / payload;
+    double start = now_s();
+    for (long i = 0; i < records; i++)
+        capture_append(cap, i & 1 ? CAPTURE_TX : CAPTURE_RX, 0, uart_time_us(), data, payload);
+    double s = now_s() - start;
+
+    printf("capture payload=%-6d %8.1f MB/s %8.3f Mrec/s %6.0f ns/rec\n",
+           payload, (double)records * payload / s / 1e6, records / s / 1e6, s / records * 1e9);
+    capture_close(cap);
+    free(data);
+    remove(path);
+    return 0;
+}
+
+int main(const int argc, const char *args[])
+{
+    if ((argc >= 2) && (strcmp(args[1], "check") == 0))
+        return bench_check(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "ring") == 0))
+        return bench_ring(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "hex") == 0))
+        return bench_hex(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "capture") == 0))
+        return bench_capture(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "frame") == 0))
+        return bench_frame(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "crc") == 0))
+        return bench_crc(argc, args);
+#ifndef _WIN32
+    if ((argc >= 2) && (strcmp(args[1], "rx") == 0))
+        return bench_rx(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "profile") == 0))
+        return bench_profile(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "coalesce") == 0))
+        return bench_coalesce(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "sendv") == 0))
+        return bench_sendv(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "pipe") == 0))
+        return bench_pipe(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "expect") == 0))
+        return bench_expect(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "modbus") == 0))
+        return bench_modbus(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "co") == 0))
+        return bench_co(argc, args);
+    if ((argc >= 2) && (strcmp(args[1], "suite") == 0))
+        return bench_suite(argc, args);
+#endif
+
+    printf("usage:\n");
+    printf("\t uart_bench ring [producers] [msg size]\n");
+    printf("\t uart_bench hex [chunk]\n");
+    printf("\t uart_bench capture [payload] [path]\n");
+    printf("\t uart_bench frame [payload]\n");
+    printf("\t uart_bench crc [size]\n");
+    printf("\t uart_bench expect [chunk]\n");
+    printf("\t uart_bench check [name]\n");
+#ifndef _WIN32
+    printf("\t uart_bench rx [baud]\n");
+    printf("\t uart_bench profile [baud] [message]\n");
+    printf("\t uart_bench coalesce [baud] [size]\n");
+    printf("\t uart_bench sendv [payload] [producers]\n");
+    printf("\t uart_bench pipe [payload] [2|4]\n");
+    printf("\t uart_bench suite [seconds] [json path]\n");
+    printf("\t uart_bench modbus [buses] [slaves] [seconds]\n");
+    printf("\t uart_bench co [size]\n");
+#endif
+    return -1;
+}
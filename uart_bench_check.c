@@ -0,0 +1,1249 @@
+// uart_bench check [name]: self-checking tests of the library, byte for byte
+// against the data sent or a plain reference implementation. Prints each
+// failure; the exit status is non-zero if any check failed. `make check`
+// runs them all.
+//
+//   pty        a port both ways over an openpty pair, and its throughput (POSIX)
+//   pty_close  senders racing the port closing on a hang up (POSIX)
+//   pty_frame  uart_send_frame, small frames and large, as uart_frame_encode has them (POSIX)
+//   ring       the TX ring: limits, wraparound, several producers while the limit
+//              changes, vectored writes not cut into
+//   frame      the RX framers: length prefixes up to 0xffffffff, frames over the
+//              maximum, whole and split over batches; each framing and CRC from
+//              the encoder through the framer, in random batches
+//   crc        MODBUS, CCITT and CRC-32 against bitwise ones, the sliced and the
+//              carry-less multiply paths, at any alignment and split
+//   hex        hex_encode (each instruction set the CPU has) and hex_decode
+//              against plain ones
+//   expect     the expect automaton against a brute force scan, across batches
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pty.h>
+#include <termios.h>
+#include <poll.h>
+#endif
+#include "uart.h"
+#include "uart_hex.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                                    \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            failures++;                                                     \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                     \
+            printf(__VA_ARGS__);                                            \
+            printf("\n");                                                   \
+        }                                                                   \
+    } while (0)
+
+#ifdef _WIN32
+typedef HANDLE check_thread;
+#define check_yield()   SwitchToThread()
+
+// a pthread style function run from a WINAPI one: the conventions differ on x86
+typedef struct
+{
+    void *(*f)(void *);
+    void   *param;
+} check_thread_entry;
+
+static DWORD WINAPI check_thread_main(LPVOID p)
+{
+    check_thread_entry e = *(check_thread_entry *)p;
+    free(p);
+    e.f(e.param);
+    return 0;
+}
+
+static void check_thread_start(check_thread *t, void *(*f)(void *), void *param)
+{
+    check_thread_entry *e = (check_thread_entry *)malloc(sizeof(check_thread_entry));
+    e->f = f;
+    e->param = param;
+    *t = CreateThread(NULL, 0, check_thread_main, e, 0, NULL);
+}
+
+static void check_thread_join(check_thread t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+#else
+typedef pthread_t check_thread;
+#define check_yield()   sched_yield()
+
+static void check_thread_start(check_thread *t, void *(*f)(void *), void *param)
+{
+    pthread_create(t, NULL, f, param);
+}
+
+static void check_thread_join(check_thread t)
+{
+    pthread_join(t, NULL);
+}
+#endif
+
+// the test stream: byte k of it, not periodic within a ring or a batch
+static inline unsigned char check_byte(const uint64_t k)
+{
+    return (unsigned char)(k * 7 + (k >> 11) + (k >> 19));
+}
+
+static uint32_t check_rand(uint32_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+    return *x;
+}
+
+// ---------------------------------------------------------------- pty
+
+#ifndef _WIN32
+
+#define PTY_CHECK_BYTES     (16 * 1024 * 1024)
+
+typedef struct
+{
+    int                 fd;             // the pty master, the far end of the port
+    volatile long long  done;           // bytes read or written by the peer
+    long long           bad;            // bytes that were not the stream's
+} pty_peer;
+
+static void *pty_reader(void *param)
+{
+    pty_peer *peer = (pty_peer *)param;
+    static unsigned char buf[64 * 1024];
+    struct pollfd pfd = {peer->fd, POLLIN, 0};
+    while (peer->done < PTY_CHECK_BYTES)
+    {
+        if (poll(&pfd, 1, 2000) <= 0) break;
+        int n = read(peer->fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (int i = 0; i < n; i++)
+            peer->bad += buf[i] != check_byte(peer->done + i);
+        peer->done += n;
+    }
+    return NULL;
+}
+
+static void *pty_writer(void *param)
+{
+    pty_peer *peer = (pty_peer *)param;
+    static unsigned char buf[4096];
+    uint32_t x = 1;
+    while (peer->done < PTY_CHECK_BYTES)
+    {
+        int n = 1 + check_rand(&x) % sizeof(buf);
+        if (n > PTY_CHECK_BYTES - peer->done) n = (int)(PTY_CHECK_BYTES - peer->done);
+        for (int i = 0; i < n; i++)
+            buf[i] = check_byte(peer->done + i);
+        for (int o = 0; o < n;)
+        {
+            int w = write(peer->fd, buf + o, n - o);
+            if (w > 0)
+                o += w;
+            else
+            {
+                struct pollfd pfd = {peer->fd, POLLOUT, 0};
+                if (poll(&pfd, 1, 2000) <= 0) return NULL;
+            }
+        }
+        peer->done += n;
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    volatile long long  received;
+    long long           bad;
+} pty_port_rx;
+
+static void pty_on_read(void *param, const char *p, const int l)
+{
+    pty_port_rx *rx = (pty_port_rx *)param;
+    for (int i = 0; i < l; i++)
+        rx->bad += (unsigned char)p[i] != check_byte(rx->received + i);
+    rx->received += l;
+}
+
+static void pty_on_close(void *param, const enum_comm_close reason)
+{
+}
+
+static double check_now_s(void)
+{
+    return uart_time_us() / 1e6;
+}
+
+static void check_pty(void)
+{
+    static uart_obj uart;
+    struct termios tio;
+    char dev[256];
+    int slave;
+    pty_peer peer = {-1, 0, 0};
+    pty_port_rx rx = {0, 0};
+
+    cfmakeraw(&tio);
+    if (openpty(&peer.fd, &slave, dev, &tio, NULL) != 0)
+    {
+        CHECK(false, "openpty");
+        return;
+    }
+    if (uart_open_dev(&uart, dev, 115200, "none", 8, 1, pty_on_read, &rx, pty_on_close, NULL, false) == NULL)
+    {
+        CHECK(false, "uart_open_dev %s", dev);
+        close(peer.fd);
+        close(slave);
+        return;
+    }
+
+    // TX: sends of 1 byte to 4 KB, read back by the peer
+    check_thread t;
+    check_thread_start(&t, pty_reader, &peer);
+    static char buf[4096];
+    uint32_t x = 2;
+    double start = check_now_s();
+    for (long long sent = 0; sent < PTY_CHECK_BYTES;)
+    {
+        int n = 1 + check_rand(&x) % sizeof(buf);
+        if (n > PTY_CHECK_BYTES - sent) n = (int)(PTY_CHECK_BYTES - sent);
+        for (int i = 0; i < n; i++)
+            buf[i] = (char)check_byte(sent + i);
+        int r = uart_send_timeout(&uart, buf, n, 5000);
+        CHECK(r == n, "tx: %d of %d bytes taken", r, n);
+        if (r < n) break;
+        sent += n;
+    }
+    check_thread_join(t);
+    const double tx_s = check_now_s() - start;
+    CHECK(peer.done == PTY_CHECK_BYTES, "tx: %lld of %d bytes arrived", peer.done, PTY_CHECK_BYTES);
+    CHECK(peer.bad == 0, "tx: %lld bytes wrong", peer.bad);
+
+    // RX: written by the peer in parts of 1 byte to 4 KB
+    peer.done = 0;
+    start = check_now_s();
+    check_thread_start(&t, pty_writer, &peer);
+    check_thread_join(t);
+    for (int i = 0; (i < 5000) && (rx.received < PTY_CHECK_BYTES); i++)
+        usleep(1000);
+    const double rx_s = check_now_s() - start;
+    CHECK(rx.received == PTY_CHECK_BYTES, "rx: %lld of %d bytes arrived", rx.received, PTY_CHECK_BYTES);
+    CHECK(rx.bad == 0, "rx: %lld bytes wrong", rx.bad);
+
+    uart_stats stats;
+    uart_get_stats(&uart, &stats);
+    CHECK(stats.tx_bytes == PTY_CHECK_BYTES, "tx_bytes %llu", (unsigned long long)stats.tx_bytes);
+    CHECK(stats.rx_bytes == PTY_CHECK_BYTES, "rx_bytes %llu", (unsigned long long)stats.rx_bytes);
+    uart_shutdown(&uart);
+    close(peer.fd);
+    close(slave);
+
+    // a pty does not pace to the baud rate: far below this, something polls or sleeps
+    const double mb = PTY_CHECK_BYTES / (1024.0 * 1024.0);
+    printf("pty: tx %.1f MB/s, rx %.1f MB/s\n", mb / tx_s, mb / rx_s);
+    CHECK(mb / tx_s > 5, "tx %.1f MB/s", mb / tx_s);
+    CHECK(mb / rx_s > 5, "rx %.1f MB/s", mb / rx_s);
+}
+
+// the port closes on its I/O thread while other threads keep waking it: the
+// fd numbers it frees are taken by pipes at once, none may be written to
+
+#define PTY_CLOSE_SENDERS   4
+#define PTY_CLOSE_PIPES     64
+
+typedef struct
+{
+    uart_obj       *uart;
+    volatile bool   stop;
+} pty_close_sender;
+
+static void *pty_close_send(void *param)
+{
+    pty_close_sender *s = (pty_close_sender *)param;
+    while (!s->stop)
+    {
+        uart_send(s->uart, "x", 1);
+        uart_flush(s->uart);
+    }
+    return NULL;
+}
+
+static volatile bool pty_closed;
+
+static void pty_close_on_close(void *param, const enum_comm_close reason)
+{
+    pty_closed = true;
+}
+
+static void check_pty_close(void)
+{
+    static uart_obj uart;
+    struct termios tio;
+    char dev[256];
+    int master, slave;
+    pty_port_rx rx = {0, 0};
+
+    cfmakeraw(&tio);
+    if (openpty(&master, &slave, dev, &tio, NULL) != 0)
+    {
+        CHECK(false, "openpty");
+        return;
+    }
+    pty_closed = false;
+    if (uart_open_dev(&uart, dev, 115200, "none", 8, 1, pty_on_read, &rx, pty_close_on_close, NULL, false) == NULL)
+    {
+        CHECK(false, "uart_open_dev %s", dev);
+        return;
+    }
+    close(slave);
+    pty_close_sender s = {&uart, false};
+    check_thread t[PTY_CLOSE_SENDERS];
+    for (int i = 0; i < PTY_CLOSE_SENDERS; i++)
+        check_thread_start(&t[i], pty_close_send, &s);
+    usleep(20000);
+
+    // the hang up closes the port; the pipes take what it frees
+    close(master);
+    int pipes[PTY_CLOSE_PIPES][2];
+    int n = 0;
+    for (int i = 0; (i < 5000) && !pty_closed; i++)
+        usleep(100);
+    for (; n < PTY_CLOSE_PIPES; n++)
+        if (pipe(pipes[n]) != 0) break;
+    usleep(20000);
+    s.stop = true;
+    for (int i = 0; i < PTY_CLOSE_SENDERS; i++)
+        check_thread_join(t[i]);
+    CHECK(pty_closed, "no close on hang up");
+
+    int written = 0;
+    for (int i = 0; i < n; i++)
+    {
+        struct pollfd pfd = {pipes[i][0], POLLIN, 0};
+        written += poll(&pfd, 1, 0) > 0;
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    CHECK(written == 0, "%d pipes written to after the port closed", written);
+    uart_shutdown(&uart);
+}
+
+typedef struct
+{
+    int                 fd;             // the pty master
+    const char         *want;           // the bytes to arrive
+    int                 l;
+    int                 done;
+    int                 bad;
+} pty_frame_peer;
+
+static void *pty_frame_reader(void *param)
+{
+    pty_frame_peer *peer = (pty_frame_peer *)param;
+    static char buf[4096];
+    struct pollfd pfd = {peer->fd, POLLIN, 0};
+    while (peer->done < peer->l)
+    {
+        if (poll(&pfd, 1, 2000) <= 0) break;
+        int n = read(peer->fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        if (n > peer->l - peer->done) n = peer->l - peer->done;
+        for (int i = 0; i < n; i++)
+            peer->bad += buf[i] != peer->want[peer->done + i];
+        peer->done += n;
+    }
+    return NULL;
+}
+
+static CB_CALL void pty_frame_on_frame(void *param, const char *p, const int l)
+{
+}
+
+// SLIP with a CRC-32: both sides of the stack buffer, escapes, and frames
+// whose encoding is beyond the TX buffer
+static void check_pty_frame(void)
+{
+    static uart_obj uart;
+    static char data[20000], want[256 * 1024];
+    struct termios tio;
+    char dev[256];
+    int master, slave;
+    pty_port_rx rx = {0, 0};
+
+    cfmakeraw(&tio);
+    if (openpty(&master, &slave, dev, &tio, NULL) != 0)
+    {
+        CHECK(false, "openpty");
+        return;
+    }
+    if (uart_open_dev(&uart, dev, 115200, "none", 8, 1, pty_on_read, &rx, pty_on_close, NULL, false) == NULL)
+    {
+        CHECK(false, "uart_open_dev %s", dev);
+        close(master);
+        close(slave);
+        return;
+    }
+    const uart_framing f = {frame_slip, 0, 0, 0, crc_32};
+    CHECK(uart_set_framing(&uart, &f, pty_frame_on_frame, NULL), "uart_set_framing");
+    uart_io_profile io;
+    uart_get_io_profile(&uart, &io);
+
+    static const int lens[] = {1, 300, (UART_FRAME_STACK - 10) / 2, (UART_FRAME_STACK - 10) / 2 + 1, 4000, 9000, 20000};
+    uint32_t x = 5;
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (char)(check_rand(&x) % 7 == 0 ? SLIP_END : check_rand(&x));
+    int l = 0;
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    {
+        const int n = uart_frame_encode(&f, data, lens[i], want + l, io.tx_queue);
+        if (n > 0) l += n;
+    }
+    CHECK(l > 4000, "%d bytes encoded", l);
+
+    pty_frame_peer peer = {master, want, l, 0, 0};
+    check_thread t;
+    check_thread_start(&t, pty_frame_reader, &peer);
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    {
+        const bool fits = uart_frame_encode(&f, data, lens[i], want + l, io.tx_queue) > 0;
+        const int r = uart_send_frame(&uart, data, lens[i], 5000);
+        CHECK(r == (fits ? lens[i] : -1), "a frame of %d bytes: %d", lens[i], r);
+    }
+    check_thread_join(t);
+    CHECK(peer.done == l, "%d of %d bytes arrived", peer.done, l);
+    CHECK(peer.bad == 0, "%d bytes wrong", peer.bad);
+
+    uart_shutdown(&uart);
+    close(master);
+    close(slave);
+}
+
+#endif
+
+// ---------------------------------------------------------------- ring
+
+#define RING_CHECK_PRODUCERS    4
+#define RING_CHECK_MESSAGES     200000
+#define RING_CHECK_MAX          200     // message bytes, the header too
+
+// A message: its length, the producer, its number, then bytes of the stream
+// from number * 31 + producer on. Producers with an odd id write theirs as
+// three segments with ring_writev.
+typedef struct
+{
+    uart_ring          *ring;
+    int                 id;
+    volatile uint32_t  *finished;
+} ring_producer;
+
+static int ring_message(const int id, const uint32_t seq, char *m)
+{
+    const int l = 6 + (int)((seq * 7 + id) % (RING_CHECK_MAX - 6 + 1));
+    m[0] = (char)l;
+    m[1] = (char)id;
+    memcpy(m + 2, &seq, 4);
+    for (int k = 6; k < l; k++)
+        m[k] = (char)check_byte((uint64_t)seq * 31 + id + k);
+    return l;
+}
+
+static void *ring_produce(void *param)
+{
+    ring_producer *p = (ring_producer *)param;
+    char m[RING_CHECK_MAX];
+    for (uint32_t seq = 0; seq < RING_CHECK_MESSAGES; seq++)
+    {
+        const int l = ring_message(p->id, seq, m);
+        if (p->id & 1)
+        {
+            const uart_iovec v[3] = {{m, 2}, {m + 2, 4}, {m + 6, l - 6}};
+            while (ring_writev(p->ring, v, 3, l) == 0)
+                check_yield();
+        }
+        else
+        {
+            while (!ring_put(p->ring, m, l))
+                check_yield();
+        }
+    }
+    ring_fetch_add(p->finished, 1);
+    return NULL;
+}
+
+// single threaded: the limit as it changes, and wraparound of peek and consume
+static void check_ring_limits(void)
+{
+    static uart_ring r;
+    static char m[UART_RING_SIZE];
+    memset(m, 'x', sizeof(m));
+    for (int mpsc = 0; mpsc < 2; mpsc++)
+    {
+        uint32_t l;
+        ring_init(&r, mpsc != 0);
+        ring_store(&r.limit, 100);
+        CHECK(ring_write(&r, m, 60, false) == 60, "limit 100: 60 bytes not taken");
+        CHECK(ring_write(&r, m, 50, false) == 0, "limit 100: 50 more taken whole");
+        CHECK(ring_write(&r, m, 50, true) == 40, "limit 100: a partial write of 50 took not 40");
+        CHECK(ring_used(&r) == 100, "limit 100: %u used", ring_used(&r));
+        ring_store(&r.limit, 200);
+        CHECK(ring_write(&r, m, 100, false) == 100, "raised to 200: 100 bytes not taken");
+        ring_store(&r.limit, 50);
+        CHECK(ring_write(&r, m, 1, true) == 0, "lowered to 50 with 200 used: a byte taken");
+        ring_peek(&r, &l);
+        ring_consume(&r, l);
+        const uart_iovec v[2] = {{m, 30}, {m, 20}};
+        CHECK(ring_writev(&r, v, 2, 50) == 50, "lowered to 50, empty: 50 bytes in segments not taken");
+        CHECK(ring_write(&r, m, 1, true) == 0, "lowered to 50, full: a byte taken");
+        ring_peek(&r, &l);
+        ring_consume(&r, l);
+
+        // odd sizes around the ring a few times, byte for byte
+        ring_store(&r.limit, UART_RING_SIZE);
+        uint64_t in = 0, out = 0, bad = 0;
+        uint32_t x = 3;
+        while (out < 5ull * UART_RING_SIZE)
+        {
+            const int n = 1 + check_rand(&x) % 5000;
+            for (int i = 0; i < n; i++)
+                m[i] = (char)check_byte(in + i);
+            in += ring_write(&r, m, n, true);
+            const char *p = ring_peek(&r, &l);
+            const uint32_t take = l < (uint32_t)n ? l : (uint32_t)n;
+            for (uint32_t i = 0; i < take; i++)
+                bad += (unsigned char)p[i] != check_byte(out + i);
+            ring_consume(&r, take);
+            out += take;
+        }
+        CHECK(bad == 0, "wraparound, %s: %llu bytes wrong", mpsc ? "mpsc" : "spsc", (unsigned long long)bad);
+    }
+}
+
+// the consumer: each producer's messages arrive whole and in order while the
+// limit changes under them
+static void check_ring_producers(const int producers, const bool mpsc)
+{
+    static uart_ring r;
+    volatile uint32_t finished = 0;
+    ring_init(&r, mpsc);
+    ring_producer p[RING_CHECK_PRODUCERS];
+    check_thread t[RING_CHECK_PRODUCERS];
+    for (int i = 0; i < producers; i++)
+    {
+        p[i].ring = &r;
+        p[i].id = i;
+        p[i].finished = &finished;
+        check_thread_start(&t[i], ring_produce, &p[i]);
+    }
+
+    static const uint32_t limits[] = {UART_RING_SIZE, 1000, RING_CHECK_MAX, 4096, UART_RING_SIZE - 1};
+    uint32_t next[RING_CHECK_PRODUCERS] = {0};
+    char m[RING_CHECK_MAX], want[RING_CHECK_MAX];
+    int held = 0;
+    long long messages = 0;
+    bool bad = false;
+    uint64_t round = 0;
+    while (!bad && (messages < (long long)producers * RING_CHECK_MESSAGES))
+    {
+        if ((++round & 1023) == 0)
+            ring_store(&r.limit, limits[(round >> 10) % (sizeof(limits) / sizeof(limits[0]))]);
+
+        uint32_t l;
+        const uint32_t done = ring_load(&finished);
+        const char *q = ring_peek(&r, &l);
+        if (l == 0)
+        {
+            // all written, and some of it missing
+            bad = done == (uint32_t)producers;
+            check_yield();
+            continue;
+        }
+        for (uint32_t j = 0; (j < l) && !bad; j++)
+        {
+            m[held++] = q[j];
+            bad = ((unsigned char)m[0] < 6) || ((unsigned char)m[0] > RING_CHECK_MAX);
+            if (bad) break;
+            if ((held < 6) || (held < (unsigned char)m[0])) continue;
+            const int id = m[1];
+            uint32_t seq;
+            memcpy(&seq, m + 2, 4);
+            bad = (id < 0) || (id >= producers) || (seq != next[id]) || (ring_message(id, seq, want) != held)
+                || (memcmp(m, want, held) != 0);
+            if (bad) break;
+            next[id]++;
+            messages++;
+            held = 0;
+        }
+        ring_consume(&r, l);
+    }
+    CHECK(!bad, "%d producers, %s: message %lld cut into or out of order", producers, mpsc ? "mpsc" : "spsc",
+          messages);
+
+    // a broken stream: drained so that the producers finish
+    ring_store(&r.limit, UART_RING_SIZE);
+    while (ring_load(&finished) < (uint32_t)producers)
+    {
+        uint32_t l;
+        ring_peek(&r, &l);
+        ring_consume(&r, l);
+        check_yield();
+    }
+    for (int i = 0; i < producers; i++)
+        check_thread_join(t[i]);
+}
+
+// ring_once: threads arriving together, one builds, none sees a partial table
+#define ONCE_CHECK_THREADS  4
+#define ONCE_CHECK_ROUNDS   8
+#define ONCE_CHECK_WORDS    (64 * 1024)
+
+typedef struct
+{
+    volatile uint32_t once;
+    volatile uint32_t go;
+    volatile uint32_t builders;
+    volatile uint32_t partial;          // threads that saw a word missing
+    uint32_t table[ONCE_CHECK_WORDS];
+} once_check;
+
+static inline uint32_t once_word(const int i)
+{
+    return (uint32_t)i * 2654435761u + 1;
+}
+
+static void *once_run(void *param)
+{
+    once_check *c = (once_check *)param;
+    while (!ring_load(&c->go))
+        check_yield();
+    if (ring_once(&c->once))
+    {
+        ring_fetch_add(&c->builders, 1);
+        for (int i = 0; i < ONCE_CHECK_WORDS; i++)
+        {
+            c->table[i] = once_word(i);
+            // the others arrive meanwhile
+            if (i % 4096 == 0) check_yield();
+        }
+        ring_once_done(&c->once);
+    }
+    for (int i = 0; i < ONCE_CHECK_WORDS; i++)
+        if (c->table[i] != once_word(i))
+        {
+            ring_fetch_add(&c->partial, 1);
+            break;
+        }
+    return NULL;
+}
+
+static void check_ring_once(void)
+{
+    once_check *c = (once_check *)malloc(sizeof(once_check));
+    for (int round = 0; round < ONCE_CHECK_ROUNDS; round++)
+    {
+        memset(c, 0, sizeof(*c));
+        check_thread t[ONCE_CHECK_THREADS];
+        for (int i = 0; i < ONCE_CHECK_THREADS; i++)
+            check_thread_start(&t[i], once_run, c);
+        ring_store(&c->go, 1);
+        for (int i = 0; i < ONCE_CHECK_THREADS; i++)
+            check_thread_join(t[i]);
+        CHECK(c->builders == 1, "round %d: %u threads built the table", round, c->builders);
+        CHECK(c->partial == 0, "round %d: %u threads saw it partly built", round, c->partial);
+    }
+    free(c);
+}
+
+static void check_ring(void)
+{
+    check_ring_limits();
+    check_ring_producers(1, false);
+    check_ring_producers(1, true);
+    check_ring_producers(RING_CHECK_PRODUCERS, true);
+    check_ring_once();
+}
+
+// ---------------------------------------------------------------- frame
+
+#define FRAME_CHECK_FRAMES  64
+#define FRAME_CHECK_BYTES   (64 * 1024)
+
+typedef struct
+{
+    int     frames;
+    int     l;                          // bytes in data
+    int     lens[FRAME_CHECK_FRAMES];
+    char    data[FRAME_CHECK_BYTES];    // the frames one after another
+} frame_sink;
+
+static CB_CALL void frame_sink_on(void *param, const char *p, const int l)
+{
+    frame_sink *sink = (frame_sink *)param;
+    if ((sink->frames < FRAME_CHECK_FRAMES) && (sink->l + l <= FRAME_CHECK_BYTES))
+    {
+        sink->lens[sink->frames] = l;
+        memcpy(sink->data + sink->l, p, l);
+        sink->l += l;
+    }
+    sink->frames++;
+}
+
+// s through a new framer in two batches cut at `cut`, or byte by byte with
+// cut < 0; false: f was refused
+static bool frame_run(const uart_framing *f, const char *s, const int l, const int cut, frame_sink *sink,
+                      uart_stats *stats)
+{
+    memset(sink, 0, sizeof(*sink));
+    memset(stats, 0, sizeof(*stats));
+    uart_framer *fr = frame_create(f, frame_sink_on, sink);
+    if (NULL == fr) return false;
+    char *buf = (char *)malloc(l > 0 ? l : 1);   // the framers decode in place
+    memcpy(buf, s, l);
+    if (cut < 0)
+    {
+        for (int i = 0; i < l; i++)
+            frame_feed(fr, stats, buf + i, 1);
+    }
+    else
+    {
+        frame_feed(fr, stats, buf, cut);
+        frame_feed(fr, stats, buf + cut, l - cut);
+    }
+    free(buf);
+    frame_free(fr);
+    return true;
+}
+
+static int frame_put_length(char *d, const int lb, const uint32_t len)
+{
+    for (int k = 0; k < lb; k++)
+        d[k] = (char)(len >> (8 * (lb - 1 - k)));
+    return lb;
+}
+
+// a frame of each length near the maximum and up to what the prefix can
+// carry, then a good one. Over the maximum, the declared length is skipped:
+// the good frame is lost too when that runs past the stream.
+static void check_frame_length(void)
+{
+    static const int prefixes[] = {1, 2, 4};
+    static const int max = 64;
+    static const int payload = 100;     // bytes after the prefix, at most
+    for (size_t j = 0; j < sizeof(prefixes) / sizeof(prefixes[0]); j++)
+    {
+        const int lb = prefixes[j];
+        const uart_framing f = {frame_length, 0, lb, max, crc_none};
+        const uint32_t top = lb == 4 ? 0xffffffffu : (1u << (8 * lb)) - 1;
+        const uint32_t lens[] = {0, (uint32_t)(max - lb), (uint32_t)(max - lb + 1), top - 3, top - 2, top - 1, top};
+        for (size_t c = 0; c < sizeof(lens) / sizeof(lens[0]); c++)
+        {
+            const uint32_t len = lens[c];
+            char s[4 + 100 + 4 + 5];
+            int l = frame_put_length(s, lb, len);
+            const int follow = len < (uint32_t)payload ? (int)len : 8;
+            for (int k = 0; k < follow; k++)
+                s[l++] = (char)check_byte(k);
+            l += frame_put_length(s + l, lb, 5);
+            memcpy(s + l, "hello", 5);
+            l += 5;
+
+            const bool fits = (uint64_t)len + lb <= (uint64_t)max;
+            const int want_frames = fits ? (len > 0 ? 2 : 1) : (len < (uint32_t)payload ? 1 : 0);
+            for (int cut = -1; cut <= l; cut++)
+            {
+                frame_sink sink;
+                uart_stats stats;
+                if (!frame_run(&f, s, l, cut, &sink, &stats))
+                {
+                    CHECK(false, "length %d bytes, max %d: refused", lb, max);
+                    return;
+                }
+                const bool ok = (sink.frames == want_frames) && (stats.rx_frame_errors == (fits ? 0u : 1u))
+                    && ((want_frames == 0) || (memcmp(sink.data + sink.l - 5, "hello", 5) == 0))
+                    && ((want_frames < 2) || ((sink.lens[0] == (int)len) && (sink.l == (int)len + 5)));
+                CHECK(ok, "length %d bytes, 0x%x declared, cut at %d: %d frames, %llu errors", lb, len, cut,
+                      sink.frames, (unsigned long long)stats.rx_frame_errors);
+                if (!ok) break;
+            }
+        }
+    }
+
+    // the buffer holds the prefix at least
+    frame_sink sink;
+    uart_stats stats;
+    const uart_framing small = {frame_length, 0, 4, 3, crc_none};
+    CHECK(!frame_run(&small, "", 0, 0, &sink, &stats), "max_frame 3 under a 4 byte length taken");
+    const uart_framing prefix_only = {frame_length, 0, 4, 4, crc_none};
+    CHECK(frame_run(&prefix_only, "\0\0\0\0", 4, 2, &sink, &stats) && (stats.rx_frame_errors == 0),
+          "max_frame 4 under a 4 byte length, an empty frame: refused or an error");
+}
+
+// the frame data: the bytes the framings treat specially among others, or
+// now and then no zero at all (COBS blocks of 254)
+static int frame_data(uint32_t *x, char *d, const int max, const int delimiter)
+{
+    static const unsigned char special[] = {0, SLIP_END, SLIP_ESC, SLIP_ESC_END, SLIP_ESC_ESC, 0xff};
+    const int l = 1 + check_rand(x) % max;
+    const bool zeros = check_rand(x) % 4 != 0;
+    for (int i = 0; i < l; i++)
+    {
+        const uint32_t r = check_rand(x);
+        d[i] = (char)(r % 3 == 0 ? special[(r >> 8) % sizeof(special)] : r >> 16);
+        if (((unsigned char)d[i] == delimiter) || (!zeros && (d[i] == 0))) d[i] = 'x';
+    }
+    return l;
+}
+
+// each framing and CRC: random frames encoded one after another, fed back in
+// random batches, must arrive as they were
+static void check_frame_round_trip(void)
+{
+    static const uart_framing framings[] =
+    {
+        {frame_delimiter, '\n', 0, 0, crc_none},
+        {frame_delimiter, 0, 0, 0, crc_none},
+        {frame_length, 0, 1, 0, crc_none},
+        {frame_length, 0, 2, 0, crc_modbus},
+        {frame_length, 0, 4, 0, crc_32},
+        {frame_slip, 0, 0, 0, crc_none},
+        {frame_slip, 0, 0, 0, crc_ccitt},
+        {frame_slip, 0, 0, 0, crc_32},
+        {frame_cobs, 0, 0, 0, crc_none},
+        {frame_cobs, 0, 0, 0, crc_modbus},
+        {frame_cobs, 0, 0, 0, crc_32},
+    };
+    static char stream[FRAME_CHECK_BYTES], data[FRAME_CHECK_BYTES];
+    static frame_sink sink;
+    uint32_t x = 11;
+    for (size_t j = 0; j < sizeof(framings) / sizeof(framings[0]); j++)
+    {
+        const uart_framing *f = &framings[j];
+        const int delimiter = f->kind == frame_delimiter ? f->delimiter : -1;
+        const int most = f->kind == frame_length && f->length_bytes == 1 ? 250 - crc_bytes(f->crc) : 800;
+        for (int round = 0; round < 20; round++)
+        {
+            int lens[FRAME_CHECK_FRAMES];
+            int frames = 1 + check_rand(&x) % 30, l = 0, dl = 0;
+            for (int i = 0; i < frames; i++)
+            {
+                lens[i] = frame_data(&x, data + dl, most, delimiter);
+                const int n = frame_encode(f, data + dl, lens[i], stream + l, (int)sizeof(stream) - l);
+                CHECK(n > 0, "framing %d: %d bytes not encoded", (int)j, lens[i]);
+                if (n <= 0) return;
+                l += n;
+                dl += lens[i];
+            }
+
+            memset(&sink, 0, sizeof(sink));
+            uart_stats stats;
+            memset(&stats, 0, sizeof(stats));
+            uart_framer *fr = frame_create(f, frame_sink_on, &sink);
+            for (int i = 0; i < l;)
+            {
+                const int n = 1 + check_rand(&x) % (round & 1 ? 8 : 700);
+                const int take = n < l - i ? n : l - i;
+                frame_feed(fr, &stats, stream + i, take);
+                i += take;
+            }
+            frame_free(fr);
+
+            bool ok = (sink.frames == frames) && (sink.l == dl) && (memcmp(sink.data, data, dl) == 0)
+                && (stats.rx_frames == (uint64_t)frames) && (stats.rx_frame_errors == 0) && (stats.rx_crc_errors == 0);
+            for (int i = 0; ok && (i < frames); i++)
+                ok = sink.lens[i] == lens[i];
+            CHECK(ok, "framing %d, round %d: %d of %d frames, %llu errors, %llu CRC errors", (int)j, round,
+                  sink.frames, frames, (unsigned long long)stats.rx_frame_errors,
+                  (unsigned long long)stats.rx_crc_errors);
+            if (!ok) break;
+        }
+    }
+
+    // a byte changed in the data: the CRC drops the frame, the next one comes
+    static const int kinds[] = {crc_modbus, crc_ccitt, crc_32};
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        const uart_framing f = {frame_length, 0, 2, 0, kinds[k]};
+        const int n = frame_encode(&f, "hello", 5, stream, sizeof(stream));
+        memcpy(stream + n, stream, n);
+        stream[3] ^= 0x10;
+        uart_stats stats;
+        frame_run(&f, stream, 2 * n, n + 1, &sink, &stats);
+        CHECK((sink.frames == 1) && (stats.rx_crc_errors == 1) && (memcmp(sink.data, "hello", 5) == 0),
+              "CRC %d: a changed byte, %d frames, %llu CRC errors", kinds[k], sink.frames,
+              (unsigned long long)stats.rx_crc_errors);
+    }
+}
+
+static void check_frame(void)
+{
+    check_frame_length();
+    check_frame_round_trip();
+}
+
+// ---------------------------------------------------------------- crc
+
+// a bit at a time, from the definitions
+static uint32_t crc_bitwise(const int kind, const unsigned char *p, const int l)
+{
+    uint32_t crc = kind == crc_32 ? 0xffffffffu : 0xffff;
+    for (int i = 0; i < l; i++)
+    {
+        if (kind == crc_ccitt)
+        {
+            crc ^= (uint32_t)p[i] << 8;
+            for (int b = 0; b < 8; b++)
+                crc = crc & 0x8000 ? ((crc << 1) ^ 0x1021) & 0xffff : (crc << 1) & 0xffff;
+        }
+        else
+        {
+            const uint32_t poly = kind == crc_32 ? 0xedb88320u : 0xa001;
+            crc ^= p[i];
+            for (int b = 0; b < 8; b++)
+                crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+        }
+    }
+    return kind == crc_32 ? ~crc : crc;
+}
+
+static void check_crc(void)
+{
+    static const int kinds[] = {crc_modbus, crc_ccitt, crc_32};
+    static const uint32_t check_values[] = {0x4b37, 0x29b1, 0xcbf43926};   // of "123456789"
+    static unsigned char buf[4096 + 16];
+    uint32_t x = 7;
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (unsigned char)check_rand(&x);
+
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        const int kind = kinds[k];
+        const uint32_t c = crc_update(kind, crc_init(kind), "123456789", 9);
+        CHECK(c == check_values[k], "CRC %d of \"123456789\": %08x", kind, c);
+
+        // every length up to 300, then some longer, at every alignment; whole
+        // and split in two
+        for (int l = 0; l < 4096; l = l < 300 ? l + 1 : l * 3 / 2 + 13)
+        {
+            for (int o = 0; o < 16; o++)
+            {
+                const char *p = (const char *)buf + o;
+                const uint32_t want = crc_bitwise(kind, buf + o, l);
+                const int cut = l > 0 ? (int)(check_rand(&x) % (l + 1)) : 0;
+                const uint32_t whole = crc_update(kind, crc_init(kind), p, l);
+                const uint32_t split = crc_update(kind, crc_update(kind, crc_init(kind), p, cut), p + cut, l - cut);
+                CHECK((whole == want) && (split == want), "CRC %d of %d bytes at +%d: %08x, split at %d %08x, not %08x",
+                      kind, l, o, whole, cut, split, want);
+                if ((whole != want) || (split != want)) return;
+            }
+        }
+
+        // crc_put and crc_check: the CRC on the line after the data
+        char frame[64 + 4];
+        memcpy(frame, buf, 64);
+        const int n = crc_put(kind, crc_update(kind, crc_init(kind), frame, 64), frame + 64);
+        CHECK(crc_check(kind, frame, 64 + n), "CRC %d: crc_put then crc_check fails", kind);
+        frame[10] ^= 1;
+        CHECK(!crc_check(kind, frame, 64 + n), "CRC %d: a changed bit passes crc_check", kind);
+    }
+
+#ifdef CRC_X86
+    // with PCLMULQDQ crc_update folds from 64 bytes on: the tables alone too
+    const uart_crc_tables *t = crc_tables();
+    for (int l = 0; l < 2000; l += 37)
+    {
+        const uint32_t c = ~crc_reflected(t->crc32, 0xffffffffu, (const char *)buf + 3, l);
+        CHECK(c == crc_bitwise(crc_32, buf + 3, l), "CRC-32 tables alone, %d bytes: %08x", l, c);
+    }
+#endif
+}
+
+// ---------------------------------------------------------------- hex
+
+static int hex_encode_plain(char *dst, const unsigned char *src, const int n)
+{
+    for (int i = 0; i < n; i++)
+        sprintf(dst + 3 * i, "%02X ", src[i]);
+    return 3 * n;
+}
+
+static int hex_digit(const char c)
+{
+    return (c >= '0') && (c <= '9') ? c - '0'
+        : (c >= 'a') && (c <= 'f') ? c - 'a' + 10
+        : (c >= 'A') && (c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+// hex_decode as its comment has it, a token at a time
+static int hex_decode_plain(const char *s, const int l, unsigned char *dst, const int max)
+{
+    int i = 0, n = 0;
+    while (i < l)
+    {
+        if ((s[i] == ' ') || (s[i] == '\t'))
+        {
+            i++;
+            continue;
+        }
+        int end = i;
+        while ((end < l) && (s[end] != ' ') && (s[end] != '\t'))
+        {
+            if (hex_digit(s[end]) < 0) return -1;
+            end++;
+        }
+        if (n + (end - i + 1) / 2 > max) return -1;
+        if ((end - i) & 1)
+            dst[n++] = (unsigned char)hex_digit(s[i++]);
+        for (; i < end; i += 2)
+            dst[n++] = (unsigned char)(hex_digit(s[i]) << 4 | hex_digit(s[i + 1]));
+    }
+    return n;
+}
+
+static void check_hex(void)
+{
+    static unsigned char src[300 + 32];
+    static char want[HEX_ENCODE_SIZE(300) + 32], got[HEX_ENCODE_SIZE(300) + 32];
+    uint32_t x = 9;
+    for (size_t i = 0; i < sizeof(src); i++)
+        src[i] = (unsigned char)check_rand(&x);
+
+    struct { const char *name; f_hex_encode f; } encoders[3] = {{"scalar", hex_encode_scalar}, {NULL, NULL}, {NULL, NULL}};
+#ifdef HEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) encoders[1].name = "ssse3", encoders[1].f = hex_encode_ssse3;
+    if (__builtin_cpu_supports("avx2")) encoders[2].name = "avx2", encoders[2].f = hex_encode_avx2;
+#endif
+    for (int e = 0; e < 3; e++)
+    {
+        if (NULL == encoders[e].f) continue;
+        for (int n = 0; n <= 300; n++)
+        {
+            const int o = n % 32;
+            const int l = hex_encode_plain(want, src + o, n);
+            const char *end = encoders[e].f(got, src + o, n);
+            const bool ok = (end - got == l) && (memcmp(got, want, l) == 0);
+            CHECK(ok, "hex_encode %s, %d bytes at +%d", encoders[e].name, n, o);
+            if (!ok) break;
+        }
+    }
+
+    // random input: tokens of 1 to 40 digits of either case, blanks, now and
+    // then a character that is no digit
+    static const char chars[] = "0123456789abcdefABCDEF";
+    static char s[512];
+    unsigned char a[256], b[256];
+    for (int round = 0; round < 20000; round++)
+    {
+        int l = 0;
+        while (l < 400)
+        {
+            const int t = 1 + check_rand(&x) % (round & 1 ? 4 : 40);
+            for (int i = 0; i < t; i++)
+                s[l++] = chars[check_rand(&x) % (sizeof(chars) - 1)];
+            if (check_rand(&x) % 500 == 0) s[l - 1] = "gG:x\r"[check_rand(&x) % 5];
+            const int blanks = 1 + check_rand(&x) % 3;
+            for (int i = 0; i < blanks; i++)
+                s[l++] = check_rand(&x) & 1 ? ' ' : '\t';
+        }
+        l -= check_rand(&x) % 8;                        // may end in a token
+        const int max = check_rand(&x) % 4 == 0 ? 100 + check_rand(&x) % 100 : (int)sizeof(a);
+        const int na = hex_decode(s, l, a, max);
+        const int nb = hex_decode_plain(s, l, b, max);
+        const bool ok = (na == nb) && ((na < 0) || (memcmp(a, b, na) == 0));
+        CHECK(ok, "hex_decode of %d characters: %d bytes, not %d, or other ones", l, na, nb);
+        if (!ok) break;
+    }
+}
+
+// ---------------------------------------------------------------- expect
+
+#define EXPECT_CHECK_MATCHES    4096
+
+typedef struct
+{
+    int         pattern;
+    uint64_t    offset;
+} expect_found;
+
+static bool expect_equal(const char *a, const char *b, const int l, const bool nocase)
+{
+    for (int i = 0; i < l; i++)
+    {
+        const int x = (unsigned char)a[i], y = (unsigned char)b[i];
+        if (nocase ? tolower(x) != tolower(y) : x != y) return false;
+    }
+    return true;
+}
+
+// the matches as uart_expect.h defines them: at the first byte ending one,
+// the longest, then the one given first; the next starts after it
+static int expect_brute(const char *const *patterns, const int count, const bool nocase, const char *s, const int l,
+                        expect_found *found)
+{
+    int start = 0, n = 0;
+    for (int e = 0; (e < l) && (n < EXPECT_CHECK_MATCHES); e++)
+    {
+        int best = -1, best_len = 0;
+        for (int i = 0; i < count; i++)
+        {
+            const int pl = (int)strlen(patterns[i]);
+            if ((pl <= best_len) || (e + 1 - pl < start)) continue;
+            if (expect_equal(patterns[i], s + e + 1 - pl, pl, nocase))
+            {
+                best = i;
+                best_len = pl;
+            }
+        }
+        if (best < 0) continue;
+        found[n].pattern = best;
+        found[n++].offset = e + 1 - best_len;
+        start = e + 1;
+    }
+    return n;
+}
+
+static void check_expect(void)
+{
+    // few symbols, so that patterns overlap and share prefixes and suffixes
+    static const char symbols[] = "abAB>\r\n";
+    static char s[16 * 1024];
+    static expect_found want[EXPECT_CHECK_MATCHES], got[EXPECT_CHECK_MATCHES];
+    uint32_t x = 13;
+    for (int round = 0; round < 400; round++)
+    {
+        const bool nocase = round & 1;
+        const int count = 1 + check_rand(&x) % 12;      // over EXPECT_SKIP_MAX first bytes too
+        char text[12][8];
+        const char *patterns[12];
+        for (int i = 0; i < count; i++)
+        {
+            const int pl = 1 + check_rand(&x) % (round % 3 == 0 ? 2 : 6);
+            for (int k = 0; k < pl; k++)
+                text[i][k] = check_rand(&x) % 4 == 0 ? (char)('c' + check_rand(&x) % 20)
+                    : symbols[check_rand(&x) % (sizeof(symbols) - 1)];
+            text[i][pl] = 0;
+            patterns[i] = text[i];
+        }
+
+        // the stream: mostly bytes in no pattern, so the skip runs, then bursts
+        const int l = 1000 + check_rand(&x) % (sizeof(s) - 1000);
+        for (int i = 0; i < l; i++)
+        {
+            const uint32_t r = check_rand(&x);
+            s[i] = (r >> 8) % 64 == 0 ? patterns[r % count][0] : (r >> 8) % 16 == 0
+                ? symbols[r % (sizeof(symbols) - 1)] : (char)(0x80 | r >> 24);
+        }
+        for (int b = 0; b < 20; b++)
+        {
+            const char *p = patterns[check_rand(&x) % count];
+            const int at = check_rand(&x) % (l - 8);
+            memcpy(s + at, p, strlen(p));
+        }
+
+        uart_expect *e = expect_create(patterns, count, nocase ? UART_EXPECT_NOCASE : 0);
+        CHECK(NULL != e, "expect_create of %d patterns", count);
+        if (NULL == e) return;
+
+        // scanned in batches of 1 to 64 bytes, or large ones
+        const int nw = expect_brute(patterns, count, nocase, s, l, want);
+        int ng = 0;
+        uint32_t state = 0;
+        for (int i = 0; i < l;)
+        {
+            const int n = 1 + check_rand(&x) % (round & 2 ? 64 : 4096);
+            const int batch = n < l - i ? n : l - i;
+            for (int j = 0; j < batch;)
+            {
+                int pattern;
+                j += expect_scan(e, &state, s + i + j, batch - j, &pattern);
+                if ((pattern < 0) || (ng == EXPECT_CHECK_MATCHES)) break;
+                got[ng].pattern = pattern;
+                got[ng++].offset = i + j - e->lens[pattern];
+            }
+            i += batch;
+        }
+        expect_free(e);
+
+        int at = 0;
+        while ((at < ng) && (at < nw) && (got[at].pattern == want[at].pattern) && (got[at].offset == want[at].offset))
+            at++;
+        const bool ok = (ng == nw) && (at == nw);
+        CHECK(ok, "round %d, %d patterns%s: %d matches, not %d; the first to differ is %d", round, count,
+              nocase ? " nocase" : "", ng, nw, at);
+        if (!ok) break;
+    }
+
+    // expect_feed queues them with their offsets in the stream; "K\r" ends
+    // before "OK\r\n" does, so it wins
+    const char *patterns[] = {"OK\r\n", "ERROR", "K\r"};
+    uart_expect *e = expect_create(patterns, 3, 0);
+    uart_expect_tap tap;
+    uart_rx_times t;
+    memset(&t, 0, sizeof(t));
+    expect_arm(&tap, e);
+    expect_feed(&tap, "AT\r\nO", 5, &t, 115200);
+    expect_feed(&tap, "K\r\nERR", 6, &t, 115200);
+    expect_feed(&tap, "OR", 2, &t, 115200);
+    uart_expect_match m1, m2;
+    CHECK(expect_pop(&tap, &m1) && (m1.pattern == 2) && (m1.offset == 5) && (m1.length == 2), "expect_feed: K\\r");
+    CHECK(expect_pop(&tap, &m2) && (m2.pattern == 1) && (m2.offset == 8) && (m2.length == 5), "expect_feed: ERROR");
+    CHECK(!expect_pop(&tap, &m1), "expect_feed: a third match");
+    expect_free(e);
+}
+
+
+// ---------------------------------------------------------------- main
+
+typedef struct
+{
+    const char *name;
+    void      (*run)(void);
+} check_entry;
+
+static const check_entry checks[] =
+{
+#ifndef _WIN32
+    {"pty", check_pty},
+    {"pty_close", check_pty_close},
+    {"pty_frame", check_pty_frame},
+#endif
+    {"ring", check_ring},
+    {"frame", check_frame},
+    {"crc", check_crc},
+    {"hex", check_hex},
+    {"expect", check_expect},
+};
+
+int bench_check(const int argc, const char *args[])
+{
+    const char *only = argc > 2 ? args[2] : NULL;
+    bool found = false;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++)
+    {
+        if ((NULL != only) && (strcmp(only, checks[i].name) != 0)) continue;
+        found = true;
+        const int before = failures;
+        checks[i].run();
+        printf("%-10s %s\n", checks[i].name, failures == before ? "ok" : "FAILED");
+    }
+    if (!found)
+    {
+        fprintf(stderr, "no check %s\n", only);
+        return -1;
+    }
+    return failures > 0 ? 1 : 0;
+}
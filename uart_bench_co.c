@@ -0,0 +1,229 @@
+// uart_bench co: request/response round trips over a pty, written as a thread
+// waiting for on_comm_read and as coroutines (uart_co.h). Built with
+// -std=c++20, apart from the rest of uart_bench.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <pty.h>
+#include <termios.h>
+#include <poll.h>
+#include <algorithm>
+#include <deque>
+
+#include "uart_co.h"
+
+#define CO_BENCH_ROUNDS     20000
+
+typedef struct
+{
+    int             fd;
+    volatile bool   stop;
+} co_echo;
+
+// the peer: sends back what it reads
+static void *co_echo_thread(void *param)
+{
+    co_echo *e = (co_echo *)param;
+    char buf[4096];
+    while (!e->stop)
+    {
+        struct pollfd pfd = {e->fd, POLLIN, 0};
+        if (poll(&pfd, 1, 10) <= 0) continue;
+        int r = read(e->fd, buf, sizeof(buf));
+        if ((r > 0) && (write(e->fd, buf, r) != r))
+            perror("write");
+    }
+    return NULL;
+}
+
+static void co_report(const char *name, const int size, int *rtt, const int n)
+{
+    std::sort(rtt, rtt + n);
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += rtt[i];
+    printf("%-18s size=%-5d rtt avg %6.1f us  p50 %5d  p99 %5d  max %6d  (%d rounds)\n", name, size,
+           n > 0 ? sum / n : 0.0, n > 0 ? rtt[n / 2] : 0, n > 0 ? rtt[n * 99 / 100] : 0, n > 0 ? rtt[n - 1] : 0, n);
+}
+
+// what the callback API asks for: on_comm_read collects the response, the
+// requesting thread waits for it
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    int             want;
+    int             got;
+} co_waiter;
+
+static void co_waiter_on_read(co_waiter *w, const char *p, const int l)
+{
+    pthread_mutex_lock(&w->lock);
+    w->got += l;
+    if (w->got >= w->want) pthread_cond_signal(&w->done);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void co_on_close(void *param, const enum_comm_close reason)
+{
+}
+
+static void co_run_thread(const char *dev, const char *req, const int size, int *rtt)
+{
+    static uart_obj uart;
+    static co_waiter w;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.done, NULL);
+    w.want = size;
+    if (uart_open_dev(&uart, dev, 115200, "none", 8, 1, f_on_comm_read(co_waiter_on_read), &w,
+                      co_on_close, NULL, false) == NULL)
+        return;
+
+    int n = 0;
+    for (; n < CO_BENCH_ROUNDS; n++)
+    {
+        const int64_t t = uart_time_us();
+        pthread_mutex_lock(&w.lock);
+        w.got = 0;
+        pthread_mutex_unlock(&w.lock);
+        uart_send_timeout(&uart, req, size, -1);
+        pthread_mutex_lock(&w.lock);
+        while (w.got < w.want)
+            pthread_cond_wait(&w.done, &w.lock);
+        pthread_mutex_unlock(&w.lock);
+        rtt[n] = (int)(uart_time_us() - t);
+    }
+    uart_shutdown(&uart);
+    co_report("thread + callback", size, rtt, n);
+}
+
+// a worker thread draining a queue of coroutines, the caller supplied executor
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  more;
+    std::deque<std::coroutine_handle<>> q;
+    bool            stop;
+} co_executor;
+
+static void co_post(void *ctx, std::coroutine_handle<> h)
+{
+    co_executor *e = (co_executor *)ctx;
+    pthread_mutex_lock(&e->lock);
+    e->q.push_back(h);
+    pthread_cond_signal(&e->more);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void *co_executor_thread(void *param)
+{
+    co_executor *e = (co_executor *)param;
+    pthread_mutex_lock(&e->lock);
+    while (!e->stop || !e->q.empty())
+    {
+        if (e->q.empty())
+        {
+            pthread_cond_wait(&e->more, &e->lock);
+            continue;
+        }
+        std::coroutine_handle<> h = e->q.front();
+        e->q.pop_front();
+        pthread_mutex_unlock(&e->lock);
+        h.resume();
+        pthread_mutex_lock(&e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+typedef struct
+{
+    int            *rtt;
+    int             n;
+    int             bad;
+    volatile bool   done;
+} co_result;
+
+static uart_task co_client(uart_co_port *port, const char *req, const int size, co_result *r)
+{
+    char resp[4096];
+    for (r->n = 0; r->n < CO_BENCH_ROUNDS; r->n++)
+    {
+        const int64_t t = uart_time_us();
+        if (co_await port->write(req, size) < size) break;
+        if (co_await port->read_exact(resp, size) < size) break;
+        r->rtt[r->n] = (int)(uart_time_us() - t);
+        r->bad += memcmp(resp, req, size) != 0;
+    }
+    r->done = true;
+}
+
+static void co_run_coroutine(const char *name, const char *dev, const char *req, const int size, int *rtt,
+                             const uart_co_executor *ex)
+{
+    static uart_co_port port;
+    co_result r = {rtt, 0, 0, false};
+    if (!port.open(dev, 115200, "none", 8, 1, ex))
+        return;
+
+    // started here, resumed on the I/O thread (or the executor) from its first wait on
+    co_client(&port, req, size, &r);
+    while (!r.done)
+        usleep(1000);
+    port.shutdown();
+    co_report(name, size, rtt, r.n);
+    if (r.bad > 0) printf("%d wrong responses\n", r.bad);
+}
+
+int bench_co(const int argc, const char *args[])
+{
+    const int size = argc > 2 ? atoi(args[2]) : 64;
+    if ((size < 1) || (size > 4096))
+    {
+        fprintf(stderr, "bad arguments\n");
+        return -1;
+    }
+
+    struct termios tio;
+    char dev[256];
+    int slave;
+    co_echo echo = {-1, false};
+    cfmakeraw(&tio);
+    if (openpty(&echo.fd, &slave, dev, &tio, NULL) != 0)
+    {
+        perror("openpty");
+        return -1;
+    }
+    pthread_t echo_thread;
+    pthread_create(&echo_thread, NULL, co_echo_thread, &echo);
+
+    char *req = (char *)malloc(size);
+    for (int i = 0; i < size; i++) req[i] = (char)rand();
+    int *rtt = (int *)malloc(CO_BENCH_ROUNDS * sizeof(int));
+
+    co_run_thread(dev, req, size, rtt);
+    co_run_coroutine("coroutine", dev, req, size, rtt, NULL);
+
+    static co_executor e;
+    pthread_mutex_init(&e.lock, NULL);
+    pthread_cond_init(&e.more, NULL);
+    pthread_t worker;
+    pthread_create(&worker, NULL, co_executor_thread, &e);
+    uart_co_executor ex = {co_post, &e};
+    co_run_coroutine("coroutine executor", dev, req, size, rtt, &ex);
+    pthread_mutex_lock(&e.lock);
+    e.stop = true;
+    pthread_cond_signal(&e.more);
+    pthread_mutex_unlock(&e.lock);
+    pthread_join(worker, NULL);
+
+    echo.stop = true;
+    pthread_join(echo_thread, NULL);
+    close(echo.fd);
+    close(slave);
+    free(req);
+    free(rtt);
+    return 0;
+}
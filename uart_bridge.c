@@ -0,0 +1,826 @@
+// TCP bridge of the uart util, see uart_bridge.h
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "uart_bridge.h"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+
+#define sock(fd)            ((SOCKET)(fd))
+#define close_socket(fd)    closesocket((SOCKET)(fd))
+#define SEND_FLAGS          0
+
+static bool would_block(void)
+{
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+static bool set_nonblock(const intptr_t fd)
+{
+    u_long on = 1;
+    return ioctlsocket((SOCKET)fd, FIONBIO, &on) == 0;
+}
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define sock(fd)            ((int)(fd))
+#define close_socket(fd)    close((int)(fd))
+#define SEND_FLAGS          MSG_NOSIGNAL
+
+static bool would_block(void)
+{
+    return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+}
+
+static bool set_nonblock(const intptr_t fd)
+{
+    int flags = fcntl(sock(fd), F_GETFL);
+    return (flags >= 0) && (fcntl(sock(fd), F_SETFL, flags | O_NONBLOCK) == 0);
+}
+#endif
+
+#define dbg_printf(...) //printf
+
+// Telnet (RFC 854) and its COM-PORT-OPTION (RFC 2217)
+#define TN_SE           240
+#define TN_SB           250
+#define TN_WILL         251
+#define TN_WONT         252
+#define TN_DO           253
+#define TN_DONT         254
+#define TN_IAC          255
+
+#define TN_BINARY       0
+#define TN_SGA          3
+#define TN_COM_PORT     44
+
+// client to server commands, the server answers with command + 100
+#define CPO_SIGNATURE           0
+#define CPO_SET_BAUDRATE        1
+#define CPO_SET_DATASIZE        2
+#define CPO_SET_PARITY          3
+#define CPO_SET_STOPSIZE        4
+#define CPO_SET_CONTROL         5
+#define CPO_NOTIFY_LINESTATE    6
+#define CPO_NOTIFY_MODEMSTATE   7
+#define CPO_FLOWCONTROL_SUSPEND 8
+#define CPO_FLOWCONTROL_RESUME  9
+#define CPO_SET_LINESTATE_MASK  10
+#define CPO_SET_MODEMSTATE_MASK 11
+#define CPO_PURGE_DATA          12
+#define CPO_SERVER              100
+
+#define BRIDGE_SIGNATURE        "KissUART"
+
+enum
+{
+    tn_data,
+    tn_iac,
+    tn_verb,
+    tn_sb,
+    tn_sb_iac
+};
+
+static void on_client(uart_bridge *bridge, const intptr_t fd, const int events);
+static void on_writable(uart_bridge *bridge, const int space);
+
+// watches the client for what it is waiting for now
+static void client_watch(uart_bridge *bridge, bridge_client *c)
+{
+    int events = (bridge->tx_blocked ? 0 : UART_WATCH_IN)
+        | ((c->q_len > 0) && !c->suspended ? UART_WATCH_OUT : 0);
+    if (events == c->watched) return;
+    if (uart_watch(bridge->uart, c->fd, events, f_on_watch(on_client), bridge))
+        c->watched = events;
+}
+
+static void client_close(uart_bridge *bridge, bridge_client *c, const char *why)
+{
+    fprintf(stderr, "client %d closed: %s, %llu byte(s) dropped\n",
+            (int)(c - bridge->clients), why, (unsigned long long)c->dropped);
+    uart_watch(bridge->uart, c->fd, 0, NULL, NULL);
+    close_socket(c->fd);
+    free(c->q);
+    c->q = NULL;
+    c->fd = -1;
+    c->watched = 0;
+    c->cmd_pending = false;
+}
+
+// sends what it can of l bytes, -1: the client failed
+static int client_send(bridge_client *c, const char *buf, const int l)
+{
+    int n = send(sock(c->fd), buf, l, SEND_FLAGS);
+    if (n >= 0) return n;
+    return would_block() ? 0 : -1;
+}
+
+// sends the queue, false: the client failed
+static bool client_flush(bridge_client *c, const int size)
+{
+    while ((c->q_len > 0) && !c->suspended)
+    {
+        int l = c->q_head + c->q_len <= size ? c->q_len : size - c->q_head;
+        int n = client_send(c, c->q + c->q_head, l);
+        if (n < 0) return false;
+        if (n == 0) break;
+        c->q_head = (c->q_head + n) % size;
+        c->q_len -= n;
+    }
+    if (c->q_len == 0) c->q_head = 0;
+    return true;
+}
+
+static void client_queue(bridge_client *c, const int size, const char *buf, const int l)
+{
+    for (int j = 0; j < l; )
+    {
+        int tail = (c->q_head + c->q_len) % size;
+        int n = tail + l - j <= size ? l - j : size - tail;
+        memcpy(c->q + tail, buf + j, n);
+        c->q_len += n;
+        j += n;
+    }
+}
+
+// Telnet replies and notifications go behind the RX queued so far; a client
+// too slow to take them misses them
+static void client_put(uart_bridge *bridge, bridge_client *c, const char *buf, const int l)
+{
+    int sent = 0;
+    if ((c->q_len == 0) && !c->suspended && ((sent = client_send(c, buf, l)) < 0))
+        sent = 0;       // the next send fails again and closes the client
+    if (l - sent > bridge->queue_size - c->q_len)
+    {
+        c->dropped += l - sent;
+        return;
+    }
+    client_queue(c, bridge->queue_size, buf + sent, l - sent);
+    client_watch(bridge, c);
+}
+
+static void telnet_send(uart_bridge *bridge, bridge_client *c, const int verb, const int opt)
+{
+    char s[3] = {(char)TN_IAC, (char)verb, (char)opt};
+    client_put(bridge, c, s, 3);
+}
+
+// IAC SB COM-PORT-OPTION cmd value IAC SE, with IAC doubled in value
+static void cpo_send(uart_bridge *bridge, bridge_client *c, const int cmd,
+                     const unsigned char *value, const int l)
+{
+    char s[6 + 2 * BRIDGE_SB_SIZE];
+    int n = 0;
+    s[n++] = (char)TN_IAC;
+    s[n++] = (char)TN_SB;
+    s[n++] = TN_COM_PORT;
+    s[n++] = (char)cmd;
+    for (int i = 0; (i < l) && (i < BRIDGE_SB_SIZE); i++)
+    {
+        if (value[i] == TN_IAC) s[n++] = (char)TN_IAC;
+        s[n++] = (char)value[i];
+    }
+    s[n++] = (char)TN_IAC;
+    s[n++] = (char)TN_SE;
+    client_put(bridge, c, s, n);
+}
+
+static void cpo_send_byte(uart_bridge *bridge, bridge_client *c, const int cmd, const int v)
+{
+    unsigned char b = (unsigned char)v;
+    cpo_send(bridge, c, cmd, &b, 1);
+}
+
+static int modem_state(const int line, const int changed)
+{
+    return ((line & UART_LINE_CTS) ? 0x10 : 0) | ((line & UART_LINE_DSR) ? 0x20 : 0)
+        | ((line & UART_LINE_RI) ? 0x40 : 0) | ((line & UART_LINE_DCD) ? 0x80 : 0)
+        | ((changed & UART_LINE_CTS) ? 0x01 : 0) | ((changed & UART_LINE_DSR) ? 0x02 : 0)
+        | ((changed & UART_LINE_RI) && !(line & UART_LINE_RI) ? 0x04 : 0)
+        | ((changed & UART_LINE_DCD) ? 0x08 : 0);
+}
+
+static int line_state(const int line)
+{
+    return ((line & UART_LINE_BREAK) ? 0x10 : 0) | ((line & UART_LINE_FRAMING) ? 0x08 : 0)
+        | ((line & UART_LINE_PARITY) ? 0x04 : 0) | ((line & UART_LINE_OVERRUN) ? 0x02 : 0);
+}
+
+static const char *const parity_names[] = {"", "none", "odd", "even", "mark", "space"};
+
+// SET-CONTROL: a query or a change, answered with the state
+static int cpo_control(uart_bridge *bridge, const int v)
+{
+    uart_obj *uart = bridge->uart;
+    switch (v)
+    {
+    case 5: case 6: uart_set_line(uart, UART_LINE_BREAK, v == 5); break;
+    case 8: case 9: uart_set_line(uart, UART_LINE_DTR, v == 8); break;
+    case 11: case 12: uart_set_line(uart, UART_LINE_RTS, v == 11); break;
+    // one mode for both directions: either sets it
+    case 1: case 14: uart_set_flow(uart, flow_none); break;
+    case 2: case 15: uart_set_flow(uart, flow_xonxoff); break;
+    case 3: case 16: uart_set_flow(uart, flow_rtscts); break;
+    case 18: case 19: uart_set_flow(uart, flow_dsrdtr); break;
+    default: break;
+    }
+
+    int line = uart_get_line(uart);
+    switch (v)
+    {
+    case 4: case 5: case 6: return (line & UART_LINE_BREAK) ? 5 : 6;
+    case 7: case 8: case 9: return (line & UART_LINE_DTR) ? 8 : 9;
+    case 10: case 11: case 12: return (line & UART_LINE_RTS) ? 11 : 12;
+    case 0: case 1: case 2: case 3: case 17: case 19:
+    {
+        static const int outbound[] = {1, 3, 19, 2};
+        return outbound[uart_get_flow(uart)];
+    }
+    case 13: case 14: case 15: case 16: case 18:
+    {
+        static const int inbound[] = {14, 16, 18, 15};
+        return inbound[uart_get_flow(uart)];
+    }
+    default: return 1;
+    }
+}
+
+// runs the COM-PORT-OPTION command in sb
+static void cpo_command(uart_bridge *bridge, bridge_client *c)
+{
+    uart_obj *uart = bridge->uart;
+    const int cmd = c->sb[1];
+    const int v = c->sb_len > 2 ? c->sb[2] : 0;
+    int baud, databits, stopbits;
+    const char *parity;
+
+    switch (cmd)
+    {
+    case CPO_SIGNATURE:
+        if (c->sb_len == 2)
+            cpo_send(bridge, c, CPO_SERVER + cmd, (const unsigned char *)BRIDGE_SIGNATURE,
+                     sizeof(BRIDGE_SIGNATURE) - 1);
+        break;
+
+    case CPO_SET_BAUDRATE:
+        if (c->sb_len < 6) break;
+        baud = (c->sb[2] << 24) | (c->sb[3] << 16) | (c->sb[4] << 8) | c->sb[5];
+        if (baud > 0) uart_config(uart, baud, "", 0, 0);
+        uart_get_config(uart, &baud, &parity, &databits, &stopbits);
+        {
+            unsigned char b[4] = {(unsigned char)(baud >> 24), (unsigned char)(baud >> 16),
+                                  (unsigned char)(baud >> 8), (unsigned char)baud};
+            cpo_send(bridge, c, CPO_SERVER + cmd, b, 4);
+        }
+        break;
+
+    case CPO_SET_DATASIZE:
+        if ((v >= 5) && (v <= 8)) uart_config(uart, 0, "", v, 0);
+        uart_get_config(uart, &baud, &parity, &databits, &stopbits);
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, databits);
+        break;
+
+    case CPO_SET_PARITY:
+        if ((v >= 1) && (v <= 5)) uart_config(uart, 0, parity_names[v], 0, 0);
+        uart_get_config(uart, &baud, &parity, &databits, &stopbits);
+        for (int i = 1; i <= 5; i++)
+            if (strcmp(parity, parity_names[i]) == 0) cpo_send_byte(bridge, c, CPO_SERVER + cmd, i);
+        break;
+
+    case CPO_SET_STOPSIZE:
+        // 3 is 1.5 stop bits, which uart_config does not take
+        if ((v == 1) || (v == 2)) uart_config(uart, 0, "", 0, v);
+        uart_get_config(uart, &baud, &parity, &databits, &stopbits);
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, stopbits == 15 ? 3 : stopbits);
+        break;
+
+    case CPO_SET_CONTROL:
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, cpo_control(bridge, v));
+        break;
+
+    case CPO_NOTIFY_LINESTATE:
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, 0);
+        break;
+
+    case CPO_NOTIFY_MODEMSTATE:
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, modem_state(uart_get_line(uart), 0) & c->modem_mask);
+        break;
+
+    case CPO_FLOWCONTROL_SUSPEND:
+    case CPO_FLOWCONTROL_RESUME:
+        c->suspended = cmd == CPO_FLOWCONTROL_SUSPEND;
+        client_watch(bridge, c);
+        break;
+
+    case CPO_SET_LINESTATE_MASK:
+        c->line_mask = v;
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, v);
+        break;
+
+    case CPO_SET_MODEMSTATE_MASK:
+        c->modem_mask = v;
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, v);
+        break;
+
+    case CPO_PURGE_DATA:
+        uart_purge(uart, (v & 1) != 0, (v & 2) != 0);
+        cpo_send_byte(bridge, c, CPO_SERVER + cmd, v);
+        break;
+
+    default:
+        break;
+    }
+}
+
+// the line settings and control lines change only after the TX ahead of them
+static bool cpo_ordered(const int cmd)
+{
+    return (cmd >= CPO_SET_BAUDRATE) && (cmd <= CPO_SET_CONTROL);
+}
+
+// BINARY, SGA and COM-PORT-OPTION are taken both ways, anything else refused
+static void telnet_option(uart_bridge *bridge, bridge_client *c, const int verb, const int opt)
+{
+    int bit = opt == TN_BINARY ? 1 : opt == TN_SGA ? 2 : opt == TN_COM_PORT ? 4 : 0;
+
+    switch (verb)
+    {
+    case TN_DO:
+        if (bit == 0)
+            telnet_send(bridge, c, TN_WONT, opt);
+        else if (!(c->tn_will & bit))
+        {
+            c->tn_will |= bit;
+            telnet_send(bridge, c, TN_WILL, opt);
+        }
+        break;
+    case TN_DONT:
+        if (c->tn_will & bit)
+        {
+            c->tn_will &= ~bit;
+            telnet_send(bridge, c, TN_WONT, opt);
+        }
+        break;
+    case TN_WILL:
+        if (bit == 0)
+            telnet_send(bridge, c, TN_DONT, opt);
+        else if (!(c->tn_do & bit))
+        {
+            c->tn_do |= bit;
+            telnet_send(bridge, c, TN_DO, opt);
+        }
+        break;
+    case TN_WONT:
+        if (c->tn_do & bit)
+        {
+            c->tn_do &= ~bit;
+            telnet_send(bridge, c, TN_DONT, opt);
+        }
+        break;
+    }
+}
+
+// Decodes raw into tx. Stops early, returning true, at a command that has to
+// wait for the TX before it.
+static bool telnet_decode(uart_bridge *bridge, bridge_client *c)
+{
+    while ((c->raw_len > 0) && (c->tx_len < BRIDGE_TX_QUANTUM))
+    {
+        const unsigned char b = (unsigned char)c->raw[c->raw_off++];
+        c->raw_len--;
+
+        switch (c->tn_state)
+        {
+        case tn_data:
+            if (b == TN_IAC)
+                c->tn_state = tn_iac;
+            else
+                c->tx[c->tx_len++] = (char)b;
+            break;
+
+        case tn_iac:
+            c->tn_state = tn_data;
+            if (b == TN_IAC)
+                c->tx[c->tx_len++] = (char)b;
+            else if ((b >= TN_WILL) && (b <= TN_DONT))
+            {
+                c->tn_verb = b;
+                c->tn_state = tn_verb;
+            }
+            else if (b == TN_SB)
+            {
+                c->sb_len = 0;
+                c->tn_state = tn_sb;
+            }
+            // NOP, AYT and the like are ignored
+            break;
+
+        case tn_verb:
+            c->tn_state = tn_data;
+            telnet_option(bridge, c, c->tn_verb, b);
+            break;
+
+        case tn_sb:
+            if (b == TN_IAC)
+                c->tn_state = tn_sb_iac;
+            else if (c->sb_len < BRIDGE_SB_SIZE)
+                c->sb[c->sb_len++] = b;
+            break;
+
+        case tn_sb_iac:
+            if (b == TN_IAC)
+            {
+                if (c->sb_len < BRIDGE_SB_SIZE) c->sb[c->sb_len++] = b;
+                c->tn_state = tn_sb;
+                break;
+            }
+            c->tn_state = tn_data;
+            if ((b != TN_SE) || (c->sb_len < 2) || (c->sb[0] != TN_COM_PORT))
+                break;
+            if (cpo_ordered(c->sb[1]))
+            {
+                c->cmd_pending = true;
+                return true;
+            }
+            cpo_command(bridge, c);
+            break;
+        }
+    }
+    return false;
+}
+
+// the pending chunk of the client goes to the TX ring, false: the ring is full
+static bool client_tx(uart_bridge *bridge, bridge_client *c)
+{
+    if (c->tx_len > 0)
+    {
+        int n = uart_send(bridge->uart, c->tx + c->tx_off, c->tx_len);
+        c->tx_off += n;
+        c->tx_len -= n;
+    }
+    if (c->tx_len > 0) return false;
+    c->tx_off = 0;
+    return true;
+}
+
+// what the port's TX ring takes, as its I/O profile has it
+static int tx_queue(uart_bridge *bridge)
+{
+    uart_io_profile io;
+    uart_get_io_profile(bridge->uart, &io);
+    return io.tx_queue;
+}
+
+// stops reading the clients until the TX ring drains to its mark
+static void tx_block(uart_bridge *bridge, bridge_client *c, const int mark)
+{
+    bridge->tx_blocked = true;
+    bridge->tx_next = (int)(c - bridge->clients);
+    uart_set_writable_callback(bridge->uart, f_on_comm_writable(on_writable), bridge, mark);
+    if (mark == 0) uart_send(bridge->uart, NULL, 0);
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++)
+        if (bridge->clients[i].fd >= 0) client_watch(bridge, bridge->clients + i);
+}
+
+// Feeds what the client sent to the port, false: it has to wait for the TX
+// ring, which blocks all clients.
+static bool client_input(uart_bridge *bridge, bridge_client *c)
+{
+    while (true)
+    {
+        if (!client_tx(bridge, c))
+        {
+            tx_block(bridge, c, c->cmd_pending ? 0 : tx_queue(bridge) / 2);
+            return false;
+        }
+        if (c->cmd_pending)
+        {
+            tx_block(bridge, c, 0);
+            return false;
+        }
+        if (c->raw_len == 0) return true;
+
+        if (bridge->rfc2217)
+            telnet_decode(bridge, c);
+        else
+        {
+            memcpy(c->tx, c->raw + c->raw_off, c->raw_len);
+            c->tx_len = c->raw_len;
+            c->raw_len = 0;
+        }
+    }
+}
+
+// the TX ring has drained: finish the chunks taken, run a command that waited
+// for them, then read the clients again
+static void on_writable(uart_bridge *bridge, const int space)
+{
+    for (int k = 0; k < BRIDGE_MAX_CLIENTS; k++)
+    {
+        int i = (bridge->tx_next + k) % BRIDGE_MAX_CLIENTS;
+        bridge_client *c = bridge->clients + i;
+        if ((c->fd >= 0) && !client_tx(bridge, c))
+        {
+            bridge->tx_next = i;
+            return;
+        }
+    }
+
+    bridge_client *c = bridge->clients + bridge->tx_next;
+    if ((c->fd >= 0) && c->cmd_pending)
+    {
+        if (space < tx_queue(bridge))
+        {
+            uart_send(bridge->uart, NULL, 0);
+            return;
+        }
+        c->cmd_pending = false;
+        cpo_command(bridge, c);
+        if (!client_input(bridge, c))
+            return;
+    }
+
+    bridge->tx_blocked = false;
+    uart_set_writable_callback(bridge->uart, f_on_comm_writable(on_writable), bridge, tx_queue(bridge) / 2);
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++)
+        if (bridge->clients[i].fd >= 0) client_watch(bridge, bridge->clients + i);
+}
+
+static void on_client(uart_bridge *bridge, const intptr_t fd, const int events)
+{
+    bridge_client *c = NULL;
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++)
+        if (bridge->clients[i].fd == fd) c = bridge->clients + i;
+    if (NULL == c) return;
+
+    if (events & UART_WATCH_ERR)
+    {
+        client_close(bridge, c, "socket error");
+        return;
+    }
+
+    if ((events & UART_WATCH_OUT) && !client_flush(c, bridge->queue_size))
+    {
+        client_close(bridge, c, "send failed");
+        return;
+    }
+
+    // one quantum per wakeup, the other clients get their turn in between
+    if ((events & UART_WATCH_IN) && !bridge->tx_blocked && (c->raw_len == 0) && (c->tx_len == 0))
+    {
+        int n = recv(sock(c->fd), c->raw, sizeof(c->raw), 0);
+        if (n == 0)
+        {
+            client_close(bridge, c, "hang up");
+            return;
+        }
+        if ((n < 0) && !would_block())
+        {
+            client_close(bridge, c, "recv failed");
+            return;
+        }
+        if (n > 0)
+        {
+            c->raw_off = 0;
+            c->raw_len = n;
+            if (!client_input(bridge, c))
+                return;
+        }
+    }
+    client_watch(bridge, c);
+}
+
+// modem and line state notifications of RFC 2217
+static void on_line(uart_bridge *bridge, const int line, const int changed)
+{
+    const int modem = modem_state(line, changed);
+    const int ls = line_state(line);
+
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++)
+    {
+        bridge_client *c = bridge->clients + i;
+        if ((c->fd < 0) || !(c->tn_do & 4)) continue;
+        if (modem & c->modem_mask & 0x0f)
+            cpo_send_byte(bridge, c, CPO_SERVER + CPO_NOTIFY_MODEMSTATE, modem & c->modem_mask);
+        if (ls & c->line_mask)
+            cpo_send_byte(bridge, c, CPO_SERVER + CPO_NOTIFY_LINESTATE, ls & c->line_mask);
+    }
+}
+
+static void on_listen(uart_bridge *bridge, const intptr_t fd, const int events)
+{
+    while (true)
+    {
+        intptr_t s = accept(sock(fd), NULL, NULL);
+        if (s < 0) return;
+
+        bridge_client *c = NULL;
+        for (int i = 0; (i < BRIDGE_MAX_CLIENTS) && (NULL == c); i++)
+            if (bridge->clients[i].fd < 0) c = bridge->clients + i;
+
+        int on = 1;
+        if ((NULL == c) || !set_nonblock(s)
+            || ((c->q = (char *)malloc(bridge->queue_size)) == NULL))
+        {
+            fprintf(stderr, "client refused: %s\n", NULL == c ? "too many clients" : "no resources");
+            close_socket(s);
+            continue;
+        }
+        setsockopt(sock(s), IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+
+        char *q = c->q;
+        memset(c, 0, sizeof(*c));
+        c->fd = s;
+        c->q = q;
+        // RFC 2217 defaults: no line state, all modem state notifications
+        c->modem_mask = 0xff;
+        client_watch(bridge, c);
+        if (c->watched == 0 && !bridge->tx_blocked)
+        {
+            client_close(bridge, c, "uart_watch failed");
+            continue;
+        }
+        if (bridge->rfc2217)
+        {
+            c->tn_do = 4;
+            telnet_send(bridge, c, TN_DO, TN_COM_PORT);
+        }
+        fprintf(stderr, "client %d connected\n", (int)(c - bridge->clients));
+    }
+}
+
+// An IAC pair must not be cut when the rest of a read is dropped: true when
+// the escaped bytes before end stop after the first IAC of a pair.
+static bool esc_cuts_pair(const char *esc, const int end)
+{
+    int n = 0;
+    for (int i = end - 1; (i >= 0) && ((unsigned char)esc[i] == TN_IAC); i--)
+        n++;
+    return (n & 1) != 0;
+}
+
+void bridge_on_comm_read(uart_bridge *bridge, const char *buf, int l)
+{
+    const int size = bridge->queue_size;
+
+    if (bridge->rfc2217)
+    {
+        if (2 * l > bridge->esc_size)
+        {
+            char *p = (char *)realloc(bridge->esc, 2 * l);
+            if (NULL == p) return;
+            bridge->esc = p;
+            bridge->esc_size = 2 * l;
+        }
+        int n = 0;
+        for (int i = 0; i < l; i++)
+        {
+            if ((unsigned char)buf[i] == TN_IAC) bridge->esc[n++] = (char)TN_IAC;
+            bridge->esc[n++] = buf[i];
+        }
+        buf = bridge->esc;
+        l = n;
+    }
+
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++)
+    {
+        bridge_client *c = bridge->clients + i;
+        if (c->fd < 0) continue;
+
+        // straight to the socket while nothing is queued
+        int sent = 0;
+        if ((c->q_len == 0) && !c->suspended)
+        {
+            sent = client_send(c, buf, l);
+            if (sent < 0)
+            {
+                client_close(bridge, c, "send failed");
+                continue;
+            }
+        }
+
+        int rest = l - sent;
+        if (rest > size - c->q_len)
+        {
+            if (bridge->slow == slow_disconnect)
+            {
+                client_close(bridge, c, "too slow");
+                continue;
+            }
+            rest = size - c->q_len;
+            if (bridge->rfc2217 && esc_cuts_pair(buf, sent + rest)) rest--;
+            c->dropped += l - sent - rest;
+        }
+
+        client_queue(c, size, buf + sent, rest);
+        client_watch(bridge, c);
+    }
+}
+
+static intptr_t listen_socket(const char *listen_addr)
+{
+    char host[256];
+    const char *port = strrchr(listen_addr, ':');
+    struct addrinfo hints, *res = NULL;
+    intptr_t fd = -1;
+
+    if (NULL == port)
+    {
+        host[0] = '\0';
+        port = listen_addr;
+    }
+    else
+    {
+        const char *h = listen_addr;
+        int l = (int)(port - listen_addr);
+        port++;
+        if ((l >= 2) && (h[0] == '[') && (h[l - 1] == ']'))
+        {
+            h++;
+            l -= 2;
+        }
+        if (l >= (int)sizeof(host)) return -1;
+        memcpy(host, h, l);
+        host[l] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &res) != 0)
+    {
+        fprintf(stderr, "bad listen address: %s\n", listen_addr);
+        return -1;
+    }
+
+    for (struct addrinfo *a = res; (NULL != a) && (fd < 0); a = a->ai_next)
+    {
+        int on = 1;
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(sock(fd), SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+        if ((bind(sock(fd), a->ai_addr, (int)a->ai_addrlen) != 0)
+            || (listen(sock(fd), BRIDGE_MAX_CLIENTS) != 0) || !set_nonblock(fd))
+        {
+            close_socket(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        fprintf(stderr, "cannot listen on %s\n", listen_addr);
+    return fd;
+}
+
+bool bridge_open(uart_bridge *bridge, const char *listen_addr,
+                 const int queue_size, const enum_slow_client slow, const bool rfc2217)
+{
+    memset(bridge, 0, sizeof(*bridge));
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++)
+        bridge->clients[i].fd = -1;
+    bridge->queue_size = queue_size > 0 ? queue_size : BRIDGE_QUEUE_SIZE;
+    bridge->slow = slow;
+    bridge->rfc2217 = rfc2217;
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        return false;
+#endif
+
+    bridge->listen_fd = listen_socket(listen_addr);
+    return bridge->listen_fd >= 0;
+}
+
+bool bridge_start(uart_bridge *bridge, uart_obj *uart)
+{
+    bridge->uart = uart;
+    uart_set_writable_callback(uart, f_on_comm_writable(on_writable), bridge, tx_queue(bridge) / 2);
+    if (bridge->rfc2217)
+        uart_set_line_callback(uart, f_on_comm_line(on_line), bridge);
+    return uart_watch(uart, bridge->listen_fd, UART_WATCH_IN, f_on_watch(on_listen), bridge);
+}
+
+void bridge_stop(uart_bridge *bridge)
+{
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++)
+        if (bridge->clients[i].fd >= 0) client_close(bridge, bridge->clients + i, "port closed");
+    if (bridge->listen_fd >= 0)
+    {
+        if (NULL != bridge->uart)
+            uart_watch(bridge->uart, bridge->listen_fd, 0, NULL, NULL);
+        close_socket(bridge->listen_fd);
+        bridge->listen_fd = -1;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef _uart_bridge_h
+#define _uart_bridge_h
+
+// TCP bridge of the uart util: serves the port to several TCP clients from the
+// port's own I/O thread through uart_watch.
+//
+// RX is fanned out to every client through a bounded queue of its own; a
+// client that cannot keep up loses the bytes that do not fit, or is
+// disconnected. TX is taken from the clients in turns of at most
+// BRIDGE_TX_QUANTUM bytes; while the TX ring is full no client is read, and the
+// turns resume round robin once it drains, so the chunks of two clients never
+// interleave.
+//
+// With rfc2217 the clients speak Telnet with the COM-PORT-OPTION (RFC 2217):
+// they may change the line settings, the modem control lines and purge the
+// buffers of the live port, and get modem and line state notifications. A
+// setting takes effect after the data sent before it has left the TX ring.
+
+#include "uart.h"
+
+#define BRIDGE_MAX_CLIENTS  16
+#define BRIDGE_TX_QUANTUM   512
+#define BRIDGE_QUEUE_SIZE   (64 * 1024)
+#define BRIDGE_SB_SIZE      16
+
+typedef enum
+{
+    slow_drop,          // drop the RX bytes that do not fit the queue
+    slow_disconnect     // close the client whose queue overflows
+} enum_slow_client;
+
+typedef struct
+{
+    intptr_t        fd;             // -1: slot free
+    int             watched;        // UART_WATCH_* given to uart_watch
+    char           *q;              // RX queue
+    int             q_head;
+    int             q_len;
+    char            raw[BRIDGE_TX_QUANTUM];  // received, not yet decoded
+    int             raw_off;
+    int             raw_len;
+    char            tx[BRIDGE_TX_QUANTUM];   // decoded, not yet taken by uart_send
+    int             tx_off;
+    int             tx_len;
+    uint64_t        dropped;
+
+    // Telnet / RFC 2217
+    int             tn_state;
+    int             tn_verb;
+    int             tn_will;        // options we have agreed to perform
+    int             tn_do;          // options we have asked the client to perform
+    unsigned char   sb[BRIDGE_SB_SIZE];
+    int             sb_len;
+    bool            cmd_pending;    // sb holds a command waiting for TX to drain
+    bool            suspended;      // FLOWCONTROL-SUSPEND: hold RX for the client
+    int             line_mask;
+    int             modem_mask;
+} bridge_client;
+
+typedef struct
+{
+    uart_obj       *uart;
+    intptr_t        listen_fd;
+    int             queue_size;
+    enum_slow_client slow;
+    bool            rfc2217;
+    bool            tx_blocked;     // TX ring full, or draining for a command: clients are not read
+    int             tx_next;        // client to be served first when it drains
+    char           *esc;            // RX with IAC doubled
+    int             esc_size;
+    bridge_client   clients[BRIDGE_MAX_CLIENTS];
+} uart_bridge;
+
+// Listens on "addr:port", "[addr6]:port" or "port" (all interfaces), before
+// the port is opened with bridge_on_comm_read and the bridge as its parameter.
+bool bridge_open(uart_bridge *bridge, const char *listen_addr,
+                 const int queue_size, const enum_slow_client slow, const bool rfc2217);
+
+// starts accepting clients once the port is open, takes its writable callback
+// (and the line callback with rfc2217)
+bool bridge_start(uart_bridge *bridge, uart_obj *uart);
+
+// from the port's on_comm_close: drops the watches, closes the sockets
+void bridge_stop(uart_bridge *bridge);
+
+void bridge_on_comm_read(uart_bridge *bridge, const char *buf, int l);
+
+#endif
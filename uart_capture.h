@@ -0,0 +1,393 @@
+#ifndef _uart_capture_h
+#define _uart_capture_h
+
+// Capture file: everything crossing one or more ports, kept in a preallocated
+// memory-mapped ring for post-mortems. The backends record (uart_set_capture),
+// the uart util's -dump reads.
+//
+// A record is a memcpy into the mapping under a lock, no syscall; the OS
+// writes the pages back on its own. When the ring is full the oldest records
+// are dropped. head is published only after the record it covers, so the file
+// is consistent whenever the process dies.
+//
+// The index holds, for each CAPTURE_INDEX-th of the ring, the first record
+// that started there in the current lap and its time, so a reader can start
+// near a point in time without walking the whole ring.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#include "uart_ring.h"
+
+#define CAPTURE_MAGIC           "KUARTCAP"
+#define CAPTURE_VERSION         1
+#define CAPTURE_HEADER_SIZE     8192
+#define CAPTURE_INDEX           256
+#define CAPTURE_MIN_RING        (64 * 1024)
+#define CAPTURE_DEFAULT_RING    (16 * 1024 * 1024)
+#define CAPTURE_REC_MARK        0xa5
+
+// record directions
+#define CAPTURE_RX              1
+#define CAPTURE_TX              2
+#define CAPTURE_PAD             3   // filler up to the end of the ring
+#define CAPTURE_CLOCK           4   // a writer opened it, payload: its wall_us
+
+typedef struct
+{
+    uint32_t len;           // payload bytes
+    uint16_t port;          // given to uart_set_capture
+    uint8_t  dir;
+    uint8_t  mark;          // CAPTURE_REC_MARK
+    int64_t  us;            // uart_time_us of the first byte
+} capture_rec;              // followed by the payload, padded to 8 bytes
+
+typedef struct
+{
+    uint64_t pos;           // of the record, counted from the start of the capture
+    int64_t  us;
+    int64_t  wall_us;       // wall clock minus uart_time_us of the writer
+} capture_index;
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t ring_size;
+    volatile uint64_t head; // end of the last record, counted from the start
+    volatile uint64_t tail; // first record still in the ring
+    int64_t  wall_us;       // wall clock minus uart_time_us of the last writer
+    capture_index index[CAPTURE_INDEX];
+} capture_header;
+
+struct _uart_capture
+{
+    capture_header *h;
+    char           *ring;
+    uint64_t        ring_size;
+    uint64_t        slot_size;  // ring_size / CAPTURE_INDEX
+    uint64_t        map_size;
+    bool            writer;
+#ifdef _WIN32
+    HANDLE          file;
+    HANDLE          mapping;
+    SRWLOCK         lock;
+#else
+    int             fd;
+    pthread_mutex_t lock;
+#endif
+};
+
+static inline uint64_t capture_align(const uint64_t n)
+{
+    return (n + 7) & ~(uint64_t)7;
+}
+
+// wall clock minus uart_time_us, in microseconds
+static inline int64_t capture_wall_offset(void)
+{
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    int64_t t = (((int64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10 - 11644473600000000LL;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    int64_t t = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+    return t - uart_time_us();
+}
+
+static inline bool capture_valid(const capture_header *h, const uint64_t ring_size)
+{
+    return (memcmp(h->magic, CAPTURE_MAGIC, 8) == 0)
+        && (h->version == CAPTURE_VERSION)
+        && (h->header_size == CAPTURE_HEADER_SIZE)
+        && (h->ring_size == ring_size)
+        && (h->tail <= h->head)
+        && (h->head - h->tail <= ring_size)
+        && (h->tail % 8 == 0) && (h->head % 8 == 0);
+}
+
+static inline void capture_unmap(uart_capture *cap)
+{
+#ifdef _WIN32
+    if (NULL != cap->h) UnmapViewOfFile(cap->h);
+    if (NULL != cap->mapping) CloseHandle(cap->mapping);
+    if (INVALID_HANDLE_VALUE != cap->file) CloseHandle(cap->file);
+#else
+    if (NULL != cap->h) munmap(cap->h, cap->map_size);
+    if (cap->fd >= 0) close(cap->fd);
+    if (cap->writer) pthread_mutex_destroy(&cap->lock);
+#endif
+    free(cap);
+}
+
+// size of the record at pos, which is in the ring
+static inline uint64_t capture_rec_size(const uart_capture *cap, const uint64_t pos)
+{
+    const uint64_t off = pos % cap->ring_size;
+    if (cap->ring_size - off < sizeof(capture_rec))
+        return cap->ring_size - off;
+    const capture_rec *rec = (const capture_rec *)(cap->ring + off);
+    return capture_align(sizeof(capture_rec) + rec->len);
+}
+
+// writer, under the lock: a record of len payload bytes at head
+static inline void capture_put(uart_capture *cap, const int dir, const int port, const int64_t us,
+                               const char *p, const uint32_t len)
+{
+    capture_header *h = cap->h;
+    uint64_t need = capture_align(sizeof(capture_rec) + len);
+    uint64_t head = h->head;
+    uint64_t off = head % cap->ring_size;
+
+    // a record does not wrap: fill the end of the ring, start over at 0
+    if (cap->ring_size - off < need)
+    {
+        const uint64_t rest = cap->ring_size - off;
+        while (head + rest - h->tail > cap->ring_size)
+            h->tail += capture_rec_size(cap, h->tail);
+        if (rest >= sizeof(capture_rec))
+        {
+            capture_rec *pad = (capture_rec *)(cap->ring + off);
+            pad->len = (uint32_t)(rest - sizeof(capture_rec));
+            pad->port = 0;
+            pad->dir = CAPTURE_PAD;
+            pad->mark = CAPTURE_REC_MARK;
+            pad->us = us;
+        }
+        head += rest;
+        off = 0;
+    }
+
+    while (head + need - h->tail > cap->ring_size)
+        h->tail += capture_rec_size(cap, h->tail);
+
+    capture_rec *rec = (capture_rec *)(cap->ring + off);
+    rec->len = len;
+    rec->port = (uint16_t)port;
+    rec->dir = (uint8_t)dir;
+    rec->mark = CAPTURE_REC_MARK;
+    rec->us = us;
+    memcpy(rec + 1, p, len);
+
+    // first record of its slot in this lap
+    const uint64_t slot = off / cap->slot_size;
+    if ((h->index[slot].pos < head - off + slot * cap->slot_size) || (h->index[slot].pos >= head))
+    {
+        h->index[slot].us = us;
+        h->index[slot].wall_us = h->wall_us;
+        h->index[slot].pos = head;
+    }
+
+    ring_fence();
+    h->head = head + need;
+}
+
+// any thread; a payload larger than a quarter of the ring is split
+static inline void capture_append(uart_capture *cap, const int dir, const int port, const int64_t us,
+                                  const char *p, int len)
+{
+    const int max = (int)(cap->ring_size / 4);
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&cap->lock);
+#else
+    pthread_mutex_lock(&cap->lock);
+#endif
+    do
+    {
+        const int n = len < max ? len : max;
+        capture_put(cap, dir, port, us, p, n);
+        p += n;
+        len -= n;
+    } while (len > 0);
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&cap->lock);
+#else
+    pthread_mutex_unlock(&cap->lock);
+#endif
+}
+
+// Writer (ring_size > 0): opens the capture at path to go on recording, or
+// makes a new one there when it is missing, damaged or of another size.
+// Reader (ring_size 0): maps an existing capture read only.
+static inline uart_capture *capture_open(const char *path, uint64_t ring_size)
+{
+    const bool writer = ring_size > 0;
+    uart_capture *cap = (uart_capture *)calloc(1, sizeof(uart_capture));
+    if (NULL == cap) return NULL;
+    cap->writer = writer;
+#ifdef _WIN32
+    cap->file = INVALID_HANDLE_VALUE;
+#else
+    cap->fd = -1;
+#endif
+
+    // whole index slots of 8 byte aligned records
+    ring_size = ring_size < CAPTURE_MIN_RING ? CAPTURE_MIN_RING : ring_size;
+    ring_size -= ring_size % (CAPTURE_INDEX * 8);
+    uint64_t file_size;
+
+#ifdef _WIN32
+    cap->file = CreateFileA(path, writer ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                            writer ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == cap->file)
+        goto error;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(cap->file, &size))
+        goto error;
+    file_size = size.QuadPart;
+    cap->map_size = writer ? CAPTURE_HEADER_SIZE + ring_size : file_size;
+    if (writer && (file_size != cap->map_size))
+    {
+        size.QuadPart = cap->map_size;
+        if (!SetFilePointerEx(cap->file, size, NULL, FILE_BEGIN) || !SetEndOfFile(cap->file))
+            goto error;
+    }
+    if (cap->map_size <= CAPTURE_HEADER_SIZE)
+        goto error;
+
+    cap->mapping = CreateFileMapping(cap->file, NULL, writer ? PAGE_READWRITE : PAGE_READONLY,
+                                     (DWORD)(cap->map_size >> 32), (DWORD)cap->map_size, NULL);
+    if (NULL == cap->mapping)
+        goto error;
+    cap->h = (capture_header *)MapViewOfFile(cap->mapping, writer ? FILE_MAP_WRITE : FILE_MAP_READ,
+                                             0, 0, (SIZE_T)cap->map_size);
+    if (NULL == cap->h)
+        goto error;
+    if (writer) InitializeSRWLock(&cap->lock);
+#else
+    cap->fd = open(path, writer ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (cap->fd < 0)
+        goto error;
+
+    struct stat st;
+    if (fstat(cap->fd, &st) != 0)
+        goto error;
+    file_size = st.st_size;
+    cap->map_size = writer ? CAPTURE_HEADER_SIZE + ring_size : file_size;
+    if (writer && (file_size != cap->map_size) && (ftruncate(cap->fd, cap->map_size) != 0))
+        goto error;
+    if (cap->map_size <= CAPTURE_HEADER_SIZE)
+        goto error;
+
+    cap->h = (capture_header *)mmap(NULL, cap->map_size,
+                                    writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, cap->fd, 0);
+    if (MAP_FAILED == (void *)cap->h)
+    {
+        cap->h = NULL;
+        goto error;
+    }
+    if (writer) pthread_mutex_init(&cap->lock, NULL);
+#endif
+
+    if (!writer)
+    {
+        ring_size = cap->h->ring_size;
+        if ((ring_size == 0) || (ring_size % (CAPTURE_INDEX * 8) != 0)
+            || (ring_size > cap->map_size - CAPTURE_HEADER_SIZE))
+            goto error;
+    }
+    cap->ring = (char *)cap->h + CAPTURE_HEADER_SIZE;
+    cap->ring_size = ring_size;
+    cap->slot_size = ring_size / CAPTURE_INDEX;
+
+    if (!capture_valid(cap->h, ring_size))
+    {
+        if (!writer)
+            goto error;
+        memset(cap->h, 0, sizeof(capture_header));
+        cap->h->version = CAPTURE_VERSION;
+        cap->h->header_size = CAPTURE_HEADER_SIZE;
+        cap->h->ring_size = ring_size;
+        ring_fence();
+        memcpy(cap->h->magic, CAPTURE_MAGIC, 8);
+    }
+    if (writer)
+    {
+        // the clock of uart_time_us may be another one than before, e.g. after a reboot
+        int64_t wall_us = capture_wall_offset();
+        cap->h->wall_us = wall_us;
+        capture_append(cap, CAPTURE_CLOCK, 0, uart_time_us(), (const char *)&wall_us, sizeof(wall_us));
+    }
+    return cap;
+
+error:
+    capture_unmap(cap);
+    return NULL;
+}
+
+static inline void capture_close(uart_capture *cap)
+{
+    if (NULL != cap) capture_unmap(cap);
+}
+
+// Reader: where to start for records from wall_us on (wall clock, us since
+// the epoch; 0: the oldest record), and the wall_us of the writer there
+static inline uint64_t capture_seek(const uart_capture *cap, const int64_t wall_us, int64_t *offset)
+{
+    const capture_header *h = cap->h;
+    const uint64_t tail = h->tail;
+    const uint64_t head = h->head;
+    uint64_t pos = tail;
+
+    *offset = h->wall_us;
+    if (wall_us == 0) return pos;
+    for (int i = 0; i < CAPTURE_INDEX; i++)
+    {
+        const capture_index *e = h->index + i;
+        if ((e->pos >= tail) && (e->pos < head) && (e->pos > pos) && (e->us + e->wall_us <= wall_us))
+        {
+            pos = e->pos;
+            *offset = e->wall_us;
+        }
+    }
+    return pos;
+}
+
+// Reader: the record at *pos, then moves *pos past it. false: no more
+// records, or the ring is damaged. Records the writer overwrote meanwhile
+// are skipped, CAPTURE_CLOCK ones are returned.
+static inline bool capture_next(const uart_capture *cap, uint64_t *pos, capture_rec *rec, const char **payload)
+{
+    const capture_header *h = cap->h;
+    while (true)
+    {
+        const uint64_t tail = h->tail;
+        if (*pos < tail) *pos = tail;
+        if (*pos >= h->head) return false;
+        ring_fence();
+
+        const uint64_t off = *pos % cap->ring_size;
+        const uint64_t size = capture_rec_size(cap, *pos);
+        if (cap->ring_size - off < sizeof(capture_rec))
+        {
+            *pos += size;
+            continue;
+        }
+
+        memcpy(rec, cap->ring + off, sizeof(capture_rec));
+        if ((rec->mark != CAPTURE_REC_MARK) || (size > cap->ring_size - off))
+            return false;
+        *pos += size;
+        if (rec->dir == CAPTURE_PAD) continue;
+        *payload = cap->ring + off + sizeof(capture_rec);
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef _uart_co_h
+#define _uart_co_h
+
+// C++20 coroutines over a port: co_await read_some, read_exact, read_until
+// and write instead of on_comm_read and uart_send, so that a request and its
+// response are straight-line code.
+//
+// The port's own callbacks complete an operation and resume the coroutine
+// right there on its I/O thread, no thread handoff; or hand it to the
+// executor given to open. An operation is its awaiter, which lives in the
+// coroutine frame: nothing is allocated per operation, and one that can
+// complete at once does not suspend. A port has at most one read and one
+// write pending.
+//
+// Bytes arriving with no read pending wait in the port's buffer (past
+// UART_CO_BUF_SIZE they are dropped and counted); a read pending on an empty
+// buffer gets them copied straight into its own.
+//
+// Needs -std=c++20; the library headers use volatile in ways C++20
+// deprecates, hence -Wno-volatile.
+
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <string.h>
+
+#include "uart.h"
+
+#define UART_CO_BUF_SIZE    (16 * 1024)
+
+// resumes h on some thread of the caller's
+typedef void (*f_co_post)(void *ctx, std::coroutine_handle<> h);
+
+typedef struct
+{
+    f_co_post   post;
+    void       *ctx;
+} uart_co_executor;
+
+// A coroutine nobody waits for: runs at once up to its first suspension,
+// its frame goes when it returns. The frame is the one allocation.
+struct uart_task
+{
+    struct promise_type
+    {
+        uart_task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+struct uart_co_port;
+
+// co_await: the bytes read; fewer than asked only if the port closed, -1 if
+// it closed before any
+struct uart_co_read
+{
+    uart_co_port   *port;
+    char           *buf;
+    int             min;        // complete with this many,
+    int             max;        // at most this many,
+    int             delim;      // or with this byte (-1: none)
+    int             got;
+    bool            found;
+    std::coroutine_handle<> h;
+
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    int await_resume() { return got > 0 ? got : -1; }
+};
+
+// co_await: l; fewer if the port closed first
+struct uart_co_write
+{
+    uart_co_port   *port;
+    const char     *p;
+    int             l;
+    int             sent;
+    std::coroutine_handle<> h;
+
+    bool await_ready() { return l <= 0; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    int await_resume() { return sent; }
+};
+
+struct uart_co_port
+{
+    uart_obj            uart;
+    uart_co_executor    executor;       // post NULL: resume on the I/O thread
+    std::mutex          lock;
+    uart_co_read       *reader;
+    uart_co_write      *writer;
+    volatile bool       closed;
+    uint64_t            dropped;        // bytes that did not fit the buffer
+    int                 head;
+    int                 len;
+    char                buf[UART_CO_BUF_SIZE];
+
+    // reactor NULL: the port gets its own thread. executor NULL: coroutines
+    // resume on the I/O thread.
+    bool open(const char *dev, const int baud, const char *parity, const int databits, const int stopbits,
+              const uart_co_executor *ex = NULL, uart_reactor *reactor = NULL)
+    {
+        reader = NULL;
+        writer = NULL;
+        closed = false;
+        dropped = 0;
+        head = len = 0;
+        executor.post = NULL != ex ? ex->post : NULL;
+        executor.ctx = NULL != ex ? ex->ctx : NULL;
+
+        uart_obj *u = NULL != reactor
+            ? uart_reactor_open(reactor, &uart, dev, baud, parity, databits, stopbits,
+                                f_on_comm_read(on_read), this, f_on_comm_close(on_close), this)
+            : uart_open_dev(&uart, dev, baud, parity, databits, stopbits,
+                            f_on_comm_read(on_read), this, f_on_comm_close(on_close), this, false);
+        if (NULL == u) return false;
+        uart_io_profile io;
+        uart_get_io_profile(&uart, &io);
+        uart_set_writable_callback(&uart, f_on_comm_writable(on_writable), this, io.tx_queue / 2);
+        return true;
+    }
+
+    // also from a coroutine running on the I/O thread
+    void shutdown() { uart_shutdown(&uart); }
+
+    uart_co_read read_some(char *p, const int max) { return {this, p, 1, max, -1, 0, false, {}}; }
+    uart_co_read read_exact(char *p, const int n) { return {this, p, n, n, -1, 0, false, {}}; }
+    // up to and with delim; max bytes without it: complete as well, p[max - 1] != delim
+    uart_co_read read_until(char *p, const int max, const char delim)
+    {
+        return {this, p, max, max, (unsigned char)delim, 0, false, {}};
+    }
+    uart_co_write write(const char *p, const int l) { return {this, p, l, 0, {}}; }
+
+    // src of l bytes into op, returns how many it took
+    static int fill(uart_co_read *op, const char *src, int l)
+    {
+        if (l > op->max - op->got) l = op->max - op->got;
+        if (op->delim >= 0)
+        {
+            const char *e = (const char *)memchr(src, op->delim, l);
+            if (NULL != e)
+            {
+                l = (int)(e - src) + 1;
+                op->found = true;
+            }
+        }
+        memcpy(op->buf + op->got, src, l);
+        op->got += l;
+        return l;
+    }
+
+    static bool complete(const uart_co_read *op) { return op->found || (op->got >= op->min); }
+
+    // from the buffer, with the lock held; true: op complete
+    bool take(uart_co_read *op)
+    {
+        const int n = fill(op, buf + head, len);
+        head += n;
+        len -= n;
+        if (len == 0) head = 0;
+        return complete(op);
+    }
+
+    void resume(std::coroutine_handle<> h)
+    {
+        if (NULL != executor.post)
+            executor.post(executor.ctx, h);
+        else
+            h.resume();
+    }
+
+    static CB_CALL void on_read(uart_co_port *port, const char *p, const int l)
+    {
+        std::coroutine_handle<> h;
+        int i = 0;
+        {
+            std::lock_guard<std::mutex> g(port->lock);
+            uart_co_read *op = port->reader;
+            if ((NULL != op) && (port->len == 0))
+                i = fill(op, p, l);
+            if (i < l)
+            {
+                if ((port->head > 0) && (port->head + port->len + l - i > UART_CO_BUF_SIZE))
+                {
+                    memmove(port->buf, port->buf + port->head, port->len);
+                    port->head = 0;
+                }
+                int n = l - i;
+                if (n > UART_CO_BUF_SIZE - port->head - port->len) n = UART_CO_BUF_SIZE - port->head - port->len;
+                memcpy(port->buf + port->head + port->len, p + i, n);
+                port->len += n;
+                port->dropped += l - i - n;
+                if ((NULL != op) && !complete(op))
+                    port->take(op);
+            }
+            if ((NULL == op) || !complete(op)) return;
+            port->reader = NULL;
+            h = op->h;
+        }
+        port->resume(h);
+    }
+
+    static CB_CALL void on_writable(uart_co_port *port, const int space)
+    {
+        std::coroutine_handle<> h;
+        {
+            std::lock_guard<std::mutex> g(port->lock);
+            uart_co_write *op = port->writer;
+            if (NULL == op) return;
+            op->sent += uart_send(&port->uart, op->p + op->sent, op->l - op->sent);
+            // short again: the ring was full, the callback comes back as it drains
+            if (op->sent < op->l) return;
+            port->writer = NULL;
+            h = op->h;
+        }
+        port->resume(h);
+    }
+
+    static CB_CALL void on_close(uart_co_port *port, const enum_comm_close reason)
+    {
+        std::coroutine_handle<> r, w;
+        {
+            std::lock_guard<std::mutex> g(port->lock);
+            port->closed = true;
+            if (NULL != port->reader) r = port->reader->h;
+            if (NULL != port->writer) w = port->writer->h;
+            port->reader = NULL;
+            port->writer = NULL;
+        }
+        if (r) port->resume(r);
+        if (w) port->resume(w);
+    }
+};
+
+// After the unlock the op may already be resumed, and gone: nothing touches
+// it past that point.
+inline bool uart_co_read::await_suspend(std::coroutine_handle<> handle)
+{
+    std::lock_guard<std::mutex> g(port->lock);
+    if (port->take(this) || port->closed) return false;
+    h = handle;
+    port->reader = this;
+    return true;
+}
+
+inline bool uart_co_write::await_suspend(std::coroutine_handle<> handle)
+{
+    std::lock_guard<std::mutex> g(port->lock);
+    sent += uart_send(&port->uart, p + sent, l - sent);
+    if ((sent == l) || port->closed) return false;
+    h = handle;
+    port->writer = this;
+    return true;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef _uart_crc_h
+#define _uart_crc_h
+
+// CRCs of frames, shared by the backends: CRC-16/MODBUS, CRC-16/CCITT (the
+// 0xffff seeded, unreflected one also known as CCITT-FALSE) and CRC-32 (IEEE
+// 802.3, as zlib's).
+//
+// crc_update takes the CRC of the bytes before, so a frame split over several
+// on_comm_read chunks is checked as it comes. Each kind goes 8 bytes per step
+// through slicing-by-8 tables, built once by the first caller. CRC-32 over 64
+// bytes and more folds 64 bytes per step with carry-less multiplies where the
+// CPU has PCLMULQDQ, picked at run time; the tail goes through the tables.
+//
+// The tables read 8 bytes as a little endian word.
+
+#include <stdint.h>
+#include <string.h>
+#include "uart_ring.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC_X86
+#include <immintrin.h>
+#endif
+
+typedef struct
+{
+    uint32_t modbus[8][256];    // [k][b]: the CRC of byte b followed by k zeros
+    uint32_t ccitt[8][256];
+    uint32_t crc32[8][256];
+} uart_crc_tables;
+
+static inline void crc_reflected_table(uint32_t t[8][256], const uint32_t poly)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++)
+            c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+        t[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int i = 0; i < 256; i++)
+            t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+}
+
+static inline void crc_msb16_table(uint32_t t[8][256], const uint32_t poly)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t c = i << 8;
+        for (int j = 0; j < 8; j++)
+            c = c & 0x8000 ? ((c << 1) ^ poly) & 0xffff : (c << 1) & 0xffff;
+        t[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int i = 0; i < 256; i++)
+            t[k][i] = ((t[k - 1][i] << 8) & 0xffff) ^ t[0][t[k - 1][i] >> 8];
+}
+
+static const uart_crc_tables *crc_tables(void)
+{
+    static uart_crc_tables tables;
+    static volatile uint32_t once = 0;
+    if (ring_once(&once))
+    {
+        crc_reflected_table(tables.modbus, 0xa001);
+        crc_msb16_table(tables.ccitt, 0x1021);
+        crc_reflected_table(tables.crc32, 0xedb88320);
+        ring_once_done(&once);
+    }
+    return &tables;
+}
+
+// a byte at a time, the tails of the sliced loops
+static inline uint32_t crc_reflected_bytes(const uint32_t t[8][256], uint32_t crc, const char *p, const int l)
+{
+    for (int i = 0; i < l; i++)
+        crc = (crc >> 8) ^ t[0][(crc ^ (unsigned char)p[i]) & 0xff];
+    return crc;
+}
+
+static inline uint32_t crc_msb16_bytes(const uint32_t t[8][256], uint32_t crc, const char *p, const int l)
+{
+    for (int i = 0; i < l; i++)
+        crc = ((crc << 8) & 0xffff) ^ t[0][(crc >> 8) ^ (unsigned char)p[i]];
+    return crc;
+}
+
+// register in, register out (CRC-32's is the complement of the CRC)
+static inline uint32_t crc_reflected(const uint32_t t[8][256], uint32_t crc, const char *p, const int l)
+{
+    int i = 0;
+    for (; i + 8 <= l; i += 8)
+    {
+        uint64_t x;
+        memcpy(&x, p + i, 8);
+        x ^= crc;
+        crc = t[7][x & 0xff] ^ t[6][(x >> 8) & 0xff] ^ t[5][(x >> 16) & 0xff] ^ t[4][(x >> 24) & 0xff]
+            ^ t[3][(x >> 32) & 0xff] ^ t[2][(x >> 40) & 0xff] ^ t[1][(x >> 48) & 0xff] ^ t[0][x >> 56];
+    }
+    return crc_reflected_bytes(t, crc, p + i, l - i);
+}
+
+static inline uint32_t crc_msb16(const uint32_t t[8][256], uint32_t crc, const char *p, const int l)
+{
+    int i = 0;
+    for (; i + 8 <= l; i += 8)
+    {
+        const unsigned char *b = (const unsigned char *)p + i;
+        crc = t[7][b[0] ^ (crc >> 8)] ^ t[6][b[1] ^ (crc & 0xff)] ^ t[5][b[2]] ^ t[4][b[3]]
+            ^ t[3][b[4]] ^ t[2][b[5]] ^ t[1][b[6]] ^ t[0][b[7]];
+    }
+    return crc_msb16_bytes(t, crc, p + i, l - i);
+}
+
+#ifdef CRC_X86
+
+// Folds 4 x 128 bits at a time, then to 128, then reduces to 32 bits
+// (Barrett), after Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ". l is at least 64 and a multiple of 16; register in and out.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const char *p, int l)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)p);
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    p += 64;
+    l -= 64;
+
+    for (; l >= 64; p += 64, l -= 64)
+    {
+        __m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), y1);
+        x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), y2);
+        x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), y3);
+        x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), y4);
+        x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p));
+        x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i *)(p + 16)));
+        x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i *)(p + 32)));
+        x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i *)(p + 48)));
+    }
+
+    // x2..x4 and whatever 16 byte blocks are left into x1
+    __m128i y;
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), y);
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), y);
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), y);
+    for (; l >= 16; p += 16, l -= 16)
+    {
+        y = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11),
+                                         _mm_loadu_si128((const __m128i *)p)), y);
+    }
+
+    // 128 to 64 bits
+    y = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), y);
+    y = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00), y);
+
+    // Barrett reduction to 32 bits
+    y = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+    y = _mm_clmulepi64_si128(_mm_and_si128(y, low32), poly, 0x00);
+    return _mm_extract_epi32(_mm_xor_si128(x1, y), 1);
+}
+
+static inline bool crc_has_pclmul(void)
+{
+    static volatile int has = -1;
+    if (has < 0)
+    {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    }
+    return has > 0;
+}
+
+#endif
+
+// bytes of the CRC after a frame, 0: crc_none or unknown
+static inline int crc_bytes(const int kind)
+{
+    return kind == crc_32 ? 4 : (kind == crc_modbus) || (kind == crc_ccitt) ? 2 : 0;
+}
+
+// the CRC of no bytes, crc_update starts from it
+static inline uint32_t crc_init(const int kind)
+{
+    return (kind == crc_modbus) || (kind == crc_ccitt) ? 0xffff : 0;
+}
+
+// the CRC of the bytes before (crc) followed by p
+static inline uint32_t crc_update(const int kind, uint32_t crc, const char *p, int l)
+{
+    const uart_crc_tables *t = crc_tables();
+    switch (kind)
+    {
+    case crc_modbus:
+        return crc_reflected(t->modbus, crc, p, l);
+    case crc_ccitt:
+        return crc_msb16(t->ccitt, crc, p, l);
+    case crc_32:
+        crc = ~crc;
+#ifdef CRC_X86
+        if ((l >= 64) && crc_has_pclmul())
+        {
+            const int n = l & ~15;
+            crc = crc32_pclmul(crc, p, n);
+            p += n;
+            l -= n;
+        }
+#endif
+        return ~crc_reflected(t->crc32, crc, p, l);
+    default:
+        return crc;
+    }
+}
+
+// crc as it goes on the line, returns its crc_bytes: MODBUS and CRC-32 low
+// byte first, CCITT high byte first
+static inline int crc_put(const int kind, const uint32_t crc, char *dst)
+{
+    const int n = crc_bytes(kind);
+    for (int i = 0; i < n; i++)
+        dst[i] = (char)(kind == crc_ccitt ? crc >> (8 * (n - 1 - i)) : crc >> (8 * i));
+    return n;
+}
+
+// the CRC at the end of frame p of l bytes matches the rest of it
+static inline bool crc_check(const int kind, const char *p, const int l)
+{
+    const int n = crc_bytes(kind);
+    if (l < n) return false;
+    char c[4];
+    crc_put(kind, crc_update(kind, crc_init(kind), p, l - n), c);
+    return memcmp(c, p + l - n, n) == 0;
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef _uart_expect_h
+#define _uart_expect_h
+
+// Multi-pattern expect over the RX stream, shared by the backends.
+//
+// The patterns are compiled once into an Aho-Corasick automaton, turned into
+// a dense DFA: every state has a next state for every input, so each byte is
+// one table step, and the state carries over from one batch to the next.
+// Bytes map to classes first (each byte occurring in a pattern is a class,
+// all others share class 0), which keeps the table small; with
+// UART_EXPECT_NOCASE both cases of a letter share one. Entries hold the next
+// state's row offset, doubled, the low bit set when a pattern ends there.
+//
+// Outside of any partial match only a byte starting a pattern leads
+// anywhere: with up to 8 such bytes the scan skips to the next one 16 bytes at
+// a time (SSE2).
+//
+// Of the patterns ending at a byte the longest wins, then the one given
+// first. The scan starts over after a match, matches do not overlap.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#define UART_EXPECT_QUEUE   16      // matches kept for uart_expect_wait
+#define UART_EXPECT_MAX_BYTES   65536   // of all patterns together
+#define EXPECT_SKIP_MAX     8
+
+struct _uart_expect
+{
+    int             count;          // patterns
+    int            *lens;
+    int             classes;
+    int             states;
+    int             flags;
+    unsigned char   cls[256];       // byte to class
+    int             skip_count;     // bytes starting a pattern, 0: more than EXPECT_SKIP_MAX
+    unsigned char   skip[EXPECT_SKIP_MAX];
+    uint32_t       *next;           // [states * classes]: 2 * (row of the next state) | match
+    int            *out;            // [states]: the pattern ending in the state, -1: none
+};
+
+// the matches of a port, uart_set_expect to uart_expect_wait
+typedef struct
+{
+    uart_expect        *e;          // NULL: no scan
+    uint32_t            state;      // row offset in e->next
+    uint64_t            pos;        // bytes scanned since uart_set_expect
+    uart_expect_match   q[UART_EXPECT_QUEUE];
+    int                 head;
+    int                 len;
+} uart_expect_tap;
+
+static inline void expect_free(uart_expect *e)
+{
+    if (NULL == e) return;
+    free(e->lens);
+    free(e->next);
+    free(e->out);
+    free(e);
+}
+
+static inline uart_expect *expect_create(const char *const *patterns, const int count, const int flags)
+{
+    if ((NULL == patterns) || (count < 1)) return NULL;
+    int64_t total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if ((NULL == patterns[i]) || (patterns[i][0] == 0)) return NULL;
+        total += (int64_t)strlen(patterns[i]);
+    }
+    if (total > UART_EXPECT_MAX_BYTES) return NULL;
+
+    uart_expect *e = (uart_expect *)calloc(1, sizeof(uart_expect));
+    if (NULL == e) return NULL;
+    e->count = count;
+    e->flags = flags;
+
+    // classes, in byte order; all 256 bytes in the patterns: one each
+    bool used[256] = {false};
+    int distinct = 0;
+    for (int i = 0; i < count; i++)
+        for (const unsigned char *s = (const unsigned char *)patterns[i]; *s; s++)
+        {
+            const int c = (flags & UART_EXPECT_NOCASE) ? tolower(*s) : *s;
+            if (!used[c]) distinct++;
+            used[c] = true;
+        }
+    int kk = 1;
+    for (int b = 0; b < 256; b++)
+    {
+        if (distinct == 256)
+            e->cls[b] = (unsigned char)b;
+        else if (used[b])
+        {
+            e->cls[b] = (unsigned char)kk++;
+            if ((flags & UART_EXPECT_NOCASE) && islower(b))
+                e->cls[toupper(b)] = e->cls[b];
+        }
+    }
+    if (distinct == 256) kk = 256;
+    e->classes = kk;
+
+    // the trie, -1: no edge yet
+    int *go = (int *)malloc((size_t)(total + 1) * kk * sizeof(int));
+    int *fail = (int *)calloc(total + 1, sizeof(int));
+    int *queue = (int *)malloc((total + 1) * sizeof(int));
+    e->lens = (int *)malloc(count * sizeof(int));
+    e->out = (int *)malloc((total + 1) * sizeof(int));
+    e->next = (uint32_t *)malloc((size_t)(total + 1) * kk * sizeof(uint32_t));
+    if ((NULL == go) || (NULL == fail) || (NULL == queue) || (NULL == e->lens) || (NULL == e->out)
+        || (NULL == e->next))
+    {
+        free(go);
+        free(fail);
+        free(queue);
+        expect_free(e);
+        return NULL;
+    }
+    memset(go, 0xff, (size_t)(total + 1) * kk * sizeof(int));
+    e->out[0] = -1;
+    e->states = 1;
+    for (int i = 0; i < count; i++)
+    {
+        int s = 0;
+        const unsigned char *p = (const unsigned char *)patterns[i];
+        for (; *p; p++)
+        {
+            int *g = &go[s * kk + e->cls[*p]];
+            if (*g < 0)
+            {
+                *g = e->states;
+                e->out[e->states++] = -1;
+            }
+            s = *g;
+        }
+        e->lens[i] = (int)(p - (const unsigned char *)patterns[i]);
+        if (e->out[s] < 0) e->out[s] = i;
+    }
+
+    // breadth first: failure links, the missing edges through them, and the
+    // longest pattern ending in each state (its own, else its failure's)
+    int qh = 0, qt = 0;
+    for (int c = 0; c < kk; c++)
+    {
+        int *g = &go[c];
+        if (*g < 0)
+            *g = 0;
+        else
+        {
+            fail[*g] = 0;
+            queue[qt++] = *g;
+        }
+    }
+    while (qh < qt)
+    {
+        const int s = queue[qh++];
+        if (e->out[s] < 0) e->out[s] = e->out[fail[s]];
+        for (int c = 0; c < kk; c++)
+        {
+            int *g = &go[s * kk + c];
+            if (*g < 0)
+                *g = go[fail[s] * kk + c];
+            else
+            {
+                fail[*g] = go[fail[s] * kk + c];
+                queue[qt++] = *g;
+            }
+        }
+    }
+    for (int i = 0; i < e->states * kk; i++)
+        e->next[i] = (uint32_t)(go[i] * kk) << 1 | (e->out[go[i]] >= 0);
+
+    // the bytes leaving the root state
+    for (int b = 0; b < 256; b++)
+    {
+        if (go[e->cls[b]] == 0) continue;
+        if (e->skip_count == EXPECT_SKIP_MAX)
+        {
+            e->skip_count = 0;
+            break;
+        }
+        e->skip[e->skip_count++] = (unsigned char)b;
+    }
+    free(go);
+    free(fail);
+    free(queue);
+    return e;
+}
+
+// the first byte in p starting a pattern, l if none
+static inline int expect_skip(const uart_expect *e, const char *p, const int l)
+{
+    if (e->skip_count == 0) return 0;
+    int i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i v[EXPECT_SKIP_MAX];
+    for (int j = 0; j < EXPECT_SKIP_MAX; j++)
+        v[j] = _mm_set1_epi8((char)e->skip[j < e->skip_count ? j : 0]);
+    for (; i + 16 <= l; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, v[0]), _mm_cmpeq_epi8(x, v[1])),
+                                 _mm_or_si128(_mm_cmpeq_epi8(x, v[2]), _mm_cmpeq_epi8(x, v[3])));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, v[4]), _mm_cmpeq_epi8(x, v[5])),
+                                         _mm_or_si128(_mm_cmpeq_epi8(x, v[6]), _mm_cmpeq_epi8(x, v[7]))));
+        int bits = _mm_movemask_epi8(m);
+        if (bits != 0)
+        {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward(&bit, bits);
+            return i + (int)bit;
+#else
+            return i + __builtin_ctz(bits);
+#endif
+        }
+    }
+#endif
+    for (; i < l; i++)
+        if ((e->next[e->cls[(unsigned char)p[i]]] >> 1) != 0) return i;
+    return l;
+}
+
+// Scans p from state on, up to and with the first byte ending a match: returns
+// the bytes scanned, *pattern the match (-1: none, all l scanned). The state
+// is back at the root after a match.
+static inline int expect_scan(const uart_expect *e, uint32_t *state, const char *p, const int l, int *pattern)
+{
+    const uint32_t *next = e->next;
+    const unsigned char *cls = e->cls;
+    const bool skip = e->skip_count > 0;
+    uint32_t s = *state;
+    int i = 0;
+    while (i < l)
+    {
+        if (skip && (s == 0))
+        {
+            i += expect_skip(e, p + i, l - i);
+            if (i >= l) break;
+        }
+        const uint32_t x = next[s + cls[(unsigned char)p[i++]]];
+        s = x >> 1;
+        if (x & 1)
+        {
+            *pattern = e->out[s / e->classes];
+            *state = 0;
+            return i;
+        }
+    }
+    *state = s;
+    *pattern = -1;
+    return l;
+}
+
+// Restarts tap on e (NULL: stops), dropping the queued matches.
+static inline void expect_arm(uart_expect_tap *tap, uart_expect *e)
+{
+    tap->e = e;
+    tap->state = 0;
+    tap->pos = 0;
+    tap->head = tap->len = 0;
+}
+
+// Scans a batch of rx_deliver, t its arrival times; queues the matches, the
+// oldest go when the queue is full. Returns the matches found.
+static inline int expect_feed(uart_expect_tap *tap, const char *p, const int l, const uart_rx_times *t,
+                              const int baud)
+{
+    int found = 0;
+    for (int i = 0; i < l;)
+    {
+        int pattern;
+        i += expect_scan(tap->e, &tap->state, p + i, l - i, &pattern);
+        if (pattern < 0) break;
+
+        if (tap->len == UART_EXPECT_QUEUE)
+        {
+            tap->head = (tap->head + 1) % UART_EXPECT_QUEUE;
+            tap->len--;
+        }
+        uart_expect_match *m = &tap->q[(tap->head + tap->len++) % UART_EXPECT_QUEUE];
+        m->pattern = pattern;
+        m->length = tap->e->lens[pattern];
+        m->offset = tap->pos + i - m->length;
+        m->time_us = rx_times_of(t, i - 1, baud);
+        found++;
+    }
+    tap->pos += l;
+    return found;
+}
+
+// the oldest queued match into m, false: none
+static inline bool expect_pop(uart_expect_tap *tap, uart_expect_match *m)
+{
+    if (tap->len == 0) return false;
+    *m = tap->q[tap->head];
+    tap->head = (tap->head + 1) % UART_EXPECT_QUEUE;
+    tap->len--;
+    return true;
+}
+
+#endif
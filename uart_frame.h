@@ -0,0 +1,448 @@
+#ifndef _uart_frame_h
+#define _uart_frame_h
+
+// RX framing shared by the backends, and the matching TX encoders.
+//
+// A framer sits between the read path and the callback: it is fed each batch
+// rx_deliver would hand to on_comm_read, and calls on_frame once per complete
+// frame instead. A frame that lies within one batch is delivered straight
+// from the read buffer; only the part of a frame split over batches is copied,
+// into the framer's reassembly buffer. SLIP and COBS frames are decoded in
+// place, either way. Frame ends are found with memchr, which the C libraries
+// vectorize.
+//
+// Empty frames are skipped (SLIP and COBS senders often lead with a
+// delimiter to flush line noise). A frame longer than the framer's maximum, or
+// one that does not decode, is dropped and counted in rx_frame_errors.
+//
+// With a CRC set, the framer checks it over each decoded frame and strips it,
+// a mismatch drops the frame into rx_crc_errors; the encoders append it to
+// the data before the encoding. A binary CRC could hold the delimiter, so
+// frame_delimiter takes none.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "uart_stats.h"
+#include "uart_crc.h"
+
+#define UART_FRAME_MAX      4096    // default max_frame
+#define UART_FRAME_ENCODE_MAX(l)    (2 * (l) + 10)
+#define UART_FRAME_STACK    1024    // uart_send_frame encodes up to this on the stack
+
+#define SLIP_END        0xc0
+#define SLIP_ESC        0xdb
+#define SLIP_ESC_END    0xdc
+#define SLIP_ESC_ESC    0xdd
+
+typedef struct
+{
+    uart_framing    cfg;
+    f_on_frame      on_frame;
+    void           *frame_param;
+    int             max;            // cfg.max_frame or UART_FRAME_MAX
+    int             end;            // the byte ending a frame, -1: length prefixed
+    int             held;           // bytes of a split frame in buf
+    bool            dropping;       // the frame in progress is too long, until its end
+    uint32_t        skip;           // frame_length: bytes of a dropped frame still to come
+    uint32_t        len;            // frame_length: of the split frame, once its prefix is held
+    char            buf[1];         // max bytes
+} uart_framer;
+
+// the first a or b in p, l if none: the end of line scan of text consumers
+static inline int frame_find2(const char *p, const int l, const char a, const char b)
+{
+    int i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    for (; i + 16 <= l; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (m != 0)
+        {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward(&bit, m);
+            return i + (int)bit;
+#else
+            return i + __builtin_ctz(m);
+#endif
+        }
+    }
+#endif
+    for (; i < l; i++)
+        if ((p[i] == a) || (p[i] == b)) return i;
+    return l;
+}
+
+static inline bool frame_valid(const uart_framing *f)
+{
+    switch (f->kind)
+    {
+    case frame_none:
+    case frame_slip:
+    case frame_cobs:
+        break;
+    case frame_delimiter:
+        if ((f->delimiter < 0) || (f->delimiter > 0xff)) return false;
+        break;
+    case frame_length:
+        if ((f->length_bytes != 1) && (f->length_bytes != 2) && (f->length_bytes != 4)) return false;
+        // the prefix at least, it is held in the buffer
+        if ((f->max_frame > 0) && (f->max_frame < f->length_bytes)) return false;
+        break;
+    default:
+        return false;
+    }
+    if ((f->crc < crc_none) || (f->crc > crc_32)) return false;
+    if ((f->crc != crc_none) && (f->kind == frame_delimiter)) return false;
+    return f->max_frame >= 0;
+}
+
+// NULL: bad framing, or frame_none (no framer)
+static inline uart_framer *frame_create(const uart_framing *f, f_on_frame on_frame, void *frame_param)
+{
+    if (!frame_valid(f) || (f->kind == frame_none) || (NULL == on_frame))
+        return NULL;
+    const int max = f->max_frame > 0 ? f->max_frame : UART_FRAME_MAX;
+    uart_framer *fr = (uart_framer *)malloc(sizeof(uart_framer) + max);
+    if (NULL == fr) return NULL;
+    crc_tables();   // here rather than on the I/O thread
+    memset(fr, 0, sizeof(*fr));
+    fr->cfg = *f;
+    fr->on_frame = on_frame;
+    fr->frame_param = frame_param;
+    fr->max = max;
+    fr->end = f->kind == frame_delimiter ? f->delimiter
+        : f->kind == frame_slip ? SLIP_END
+        : f->kind == frame_cobs ? 0 : -1;
+    return fr;
+}
+
+static inline void frame_free(uart_framer *fr)
+{
+    free(fr);
+}
+
+// in place, -1: a bad escape
+static inline int slip_decode(char *p, const int l)
+{
+    int o = 0, i = 0;
+    while (true)
+    {
+        const char *e = (const char *)memchr(p + i, SLIP_ESC, l - i);
+        const int n = (NULL != e ? (int)(e - p) : l) - i;
+        if (o != i) memmove(p + o, p + i, n);
+        o += n;
+        i += n;
+        if (NULL == e) return o;
+
+        if (i + 1 >= l) return -1;
+        const unsigned char c = (unsigned char)p[i + 1];
+        if (c == SLIP_ESC_END) p[o++] = (char)SLIP_END;
+        else if (c == SLIP_ESC_ESC) p[o++] = (char)SLIP_ESC;
+        else return -1;
+        i += 2;
+    }
+}
+
+// in place, -1: a code runs past the end
+static inline int cobs_decode(char *p, const int l)
+{
+    int o = 0, i = 0;
+    while (i < l)
+    {
+        const int code = (unsigned char)p[i++];
+        if (code - 1 > l - i) return -1;
+        if (o != i) memmove(p + o, p + i, code - 1);
+        o += code - 1;
+        i += code - 1;
+        if ((code < 0xff) && (i < l)) p[o++] = 0;
+    }
+    return o;
+}
+
+static inline void frame_deliver(uart_framer *fr, uart_stats *stats, char *p, int l)
+{
+    if (fr->cfg.kind == frame_slip) l = slip_decode(p, l);
+    else if (fr->cfg.kind == frame_cobs) l = cobs_decode(p, l);
+    if (l < 0)
+    {
+        stat_bump(&stats->rx_frame_errors, 1);
+        return;
+    }
+    if (l == 0) return;
+    if (fr->cfg.crc != crc_none)
+    {
+        if (!crc_check(fr->cfg.crc, p, l))
+        {
+            stat_bump(&stats->rx_crc_errors, 1);
+            return;
+        }
+        l -= crc_bytes(fr->cfg.crc);
+    }
+    stat_bump(&stats->rx_frames, 1);
+    fr->on_frame(fr->frame_param, p, l);
+}
+
+// bytes of the split frame, false: it outgrew the buffer and is dropped
+static inline bool frame_hold(uart_framer *fr, uart_stats *stats, const char *p, const int l)
+{
+    if (fr->held + l > fr->max)
+    {
+        stat_bump(&stats->rx_frame_errors, 1);
+        fr->held = 0;
+        return false;
+    }
+    memcpy(fr->buf + fr->held, p, l);
+    fr->held += l;
+    return true;
+}
+
+static inline void frame_feed_delimited(uart_framer *fr, uart_stats *stats, char *p, const int l)
+{
+    int i = 0;
+    while (i < l)
+    {
+        char *e = (char *)memchr(p + i, fr->end, l - i);
+        if (NULL == e)
+        {
+            if (!fr->dropping)
+                fr->dropping = !frame_hold(fr, stats, p + i, l - i);
+            return;
+        }
+
+        const int n = (int)(e - p) - i;
+        if (fr->dropping)
+            fr->dropping = false;
+        else if (fr->held == 0)
+        {
+            if (n > fr->max)
+                stat_bump(&stats->rx_frame_errors, 1);
+            else
+                frame_deliver(fr, stats, p + i, n);
+        }
+        else if (frame_hold(fr, stats, p + i, n))
+        {
+            frame_deliver(fr, stats, fr->buf, fr->held);
+            fr->held = 0;
+        }
+        i += n + 1;
+    }
+}
+
+static inline uint32_t frame_length_of(const unsigned char *h, const int n)
+{
+    uint32_t len = 0;
+    for (int i = 0; i < n; i++)
+        len = (len << 8) | h[i];
+    return len;
+}
+
+// len is the sender's, anything up to 0xffffffff: compared in 64 bits
+static inline bool frame_too_long(const uart_framer *fr, const uint32_t len)
+{
+    return (uint64_t)len + (uint64_t)fr->cfg.length_bytes > (uint64_t)fr->max;
+}
+
+static inline void frame_feed_length(uart_framer *fr, uart_stats *stats, char *p, const int l)
+{
+    const int lb = fr->cfg.length_bytes;
+    int i = 0;
+    while (i < l)
+    {
+        if (fr->skip > 0)
+        {
+            const uint32_t n = (uint32_t)(l - i) < fr->skip ? (uint32_t)(l - i) : fr->skip;
+            fr->skip -= n;
+            i += n;
+            continue;
+        }
+
+        // the whole frame is in this batch
+        if ((fr->held == 0) && (l - i >= lb))
+        {
+            const uint32_t len = frame_length_of((const unsigned char *)p + i, lb);
+            if (frame_too_long(fr, len))
+            {
+                stat_bump(&stats->rx_frame_errors, 1);
+                fr->skip = len;
+                i += lb;
+                continue;
+            }
+            if ((uint32_t)(l - i - lb) >= len)
+            {
+                frame_deliver(fr, stats, p + i + lb, (int)len);
+                i += lb + len;
+                continue;
+            }
+        }
+
+        // split: the length first, then the rest of the frame, fr->len checked
+        // against the buffer by then
+        const int want = fr->held < lb ? lb - fr->held : lb + (int)fr->len - fr->held;
+        const int n = l - i < want ? l - i : want;
+        memcpy(fr->buf + fr->held, p + i, n);
+        fr->held += n;
+        i += n;
+        if (fr->held < lb) continue;
+
+        if (fr->held == lb)
+        {
+            fr->len = frame_length_of((const unsigned char *)fr->buf, lb);
+            if (frame_too_long(fr, fr->len))
+            {
+                stat_bump(&stats->rx_frame_errors, 1);
+                fr->skip = fr->len;
+                fr->held = 0;
+                continue;
+            }
+        }
+        if (fr->held == lb + (int)fr->len)
+        {
+            frame_deliver(fr, stats, fr->buf + lb, fr->held - lb);
+            fr->held = 0;
+        }
+    }
+}
+
+// a batch of received bytes, p may be written to
+static inline void frame_feed(uart_framer *fr, uart_stats *stats, char *p, const int l)
+{
+    if (fr->end >= 0)
+        frame_feed_delimited(fr, stats, p, l);
+    else
+        frame_feed_length(fr, stats, p, l);
+}
+
+// continues the COBS block whose code byte is dst[*code], dst[o] is the next
+// free byte; returns the new o. A frame: the code byte, its parts, cobs_end.
+static inline int cobs_encode_part(const char *s, const int l, char *dst, int o, int *code)
+{
+    const char *end = s + l;
+    while (s < end)
+    {
+        const char *z = (const char *)memchr(s, 0, end - s);
+        int run = (int)((NULL != z ? z : end) - s);
+        while (run > 0)
+        {
+            const int room = 0xfe - (o - *code - 1);
+            const int n = run < room ? run : room;
+            memcpy(dst + o, s, n);
+            o += n;
+            s += n;
+            run -= n;
+            if (n == room)
+            {
+                dst[*code] = (char)0xff;
+                *code = o++;
+            }
+        }
+        if (NULL == z) break;
+        dst[*code] = (char)(o - *code);
+        *code = o++;
+        s++;
+    }
+    return o;
+}
+
+static inline int cobs_end(char *dst, int o, const int code)
+{
+    dst[code] = (char)(o - code);
+    dst[o++] = 0;
+    return o;
+}
+
+// src escaped to dst[o], returns the new o
+static inline int slip_encode_part(const char *src, const int l, char *dst, int o)
+{
+    for (int i = 0; i < l; i++)
+    {
+        const unsigned char c = (unsigned char)src[i];
+        if (c == SLIP_END)
+        {
+            dst[o++] = (char)SLIP_ESC;
+            dst[o++] = (char)SLIP_ESC_END;
+        }
+        else if (c == SLIP_ESC)
+        {
+            dst[o++] = (char)SLIP_ESC;
+            dst[o++] = (char)SLIP_ESC_ESC;
+        }
+        else
+            dst[o++] = (char)c;
+    }
+    return o;
+}
+
+static inline int slip_escapes(const char *p, const int l)
+{
+    int n = 0;
+    for (int i = 0; i < l; i++)
+        n += ((unsigned char)p[i] == SLIP_END) || ((unsigned char)p[i] == SLIP_ESC);
+    return n;
+}
+
+// one frame into dst of max bytes (UART_FRAME_ENCODE_MAX(l) is always enough),
+// returns its length; -1: it does not fit, or cannot be framed (a delimiter
+// in the data, a length beyond the prefix)
+static inline int frame_encode(const uart_framing *f, const char *p, const int l, char *dst, const int max)
+{
+    if ((l < 0) || !frame_valid(f)) return -1;
+
+    // the CRC goes on the line after the data, inside the framing
+    char crc[4];
+    const int t = crc_put(f->crc, crc_update(f->crc, crc_init(f->crc), p, l), crc);
+    const int n = l + t;
+    switch (f->kind)
+    {
+    case frame_none:
+        if (n > max) return -1;
+        memcpy(dst, p, l);
+        memcpy(dst + l, crc, t);
+        return n;
+    case frame_delimiter:
+        if ((l + 1 > max) || (NULL != memchr(p, f->delimiter, l))) return -1;
+        memcpy(dst, p, l);
+        dst[l] = (char)f->delimiter;
+        return l + 1;
+    case frame_length:
+    {
+        const int lb = f->length_bytes;
+        if ((n + lb > max) || ((lb < 4) && ((uint32_t)n >> (8 * lb) != 0))) return -1;
+        for (int i = 0; i < lb; i++)
+            dst[i] = (char)(((uint32_t)n >> (8 * (lb - 1 - i))) & 0xff);
+        memcpy(dst + lb, p, l);
+        memcpy(dst + lb + l, crc, t);
+        return n + lb;
+    }
+    case frame_slip:
+    {
+        // worst case first, then the exact size
+        if ((UART_FRAME_ENCODE_MAX(l) > max) && (n + 2 + slip_escapes(p, l) + slip_escapes(crc, t) > max))
+            return -1;
+        dst[0] = (char)SLIP_END;
+        int o = slip_encode_part(crc, t, dst, slip_encode_part(p, l, dst, 1));
+        dst[o++] = (char)SLIP_END;
+        return o;
+    }
+    case frame_cobs:
+    {
+        if (n + n / 0xfe + 2 > max) return -1;
+        int code = 0;
+        int o = cobs_encode_part(p, l, dst, 1, &code);
+        o = cobs_encode_part(crc, t, dst, o, &code);
+        return cobs_end(dst, o, code);
+    }
+    default:
+        return -1;
+    }
+}
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef _uart_hex_h
+#define _uart_hex_h
+
+// Hex dump formatting and hex input parsing of the uart util, shared with
+// uart_bench.
+//
+// hex_encode renders bytes as "XX " each. Besides the scalar table the x86
+// builds carry SSSE3 and AVX2 versions picked at run time; SSE2 alone has no
+// byte shuffle for the 3 byte layout, so it gets the table. hex_decode takes
+// the tokens typed in -hex mode, scanning and converting 16 digits at a time
+// with SSE2.
+
+#include <stdint.h>
+#include <string.h>
+#include "uart_ring.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HEX_X86
+#include <immintrin.h>
+#endif
+
+// output bound of hex_encode
+#define HEX_ENCODE_SIZE(n)  (3 * (n) + 1)
+
+// "XX " of each byte, with a 4th byte so that a whole word can be stored
+static const uint32_t *hex_table(void)
+{
+    static uint32_t table[256];
+    static volatile uint32_t once = 0;
+    if (ring_once(&once))
+    {
+        static const char digits[] = "0123456789ABCDEF";
+        for (int i = 0; i < 256; i++)
+        {
+            const char s[4] = {digits[i >> 4], digits[i & 15], ' ', '\0'};
+            memcpy(table + i, s, 4);
+        }
+        ring_once_done(&once);
+    }
+    return table;
+}
+
+// dst needs HEX_ENCODE_SIZE(n) bytes, returns the end of the text
+static inline char *hex_encode_scalar(char *dst, const unsigned char *src, const int n)
+{
+    const uint32_t *table = hex_table();
+    for (int i = 0; i < n; i++)
+    {
+        memcpy(dst, table + src[i], 4);
+        dst += 3;
+    }
+    return dst;
+}
+
+#ifdef HEX_X86
+
+// 16 bytes as 48 characters: the digits are looked up by pshufb, interleaved
+// into pairs, then spread to 3 byte groups by one more shuffle per source
+#define HEX_SHUFFLES \
+    const __m128i a0 = _mm_setr_epi8(0, 1, -128, 2, 3, -128, 4, 5, -128, 6, 7, -128, 8, 9, -128, 10); \
+    const __m128i a1 = _mm_setr_epi8(11, -128, 12, 13, -128, 14, 15, -128, \
+                                     -128, -128, -128, -128, -128, -128, -128, -128); \
+    const __m128i b1 = _mm_setr_epi8(-128, -128, -128, -128, -128, -128, -128, -128, \
+                                     0, 1, -128, 2, 3, -128, 4, 5); \
+    const __m128i b2 = _mm_setr_epi8(-128, 6, 7, -128, 8, 9, -128, 10, 11, -128, 12, 13, -128, 14, 15, -128); \
+    const __m128i s0 = _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0); \
+    const __m128i s1 = _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0); \
+    const __m128i s2 = _mm_setr_epi8(' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ')
+
+__attribute__((target("ssse3")))
+static inline void hex_spread(char *dst, const __m128i p0, const __m128i p1)
+{
+    HEX_SHUFFLES;
+    _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_shuffle_epi8(p0, a0), s0));
+    _mm_storeu_si128((__m128i *)(dst + 16),
+                     _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, a1), _mm_shuffle_epi8(p1, b1)), s1));
+    _mm_storeu_si128((__m128i *)(dst + 32), _mm_or_si128(_mm_shuffle_epi8(p1, b2), s2));
+}
+
+__attribute__((target("ssse3")))
+static char *hex_encode_ssse3(char *dst, const unsigned char *src, const int n)
+{
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m128i low = _mm_set1_epi8(0x0f);
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16, dst += 48)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(x, 4), low));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(x, low));
+        hex_spread(dst, _mm_unpacklo_epi8(hi, lo), _mm_unpackhi_epi8(hi, lo));
+    }
+    return hex_encode_scalar(dst, src + i, n - i);
+}
+
+// pshufb works within 128 bit lanes: each lane renders its own 16 bytes
+__attribute__((target("avx2")))
+static char *hex_encode_avx2(char *dst, const unsigned char *src, const int n)
+{
+    const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+                                            '0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    HEX_SHUFFLES;
+    const __m256i a0w = _mm256_broadcastsi128_si256(a0);
+    const __m256i a1w = _mm256_broadcastsi128_si256(a1);
+    const __m256i b1w = _mm256_broadcastsi128_si256(b1);
+    const __m256i b2w = _mm256_broadcastsi128_si256(b2);
+    const __m256i s0w = _mm256_broadcastsi128_si256(s0);
+    const __m256i s1w = _mm256_broadcastsi128_si256(s1);
+    const __m256i s2w = _mm256_broadcastsi128_si256(s2);
+    int i = 0;
+
+    for (; i + 32 <= n; i += 32, dst += 96)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+        __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(x, low));
+        __m256i p0 = _mm256_unpacklo_epi8(hi, lo);
+        __m256i p1 = _mm256_unpackhi_epi8(hi, lo);
+        __m256i o0 = _mm256_or_si256(_mm256_shuffle_epi8(p0, a0w), s0w);
+        __m256i o1 = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(p0, a1w),
+                                                     _mm256_shuffle_epi8(p1, b1w)), s1w);
+        __m256i o2 = _mm256_or_si256(_mm256_shuffle_epi8(p1, b2w), s2w);
+        _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(o0));
+        _mm_storeu_si128((__m128i *)(dst + 16), _mm256_castsi256_si128(o1));
+        _mm_storeu_si128((__m128i *)(dst + 32), _mm256_castsi256_si128(o2));
+        _mm_storeu_si128((__m128i *)(dst + 48), _mm256_extracti128_si256(o0, 1));
+        _mm_storeu_si128((__m128i *)(dst + 64), _mm256_extracti128_si256(o1, 1));
+        _mm_storeu_si128((__m128i *)(dst + 80), _mm256_extracti128_si256(o2, 1));
+    }
+    return hex_encode_ssse3(dst, src + i, n - i);
+}
+
+#endif
+
+typedef char *(*f_hex_encode)(char *dst, const unsigned char *src, const int n);
+
+static inline f_hex_encode hex_encoder(void)
+{
+    static f_hex_encode f = NULL;
+    if (NULL != f) return f;
+    f = hex_encode_scalar;
+#ifdef HEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        f = hex_encode_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        f = hex_encode_ssse3;
+#endif
+    return f;
+}
+
+static inline char *hex_encode(char *dst, const unsigned char *src, const int n)
+{
+    return hex_encoder()(dst, src, n);
+}
+
+// digit values, 0xff: not a hex digit
+static const unsigned char *hex_values(void)
+{
+    static unsigned char values[256];
+    static volatile uint32_t once = 0;
+    if (ring_once(&once))
+    {
+        memset(values, 0xff, sizeof(values));
+        for (int i = 0; i < 10; i++) values['0' + i] = i;
+        for (int i = 0; i < 6; i++) values['a' + i] = values['A' + i] = 10 + i;
+        ring_once_done(&once);
+    }
+    return values;
+}
+
+#ifdef HEX_X86
+
+// bit i set: s[i] is a hex digit
+static inline int hex_digits16(const char *s)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i *)s);
+    const __m128i l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                        _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                                        _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+    return _mm_movemask_epi8(_mm_or_si128(digit, alpha));
+}
+
+// 16 characters known to be hex digits to 8 bytes
+static inline void hex_decode16(const char *s, unsigned char *dst)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i *)s);
+    const __m128i digit = _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1));
+    const __m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a' - 10));
+    const __m128i nib = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+                                     _mm_andnot_si128(digit, alpha));
+    // each 16 bit lane holds the high digit in its low byte
+    const __m128i b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib, _mm_set1_epi16(0x00ff)), 4),
+                                   _mm_srli_epi16(nib, 8));
+    _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(b, b));
+}
+
+#endif
+
+// Parses hex input typed in -hex mode: tokens separated by blanks, each a run
+// of digit pairs ("0d0a", "DEADBEEF"); a token of odd length starts with a
+// single digit byte ("1 2 a" is 01 02 0A). Returns the number of bytes, or -1
+// at a character that is not a digit or a blank, or when dst is full.
+static inline int hex_decode(const char *s, const int l, unsigned char *dst, const int max)
+{
+    const unsigned char *values = hex_values();
+    int i = 0, n = 0;
+
+    while (i < l)
+    {
+        if ((s[i] == ' ') || (s[i] == '\t'))
+        {
+            i++;
+            continue;
+        }
+
+        // the common "XX" token
+        const int hi = values[(unsigned char)s[i]];
+        const int lo = i + 1 < l ? values[(unsigned char)s[i + 1]] : 0xff;
+        if (((hi | lo) != 0xff) && ((i + 2 == l) || (s[i + 2] == ' ') || (s[i + 2] == '\t')))
+        {
+            if (n == max) return -1;
+            dst[n++] = (hi << 4) | lo;
+            i += 3;
+            continue;
+        }
+
+        int end = i;
+#ifdef HEX_X86
+        while ((end + 16 <= l) && (hex_digits16(s + end) == 0xffff)) end += 16;
+#endif
+        while ((end < l) && (values[(unsigned char)s[end]] != 0xff)) end++;
+        if ((end < l) && (s[end] != ' ') && (s[end] != '\t'))
+            return -1;
+        if (n + (end - i + 1) / 2 > max)
+            return -1;
+
+        if ((end - i) & 1)
+            dst[n++] = values[(unsigned char)s[i++]];
+#ifdef HEX_X86
+        for (; i + 16 <= end; i += 16, n += 8)
+            hex_decode16(s + i, dst + n);
+#endif
+        for (; i < end; i += 2)
+            dst[n++] = (values[(unsigned char)s[i]] << 4) | values[(unsigned char)s[i + 1]];
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,321 @@
+// Replay and traffic generator of the uart util, see uart_load.h
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "uart_load.h"
+#include "uart_capture.h"
+
+#define dbg_printf(...) //printf
+
+// the last stretch before a due time is spun, sleeps overshoot by about a tick
+#define LOAD_SPIN_US    2000
+
+static void sleep_us(const int64_t us)
+{
+#ifdef _WIN32
+    Sleep((DWORD)(us / 1000));
+#else
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void wait_until(const int64_t due)
+{
+    while (true)
+    {
+        int64_t left = due - uart_time_us();
+        if (left <= 0) return;
+        if (left > LOAD_SPIN_US)
+            sleep_us(left - LOAD_SPIN_US);
+        else
+            ring_yield();
+    }
+}
+
+// due < 0: right away. false: the port closed.
+static bool load_send(uart_obj *uart, load_stats *st, const int64_t due, const char *p, const int l)
+{
+    if (st->frames == 0) st->start_us = uart_time_us();
+    if (due >= 0)
+    {
+        wait_until(due);
+        int64_t late = uart_time_us() - due;
+        st->due_us = due;
+        st->late_sum_us += late;
+        if (late > st->late_max_us) st->late_max_us = late;
+        st->late_hist[late < LOAD_JITTER_BUCKETS ? late : LOAD_JITTER_BUCKETS]++;
+    }
+
+    if (uart_send_timeout(uart, p, l, -1) < l)
+        return false;
+    st->bytes += l;
+    st->frames++;
+    return true;
+}
+
+static volatile bool drained;
+
+static void on_drained(void *param, const int space)
+{
+    drained = true;
+}
+
+// until the TX ring is empty, or long after it should have been
+static void wait_drained(uart_obj *uart)
+{
+    int baud;
+    const char *parity;
+    int databits, stopbits;
+    uart_io_profile io;
+    uart_get_config(uart, &baud, &parity, &databits, &stopbits);
+    uart_get_io_profile(uart, &io);
+    const int64_t limit = uart_time_us() + 1000000 + 2 * rx_bytes_to_us(io.tx_queue, baud);
+
+    drained = false;
+    uart_set_writable_callback(uart, f_on_comm_writable(on_drained), NULL, 0);
+    uart_send(uart, NULL, 0);
+    while (!drained && (uart_time_us() < limit))
+        sleep_us(1000);
+    uart_set_writable_callback(uart, NULL, NULL, 0);
+}
+
+static void load_report(uart_obj *uart, const load_stats *st, const double requested)
+{
+    wait_drained(uart);
+    const double s = st->frames > 0 ? (uart_time_us() - st->start_us) / 1e6 : 0;
+
+    int baud;
+    const char *parity;
+    int databits, stopbits;
+    uart_get_config(uart, &baud, &parity, &databits, &stopbits);
+
+    fprintf(stderr, "sent %llu bytes in %llu frames, %.3f s: %.0f B/s",
+            (unsigned long long)st->bytes, (unsigned long long)st->frames, s, s > 0 ? st->bytes / s : 0);
+    if (requested > 0)
+        fprintf(stderr, " of %.0f requested (%.1f%%)", requested, s > 0 ? st->bytes / s / requested * 100 : 0);
+    fprintf(stderr, ", the line takes %d B/s\n", baud / UART_BITS_PER_CHAR);
+
+    uint64_t timed = 0;
+    for (int i = 0; i <= LOAD_JITTER_BUCKETS; i++) timed += st->late_hist[i];
+    if (timed == 0) return;
+
+    uint64_t n = 0;
+    int p99 = 0;
+    while ((p99 < LOAD_JITTER_BUCKETS) && ((n += st->late_hist[p99]) < (timed * 99 + 99) / 100))
+        p99++;
+    fprintf(stderr, "lateness us: mean %lld p99 %s%d max %lld\n",
+            (long long)(st->late_sum_us / (int64_t)timed), p99 == LOAD_JITTER_BUCKETS ? ">" : "", p99,
+            (long long)st->late_max_us);
+}
+
+int load_replay(uart_obj *uart, const char *path, const int dir,
+                const double from, const double to, const double speed)
+{
+    uart_capture *cap = capture_open(path, 0);
+    if (NULL == cap)
+    {
+        fprintf(stderr, "Failed to open the capture %s\n", path);
+        return -1;
+    }
+
+    load_stats *st = (load_stats *)calloc(1, sizeof(load_stats));
+    const int64_t from_us = (int64_t)(from * 1e6);
+    const int64_t to_us = (int64_t)(to * 1e6);
+    int64_t offset;
+    uint64_t pos = capture_seek(cap, from_us, &offset);
+    int64_t first = 0, last = 0;
+    capture_rec rec;
+    const char *p;
+
+    while (capture_next(cap, &pos, &rec, &p))
+    {
+        if (rec.dir == CAPTURE_CLOCK)
+        {
+            memcpy(&offset, p, sizeof(offset));
+            continue;
+        }
+        const int64_t t = rec.us + offset;
+        if ((rec.dir != dir) || (t < from_us)) continue;
+        if ((to_us > 0) && (t > to_us)) break;
+
+        if (st->frames == 0) first = t;
+        last = t;
+        int64_t due = speed > 0 ? st->start_us + (int64_t)((t - first) / speed) : -1;
+        if (!load_send(uart, st, st->frames == 0 ? -1 : due, p, rec.len))
+            break;
+    }
+    capture_close(cap);
+
+    load_report(uart, st, (speed > 0) && (last > first) ? st->bytes / ((last - first) / 1e6 / speed) : 0);
+    free(st);
+    return 0;
+}
+
+static uint64_t xorshift(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+int load_generate(uart_obj *uart, const enum_gen_pattern pattern,
+                  const double rate, const int frame, const double duration)
+{
+    load_stats *st = (load_stats *)calloc(1, sizeof(load_stats));
+    char *buf = (char *)malloc(frame);
+    uint64_t x = uart_time_us() | 1;
+    const int64_t start = uart_time_us();
+    const int64_t end = start + (int64_t)(duration * 1e6);
+    double due = (double)start;
+
+    for (uint64_t n = 0; (rate > 0 ? (int64_t)due : uart_time_us()) < end; n++)
+    {
+        int l = frame;
+        if (pattern == gen_random)
+        {
+            l = 1 + (int)(xorshift(&x) % frame);
+            for (int i = 0; i < l; i += 8)
+            {
+                uint64_t r = xorshift(&x);
+                memcpy(buf + i, &r, l - i < 8 ? l - i : 8);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < l; i++) buf[i] = (char)(n + i);
+        }
+
+        if (!load_send(uart, st, rate > 0 ? (int64_t)due : -1, buf, l))
+            break;
+        if (rate > 0)
+        {
+            // poisson: exponential gaps of the same mean
+            double gap = l * 1e6 / rate;
+            if (pattern == gen_poisson)
+                gap *= -log(1 - (xorshift(&x) >> 11) * (1.0 / 9007199254740992.0));
+            due += gap;
+        }
+    }
+
+    load_report(uart, st, rate);
+    free(buf);
+    free(st);
+    return 0;
+}
+
+int load_send_file(uart_obj *uart, const char *path)
+{
+    const char *map = NULL;
+    int64_t size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    HANDLE mapping = NULL;
+    LARGE_INTEGER li;
+    if ((INVALID_HANDLE_VALUE == file) || !GetFileSizeEx(file, &li))
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        if (INVALID_HANDLE_VALUE != file) CloseHandle(file);
+        return -1;
+    }
+    size = li.QuadPart;
+    if (size > 0)
+    {
+        mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (NULL != mapping) map = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if ((fd < 0) || (fstat(fd, &info) != 0))
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size = info.st_size;
+    if (size > 0)
+    {
+        void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED != m)
+        {
+            map = (const char *)m;
+            madvise(m, size, MADV_SEQUENTIAL);
+        }
+    }
+#endif
+
+    int r = 0;
+    load_stats *st = (load_stats *)calloc(1, sizeof(load_stats));
+    if ((size > 0) && (NULL == map))
+    {
+        fprintf(stderr, "Failed to map %s\n", path);
+        r = -1;
+    }
+    else
+    {
+        for (int64_t o = 0; o < size; o += LOAD_BLOCK)
+            if (!load_send(uart, st, -1, map + o, size - o < LOAD_BLOCK ? (int)(size - o) : LOAD_BLOCK))
+            {
+                r = -1;
+                break;
+            }
+        load_report(uart, st, 0);
+    }
+    free(st);
+
+#ifdef _WIN32
+    if (NULL != map) UnmapViewOfFile(map);
+    if (NULL != mapping) CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    if (NULL != map) munmap((void *)map, size);
+    close(fd);
+#endif
+    return r;
+}
+
+int load_pipe(uart_obj *uart)
+{
+    static char buf[LOAD_BLOCK];
+    load_stats *st = (load_stats *)calloc(1, sizeof(load_stats));
+    int r = 0;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    while (true)
+    {
+        // whatever a pipe holds, not waiting for a full block
+#ifdef _WIN32
+        const int l = _read(_fileno(stdin), buf, sizeof(buf));
+#else
+        const int l = (int)read(STDIN_FILENO, buf, sizeof(buf));
+#endif
+        if (l <= 0) break;
+        if (!load_send(uart, st, -1, buf, l))
+        {
+            r = -1;
+            break;
+        }
+    }
+    load_report(uart, st, 0);
+    free(st);
+    return r;
+}
@@ -0,0 +1,52 @@
+#ifndef _uart_load_h
+#define _uart_load_h
+
+// Load modes of the uart util: replay of a capture (see uart_capture.h),
+// synthetic traffic and raw bulk data, all sent through uart_send_timeout from
+// the calling thread to soak test whatever reads the other end of the line.
+//
+// Each frame (a capture record, or a generated frame) has a due time. The
+// report compares the achieved throughput, up to the last byte leaving the TX
+// ring, with the requested one, and gives how late the frames were sent.
+
+#include "uart.h"
+
+#define LOAD_JITTER_BUCKETS 10000   // lateness histogram, 1 us each, the rest count as more
+#define LOAD_BLOCK          (64 * 1024) // -pipe reads, -send_file sends
+
+typedef enum
+{
+    gen_fixed,          // frames of frame bytes at a steady rate
+    gen_poisson,        // frames of frame bytes, exponential gaps averaging the rate
+    gen_random          // frames of 1 .. frame random bytes at a steady rate
+} enum_gen_pattern;
+
+typedef struct
+{
+    uint64_t    bytes;
+    uint64_t    frames;
+    int64_t     start_us;
+    int64_t     due_us;         // of the last frame
+    int64_t     late_sum_us;
+    int64_t     late_max_us;
+    uint32_t    late_hist[LOAD_JITTER_BUCKETS + 1];
+} load_stats;
+
+// Sends the records of a capture in direction dir (CAPTURE_RX: what the port
+// received) within [from, to] (Unix time, 0: no limit), speed times as fast
+// as recorded; speed 0: as fast as the port takes them.
+int load_replay(uart_obj *uart, const char *path, const int dir,
+                const double from, const double to, const double speed);
+
+// rate: bytes per second (0: as fast as the port takes them), for duration seconds
+int load_generate(uart_obj *uart, const enum_gen_pattern pattern,
+                  const double rate, const int frame, const double duration);
+
+// Sends the file at path as is, in blocks straight from a read-only mapping
+// of it. -1: cannot be opened or mapped.
+int load_send_file(uart_obj *uart, const char *path);
+
+// Sends what stdin gives (switched to binary), as read, until its end.
+int load_pipe(uart_obj *uart);
+
+#endif
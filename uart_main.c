@@ -1,124 +1,403 @@
 //
 #include <stdio.h>
-#include <conio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include <sys/time.h>
-#include "uart_win32.h"
+#ifdef _WIN32
+#include <conio.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+#include "uart.h"
+#include "uart_bridge.h"
+#include "uart_hex.h"
+#include "uart_capture.h"
+#include "uart_load.h"
+#include "uart_modbus.h"
 
 #define dbg_printf(...) //printf
 
+#define HEX_LINE    32
+#define TIME_SIZE   40
+#define MODBUS_POLLS 64     // -modbus options
+#define EXPECT_PATTERNS 32  // -expect options
+
 static bool hex = false;
+static int exit_code = 0;           // of the process once the port closes
 static bool timestamp = false;
 static int print_counter = 0;
 
-static void print_time(void)
+#ifndef _WIN32
+// single key input like conio's, Ctrl+C arrives as a key instead of a signal
+static int _getch(void)
 {
-    SYSTEMTIME wtm;
-    GetLocalTime(&wtm);
-    printf("[%04d-%2d-%02d %02d:%02d:%02d.%03d] ",
-           wtm.wYear,
-           wtm.wMonth,
-           wtm.wDay,
-           wtm.wHour,
-           wtm.wMinute,
-           wtm.wSecond,
-           wtm.wMilliseconds);
+    struct termios old, raw;
+    unsigned char c = 3;
+
+    if (tcgetattr(0, &old) != 0)
+        return read(0, &c, 1) == 1 ? c : 3;
+
+    raw = old;
+    raw.c_iflag &= ~ICRNL;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &raw);
+    if (read(0, &c, 1) != 1) c = 3;
+    tcsetattr(0, TCSANOW, &old);
+    return c;
 }
+#endif
 
-static void on_comm_read(uart_obj *uart, const char *buf, const int l)
+// Wall clock text of uart_time_us times: the offset between the two clocks is
+// taken once per batch, the date and time rendered once a second.
+static struct
 {
-    if (l < 1) return;
+    int64_t offset_us;
+    int64_t sec;
+    char    text[TIME_SIZE];
+    int     len;
+} wall = {0, -1, "", 0};
 
-    if (hex)
+static void wall_sync(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    wall.offset_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - uart_time_us();
+}
+
+// "[date time.ms] " of us, returns its length
+static int format_time(char *s, const int64_t us)
+{
+    const int64_t t = us + wall.offset_us;
+    if (t / 1000000 != wall.sec)
     {
-        unsigned char *s = (unsigned char *)buf;
-        for (int i = 0; i < l; i++)
+        time_t sec = (time_t)(t / 1000000);
+        struct tm wtm;
+#ifdef _WIN32
+        wtm = *localtime(&sec);
+#else
+        localtime_r(&sec, &wtm);
+#endif
+        wall.sec = t / 1000000;
+        wall.len = snprintf(wall.text, sizeof(wall.text), "[%04d-%2d-%02d %02d:%02d:%02d.",
+                            wtm.tm_year + 1900,
+                            wtm.tm_mon + 1,
+                            wtm.tm_mday,
+                            wtm.tm_hour,
+                            wtm.tm_min,
+                            wtm.tm_sec);
+    }
+
+    const int ms = (int)(t / 1000 % 1000);
+    memcpy(s, wall.text, wall.len);
+    s += wall.len;
+    s[0] = '0' + ms / 100;
+    s[1] = '0' + ms / 10 % 10;
+    s[2] = '0' + ms % 10;
+    s[3] = ']';
+    s[4] = ' ';
+    return wall.len + 5;
+}
+
+// Each print_* renders a batch into one buffer and writes it at once; a line
+// is stamped with the arrival of its first byte.
+
+static bool    new_line = true;     // text: at the start of a line
+static int64_t dump_us;             // -dump: the time of the record printed
+
+static int64_t byte_time(uart_obj *uart, const int i)
+{
+    return NULL != uart ? uart_rx_time_us(uart, i) : dump_us;
+}
+
+// HEX_LINE bytes a line
+static void print_hex(uart_obj *uart, const unsigned char *s, const int l)
+{
+    static char out[16 * 1024];
+    int o = 0;
+
+    for (int i = 0; i < l; )
+    {
+        int n = HEX_LINE - print_counter % HEX_LINE;
+        if (n > l - i) n = l - i;
+        if (o + TIME_SIZE + HEX_ENCODE_SIZE(n) + 1 > (int)sizeof(out))
         {
-            printf("%02X ", s[i]);
-            print_counter++;
-            if (print_counter % 32 == 0)
-            {
-                printf("\n");
-                if (timestamp) print_time();
-            }
+            fwrite(out, 1, o, stdout);
+            o = 0;
         }
+
+        if (timestamp && (print_counter % HEX_LINE == 0))
+            o += format_time(out + o, byte_time(uart, i));
+        o = hex_encode(out + o, s + i, n) - out;
+        i += n;
+        print_counter += n;
+        if (print_counter % HEX_LINE == 0)
+            out[o++] = '\n';
     }
-    else
+    fwrite(out, 1, o, stdout);
+}
+
+// text split at CR and LF, empty lines dropped
+static void print_lines(uart_obj *uart, const char *buf, const int l)
+{
+    static char out[16 * 1024];
+    int o = 0;
+
+    for (int i = 0; i < l; )
     {
-        static char s[20 * 1024];
-        if (timestamp)
+        if (('\r' == buf[i]) || ('\n' == buf[i]))
         {
-            static bool new_line = true;
-            int j = -1;
-            int i = 0;
-            for (i = 0; i < l; i++)
-            {
-                if (('\r' == buf[i]) || ('\n' == buf[i]))
-                {
-                    if ((j >= 0) && (i > j))
-                    {
-                        memcpy(s, buf + j, i - j);
-                        s[i - j + 0] = '\n';
-                        s[i - j + 1] = '\0';
-                        if (new_line)
-                            print_time();
-                        printf(s);
-                        new_line = true;
-                    }
-                    else;
-                    j = i + 1;
-                }
-                else
-                {
-                    if (j < 0) j = i;
-                }
-                continue;
-            }
+            if (!new_line) out[o++] = '\n';
+            new_line = true;
+            i++;
+            continue;
+        }
 
-            if ((j >= 0) && (i > j))
-            {
-                memcpy(s, buf + j, i - j);
-                s[i - j + 0] = '\0';
-                if (new_line)
-                {
-                    print_time();
-                    new_line = false;
-                }
-                printf(s);
-            }
+        // a run longer than out goes in pieces, the line carries on
+        int j = i + frame_find2(buf + i, l - i, '\r', '\n');
+        if (j - i > (int)sizeof(out) - TIME_SIZE - 1)
+            j = i + (int)sizeof(out) - TIME_SIZE - 1;
+        if (o + TIME_SIZE + (j - i) + 1 > (int)sizeof(out))
+        {
+            fwrite(out, 1, o, stdout);
+            o = 0;
         }
-        else
+
+        if (new_line)
         {
-            int t = (int)sizeof(s) - 1 < l ? sizeof(s) - 1 : l;
-            memcpy(s, buf, t);
+            o += format_time(out + o, byte_time(uart, i));
+            new_line = false;
+        }
+        memcpy(out + o, buf + i, j - i);
+        o += j - i;
+        i = j;
+    }
+    fwrite(out, 1, o, stdout);
+}
 
-            s[l] = '\0';
-            printf(s);
+static void print(uart_obj *uart, const char *buf, const int l)
+{
+    if (hex)
+        print_hex(uart, (const unsigned char *)buf, l);
+    else if (timestamp)
+        print_lines(uart, buf, l);
+    else
+    {
+        fwrite(buf, 1, l, stdout);
+        new_line = ('\r' == buf[l - 1]) || ('\n' == buf[l - 1]);
+    }
+}
+
+// ends the line being printed
+static void print_break(void)
+{
+    if (hex ? (print_counter % HEX_LINE != 0) : !new_line)
+        fwrite("\n", 1, 1, stdout);
+    print_counter = 0;
+    new_line = true;
+}
+
+static void on_comm_read(uart_obj *uart, const char *buf, const int l)
+{
+    if (l < 1) return;
+
+    if (timestamp) wall_sync();
+    print(uart, buf, l);
+}
+
+// -dump: a capture as the console shows it, with a "RX n:" or "TX n:" line
+// (n: the port id) where the direction or the port changes
+static int dump(const char *path, const double from, const double to)
+{
+    uart_capture *cap = capture_open(path, 0);
+    if (NULL == cap)
+    {
+        fprintf(stderr, "Failed to open the capture %s\n", path);
+        return -1;
+    }
+
+    const int64_t from_us = (int64_t)(from * 1e6);
+    const int64_t to_us = (int64_t)(to * 1e6);
+    uint64_t pos = capture_seek(cap, from_us, &wall.offset_us);
+    capture_rec rec;
+    const char *p;
+    int stream = -1;
+    while (capture_next(cap, &pos, &rec, &p))
+    {
+        if (rec.dir == CAPTURE_CLOCK)
+        {
+            memcpy(&wall.offset_us, p, sizeof(wall.offset_us));
+            continue;
         }
+        const int64_t t = rec.us + wall.offset_us;
+        if (t < from_us) continue;
+        if ((to_us > 0) && (t > to_us)) break;
+
+        if (stream != rec.dir * 65536 + rec.port)
+        {
+            print_break();
+            printf("%s %d:\n", rec.dir == CAPTURE_RX ? "RX" : "TX", rec.port);
+            stream = rec.dir * 65536 + rec.port;
+        }
+        dump_us = rec.us;
+        for (uint32_t i = 0; i < rec.len; i += COMM_READ_BUF_SIZE)
+            print(NULL, p + i, rec.len - i < COMM_READ_BUF_SIZE ? rec.len - i : COMM_READ_BUF_SIZE);
+    }
+    print_break();
+    capture_close(cap);
+    return 0;
+}
+
+// -modbus: a line per result, the data of a response in hex
+static void on_modbus_response(void *param, const int slave, const int status, const char *pdu, const int l)
+{
+    char out[TIME_SIZE + 64 + HEX_ENCODE_SIZE(MODBUS_MAX_PDU)];
+    int o = 0;
+    if (timestamp)
+    {
+        wall_sync();
+        o += format_time(out, uart_time_us());
     }
+    o += sprintf(out + o, "slave %d fc %d: ", slave, *(int *)param);
+    if (status == modbus_ok)
+        o = hex_encode(out + o, (const unsigned char *)pdu + 1, l - 1) - out;
+    else if (status == modbus_exception)
+        o += sprintf(out + o, "exception %d", l > 1 ? (unsigned char)pdu[1] : 0);
+    else
+        o += sprintf(out + o, status == modbus_timeout ? "timeout" : "bad response");
+    out[o++] = '\n';
+    fwrite(out, 1, o, stdout);
 }
 
+static uart_bridge   bridge;
+static bool          bridge_on = false;
+static uart_capture *capture = NULL;
+
 static void on_comm_close(uart_obj *uart, const enum_comm_close reason)
 {
     dbg_printf("COM closed: %s\n", reason == cc_shutdown ? "shutdown" : "error");
-    exit(0);
+    if (bridge_on) bridge_stop(&bridge);
+    if (NULL != capture)
+    {
+        uart_set_capture(uart, NULL, 0);
+        uart_capture_close(capture);
+    }
+    exit(exit_code);
+}
+
+// -stats: what the port counted in each interval, on stderr. Deltas of
+// snapshots, so the counters are left alone; the maxima are since the start.
+static double stats_interval = 0;
+
+#ifdef _WIN32
+static DWORD WINAPI stats_thread(void *param)
+#else
+static void *stats_thread(void *param)
+#endif
+{
+    uart_obj *uart = (uart_obj *)param;
+    uart_stats last, now;
+    uart_get_stats(uart, &last);
+
+    while (true)
+    {
+#ifdef _WIN32
+        Sleep((DWORD)(stats_interval * 1000));
+#else
+        struct timespec ts;
+        ts.tv_sec = (time_t)stats_interval;
+        ts.tv_nsec = (long)((stats_interval - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+#endif
+        uart_get_stats(uart, &now);
+#define delta(f) (unsigned long long)(now.f - last.f)
+        fprintf(stderr, "stats: rx %.0f B/s in %.0f reads/s, tx %.0f B/s in %.0f writes/s, dropped %llu, "
+                "break %llu framing %llu parity %llu overrun %llu overflow %llu, "
+                "tx queue max %llu, tx waited %.1f ms (max %.1f, throttled %.1f)\n",
+                delta(rx_bytes) / stats_interval, delta(rx_chunks) / stats_interval,
+                delta(tx_bytes) / stats_interval, delta(tx_chunks) / stats_interval, delta(tx_dropped),
+                delta(breaks), delta(framing_errors), delta(parity_errors), delta(overruns), delta(rx_overflows),
+                (unsigned long long)now.tx_high_water, delta(tx_pending_us) / 1000.0, now.tx_pending_max_us / 1000.0,
+                delta(tx_throttled_us) / 1000.0);
+#undef delta
+        last = now;
+    }
+    return 0;
+}
+
+static void stats_start(uart_obj *uart)
+{
+#ifdef _WIN32
+    HANDLE h = CreateThread(NULL, 0, stats_thread, uart, 0, NULL);
+    if (NULL != h) CloseHandle(h);
+#else
+    pthread_t t;
+    if (pthread_create(&t, NULL, stats_thread, uart) == 0)
+        pthread_detach(t);
+#endif
 }
 
 void help()
 {
     printf("UART util command line options:\n");
     printf("UART port options:\n");
-    printf("\t -port      <integer>                     (mandatory)\n");
+    printf("\t -port      <integer>                     (mandatory, or -dev)\n");
+    printf("\t -dev       <path>                        device path, e.g. COM12, /dev/ttyUSB0\n");
     printf("\t -baud      <integer>\n");
     printf("\t -databits  <integer>\n");
     printf("\t -stopbits  <integer>\n");
     printf("\t -parity    none | even | odd | mark | space\n");
+    printf("\t -flow      none | rtscts | dsrdtr | xonxoff  flow control (dsrdtr: Windows only), default: none\n");
+    printf("\t -io_profile balanced | low_latency | bulk  buffer sizes and timeouts, default: balanced\n");
+    printf("\t -io_message <integer>                   -io_profile: the usual message size in bytes\n");
+    printf("TCP bridge options:\n");
+    printf("\t -tcp_listen [addr:]port                  serve the port to TCP clients instead of the console\n");
+    printf("\t -tcp_queue  <integer>                    RX bytes queued per client, default: %d\n", BRIDGE_QUEUE_SIZE);
+    printf("\t -tcp_slow   drop | disconnect            a client whose queue is full, default: drop\n");
+    printf("\t -rfc2217                                 clients speak Telnet COM-PORT-OPTION (RFC 2217)\n");
+    printf("Capture options:\n");
+    printf("\t -capture   <path>                        record RX and TX into a capture file\n");
+    printf("\t -capture_size <integer>                  MB of records kept, default: %d\n", CAPTURE_DEFAULT_RING >> 20);
+    printf("\t -dump      <path>                        print a capture as -hex/-timestamp would, then exit\n");
+    printf("\t -from      <seconds>                     -dump: records from this Unix time on\n");
+    printf("\t -to        <seconds>                     -dump: records up to this Unix time\n");
+    printf("Load options:\n");
+    printf("\t -replay    <path>                        send the RX records of a capture (-from, -to apply)\n");
+    printf("\t -replay_tx                               send its TX records instead\n");
+    printf("\t -speed     <number>                      replay: times the recorded pace, 0: at once, default: 1\n");
+    printf("\t -gen       fixed | poisson | random      send synthetic frames\n");
+    printf("\t -rate      <number>                      gen: bytes per second, 0: at once, default: 0\n");
+    printf("\t -frame     <integer>                     gen: bytes per frame (random: at most), default: 64\n");
+    printf("\t -duration  <number>                      gen: seconds, default: 10\n");
+    printf("Modbus RTU master options:\n");
+    printf("\t -modbus    <slave,function,addr,count>   poll a slave (functions 1 to 6), repeat for more\n");
+    printf("\t -modbus_period  <ms>                     per poll, 0: back to back, default: 1000\n");
+    printf("\t -modbus_timeout <ms>                     response timeout, default: 100\n");
+    printf("\t -modbus_retries <integer>                default: 2\n");
+    printf("Expect options:\n");
+    printf("\t -expect    <text>                        wait for it in RX, repeat for more; exit with the\n"
+           "\t                                          index of the first to arrive, -1 on timeout\n");
+    printf("\t -send      <text>                        -expect: send it (and -cr) first\n");
+    printf("\t -expect_timeout <ms>                     <0: no limit, default: 10000\n");
+    printf("\t -nocase                                  -expect: letters match either case\n");
+    printf("Raw data options:\n");
+    printf("\t -pipe                                    send stdin as is, received bytes go to stdout as is\n");
+    printf("\t -send_file <path>                        send the file as is, received bytes go to stdout\n");
+    printf("\t -linger    <ms>                          then exit once RX is quiet this long, <0: never,\n"
+           "\t                                          default: 500\n");
     printf("Common options:\n");
     printf("\t -help/-?                                 show this\n");
     printf("\t -hex       use hex display\n");
     printf("\t -timestamp display time stamp for output default: OFF\n");
-    printf("\t -async_io  use win32 async IO operations default: OFF\n");
+    printf("\t -stats     <seconds> print the port's counters to stderr at this interval default: OFF\n");
+    printf("\t -async_io  use win32 async IO operations default: OFF (no effect on POSIX)\n");
     printf("\t -cr        cr | lf | crlf | lfcr         default: cr\n");
     printf("\t -input     string | char \n"
            "\n"
@@ -131,19 +410,134 @@ static uart_obj uart;
 static char     cr[3] = {'\r', '\0'};
 static bool     use_getch = false;
 
+// the line and cr in one block, no copy; one longer than the TX queue goes in parts
+static void send_line(const char *s)
+{
+    uart_iovec v[2] = {{s, (int)strlen(s)}, {cr, (int)strlen(cr)}};
+    uart_io_profile io;
+    uart_get_io_profile(&uart, &io);
+    if (v[0].l + v[1].l <= io.tx_queue)
+    {
+        uart_sendv(&uart, v, 2, -1);
+        return;
+    }
+    uart_send_timeout(&uart, v[0].p, v[0].l, -1);
+    uart_send_timeout(&uart, v[1].p, v[1].l, -1);
+}
+
+// -expect: arms the patterns, sends send and waits for the first match; the
+// port's output goes on to the console meanwhile
+static int expect_run(const char *const *patterns, const int count, const bool nocase, const char *send,
+                      const int timeout_ms)
+{
+    uart_expect *e = uart_expect_create(patterns, count, nocase ? UART_EXPECT_NOCASE : 0);
+    if (NULL == e)
+    {
+        fprintf(stderr, "bad -expect patterns\n");
+        exit_code = -1;
+        uart_shutdown(&uart);
+        return -1;
+    }
+    uart_set_expect(&uart, e);
+    if (NULL != send)
+    {
+        send_line(send);
+    }
+
+    uart_expect_match m;
+    const int r = uart_expect_wait(&uart, timeout_ms, &m);
+    if (r >= 0)
+    {
+        char t[TIME_SIZE];
+        wall_sync();
+        t[format_time(t, m.time_us)] = '\0';
+        fprintf(stderr, "\n%smatched %d: \"%s\" at offset %llu\n", t, r, patterns[r], (unsigned long long)m.offset);
+    }
+    else
+        fprintf(stderr, r == -1 ? "\ntimed out\n" : "\nport closed\n");
+    uart_set_expect(&uart, NULL);
+    uart_expect_free(e);
+    exit_code = r;
+    uart_shutdown(&uart);
+    return r;
+}
+
+// -pipe, -send_file: received bytes as they come, nothing added
+static volatile int64_t raw_rx_us;
+
+static void on_comm_read_raw(uart_obj *uart, const char *p, const int l)
+{
+    raw_rx_us = uart_time_us();
+    if (fwrite(p, 1, l, stdout) != (size_t)l)
+        dbg_printf("stdout: short write\n");
+}
+
+// after the data went out, until RX stays quiet for linger_ms
+static int raw_run(const bool from_stdin, const char *path, const int linger_ms)
+{
+    int r = from_stdin ? load_pipe(&uart) : load_send_file(&uart, path);
+    raw_rx_us = uart_time_us();
+    while ((r == 0) && ((linger_ms < 0) || (uart_time_us() - raw_rx_us < linger_ms * 1000LL)))
+    {
+#ifdef _WIN32
+        Sleep(10);
+#else
+        usleep(10000);
+#endif
+    }
+    fflush(stdout);
+    exit_code = r;
+    uart_shutdown(&uart);
+    return r;
+}
+
 void interact_direct();
 void interact_str();
 void interact_hex();
+#ifdef _WIN32
 BOOL ctrl_handler(DWORD fdwCtrlType);
+#endif
 
 int main(const int argc, const char *args[])
 {
     int port = -1;
+    char dev[256] = {'\0'};
     int baud = -1;
     char parity[20] = {'\0'};
+    int flow = flow_none;
+    int io_profile = -1;
+    int io_message = 0;
     int  databits = -1;
     int  stopbits = -1;
     bool async_io = false;
+    char tcp_listen[256] = {'\0'};
+    int  tcp_queue = BRIDGE_QUEUE_SIZE;
+    enum_slow_client tcp_slow = slow_drop;
+    bool rfc2217 = false;
+    char capture_path[256] = {'\0'};
+    int  capture_size = CAPTURE_DEFAULT_RING >> 20;
+    char dump_path[256] = {'\0'};
+    double from = 0, to = 0;
+    char replay[256] = {'\0'};
+    bool replay_tx = false;
+    double speed = 1;
+    int  gen = -1;
+    double rate = 0;
+    int  frame = 64;
+    double duration = 10;
+    static int modbus_polls[MODBUS_POLLS][4];
+    int  modbus_count = 0;
+    int  modbus_period = 1000;
+    int  modbus_timeout = 100;
+    int  modbus_retries = 2;
+    static const char *expect[EXPECT_PATTERNS];
+    int  expect_count = 0;
+    const char *send = NULL;
+    int  expect_timeout = 10000;
+    bool nocase = false;
+    bool pipe = false;
+    char send_file[256] = {'\0'};
+    int  linger = 500;
 
 #define check_param_arg() do { if (i >= argc - 1) { fprintf(stderr, "arg missing for: %s\n", args[i]); help(); return -1; } } while (0)
 
@@ -151,6 +545,10 @@ int main(const int argc, const char *args[])
     if (strcmp(args[i], "-"#param) == 0)   \
     {   check_param_arg(); param = atoi(args[i + 1]); i += 2; }
 
+#define load_f_param(param) \
+    if (strcmp(args[i], "-"#param) == 0)   \
+    {   check_param_arg(); param = atof(args[i + 1]); i += 2; }
+
 #define load_b_param(param) \
     if (strcmp(args[i], "-"#param) == 0)   \
     {   param = true; i++; }
@@ -166,11 +564,35 @@ int main(const int argc, const char *args[])
     {
         load_i_param(port)
         else load_i_param(baud)
+        else load_i_param(tcp_queue)
+        else load_i_param(capture_size)
+        else load_i_param(frame)
+        else load_i_param(modbus_period)
+        else load_i_param(modbus_timeout)
+        else load_i_param(modbus_retries)
+        else load_i_param(expect_timeout)
+        else load_i_param(linger)
+        else load_i_param(io_message)
+        else load_f_param(from)
+        else load_f_param(to)
+        else load_f_param(speed)
+        else load_f_param(rate)
+        else load_f_param(duration)
+        else if (strcmp(args[i], "-stats") == 0)
+        {
+            check_param_arg();
+            stats_interval = atof(args[i + 1]);
+            i += 2;
+        }
         else load_i_param(databits)
         else load_i_param(stopbits)
         else load_b_param(hex)
         else load_b_param(async_io)
         else load_b_param(timestamp)
+        else load_b_param(rfc2217)
+        else load_b_param(replay_tx)
+        else load_b_param(nocase)
+        else load_b_param(pipe)
         else if ((strcmp(args[i], "-?") == 0) || (strcmp(args[i], "-help") == 0))
         {
             help();
@@ -198,6 +620,125 @@ int main(const int argc, const char *args[])
             strncpy(parity, args[i + 1], 19);
             i += 2;
         }
+        else if (strcmp(args[i], "-io_profile") == 0)
+        {
+            check_param_arg();
+            if (strcmp(args[i + 1], "balanced") == 0) io_profile = io_balanced;
+            else if (strcmp(args[i + 1], "low_latency") == 0) io_profile = io_low_latency;
+            else if (strcmp(args[i + 1], "bulk") == 0) io_profile = io_bulk;
+            else
+            {
+                fprintf(stderr, "unknown -io_profile: %s\n", args[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(args[i], "-flow") == 0)
+        {
+            check_param_arg();
+            if (strcmp(args[i + 1], "none") == 0) flow = flow_none;
+            else if (strcmp(args[i + 1], "rtscts") == 0) flow = flow_rtscts;
+            else if (strcmp(args[i + 1], "dsrdtr") == 0) flow = flow_dsrdtr;
+            else if (strcmp(args[i + 1], "xonxoff") == 0) flow = flow_xonxoff;
+            else
+            {
+                fprintf(stderr, "unknown -flow: %s\n", args[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(args[i], "-tcp_listen") == 0)
+        {
+            check_param_arg();
+            strncpy(tcp_listen, args[i + 1], sizeof(tcp_listen) - 1);
+            i += 2;
+        }
+        else if (strcmp(args[i], "-tcp_slow") == 0)
+        {
+            check_param_arg();
+            if (strcmp(args[i + 1], "drop") == 0) tcp_slow = slow_drop;
+            else if (strcmp(args[i + 1], "disconnect") == 0) tcp_slow = slow_disconnect;
+            else
+            {
+                fprintf(stderr, "unknown -tcp_slow: %s\n", args[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(args[i], "-dev") == 0)
+        {
+            check_param_arg();
+            strncpy(dev, args[i + 1], sizeof(dev) - 1);
+            i += 2;
+        }
+        else if (strcmp(args[i], "-capture") == 0)
+        {
+            check_param_arg();
+            strncpy(capture_path, args[i + 1], sizeof(capture_path) - 1);
+            i += 2;
+        }
+        else if (strcmp(args[i], "-dump") == 0)
+        {
+            check_param_arg();
+            strncpy(dump_path, args[i + 1], sizeof(dump_path) - 1);
+            i += 2;
+        }
+        else if (strcmp(args[i], "-replay") == 0)
+        {
+            check_param_arg();
+            strncpy(replay, args[i + 1], sizeof(replay) - 1);
+            i += 2;
+        }
+        else if (strcmp(args[i], "-gen") == 0)
+        {
+            check_param_arg();
+            if (strcmp(args[i + 1], "fixed") == 0) gen = gen_fixed;
+            else if (strcmp(args[i + 1], "poisson") == 0) gen = gen_poisson;
+            else if (strcmp(args[i + 1], "random") == 0) gen = gen_random;
+            else
+            {
+                fprintf(stderr, "unknown -gen: %s\n", args[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if (strcmp(args[i], "-modbus") == 0)
+        {
+            check_param_arg();
+            int *q = modbus_polls[modbus_count];
+            if ((modbus_count == MODBUS_POLLS)
+                || (sscanf(args[i + 1], "%d,%d,%d,%d", q, q + 1, q + 2, q + 3) != 4)
+                || (q[1] < 1) || (q[1] > 6))
+            {
+                fprintf(stderr, "bad -modbus: %s\n", args[i + 1]);
+                return -1;
+            }
+            modbus_count++;
+            i += 2;
+        }
+        else if (strcmp(args[i], "-expect") == 0)
+        {
+            check_param_arg();
+            if (expect_count == EXPECT_PATTERNS)
+            {
+                fprintf(stderr, "more than %d -expect\n", EXPECT_PATTERNS);
+                return -1;
+            }
+            expect[expect_count++] = args[i + 1];
+            i += 2;
+        }
+        else if (strcmp(args[i], "-send_file") == 0)
+        {
+            check_param_arg();
+            strncpy(send_file, args[i + 1], sizeof(send_file) - 1);
+            i += 2;
+        }
+        else if (strcmp(args[i], "-send") == 0)
+        {
+            check_param_arg();
+            send = args[i + 1];
+            i += 2;
+        }
         else
         {
             fprintf(stderr, "unknown option: %s\n", args[i]);
@@ -207,35 +748,223 @@ int main(const int argc, const char *args[])
 
     if (hex) use_getch = false;
 
-    if (port < 0)
+    if (dump_path[0] != '\0')
+        return dump(dump_path, from, to);
+
+    if (rfc2217 && (tcp_listen[0] == '\0'))
+    {
+        fprintf(stderr, "-rfc2217 needs -tcp_listen\n");
+        return -1;
+    }
+
+    if ((replay[0] != '\0') || (gen >= 0))
+    {
+        if ((tcp_listen[0] != '\0') || ((replay[0] != '\0') && (gen >= 0)))
+        {
+            fprintf(stderr, "-replay, -gen and -tcp_listen exclude each other\n");
+            return -1;
+        }
+        if ((frame < 1) || (speed < 0) || (rate < 0))
+        {
+            fprintf(stderr, "bad -frame, -speed or -rate\n");
+            return -1;
+        }
+    }
+
+    if ((modbus_count > 0) && ((tcp_listen[0] != '\0') || (replay[0] != '\0') || (gen >= 0)))
+    {
+        fprintf(stderr, "-modbus excludes -tcp_listen, -replay and -gen\n");
+        return -1;
+    }
+
+    if ((expect_count > 0)
+        && ((tcp_listen[0] != '\0') || (replay[0] != '\0') || (gen >= 0) || (modbus_count > 0)))
+    {
+        fprintf(stderr, "-expect excludes -tcp_listen, -replay, -gen and -modbus\n");
+        return -1;
+    }
+    const bool raw = pipe || (send_file[0] != '\0');
+    if (raw && ((pipe && (send_file[0] != '\0')) || (expect_count > 0) || (tcp_listen[0] != '\0')
+                || (replay[0] != '\0') || (gen >= 0) || (modbus_count > 0)))
+    {
+        fprintf(stderr, "-pipe and -send_file exclude each other and the other modes\n");
+        return -1;
+    }
+    if ((NULL != send) && (expect_count == 0))
+    {
+        fprintf(stderr, "-send needs -expect\n");
+        return -1;
+    }
+
+    if ((port < 0) && (dev[0] == '\0'))
     {
         fprintf(stderr, "Port unspecified\n");
         return -1;
     }
 
-    if (uart_open(&uart,
-                  port,
+    if (dev[0] == '\0')
+#ifdef _WIN32
+        sprintf(dev, "COM%d", port);
+#else
+        sprintf(dev, "/dev/ttyS%d", port);
+
+    // console output is unbuffered on Windows, do the same here
+    setvbuf(stdout, NULL, _IONBF, 0);
+#endif
+
+    if (capture_path[0] != '\0')
+    {
+        capture = uart_capture_open(capture_path, (int64_t)capture_size << 20);
+        if (NULL == capture)
+        {
+            fprintf(stderr, "Failed to open the capture %s\n", capture_path);
+            return -1;
+        }
+    }
+
+    if (tcp_listen[0] != '\0')
+    {
+        if (!bridge_open(&bridge, tcp_listen, tcp_queue, tcp_slow, rfc2217))
+            return -1;
+        bridge_on = true;
+    }
+
+    static modbus_master master;
+    modbus_bus *bus = NULL;
+    if (modbus_count > 0)
+    {
+        modbus_init(&master);
+        bus = modbus_add_bus(&master, baud, modbus_timeout);
+        for (int k = 0; k < modbus_count; k++)
+        {
+            char pdu[MODBUS_MAX_PDU];
+            const int *q = modbus_polls[k];
+            modbus_add_poll(bus, q[0], pdu, modbus_pdu(pdu, q[1], q[2], q[3]), modbus_period, modbus_retries,
+                            on_modbus_response, (void *)(q + 1));
+        }
+    }
+
+    f_on_comm_read read_cb = f_on_comm_read(on_comm_read);
+    void *read_param = &uart;
+    if (bridge_on)
+    {
+        read_cb = f_on_comm_read(bridge_on_comm_read);
+        read_param = &bridge;
+    }
+    else if (NULL != bus)
+    {
+        read_cb = f_on_comm_read(modbus_on_comm_read);
+        read_param = bus;
+    }
+    else if (raw)
+    {
+        read_cb = f_on_comm_read(on_comm_read_raw);
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+
+    if (uart_open_dev(&uart,
+                  dev,
                   baud,
                   parity,
                   databits,
                   stopbits,
-                  f_on_comm_read(on_comm_read),
-                  &uart,
+                  read_cb,
+                  read_param,
                   f_on_comm_close(on_comm_close),
                   &uart,
                   async_io) == NULL)
     {
-        fprintf(stderr, "Failed to open the specified port COM%d\n", port);
+        fprintf(stderr, "Failed to open the specified port %s\n", dev);
         return -1;
     }
+
+    if ((flow != flow_none) && (uart_set_flow(&uart, flow) != 0))
+    {
+        fprintf(stderr, "Failed to set flow control on %s\n", dev);
+        exit_code = -1;
+        uart_shutdown(&uart);
+        return -1;
+    }
+
+    if (io_profile >= 0)
+    {
+        uart_io_profile io;
+        const char *p;
+        int b, d, st;
+        uart_get_config(&uart, &b, &p, &d, &st);
+        uart_io_preset(&io, io_profile, b, io_message);
+        uart_set_io_profile(&uart, &io);
+    }
+
+    if (NULL != capture)
+        uart_set_capture(&uart, capture, 0);
+
+    if (stats_interval > 0)
+        stats_start(&uart);
+
+    if (NULL != bus)
+    {
+#ifdef _WIN32
+        if (!SetConsoleCtrlHandler((PHANDLER_ROUTINE)ctrl_handler, TRUE))
+            fprintf(stderr, "WARNING: SetConsoleCtrlHandler failed.\n");
+#endif
+        fprintf(stderr, "Port %s is opened, polling %d Modbus slave%s. Use Ctrl+C to exit.\n",
+                dev, modbus_count, modbus_count > 1 ? "s" : "");
+        modbus_start_bus(bus, &uart);
+        modbus_run(&master, 0);
+        return 0;
+    }
+
+    if (raw)
+        return raw_run(pipe, send_file, linger);
+
+    if (expect_count > 0)
+        return expect_run(expect, expect_count, nocase, send, expect_timeout);
+
+    if ((replay[0] != '\0') || (gen >= 0))
+    {
+        fprintf(stderr, "Port %s is opened, sending...\n", dev);
+        if (replay[0] != '\0')
+            load_replay(&uart, replay, replay_tx ? CAPTURE_TX : CAPTURE_RX, from, to, speed);
+        else
+            load_generate(&uart, (enum_gen_pattern)gen, rate, frame, duration);
+        uart_shutdown(&uart);
+        return 0;
+    }
+
+    if (bridge_on)
+    {
+        if (!bridge_start(&bridge, &uart))
+        {
+            fprintf(stderr, "Failed to start the TCP bridge\n");
+            uart_shutdown(&uart);
+            return -1;
+        }
+        fprintf(stderr, "Port %s is served on %s.\n", dev, tcp_listen);
+    }
     else
     {
-        fprintf(stderr, "Port COM%d is opened. Input mode: %s\n", port, use_getch ? "CHAR" : "STRING");
+        fprintf(stderr, "Port %s is opened. Input mode: %s\n", dev, use_getch ? "CHAR" : "STRING");
         fprintf(stderr, "Use Ctrl+C to close port and exit.\n");
     }
 
+#ifdef _WIN32
     if (!SetConsoleCtrlHandler((PHANDLER_ROUTINE)ctrl_handler, TRUE))
         fprintf(stderr, "WARNING: SetConsoleCtrlHandler failed.\n");
+#endif
+
+    // the bridge runs on the port's thread, the process exits when the port closes
+    if (bridge_on)
+    {
+        while (true)
+#ifdef _WIN32
+            Sleep(INFINITE);
+#else
+            pause();
+#endif
+    }
 
     if (use_getch)
         interact_direct();
@@ -246,78 +975,50 @@ int main(const int argc, const char *args[])
     return 0;
 }
 
+static bool read_line(char *s, const int size)
+{
+    if (fgets(s, size, stdin) == NULL)
+        return false;
+    s[strcspn(s, "\r\n")] = '\0';
+    return true;
+}
+
 void interact_str()
 {
     char s[10240 + 1];
     while (true)
     {
         s[0] = '\0';
-        gets(s);
-        if (strlen(s) >= sizeof(s) - 1)
+        if (!read_line(s, sizeof(s)) || (strlen(s) >= sizeof(s) - 1))
         {
             uart_shutdown(&uart);
             break;
         }
 
-        strcat(s, cr);
-        uart_send(&uart, s, strlen(s));
-    }
-}
-
-int parsestr(char *s)
-{
-    int r = 0;
-    while (*s != '\0')
-    {
-        char c = *s++;
-        r *= 16;
-        if (('0' <= c) && (c <= '9')) r += c - '0';
-        else if (('A' <= c) && (c <= 'F')) r += c - 'A';
-        else if (('a' <= c) && (c <= 'a')) r += c - 'a';
-    }
-    return r;
-}
-
-int hexstr(char *s, char *b, int max)
-{
-    char *p = s;
-    int i = 0;
-
-    // parse hex input
-    while (*p != '\0')
-    {
-        char *start = p;
-        if (*p == ' ')
-        {
-            p++;
-            continue;
-        }
-
-        while ((*p != '\0') && (*p != ' ')) p++;
-        if (*p == ' ') *p = '\0';
-        b[i++] = parsestr(start);
-        if (i > max) break;
-        p++;
+        send_line(s);
     }
-    return i;
 }
 
 void interact_hex()
 {
     static char s[10240 + 1];
-    static char d[10240];
+    static unsigned char d[10240 / 2];
     while (true)
     {
         s[0] = '\0';
-        gets(s);
-        if (strlen(s) >= sizeof(s) - 1)
+        if (!read_line(s, sizeof(s)) || (strlen(s) >= sizeof(s) - 1))
         {
             uart_shutdown(&uart);
             break;
         }
         print_counter = 0;
-        int count = hexstr(s, d, sizeof(d) - 1);
-        uart_send(&uart, d, count);
+        int count = hex_decode(s, strlen(s), d, sizeof(d));
+        if (count < 0)
+        {
+            printf("not hex: %s\n", s);
+            continue;
+        }
+        uart_send_timeout(&uart, (char *)d, count, -1);
     }
 }
 
@@ -344,6 +1045,7 @@ void interact_direct()
     }
 }
 
+#ifdef _WIN32
 BOOL ctrl_handler(DWORD fdwCtrlType)
 {
     switch (fdwCtrlType)
@@ -366,4 +1068,4 @@ BOOL ctrl_handler(DWORD fdwCtrlType)
             return FALSE;
     }
 }
-
+#endif
@@ -0,0 +1,401 @@
+// Modbus RTU master of the uart util, see uart_modbus.h
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#include "uart_modbus.h"
+
+#define dbg_printf(...) //printf
+
+// RTU characters are 11 bits: start, 8 data, parity (or a second stop), stop
+#define MODBUS_CHAR_BITS    11
+// above 19200 baud the spec fixes t3.5 at 1750 us
+#define MODBUS_T35_MIN_US   1750
+
+typedef enum
+{
+    bus_idle,
+    bus_waiting
+} enum_bus_state;
+
+static void master_lock(modbus_master *m)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&m->lock);
+#else
+    pthread_mutex_lock(&m->lock);
+#endif
+}
+
+static void master_unlock(modbus_master *m)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&m->lock);
+#else
+    pthread_mutex_unlock(&m->lock);
+#endif
+}
+
+static void master_kick(modbus_master *m)
+{
+    m->kicked = true;
+#ifdef _WIN32
+    WakeConditionVariable(&m->wake);
+#else
+    pthread_cond_signal(&m->wake);
+#endif
+}
+
+// with the lock held, until due on the uart_time_us clock or a kick
+static void master_wait(modbus_master *m, const int64_t due)
+{
+    if (m->kicked) return;
+#ifdef _WIN32
+    int64_t left = due - uart_time_us();
+    if (left > 0)
+        SleepConditionVariableSRW(&m->wake, &m->lock, (DWORD)((left + 999) / 1000), 0);
+#else
+    struct timespec ts;
+    ts.tv_sec = due / 1000000;
+    ts.tv_nsec = (due % 1000000) * 1000;
+    pthread_cond_timedwait(&m->wake, &m->lock, &ts);
+#endif
+}
+
+void modbus_init(modbus_master *master)
+{
+    memset(master, 0, sizeof(*master));
+#ifdef _WIN32
+    InitializeSRWLock(&master->lock);
+    InitializeConditionVariable(&master->wake);
+#else
+    pthread_mutex_init(&master->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&master->wake, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+void modbus_close(modbus_master *master)
+{
+    for (int i = 0; i < master->bus_count; i++)
+        free(master->buses[i].polls);
+    master->bus_count = 0;
+#ifndef _WIN32
+    pthread_cond_destroy(&master->wake);
+    pthread_mutex_destroy(&master->lock);
+#endif
+}
+
+modbus_bus *modbus_add_bus(modbus_master *master, const int baud, const int timeout_ms)
+{
+    if (master->bus_count >= MODBUS_MAX_BUSES)
+        return NULL;
+
+    modbus_bus *bus = master->buses + master->bus_count++;
+    bus->master = master;
+    bus->char_us = (int64_t)MODBUS_CHAR_BITS * 1000000 / (baud > 0 ? baud : UART_DEFAULT_BAUD);
+    bus->t35_us = baud > 19200 ? MODBUS_T35_MIN_US : bus->char_us * 7 / 2;
+    bus->timeout_us = (int64_t)timeout_ms * 1000;
+    bus->state = bus_idle;
+    return bus;
+}
+
+void modbus_start_bus(modbus_bus *bus, uart_obj *uart)
+{
+    master_lock(bus->master);
+    bus->uart = uart;
+    bus->gap_until_us = uart_time_us() + bus->t35_us;
+    master_kick(bus->master);
+    master_unlock(bus->master);
+}
+
+bool modbus_add_poll(modbus_bus *bus, const int slave, const char *pdu, const int l,
+                     const int period_ms, const int retries,
+                     f_modbus_response on_response, void *param)
+{
+    if ((l < 1) || (l > MODBUS_MAX_PDU) || (slave < 0) || (slave > 247))
+        return false;
+
+    if (bus->poll_count == bus->poll_size)
+    {
+        const int size = bus->poll_size > 0 ? 2 * bus->poll_size : 16;
+        modbus_poll *polls = (modbus_poll *)realloc(bus->polls, size * sizeof(modbus_poll));
+        if (NULL == polls) return false;
+        bus->polls = polls;
+        bus->poll_size = size;
+    }
+
+    modbus_poll *p = bus->polls + bus->poll_count++;
+    memset(p, 0, sizeof(*p));
+    p->slave = slave;
+    memcpy(p->pdu, pdu, l);
+    p->pdu_len = l;
+    p->period_us = (int64_t)period_ms * 1000;
+    p->retries = retries;
+    p->on_response = on_response;
+    p->param = param;
+    return true;
+}
+
+int modbus_pdu(char *pdu, const int function, const int addr, const int count)
+{
+    pdu[0] = (char)function;
+    pdu[1] = (char)(addr >> 8);
+    pdu[2] = (char)addr;
+    pdu[3] = (char)(count >> 8);
+    pdu[4] = (char)count;
+    return 5;
+}
+
+// Bytes of the response ADU (CRC included) that starts with a of l bytes:
+// 0: more bytes are needed to tell, -1: the function's responses have no
+// length known up front
+static int response_len(const unsigned char *a, const int l)
+{
+    if (l < 2) return 0;
+    if (a[1] & 0x80) return 5;
+    switch (a[1])
+    {
+    case 0x01:
+    case 0x02:
+    case 0x03:
+    case 0x04:
+    case 0x0c:
+    case 0x11:
+    case 0x14:
+    case 0x15:
+    case 0x17:
+        return l < 3 ? 0 : 5 + a[2];
+    case 0x05:
+    case 0x06:
+    case 0x08:
+    case 0x0b:
+    case 0x0f:
+    case 0x10:
+        return 8;
+    case 0x07:
+        return 5;
+    case 0x16:
+        return 10;
+    case 0x18:
+        return l < 4 ? 0 : 6 + ((a[2] << 8) | a[3]);
+    default:
+        return -1;
+    }
+}
+
+void modbus_on_comm_read(modbus_bus *bus, const char *buf, const int l)
+{
+    modbus_master *m = bus->master;
+    master_lock(m);
+    if ((bus->state != bus_waiting) || bus->rx_done || (bus->cur->slave == 0))
+    {
+        bus->stats.stray_bytes += l;
+        master_unlock(m);
+        return;
+    }
+
+    // a frame follows t3.5 of silence, what came before it was another one
+    if ((bus->rx_len > 0) && (uart_rx_time_us(bus->uart, 0) - bus->rx_last_us > bus->t35_us))
+    {
+        bus->stats.stray_bytes += bus->rx_len;
+        bus->rx_len = 0;
+    }
+    const int n = l < MODBUS_MAX_ADU - bus->rx_len ? l : MODBUS_MAX_ADU - bus->rx_len;
+    memcpy(bus->rx + bus->rx_len, buf, n);
+    bus->rx_len += n;
+    bus->rx_last_us = uart_rx_time_us(bus->uart, l - 1);
+
+    const int want = response_len((const unsigned char *)bus->rx, bus->rx_len);
+    if (((want > 0) && (bus->rx_len >= want)) || (bus->rx_len == MODBUS_MAX_ADU))
+        bus->rx_done = true;
+    // an unknown length ends by silence, timed by modbus_run
+    if (bus->rx_done || (want < 0))
+        master_kick(m);
+    master_unlock(m);
+}
+
+static void bus_send(modbus_bus *bus, const int64_t now)
+{
+    modbus_poll *p = bus->cur;
+    bus->tx[0] = (char)p->slave;
+    memcpy(bus->tx + 1, p->pdu, p->pdu_len);
+    bus->tx_len = p->pdu_len + 1;
+    bus->tx_len += crc_put(crc_modbus, crc_update(crc_modbus, crc_init(crc_modbus), bus->tx, bus->tx_len),
+                           bus->tx + bus->tx_len);
+
+    bus->rx_len = 0;
+    bus->rx_done = false;
+    bus->state = bus_waiting;
+    bus->sent_us = now;
+    // the request leaves the ring at once, the bus is ours
+    bus->deadline_us = now + bus->tx_len * bus->char_us + (p->slave == 0 ? MODBUS_BROADCAST_US : bus->timeout_us);
+    bus->stats.requests++;
+    if (uart_send(bus->uart, bus->tx, bus->tx_len) < bus->tx_len)
+        dbg_printf("modbus: request not queued\n");
+}
+
+// the poll is done with: the result to its callback, outside the lock
+static void bus_finish(modbus_master *m, modbus_bus *bus, const int status, const char *pdu, const int l,
+                       const int64_t now)
+{
+    modbus_poll *p = bus->cur;
+    bus->cur = NULL;
+    bus->attempt = 0;
+    bus->state = bus_idle;
+    if (p->period_us > 0)
+        p->due_us = p->due_us + p->period_us > now ? p->due_us + p->period_us : now;
+    else
+        p->due_us = now;
+
+    if ((status == modbus_ok) || (status == modbus_exception))
+    {
+        const int64_t latency = now - bus->sent_us;
+        bus->stats.latency_sum_us += latency;
+        if (latency > bus->stats.latency_max_us) bus->stats.latency_max_us = latency;
+    }
+    if (status == modbus_ok) bus->stats.ok++;
+    else if (status == modbus_exception) bus->stats.exceptions++;
+    else if (status == modbus_timeout) bus->stats.timeouts++;
+    else bus->stats.bad_responses++;
+
+    if (NULL != p->on_response)
+    {
+        // rx stays as it is: only this thread sends the request that refills it
+        master_unlock(m);
+        p->on_response(p->param, p->slave, status, pdu, l);
+        master_lock(m);
+    }
+}
+
+// again if retries are left, otherwise done with status
+static void bus_retry(modbus_master *m, modbus_bus *bus, const int status, const int64_t now)
+{
+    if (bus->attempt < bus->cur->retries)
+    {
+        bus->attempt++;
+        bus->stats.retries++;
+        bus->state = bus_idle;
+        return;
+    }
+    bus_finish(m, bus, status, NULL, 0, now);
+}
+
+static void bus_response(modbus_master *m, modbus_bus *bus, const int64_t now)
+{
+    const int want = response_len((const unsigned char *)bus->rx, bus->rx_len);
+    const int l = want > 0 ? want : bus->rx_len;
+    const unsigned char *a = (const unsigned char *)bus->rx;
+    bus->gap_until_us = bus->rx_last_us + bus->t35_us;
+    bus->stats.stray_bytes += bus->rx_len - l;
+
+    if ((l < 5) || (l > bus->rx_len) || (a[0] != bus->cur->slave)
+        || ((a[1] & 0x7f) != (unsigned char)bus->cur->pdu[0]) || !crc_check(crc_modbus, bus->rx, l))
+    {
+        bus->stats.crc_errors++;
+        bus_retry(m, bus, modbus_bad_response, now);
+        return;
+    }
+    bus_finish(m, bus, a[1] & 0x80 ? modbus_exception : modbus_ok, bus->rx + 1, l - 3, now);
+}
+
+// the next poll of the bus, the retried one first
+static modbus_poll *bus_next(modbus_bus *bus)
+{
+    if (NULL != bus->cur) return bus->cur;
+    modbus_poll *next = NULL;
+    for (int i = 0; i < bus->poll_count; i++)
+        if ((NULL == next) || (bus->polls[i].due_us < next->due_us))
+            next = bus->polls + i;
+    return next;
+}
+
+// Moves the bus on at now, with the lock held (a callback may release it);
+// returns when it needs a look again.
+static int64_t bus_step(modbus_master *m, modbus_bus *bus, int64_t now)
+{
+    if (NULL == bus->uart)
+        return INT64_MAX;
+
+    if (bus->state == bus_waiting)
+    {
+        const int want = response_len((const unsigned char *)bus->rx, bus->rx_len);
+        const int64_t quiet = bus->rx_last_us + bus->t35_us;
+        if (bus->rx_done || ((want < 0) && (bus->rx_len > 0) && (now >= quiet)))
+            bus_response(m, bus, now);
+        else if (now >= bus->deadline_us)
+        {
+            if (bus->cur->slave == 0)
+            {
+                bus->gap_until_us = now;
+                bus_finish(m, bus, modbus_ok, NULL, 0, now);
+            }
+            else if (bus->rx_len > 0)
+            {
+                // a response that never completed, it may still be trickling in
+                bus->stats.crc_errors++;
+                bus->gap_until_us = (quiet > now ? quiet : now);
+                bus_retry(m, bus, modbus_bad_response, now);
+            }
+            else
+            {
+                bus->gap_until_us = now;
+                bus_retry(m, bus, modbus_timeout, now);
+            }
+        }
+        else
+            return (want < 0) && (bus->rx_len > 0) && (quiet < bus->deadline_us) ? quiet : bus->deadline_us;
+
+        // a callback ran without the lock
+        now = uart_time_us();
+    }
+
+    if (now < bus->gap_until_us)
+        return bus->gap_until_us;
+    modbus_poll *p = bus_next(bus);
+    if (NULL == p)
+        return INT64_MAX;
+    if (p->due_us > now)
+        return p->due_us;
+    bus->cur = p;
+    bus_send(bus, now);
+    return bus->deadline_us;
+}
+
+void modbus_run(modbus_master *master, const double seconds)
+{
+    const int64_t end = seconds > 0 ? uart_time_us() + (int64_t)(seconds * 1e6) : INT64_MAX;
+    master_lock(master);
+    master->stop = false;
+    while (!master->stop)
+    {
+        master->kicked = false;
+        int64_t now = uart_time_us();
+        if (now >= end) break;
+
+        int64_t next = end;
+        for (int i = 0; i < master->bus_count; i++)
+        {
+            int64_t t = bus_step(master, master->buses + i, now);
+            if (t < next) next = t;
+            now = uart_time_us();
+        }
+        master_wait(master, next);
+    }
+    master_unlock(master);
+}
+
+void modbus_stop(modbus_master *master)
+{
+    master_lock(master);
+    master->stop = true;
+    master_kick(master);
+    master_unlock(master);
+}
@@ -0,0 +1,138 @@
+#ifndef _uart_modbus_h
+#define _uart_modbus_h
+
+// Modbus RTU master of the uart util: polls the slaves of several buses, one
+// port each, from the thread in modbus_run, keeping every bus busy.
+//
+// Bytes reach the master through modbus_on_comm_read on the port's I/O
+// thread. A response is complete as soon as the bytes its function code calls
+// for are in; only a response of unknown length waits for the line to stay
+// quiet for t3.5, timed from the arrival of its last byte (uart_rx_time_us).
+// Bytes that follow a silence of t3.5 start a frame of their own, so a late
+// response to an earlier request does not corrupt the current one. The next
+// request goes out t3.5 after the last byte of the previous response.
+//
+// A response is checked by CRC, slave and function. A request that times out
+// or gets a bad response is sent again, up to the retries of its poll.
+//
+// Each bus cycles through its polls: one with a period is due once per period,
+// the others back to back, the one waiting longest first. The results are
+// handed to the polls' callbacks on the modbus_run thread.
+
+#include "uart.h"
+
+#define MODBUS_MAX_ADU          256
+#define MODBUS_MAX_PDU          (MODBUS_MAX_ADU - 3)
+#define MODBUS_MAX_BUSES        32
+#define MODBUS_BROADCAST_US     100000  // after a broadcast, for the slaves to act on it
+
+typedef enum
+{
+    modbus_ok,
+    modbus_exception,       // pdu: the function code | 0x80 and the exception code
+    modbus_timeout,         // no response, pdu empty
+    modbus_bad_response     // failed the checks each time
+} enum_modbus_status;
+
+// pdu: of the response (function code and data), valid during the call
+typedef void (*f_modbus_response)(void *param, const int slave, const int status, const char *pdu, const int l);
+
+typedef struct
+{
+    int         slave;                  // 0: broadcast, no response
+    char        pdu[MODBUS_MAX_PDU];    // function code and data
+    int         pdu_len;
+    int64_t     period_us;              // 0: back to back
+    int         retries;
+    f_modbus_response on_response;
+    void       *param;
+    int64_t     due_us;
+} modbus_poll;
+
+typedef struct
+{
+    uint64_t    requests;           // sent, retries included
+    uint64_t    ok;
+    uint64_t    exceptions;
+    uint64_t    timeouts;           // polls without a response after their retries
+    uint64_t    bad_responses;      // polls whose responses all failed the checks
+    uint64_t    retries;
+    uint64_t    crc_errors;         // responses failing the CRC, slave or function check
+    uint64_t    stray_bytes;        // received with no request waiting for them
+    int64_t     latency_sum_us;     // request sent to response complete, of ok and exceptions
+    int64_t     latency_max_us;
+} modbus_stats;
+
+typedef struct _modbus_master modbus_master;
+
+typedef struct
+{
+    modbus_master  *master;
+    uart_obj       *uart;           // NULL until modbus_start_bus
+    int64_t         char_us;        // one 11 bit character at the baud rate
+    int64_t         t35_us;         // the silence between frames
+    int64_t         timeout_us;
+    modbus_poll    *polls;
+    int             poll_count;
+    int             poll_size;
+
+    int             state;
+    modbus_poll    *cur;            // the poll sent, or to be sent again
+    int             attempt;
+    char            tx[MODBUS_MAX_ADU];
+    int             tx_len;
+    int64_t         sent_us;
+    int64_t         deadline_us;
+    int64_t         gap_until_us;   // t3.5 after the last byte on the line
+    char            rx[MODBUS_MAX_ADU];
+    int             rx_len;
+    int64_t         rx_last_us;     // arrival of rx[rx_len - 1]
+    bool            rx_done;        // rx holds the whole response
+    modbus_stats    stats;
+} modbus_bus;
+
+struct _modbus_master
+{
+#ifdef _WIN32
+    SRWLOCK             lock;
+    CONDITION_VARIABLE  wake;
+#else
+    pthread_mutex_t     lock;
+    pthread_cond_t      wake;
+#endif
+    volatile bool       stop;
+    bool                kicked;     // a bus changed while modbus_run was not waiting
+    modbus_bus          buses[MODBUS_MAX_BUSES];
+    int                 bus_count;
+};
+
+void modbus_init(modbus_master *master);
+
+void modbus_close(modbus_master *master);
+
+// A bus to open a port for, with modbus_on_comm_read and the bus as its
+// parameter. timeout_ms: how long a slave may take to respond. NULL: no room.
+modbus_bus *modbus_add_bus(modbus_master *master, const int baud, const int timeout_ms);
+
+// once its port is open
+void modbus_start_bus(modbus_bus *bus, uart_obj *uart);
+
+// Before modbus_run. The pdu is the function code and its data, see
+// modbus_pdu. false: too long, or no memory.
+bool modbus_add_poll(modbus_bus *bus, const int slave, const char *pdu, const int l,
+                     const int period_ms, const int retries,
+                     f_modbus_response on_response, void *param);
+
+// the PDU of functions 1 to 6: the function code, then two 16 bit fields
+// (address and count, or address and value); returns its length, 5
+int modbus_pdu(char *pdu, const int function, const int addr, const int count);
+
+// Polls until seconds pass (<= 0: until modbus_stop).
+void modbus_run(modbus_master *master, const double seconds);
+
+// any thread
+void modbus_stop(modbus_master *master);
+
+void modbus_on_comm_read(modbus_bus *bus, const char *buf, const int l);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef _uart_packet_h
+#define _uart_packet_h
+
+// Erlang port framing, {packet, 2} or {packet, 4}: a big endian length, then
+// the packet, which here starts with a command byte. Shared by uart_port and
+// uart_bench.
+//
+// A packet goes out in one gathered write: header and payload are not copied
+// together first, and a packet up to PIPE_BUF bytes cannot interleave with one
+// written by another thread.
+
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+// largest packet with 4 length bytes, the Erlang side may allow more
+#define PACKET_MAX_4    (16 * 1024 * 1024)
+
+static inline uint32_t packet_max(const int packet_bytes)
+{
+    return packet_bytes == 4 ? PACKET_MAX_4 : 0xffff;
+}
+
+// length header plus command byte, returns its size
+static inline int packet_head(unsigned char *head, const int packet_bytes, const int t, const uint32_t len)
+{
+    const uint32_t n = len + 1;
+    int h = 0;
+    if (packet_bytes == 4)
+    {
+        head[h++] = (n >> 24) & 0xff;
+        head[h++] = (n >> 16) & 0xff;
+    }
+    head[h++] = (n >> 8) & 0xff;
+    head[h++] = n & 0xff;
+    head[h++] = t;
+    return h;
+}
+
+#ifdef _WIN32
+
+// no gathered write for pipes here: copy into one buffer
+static inline bool packet_write(const int fd, const int packet_bytes, const int t,
+                                const unsigned char *s, const uint32_t len)
+{
+    static unsigned char *out_buf = NULL;
+    static uint32_t out_size = 0;
+
+    if (len + 1 > packet_max(packet_bytes))
+        return false;
+    if (len + 5 > out_size)
+    {
+        unsigned char *p = (unsigned char *)realloc(out_buf, len + 5);
+        if (NULL == p) return false;
+        out_buf = p;
+        out_size = len + 5;
+    }
+
+    int h = packet_head(out_buf, packet_bytes, t, len);
+    memcpy(out_buf + h, s, len);
+    for (uint32_t wrote = 0; wrote < h + len; )
+    {
+        int i = _write(fd, out_buf + wrote, h + len - wrote);
+        if (i <= 0) return false;
+        wrote += i;
+    }
+    return true;
+}
+
+#else
+
+static inline bool packet_write(const int fd, const int packet_bytes, const int t,
+                                const unsigned char *s, const uint32_t len)
+{
+    unsigned char head[5];
+    struct iovec iov[2];
+
+    if (len + 1 > packet_max(packet_bytes))
+        return false;
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = packet_head(head, packet_bytes, t, len);
+    iov[1].iov_base = (void *)s;
+    iov[1].iov_len = len;
+
+    int i = 0;
+    while (i < 2)
+    {
+        ssize_t n = writev(fd, iov + i, 2 - i);
+        if (n <= 0) return false;
+
+        // a short write on a pipe: go on from where it stopped
+        while ((i < 2) && ((size_t)n >= iov[i].iov_len))
+            n -= iov[i++].iov_len;
+        if (i < 2)
+        {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    return true;
+}
+
+#endif
+
+#endif
@@ -1,19 +1,33 @@
 //
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
 #include <fcntl.h>
-#include "uart_win32.h"
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "uart.h"
+#include "uart_packet.h"
 
 #define command_write_to_uart       0
 #define command_read_from_uart      1
 #define command_dbg_msg             2
 #define command_shutdown            3
 
-#define MAX_COMM_PACK_SIZE 65536
+// how long a write command may wait for TX space before the rest is dropped
+#define SEND_TIMEOUT_MS    5000
+
+// RX buffers lent to on_comm_read, written to stdout without a copy
+#define RX_POOL_BUFFERS    8
 
 #define dbg_printf port_dbg_print
 
 typedef unsigned char byte;
 
+// {packet, 2} or {packet, 4}, as opened on the Erlang side
+static int packet_bytes = 2;
+
 int read_exact(byte *buf, int len)
 {
   int i, got=0;
@@ -28,41 +42,33 @@ int read_exact(byte *buf, int len)
   return len;
 }
 
-int write_exact(byte *buf, int len)
+// returns the packet length, or -1
+int read_cmd(byte **buf)
 {
-  int i, wrote = 0;
-
-  do 
-  {
-    if ((i = write(1, buf + wrote, len - wrote)) <= 0)
-      return i;
-    wrote += i;
-  } while (wrote < len);
+  static byte *cmd_buf = NULL;
+  static uint32_t cmd_size = 0;
+  byte head[4];
+  uint32_t len = 0;
 
-  return len;
-}
-
-int read_cmd(byte *buf)
-{
-  int len;
-
-  if (read_exact(buf, 2) != 2)
+  if (read_exact(head, packet_bytes) != packet_bytes)
+    return -1;
+  for (int i = 0; i < packet_bytes; i++)
+    len = (len << 8) | head[i];
+  if ((len < 1) || (len > packet_max(packet_bytes)))
     return -1;
-  len = (buf[0] << 8) | buf[1];
-  return read_exact(buf, len);
-}
-
-int write_cmd(byte *buf, int len)
-{
-  byte li;
 
-  li = (len >> 8) & 0xff;
-  write_exact(&li, 1);
-  
-  li = len & 0xff;
-  write_exact(&li, 1);
+  // one more for the terminating 0 of read_comm_cmd
+  if (len + 1 > cmd_size)
+  {
+    byte *p = (byte *)realloc(cmd_buf, len + 1);
+    if (NULL == p)
+      return -1;
+    cmd_buf = p;
+    cmd_size = len + 1;
+  }
 
-  return write_exact(buf, len);
+  *buf = cmd_buf;
+  return read_exact(cmd_buf, len);
 }
 
 struct uart_port_comm
@@ -74,10 +80,10 @@ struct uart_port_comm
 
 bool read_comm_cmd(uart_port_comm &r)
 {
-    static byte cmd_buf[MAX_COMM_PACK_SIZE];
+    byte *cmd_buf;
     r.len = -1;
-    int len = read_cmd(cmd_buf);
-    if (len < 0)
+    int len = read_cmd(&cmd_buf);
+    if (len <= 0)
         return false;
     
     r.t = cmd_buf[0];
@@ -89,14 +95,7 @@ bool read_comm_cmd(uart_port_comm &r)
 
 bool send_comm_response(const int t, const byte *s, const int len)
 {
-    static byte out_buf[MAX_COMM_PACK_SIZE];
-    if (1 + len > MAX_COMM_PACK_SIZE)
-        return false;
-
-    out_buf[0] = t;
-    memcpy(out_buf + 1, s, len);
-
-    return write_cmd(out_buf, len + 1) > 0; 
+    return packet_write(1, packet_bytes, t, s, len);
 }
 
 int port_dbg_print(const char *s, ...)
@@ -114,6 +113,10 @@ int port_dbg_print(const char *s, ...)
 static void on_comm_read(uart_obj *uart, byte *buf, const int l)
 {
     send_comm_response(command_read_from_uart, buf, l);
+
+    // batches delivered before the pool was in place are not pooled
+    if ((char *)buf != uart->comm_read_buf)
+        uart_rx_release((const char *)buf);
 }
 
 static void on_comm_close(uart_obj *uart, const enum_comm_close reason)
@@ -126,14 +129,22 @@ int main(const int argc, const char *args[])
 {   
     uart_obj uart;
     int port = -1;
+    char dev[256] = {'\0'};
     int baud = -1;
     char parity[20] = {'\0'};
     int  databits = -1;
     int  stopbits = -1;
     bool async_io = false;
+    int  packet = 2;
+    int  latency_us = 0;
+    int  flow = flow_none;
+    int  io_profile = -1;
+    int  io_message = 0;
 
+#ifdef _WIN32
     setmode(0, O_BINARY);
     setmode(1, O_BINARY);
+#endif
     
 #define load_i_param(param) \
     if (strcmp(args[i], "-"#param) == 0)   \
@@ -151,23 +162,53 @@ int main(const int argc, const char *args[])
         else load_i_param(databits)
         else load_i_param(stopbits)
         else load_b_param(async_io)
+        else load_i_param(packet)
+        else load_i_param(latency_us)
+        else load_i_param(io_message)
         else if (strcmp(args[i], "-parity") == 0)
         {
             strncpy(parity, args[i + 1], 19);
             i += 2;
         }
+        else if (strcmp(args[i], "-dev") == 0)
+        {
+            strncpy(dev, args[i + 1], sizeof(dev) - 1);
+            i += 2;
+        }
+        else if (strcmp(args[i], "-io_profile") == 0)
+        {
+            if (strcmp(args[i + 1], "balanced") == 0) io_profile = io_balanced;
+            else if (strcmp(args[i + 1], "low_latency") == 0) io_profile = io_low_latency;
+            else if (strcmp(args[i + 1], "bulk") == 0) io_profile = io_bulk;
+            i += 2;
+        }
+        else if (strcmp(args[i], "-flow") == 0)
+        {
+            if (strcmp(args[i + 1], "rtscts") == 0) flow = flow_rtscts;
+            else if (strcmp(args[i + 1], "dsrdtr") == 0) flow = flow_dsrdtr;
+            else if (strcmp(args[i + 1], "xonxoff") == 0) flow = flow_xonxoff;
+            i += 2;
+        }
         else
             i++;
     }
+    packet_bytes = packet == 4 ? 4 : 2;
 
-    if (port < 0)
+    if ((port < 0) && (dev[0] == '\0'))
     {
         dbg_printf("port unspecified\n");
         return -1;
     }
 
-    if (uart_open(&uart, 
-                  port, 
+    if (dev[0] == '\0')
+#ifdef _WIN32
+        sprintf(dev, "COM%d", port);
+#else
+        sprintf(dev, "/dev/ttyS%d", port);
+#endif
+
+    if (uart_open_dev(&uart, 
+                  dev, 
                   baud, 
                   parity, 
                   databits, 
@@ -181,6 +222,28 @@ int main(const int argc, const char *args[])
         dbg_printf("failed to open the specified COM port\n");
         return -1;
     }
+    if ((flow != flow_none) && (uart_set_flow(&uart, flow) != 0))
+        dbg_printf("failed to set flow control\n");
+    if (!uart_set_rx_pool(&uart, RX_POOL_BUFFERS))
+        dbg_printf("no RX pool\n");
+
+    uart_io_profile io;
+    if (io_profile >= 0)
+    {
+        const char *p;
+        int b, d, st;
+        uart_get_config(&uart, &b, &p, &d, &st);
+        uart_io_preset(&io, io_profile, b, io_message);
+        uart_set_io_profile(&uart, &io);
+    }
+    uart_get_io_profile(&uart, &io);
+
+    if (latency_us > 0)
+    {
+        // consecutive reads go out as one packet, held for latency_us at most
+        uart_rx_policy policy = {io.read_size, latency_us / 4 > 0 ? latency_us / 4 : 1, latency_us};
+        uart_set_rx_policy(&uart, &policy);
+    }
 
     while (true)
     {
@@ -190,8 +253,12 @@ int main(const int argc, const char *args[])
         switch (c.t)
         {
         case command_write_to_uart:
-            uart_send(&uart, (char *)c.b, c.len);
+        {
+            int sent = uart_send_timeout(&uart, (char *)c.b, c.len, SEND_TIMEOUT_MS);
+            if (sent < c.len)
+                dbg_printf("uart_send: %d of %d bytes dropped\n", c.len - sent, c.len);
             break;
+        }
         case command_shutdown:
             uart_shutdown(&uart);
             break;
@@ -0,0 +1,1677 @@
+// POSIX backend: termios for the line settings, epoll driven I/O on a thread of
+// the port's own or on a reactor worker shared with other ports.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <linux/serial.h>
+#include <sched.h>
+
+#include "uart.h"
+#include "uart_capture.h"
+
+int port_dbg_print(const char *s, ...);
+
+#define dbg_print dummy // port_dbg_print // dummy //printf
+
+// size of the N_TTY read buffer
+#define TTY_QUEUE_SIZE  4096
+
+// epoll events taken per wait by a reactor worker
+#define SHARD_EVENTS    64
+
+// modem lines and error counts are polled this often while on_comm_line is set
+#define LINE_POLL_MS    10
+
+struct _uart_shard
+{
+    uart_reactor   *reactor;
+    int             ep;
+    int             ev_stop;
+    pthread_t       h_thread;
+    bool            thread_started;
+    int             ports;          // protected by the reactor lock
+};
+
+struct _uart_reactor
+{
+    int             workers;
+    pthread_mutex_t lock;
+    uart_shard     *shards;
+};
+
+static void dummy(...)
+{
+}
+
+static void rx_pool_drop(p_uart_obj uart)
+{
+    if (NULL != uart->rx_pool)
+    {
+        if (NULL != uart->rx_buf) rx_buf_release(uart->rx_buf);
+        rx_pool_unref(uart->rx_pool);
+    }
+    if (NULL != uart->rx_pool_next) rx_pool_unref(uart->rx_pool_next);
+    uart->rx_pool = uart->rx_pool_next = NULL;
+    uart->rx_buf = uart->comm_read_buf;
+}
+
+static int finalize(p_uart_obj uart)
+{
+    // the wake fd lives on in an RX pool and the watched fds are the caller's,
+    // take them out of a shared epoll explicitly
+    if (NULL != uart->shard)
+    {
+        if (uart->ev_wake >= 0)
+            epoll_ctl(uart->ep, EPOLL_CTL_DEL, uart->ev_wake, NULL);
+        for (int i = 0; i < UART_MAX_WATCHES; i++)
+            if (NULL != uart->watches[i].on_watch)
+                epoll_ctl(uart->ep, EPOLL_CTL_DEL, uart->watches[i].fd, NULL);
+    }
+    rx_pool_drop(uart);
+    frame_free(uart->framer);
+    uart->framer = NULL;
+
+    if (uart->fd >= 0)
+    {
+        ioctl(uart->fd, TIOCNXCL);
+        close(uart->fd);
+    }
+    // a reactor's epoll instance is shared, closing the fds is enough to leave it
+    if ((uart->ep >= 0) && (NULL == uart->shard)) close(uart->ep);
+
+    // a sender may be in wake() on another thread: the fd number must not be
+    // reused under it. Pairs with the count taken in wake().
+    ring_store(&uart->wake_closing, 1);
+    ring_fence();
+    while (ring_load(&uart->wakers) != 0)
+        ring_yield();
+    if (uart->ev_wake >= 0) close(uart->ev_wake);
+    if (uart->ev_timer >= 0) close(uart->ev_timer);
+    if (uart->ev_line >= 0) close(uart->ev_line);
+    if (uart->ev_tx_timer >= 0) close(uart->ev_tx_timer);
+    uart->fd = uart->ep = uart->ev_wake = uart->ev_timer = uart->ev_line = uart->ev_tx_timer = -1;
+
+    // release blocked senders and expect waiters
+    pthread_mutex_lock(&uart->tx_lock);
+    uart->closed = true;
+    pthread_cond_broadcast(&uart->tx_space);
+    pthread_cond_broadcast(&uart->expect_match);
+    pthread_mutex_unlock(&uart->tx_lock);
+    return 0;
+}
+
+static int fatal(p_uart_obj uart, const char *msg)
+{
+    dbg_print("fatal: %s (errno = %d)\n", msg, errno);
+    finalize(uart);
+    return -1;
+}
+
+// any thread; after finalize, a no-op
+static void wake(p_uart_obj uart)
+{
+    uint64_t one = 1;
+    ring_fetch_add(&uart->wakers, 1);
+    if (!ring_load(&uart->wake_closing))
+    {
+        int fd = uart->ev_wake;
+        if ((fd >= 0) && (write(fd, &one, sizeof(one)) < 0))
+            dbg_print("wake: write eventfd failed\n");
+    }
+    ring_fetch_add(&uart->wakers, -1);
+}
+
+static bool watch(p_uart_obj uart, const bool in, const bool out)
+{
+    if ((uart->in_armed == in) && (uart->out_armed == out)) return true;
+
+    struct epoll_event ev;
+    ev.events = (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+    ev.data.ptr = &uart->src[src_tty];
+    if (epoll_ctl(uart->ep, EPOLL_CTL_MOD, uart->fd, &ev) != 0)
+    {
+        dbg_print("error: epoll_ctl\n");
+        return false;
+    }
+    uart->in_armed = in;
+    uart->out_armed = out;
+    return true;
+}
+
+// between two batches: switch to a pool given by uart_set_rx_pool
+static void rx_pool_adopt(p_uart_obj uart)
+{
+    if ((NULL == uart->rx_pool_next) || (uart->rx_held > 0) || (NULL != uart->rx_pool))
+        return;
+    uart->rx_pool = uart->rx_pool_next;
+    uart->rx_buf = rx_pool_get(uart->rx_pool);
+
+    // lets uart_set_rx_pool return
+    pthread_mutex_lock(&uart->tx_lock);
+    uart->rx_pool_next = NULL;
+    pthread_cond_broadcast(&uart->tx_space);
+    pthread_mutex_unlock(&uart->tx_lock);
+}
+
+// the batch through the expect automaton, ahead of the framer
+static void rx_expect(p_uart_obj uart, const int l)
+{
+    pthread_mutex_lock(&uart->tx_lock);
+    if ((NULL != uart->expect.e) && (expect_feed(&uart->expect, uart->rx_buf, l, &uart->rx_times, uart->baud) > 0))
+        pthread_cond_broadcast(&uart->expect_match);
+    pthread_mutex_unlock(&uart->tx_lock);
+}
+
+static void rx_deliver(p_uart_obj uart)
+{
+    int l = uart->rx_held;
+    if (l <= 0) return;
+
+    uart->rx_held = 0;
+    stat_bump(&uart->stats.rx_bytes, l);
+    stat_bump(&uart->stats.rx_chunks, 1);
+    if (NULL != uart->capture)
+        capture_append(uart->capture, CAPTURE_RX, uart->capture_port, rx_times_of(&uart->rx_times, 0, uart->baud),
+                       uart->rx_buf, l);
+    if (NULL != uart->expect.e)
+        rx_expect(uart, l);
+    if (NULL != uart->framer)
+    {
+        // frames are handed over from rx_buf, which stays the port's
+        frame_feed(uart->framer, &uart->stats, uart->rx_buf, l);
+        return;
+    }
+    if (NULL == uart->rx_pool)
+    {
+        uart->on_comm_read(uart->comm_read_param, uart->comm_read_buf, l);
+        rx_pool_adopt(uart);
+        return;
+    }
+
+    // the buffer is the consumer's now, until uart_rx_release
+    char *p = uart->rx_buf;
+    uart->on_comm_read(uart->comm_read_param, p, l);
+    uart->rx_buf = rx_pool_get(uart->rx_pool);
+}
+
+// stop watching RX for wait_us while a batch is held, 0: watch again
+static bool rx_park(p_uart_obj uart, const int64_t wait_us)
+{
+    if (wait_us > 0)
+    {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = wait_us / 1000000;
+        its.it_value.tv_nsec = (wait_us % 1000000) * 1000;
+        if (timerfd_settime(uart->ev_timer, 0, &its, NULL) != 0)
+        {
+            dbg_print("error: timerfd_settime\n");
+            return false;
+        }
+        stat_bump(&uart->stats.rx_syscalls, 1);
+    }
+    uart->rx_parked = wait_us > 0;
+
+    if (uart->in_armed == !uart->rx_parked) return true;
+    stat_bump(&uart->stats.rx_syscalls, 1);
+    return watch(uart, !uart->rx_parked, uart->out_armed);
+}
+
+static bool comm_read(p_uart_obj uart)
+{
+    bool got = false;
+
+    rx_pool_adopt(uart);
+    while (true)
+    {
+        // pool starved: leave the data to the driver until uart_rx_release wakes us
+        if ((NULL == uart->rx_buf) && ((uart->rx_buf = rx_pool_get(uart->rx_pool)) == NULL))
+            return watch(uart, false, uart->out_armed);
+
+        // read_size may have dropped below what is held
+        const int size = uart->io.read_size;
+        if (uart->rx_held >= size)
+        {
+            rx_deliver(uart);
+            continue;
+        }
+        const int space = size - uart->rx_held;
+        stat_bump(&uart->stats.rx_syscalls, 1);
+        ssize_t n = read(uart->fd, uart->rx_buf + uart->rx_held, space);
+        if (n > 0)
+        {
+            rx_times_add(&uart->rx_times, uart->rx_held, n, uart_time_us());
+            uart->rx_held += n;
+            got = true;
+            if (uart->rx_held >= size)
+                rx_deliver(uart);
+            // a short read means the driver queue is drained, save an EAGAIN round trip
+            if (n < space)
+                break;
+            continue;
+        }
+
+        if (n == 0)
+        {
+            dbg_print("read: hang up\n");
+            return false;
+        }
+
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN) break;
+
+        dbg_print("read: errno = %d\n", errno);
+        return false;
+    }
+
+    int64_t wait = rx_policy_wait(&uart->rx_policy, uart->rx_held, uart->rx_times.us[0],
+                                  uart_time_us(), got, uart->baud, TTY_QUEUE_SIZE);
+    if (wait == 0)
+        rx_deliver(uart);
+    return rx_park(uart, wait);
+}
+
+// called by the I/O thread after TX bytes left the ring
+static void tx_released(p_uart_obj uart)
+{
+    // pairs with the waiter count taken before the space check in uart_send_timeout
+    ring_fence();
+    if (ring_load(&uart->tx_waiters) > 0)
+    {
+        pthread_mutex_lock(&uart->tx_lock);
+        pthread_cond_broadcast(&uart->tx_space);
+        pthread_mutex_unlock(&uart->tx_lock);
+    }
+
+    if ((NULL != uart->on_comm_writable) && ring_load(&uart->writable_armed))
+    {
+        uint32_t used = ring_used(&uart->tx);
+        if ((int)used <= uart->writable_low)
+        {
+            ring_store(&uart->writable_armed, 0);
+            uart->on_comm_writable(uart->comm_writable_param, ring_room(&uart->tx, ring_load(&uart->tx.head)));
+        }
+    }
+}
+
+// the driver's queue is full: the wait starts
+static void tx_blocked(p_uart_obj uart)
+{
+    uart->tx_blocked_us = uart_time_us();
+    if (ioctl(uart->fd, TIOCOUTQ, &uart->tx_blocked_outq) != 0)
+        uart->tx_blocked_outq = 0;
+}
+
+// It took bytes again: the wait into the stats, and what of it sending the
+// bytes that left the queue meanwhile does not explain as throttled.
+static void tx_unblocked(p_uart_obj uart)
+{
+    const int64_t now = uart_time_us();
+    int outq;
+    if ((ioctl(uart->fd, TIOCOUTQ, &outq) == 0) && (uart->tx_blocked_outq >= outq))
+        stat_tx_throttled(&uart->stats, now - uart->tx_blocked_us, uart->tx_blocked_outq - outq, uart->baud);
+    stat_tx_unblocked(&uart->stats, &uart->tx_blocked_us, now);
+}
+
+// Coalescing: the bytes just written keep the line busy for a while, sends
+// meanwhile wait for ev_tx_timer unless they reach tx_coalesce
+static void tx_hold(p_uart_obj uart, const int written)
+{
+    if ((uart->io.tx_coalesce <= 0) || ring_load(&uart->tx_held)) return;
+
+    int64_t us = rx_bytes_to_us(written, uart->baud);
+    if ((uart->io.tx_delay_us > 0) && (us > uart->io.tx_delay_us)) us = uart->io.tx_delay_us;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = us / 1000000;
+    its.it_value.tv_nsec = (us % 1000000) * 1000 + 1;
+    ring_store(&uart->tx_held, 1);
+    stat_bump(&uart->stats.tx_syscalls, 1);
+    if (timerfd_settime(uart->ev_tx_timer, 0, &its, NULL) != 0)
+        ring_store(&uart->tx_held, 0);
+}
+
+static bool comm_write(p_uart_obj uart)
+{
+    bool r = true;
+    bool wrote = false;
+    int written = 0;
+
+    while (true)
+    {
+        uint32_t to_write;
+        const char *p = ring_peek(&uart->tx, &to_write);
+        if (to_write == 0) break;
+
+        dbg_print("sending %d bytes...\n", (int)to_write);
+        ssize_t n = write(uart->fd, p, to_write);
+        stat_bump(&uart->stats.tx_syscalls, 1);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN)
+            {
+                if (uart->tx_blocked_us == 0) tx_blocked(uart);
+                r = watch(uart, uart->in_armed, true);
+                // nothing left the ring: waking uart_send_timeout would only spin it against EAGAIN
+                if (!wrote) return r;
+                goto ret;
+            }
+            dbg_print("write: errno = %d\n", errno);
+            return false;
+        }
+        if (uart->tx_blocked_us != 0)
+            tx_unblocked(uart);
+        stat_bump(&uart->stats.tx_bytes, n);
+        stat_bump(&uart->stats.tx_chunks, 1);
+        if (NULL != uart->capture)
+            capture_append(uart->capture, CAPTURE_TX, uart->capture_port, uart_time_us(), p, (int)n);
+        ring_consume(&uart->tx, (uint32_t)n);
+        wrote = true;
+        written += (int)n;
+    }
+
+    r = watch(uart, uart->in_armed, false);
+    if (written > 0) tx_hold(uart, written);
+
+ret:
+    tx_released(uart);
+    return r;
+}
+
+// modem inputs and line event counts, false: the device has neither (a pty)
+static bool line_read(p_uart_obj uart, int *line, int *count)
+{
+    int m;
+    struct serial_icounter_struct ic;
+    bool r = false;
+
+    *line = 0;
+    if (ioctl(uart->fd, TIOCMGET, &m) == 0)
+    {
+        *line = ((m & TIOCM_CTS) ? UART_LINE_CTS : 0) | ((m & TIOCM_DSR) ? UART_LINE_DSR : 0)
+            | ((m & TIOCM_RI) ? UART_LINE_RI : 0) | ((m & TIOCM_CD) ? UART_LINE_DCD : 0);
+        r = true;
+    }
+
+    memset(&ic, 0, sizeof(ic));
+    if (ioctl(uart->fd, TIOCGICOUNT, &ic) == 0) r = true;
+    count[0] = ic.brk;
+    count[1] = ic.frame;
+    count[2] = ic.parity;
+    count[3] = ic.overrun + ic.buf_overrun;
+    return r;
+}
+
+// the driver's line error counts into the live stats, they count since the device opened
+static void stats_icount(p_uart_obj uart)
+{
+    struct serial_icounter_struct ic;
+    if (ioctl(uart->fd, TIOCGICOUNT, &ic) != 0) return;
+    stat_store(&uart->stats.breaks, (uint64_t)ic.brk);
+    stat_store(&uart->stats.framing_errors, (uint64_t)ic.frame);
+    stat_store(&uart->stats.parity_errors, (uint64_t)ic.parity);
+    stat_store(&uart->stats.overruns, (uint64_t)ic.overrun);
+    stat_store(&uart->stats.rx_overflows, (uint64_t)ic.buf_overrun);
+}
+
+static bool line_timer(p_uart_obj uart, const bool on)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (on)
+    {
+        its.it_value.tv_nsec = LINE_POLL_MS * 1000000;
+        its.it_interval = its.it_value;
+    }
+    return timerfd_settime(uart->ev_line, 0, &its, NULL) == 0;
+}
+
+static void line_poll(p_uart_obj uart)
+{
+    static const int events[4] = {UART_LINE_BREAK, UART_LINE_FRAMING, UART_LINE_PARITY, UART_LINE_OVERRUN};
+    int line, count[4];
+    uint64_t v;
+
+    if (read(uart->ev_line, &v, sizeof(v)) < 0)
+        dbg_print("read timerfd failed\n");
+    if (NULL == uart->on_comm_line) return;
+    if (!line_read(uart, &line, count))
+    {
+        line_timer(uart, false);
+        return;
+    }
+
+    int changed = line ^ uart->line_in;
+    int happened = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (count[i] != uart->line_count[i]) happened |= events[i];
+        uart->line_count[i] = count[i];
+    }
+    uart->line_in = line;
+    if ((changed | happened) != 0)
+        uart->on_comm_line(uart->comm_line_param, line | happened, changed);
+}
+
+// uart_purge requests, on the I/O thread
+static void purge(p_uart_obj uart)
+{
+    if (ring_load(&uart->purge_rx))
+    {
+        ring_store(&uart->purge_rx, 0);
+        tcflush(uart->fd, TCIFLUSH);
+        uart->rx_held = 0;
+    }
+    if (ring_load(&uart->purge_tx))
+    {
+        ring_store(&uart->purge_tx, 0);
+        tcflush(uart->fd, TCOFLUSH);
+        uint32_t l;
+        while ((ring_peek(&uart->tx, &l), l) > 0)
+            ring_consume(&uart->tx, l);
+        if (uart->tx_blocked_us != 0)
+            stat_tx_unblocked(&uart->stats, &uart->tx_blocked_us, uart_time_us());
+        tx_released(uart);
+    }
+}
+
+// the profile of uart_set_io_profile or uart_set_rx_policy, on the I/O thread
+static void io_adopt(p_uart_obj uart)
+{
+    if (!ring_load(&uart->io_pending)) return;
+    pthread_mutex_lock(&uart->tx_lock);
+    uart->io = uart->io_next;
+    uart->rx_policy = uart->io.rx;
+    ring_store(&uart->tx_coalesce, (uint32_t)uart->io.tx_coalesce);
+    ring_store(&uart->io_pending, 0);
+    pthread_mutex_unlock(&uart->tx_lock);
+}
+
+static uint32_t watch_epoll_events(const int events)
+{
+    return ((events & UART_WATCH_IN) ? EPOLLIN : 0) | ((events & UART_WATCH_OUT) ? EPOLLOUT : 0);
+}
+
+// an fd given to uart_watch is ready
+static void watch_event(p_uart_obj uart, const int index, const uint32_t e)
+{
+    uart_watch_entry *w = &uart->watches[index];
+
+    // removed earlier in this batch
+    if (NULL == w->on_watch) return;
+
+    int events = ((e & EPOLLIN) ? UART_WATCH_IN : 0) | ((e & EPOLLOUT) ? UART_WATCH_OUT : 0);
+    if (e & (EPOLLERR | EPOLLHUP))
+        events |= UART_WATCH_ERR | (w->events & UART_WATCH_IN);
+    events &= w->events | UART_WATCH_ERR;
+    if (events != 0)
+        w->on_watch(w->watch_param, w->fd, events);
+}
+
+// handles an epoll event on one of the port's fds; false: the port failed
+static bool uart_event(p_uart_obj uart, const int kind, const uint32_t e)
+{
+    uint64_t v;
+
+    if (kind >= src_last)
+    {
+        watch_event(uart, kind - src_last, e);
+        return true;
+    }
+
+    switch (kind)
+    {
+    case src_wake:
+        if (read(uart->ev_wake, &v, sizeof(v)) < 0)
+            dbg_print("read eventfd failed\n");
+        if (uart->shutdown) return true;
+        purge(uart);
+        io_adopt(uart);
+        // a pool buffer came back or a pool is to be installed
+        if (((NULL == uart->rx_buf) || (NULL != uart->rx_pool_next)) && !comm_read(uart))
+            return false;
+        return comm_write(uart);
+
+    case src_timer:
+        if (read(uart->ev_timer, &v, sizeof(v)) < 0)
+            dbg_print("read timerfd failed\n");
+        uart->rx_parked = false;
+        return comm_read(uart);
+
+    case src_line:
+        line_poll(uart);
+        return true;
+
+    case src_tx_timer:
+        if (read(uart->ev_tx_timer, &v, sizeof(v)) < 0)
+            dbg_print("read timerfd failed\n");
+        // pairs with the fence in tx_put: a send either sees the flag down and
+        // wakes the thread, or its bytes are in the ring for this write
+        ring_store(&uart->tx_held, 0);
+        ring_fence();
+        return comm_write(uart);
+
+    default:
+        break;
+    }
+
+    if (e & EPOLLIN)
+    {
+        if (!comm_read(uart))
+            return false;
+    }
+    else if (e & (EPOLLERR | EPOLLHUP))
+        return false;
+
+    if (e & EPOLLOUT)
+        return comm_write(uart);
+    return true;
+}
+
+static void port_close(p_uart_obj uart, const enum_comm_close reason)
+{
+    rx_deliver(uart);
+    finalize(uart);
+    if (NULL != uart->on_comm_close)
+        uart->on_comm_close(uart->comm_close_param, reason);
+}
+
+static void *uart_thread(void *param)
+{
+    uart_obj *uart = (uart_obj *)param;
+    struct epoll_event events[src_last + UART_MAX_WATCHES];
+    enum_comm_close reason = cc_shutdown;
+
+    while (!uart->shutdown)
+    {
+        int n = epoll_wait(uart->ep, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            dbg_print("error: epoll_wait\n");
+            goto error;
+        }
+
+        for (int i = 0; (i < n) && !uart->shutdown; i++)
+        {
+            const uart_source *src = (const uart_source *)events[i].data.ptr;
+            if (!uart_event(uart, src->kind, events[i].events))
+                goto error;
+        }
+    }
+
+    goto clean_up;
+
+error:
+    reason = cc_error;
+
+clean_up:
+
+    port_close(uart, reason);
+    return NULL;
+}
+
+// the worker has closed a port: report it and let uart_shutdown return
+static void shard_release(uart_shard *shard, p_uart_obj uart, const enum_comm_close reason)
+{
+    pthread_mutex_lock(&shard->reactor->lock);
+    shard->ports--;
+    pthread_mutex_unlock(&shard->reactor->lock);
+
+    if (NULL != uart->on_comm_close)
+        uart->on_comm_close(uart->comm_close_param, reason);
+
+    pthread_mutex_lock(&uart->tx_lock);
+    uart->released = true;
+    pthread_cond_broadcast(&uart->tx_space);
+    pthread_mutex_unlock(&uart->tx_lock);
+}
+
+static void *shard_thread(void *param)
+{
+    uart_shard *shard = (uart_shard *)param;
+    struct epoll_event events[SHARD_EVENTS];
+    p_uart_obj gone[SHARD_EVENTS];
+    enum_comm_close reasons[SHARD_EVENTS];
+    bool stop = false;
+
+    while (!stop)
+    {
+        int n = epoll_wait(shard->ep, events, SHARD_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            dbg_print("error: epoll_wait\n");
+            break;
+        }
+
+        int m = 0;
+        for (int i = 0; i < n; i++)
+        {
+            const uart_source *src = (const uart_source *)events[i].data.ptr;
+            if (NULL == src)
+            {
+                stop = true;
+                continue;
+            }
+
+            p_uart_obj uart = src->uart;
+            if (uart->fd < 0) continue;     // closed earlier in this batch
+
+            bool ok = uart_event(uart, src->kind, events[i].events);
+            if (ok && !uart->shutdown) continue;
+
+            rx_deliver(uart);
+            finalize(uart);
+            gone[m] = uart;
+            reasons[m++] = ok ? cc_shutdown : cc_error;
+        }
+
+        // later events of the batch may still point at a closed port, so it is
+        // only handed back to its owner now
+        for (int i = 0; i < m; i++)
+            shard_release(shard, gone[i], reasons[i]);
+    }
+    return NULL;
+}
+
+static bool watch_add(p_uart_obj uart, const int kind, const int fd)
+{
+    struct epoll_event ev;
+    uart->src[kind].uart = uart;
+    uart->src[kind].kind = kind;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &uart->src[kind];
+    return epoll_ctl(uart->ep, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static const struct { int baud; speed_t speed; } baud_table[] =
+{
+        {50, B50}, {75, B75}, {110, B110}, {134, B134}, {150, B150}, {200, B200},
+        {300, B300}, {600, B600}, {1200, B1200}, {1800, B1800}, {2400, B2400},
+        {4800, B4800}, {9600, B9600}, {19200, B19200}, {38400, B38400},
+        {57600, B57600}, {115200, B115200}, {230400, B230400},
+#ifdef B460800
+        {460800, B460800}, {500000, B500000}, {576000, B576000}, {921600, B921600},
+        {1000000, B1000000}, {1152000, B1152000}, {1500000, B1500000},
+        {2000000, B2000000}, {2500000, B2500000}, {3000000, B3000000},
+        {3500000, B3500000}, {4000000, B4000000},
+#endif
+};
+
+static speed_t baud_to_speed(const int baud)
+{
+    for (unsigned i = 0; i < sizeof(baud_table) / sizeof(baud_table[0]); i++)
+        if (baud_table[i].baud == baud) return baud_table[i].speed;
+    return B0;
+}
+
+static int speed_to_baud(const speed_t speed)
+{
+    for (unsigned i = 0; i < sizeof(baud_table) / sizeof(baud_table[0]); i++)
+        if (baud_table[i].speed == speed) return baud_table[i].baud;
+    return 0;
+}
+
+EXPORT_DLL int uart_config(uart_obj *uart,
+            int  baud,          // baudrate
+            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
+            int  databits,      // databits
+            int  stopbits)
+{
+    struct termios tio;
+    if (tcgetattr(uart->fd, &tio) != 0)
+    {
+        dbg_print("uart_config: tcgetattr() errno = %d\n", errno);
+        return 1;
+    }
+
+    // the tty layer has no DSR/DTR handshake
+    if (uart->flow == flow_dsrdtr)
+    {
+        dbg_print("uart_config: no DSR/DTR flow control\n");
+        return 4;
+    }
+
+    // raw mode, but keep the character format unless asked to change it
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_cflag |= CLOCAL | CREAD;
+    if (uart->flow == flow_rtscts)
+        tio.c_cflag |= CRTSCTS;
+    else if (uart->flow == flow_xonxoff)
+    {
+        tio.c_iflag |= IXON | IXOFF;
+        tio.c_cc[VSTART] = 0x11;
+        tio.c_cc[VSTOP] = 0x13;
+    }
+    // VMIN = 1: an empty non-blocking read fails with EAGAIN, 0 is left for hang up
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+
+    if (baud > 0)
+    {
+        speed_t speed = baud_to_speed(baud);
+        if (speed == B0)
+        {
+            dbg_print("uart_config: unsupported baud %d\n", baud);
+            return 2;
+        }
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+
+    if (databits > 0)
+    {
+        tio.c_cflag &= ~CSIZE;
+        switch (databits)
+        {
+        case 5: tio.c_cflag |= CS5; break;
+        case 6: tio.c_cflag |= CS6; break;
+        case 7: tio.c_cflag |= CS7; break;
+        default: tio.c_cflag |= CS8; break;
+        }
+    }
+
+    if (stopbits > 0)
+    {
+        if (stopbits >= 2)
+            tio.c_cflag |= CSTOPB;
+        else
+            tio.c_cflag &= ~CSTOPB;
+    }
+
+    if (strlen(parity) > 0)
+    {
+        tio.c_cflag &= ~(PARENB | PARODD | CMSPAR);
+        switch (parity[0] | 0x20)
+        {
+        case 'e': tio.c_cflag |= PARENB; break;
+        case 'o': tio.c_cflag |= PARENB | PARODD; break;
+        case 'm': tio.c_cflag |= PARENB | CMSPAR | PARODD; break;
+        case 's': tio.c_cflag |= PARENB | CMSPAR; break;
+        default: break;
+        }
+    }
+
+    // bytes already written still go out with the old settings
+    if (tcsetattr(uart->fd, TCSADRAIN, &tio) != 0)
+    {
+        dbg_print("uart_config: tcsetattr() errno = %d\n", errno);
+        return 3;
+    }
+    uart->baud = speed_to_baud(cfgetospeed(&tio));
+    return 0;
+}
+
+EXPORT_DLL int uart_set_flow(uart_obj *uart, const int flow)
+{
+    if ((flow < flow_none) || (flow > flow_xonxoff)) return 4;
+    const int old = uart->flow;
+    uart->flow = flow;
+    const int r = uart_config(uart, 0, "", 0, 0);
+    if (r != 0) uart->flow = old;
+    return r;
+}
+
+EXPORT_DLL int uart_get_flow(uart_obj *uart)
+{
+    return uart->flow;
+}
+
+EXPORT_DLL void uart_get_config(uart_obj *uart,
+            int         *baud,
+            const char **parity,
+            int         *databits,
+            int         *stopbits)
+{
+    struct termios tio;
+    memset(&tio, 0, sizeof(tio));
+    tcgetattr(uart->fd, &tio);
+
+    *baud = uart->baud;
+    if (!(tio.c_cflag & PARENB))
+        *parity = "none";
+    else if (tio.c_cflag & CMSPAR)
+        *parity = (tio.c_cflag & PARODD) ? "mark" : "space";
+    else
+        *parity = (tio.c_cflag & PARODD) ? "odd" : "even";
+    switch (tio.c_cflag & CSIZE)
+    {
+    case CS5: *databits = 5; break;
+    case CS6: *databits = 6; break;
+    case CS7: *databits = 7; break;
+    default: *databits = 8; break;
+    }
+    *stopbits = (tio.c_cflag & CSTOPB) ? 2 : 1;
+}
+
+static uart_obj *port_open(uart_obj *uart,
+            uart_shard *shard,
+            const char *dev,
+            int  baud,
+            const char *parity,
+            int  databits,
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param,
+            const bool       async_io)
+{
+    memset(uart, 0, sizeof(*uart));
+    uart->fd = uart->ep = uart->ev_wake = uart->ev_timer = uart->ev_line = uart->ev_tx_timer = -1;
+    uart->rx_buf = uart->comm_read_buf;
+    uart->on_comm_read = on_comm_read;
+    uart->comm_read_param = comm_read_param;
+    uart->comm_close_param = comm_close_param;
+    uart->async_io = async_io;
+    ring_init(&uart->tx, true);
+    io_preset(&uart->io, io_balanced, baud, 0);
+    uart->tx.limit = uart->io.tx_queue;
+    uart->tx_coalesce = uart->io.tx_coalesce;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&uart->tx_space, &attr);
+    pthread_cond_init(&uart->expect_match, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&uart->tx_lock, NULL);
+
+    snprintf(uart->comm, sizeof(uart->comm), "%s", dev);
+
+    uart->fd = open(uart->comm, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (uart->fd < 0)
+    {
+        fatal(uart, "open()");
+        return NULL;
+    }
+
+    // comm devices are opened with exclusive access
+    ioctl(uart->fd, TIOCEXCL);
+
+    uart->ev_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    uart->ev_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    uart->ev_line = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    uart->ev_tx_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((uart->ev_wake < 0) || (uart->ev_timer < 0) || (uart->ev_line < 0) || (uart->ev_tx_timer < 0))
+    {
+        fatal(uart, "eventfd()/timerfd_create()");
+        return NULL;
+    }
+
+    if (uart_config(uart, baud, parity, databits, stopbits) != 0)
+    {
+        fatal(uart, "uart_config()");
+        return NULL;
+    }
+
+    // flush the port
+    tcflush(uart->fd, TCIOFLUSH);
+
+    // line errors from before count in the baseline
+    stats_icount(uart);
+    stats_reset(&uart->stats, &uart->stats_base);
+
+    // on_comm_close is enabled now
+    uart->on_comm_close = on_comm_close;
+
+    if (NULL != shard)
+    {
+        // a worker may pick up the port as soon as the tty is added, so it goes last
+        uart->shard = shard;
+        uart->ep = shard->ep;
+    }
+    else if ((uart->ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        fatal(uart, "epoll_create1()");
+        return NULL;
+    }
+
+    uart->in_armed = true;
+    if (!watch_add(uart, src_wake, uart->ev_wake)
+        || !watch_add(uart, src_timer, uart->ev_timer)
+        || !watch_add(uart, src_line, uart->ev_line)
+        || !watch_add(uart, src_tx_timer, uart->ev_tx_timer)
+        || !watch_add(uart, src_tty, uart->fd))
+    {
+        uart->on_comm_close = NULL;
+        fatal(uart, "epoll_ctl()");
+        uart->shard = NULL;
+        return NULL;
+    }
+
+    if (NULL != shard)
+        return uart;
+
+    if (pthread_create(&uart->h_thread, NULL, uart_thread, uart) != 0)
+    {
+        fatal(uart, "pthread_create()");
+        return NULL;
+    }
+    uart->thread_started = true;
+
+    return uart;
+}
+
+EXPORT_DLL uart_obj *uart_open_dev(uart_obj *uart,
+            const char *dev,
+            int  baud,          // baudrate
+            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
+            int  databits,      // databits
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param,
+            const bool       async_io)  // no effect: all I/O is driven by epoll
+{
+    return port_open(uart, NULL, dev, baud, parity, databits, stopbits,
+                     on_comm_read, comm_read_param, on_comm_close, comm_close_param, async_io);
+}
+
+EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
+            const int portnr,
+            int  baud,          // baudrate
+            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
+            int  databits,      // databits
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param,
+            const bool       async_io)
+{
+    char dev[32];
+    sprintf(dev, "/dev/ttyS%d", portnr);
+    return uart_open_dev(uart, dev, baud, parity, databits, stopbits,
+                         on_comm_read, comm_read_param, on_comm_close, comm_close_param, async_io);
+}
+
+EXPORT_DLL void uart_shutdown(uart_obj *uart)
+{
+    uart->shutdown = true;
+    wake(uart);
+
+    if (NULL != uart->shard)
+    {
+        // called from a callback on the worker: the port closes once it returns
+        if (pthread_equal(pthread_self(), uart->shard->h_thread)) return;
+
+        pthread_mutex_lock(&uart->tx_lock);
+        while (!uart->released)
+            pthread_cond_wait(&uart->tx_space, &uart->tx_lock);
+        pthread_mutex_unlock(&uart->tx_lock);
+        return;
+    }
+
+    if (!uart->thread_started) return;
+    uart->thread_started = false;
+
+    // called from a callback: the thread exits once the callback returns
+    if (pthread_equal(pthread_self(), uart->h_thread))
+        pthread_detach(uart->h_thread);
+    else
+        pthread_join(uart->h_thread, NULL);
+}
+
+// r of l bytes went into the ring: arms the writable callback, wakes the thread
+static int tx_queued(uart_obj *uart, const int r, const int l)
+{
+    stat_max(&uart->stats.tx_high_water, ring_used(&uart->tx));
+    if (r < l)
+    {
+        dbg_print("comm_write_buf overflow: %d of %d bytes taken\n", r, l);
+        ring_store(&uart->writable_armed, 1);
+    }
+    else if ((NULL != uart->on_comm_writable) && ((int)ring_used(&uart->tx) > uart->writable_low))
+        ring_store(&uart->writable_armed, 1);
+
+    // coalescing: a write is due anyway
+    const int coalesce = (int)ring_load(&uart->tx_coalesce);
+    if ((coalesce > 0) && (r == l))
+    {
+        ring_fence();
+        // held, only the send taking the queue to tx_coalesce wakes the thread
+        const int used = (int)ring_used(&uart->tx);
+        if (ring_load(&uart->tx_held) && ((used < coalesce) || (used - l >= coalesce)))
+            return r;
+    }
+    stat_add(&uart->stats.tx_wakeups, 1);
+    wake(uart);
+    return r;
+}
+
+// queues what fits, or all or nothing
+static int tx_put(uart_obj *uart, const char *buf, const int l, const bool partial)
+{
+    return tx_queued(uart, (int)ring_write(&uart->tx, buf, l, partial), l);
+}
+
+// all count segments of v, l bytes, or nothing
+static int tx_putv(uart_obj *uart, const uart_iovec *v, const int count, const int l)
+{
+    return tx_queued(uart, (int)ring_writev(&uart->tx, v, count, (uint32_t)l), l);
+}
+
+EXPORT_DLL void uart_flush(uart_obj *uart)
+{
+    stat_add(&uart->stats.tx_wakeups, 1);
+    wake(uart);
+}
+
+EXPORT_DLL int uart_send(uart_obj *uart, const char *buf, const int l)
+{
+#ifdef _DEBUG
+    printf("send %d byte(s):", l);
+    for (int i = 0; i < l; i++) printf(" %.2X", buf[i]);
+    printf("\n");
+#endif
+
+    if (l < 1)
+    {
+        // arms the writable callback, the I/O thread checks the mark right away
+        if (NULL == uart->on_comm_writable) return 0;
+        ring_store(&uart->writable_armed, 1);
+        wake(uart);
+        return 0;
+    }
+
+    int r = tx_put(uart, buf, l, true);
+    if (r < l)
+        stat_add(&uart->stats.tx_dropped, (uint64_t)(l - r));
+    return r;
+}
+
+// CLOCK_MONOTONIC, for the timed waits on the port's conditions
+static void deadline_after(struct timespec *deadline, const int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// the bytes of v past sent: a single segment may go in parts, several only whole
+static int tx_put_rest(uart_obj *uart, const uart_iovec *v, const int count, const int l, const int sent,
+                       const bool partial)
+{
+    if (count == 1) return tx_put(uart, v->p + sent, l - sent, partial);
+    return tx_putv(uart, v, count, l);
+}
+
+// uart_send_timeout, or with partial false a whole frame
+static int tx_send(uart_obj *uart, const uart_iovec *v, const int count, const int l, const int timeout_ms,
+                   const bool partial)
+{
+    int sent = tx_put_rest(uart, v, count, l, 0, partial);
+    if (sent >= l)
+        return sent;
+    if (timeout_ms == 0)
+    {
+        stat_add(&uart->stats.tx_dropped, (uint64_t)(l - sent));
+        return sent;
+    }
+
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&uart->tx_lock);
+    ring_fetch_add(&uart->tx_waiters, 1);
+    while (!uart->closed && !uart->shutdown)
+    {
+        sent += tx_put_rest(uart, v, count, l, sent, partial);
+        if (sent >= l) break;
+
+        if (timeout_ms < 0)
+            pthread_cond_wait(&uart->tx_space, &uart->tx_lock);
+        else if (pthread_cond_timedwait(&uart->tx_space, &uart->tx_lock, &deadline) == ETIMEDOUT)
+        {
+            sent += tx_put_rest(uart, v, count, l, sent, partial);
+            break;
+        }
+    }
+    ring_fetch_add(&uart->tx_waiters, -1);
+    pthread_mutex_unlock(&uart->tx_lock);
+    if (sent < l)
+        stat_add(&uart->stats.tx_dropped, (uint64_t)(l - sent));
+    return sent;
+}
+
+EXPORT_DLL int uart_send_timeout(uart_obj *uart, const char *buf, const int l, const int timeout_ms)
+{
+    if (l < 1) return 0;
+    uart_iovec v = {buf, l};
+    return tx_send(uart, &v, 1, l, timeout_ms, true);
+}
+
+EXPORT_DLL int uart_sendv(uart_obj *uart, const uart_iovec *v, const int count, const int timeout_ms)
+{
+    int64_t l = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (v[i].l < 0) return 0;
+        l += v[i].l;
+    }
+    if (l < 1) return 0;
+    // would never fit
+    if (l > ring_load(&uart->tx.limit))
+    {
+        stat_add(&uart->stats.tx_dropped, (uint64_t)l);
+        return 0;
+    }
+    return tx_send(uart, v, count, (int)l, timeout_ms, false);
+}
+
+EXPORT_DLL int uart_send_frame(uart_obj *uart, const char *p, const int l, const int timeout_ms)
+{
+    // the worst case encoding, no more than the TX buffer takes
+    const int64_t worst = UART_FRAME_ENCODE_MAX((int64_t)l);
+    const int queue = (int)ring_load(&uart->tx.limit);
+    const int max = worst < queue ? (int)worst : queue;
+    char small[UART_FRAME_STACK];
+    char *frame = max <= UART_FRAME_STACK ? small : (char *)malloc(max);
+    if (NULL == frame) return -1;
+    int n = frame_encode(&uart->framing, p, l, frame, max);
+    if (n > 0)
+    {
+        uart_iovec v = {frame, n};
+        n = tx_send(uart, &v, 1, n, timeout_ms, false) == n ? l : 0;
+    }
+    if (frame != small) free(frame);
+    return n;
+}
+
+EXPORT_DLL void uart_set_writable_callback(uart_obj *uart,
+            f_on_comm_writable on_comm_writable,
+            void              *comm_writable_param,
+            const int          low_watermark)
+{
+    uart->writable_low = low_watermark;
+    uart->comm_writable_param = comm_writable_param;
+    uart->on_comm_writable = on_comm_writable;
+}
+
+EXPORT_DLL void uart_set_single_producer(uart_obj *uart, const bool single)
+{
+    uart->tx.mpsc = !single;
+}
+
+EXPORT_DLL int get_uart_obj_size()
+{
+    return sizeof(uart_obj);
+}
+
+// the I/O thread takes io_next: right here, or at its next wake
+static void io_post(p_uart_obj uart)
+{
+    pthread_t io = NULL != uart->shard ? uart->shard->h_thread : uart->h_thread;
+    if (pthread_equal(pthread_self(), io))
+        io_adopt(uart);
+    else
+        wake(uart);
+}
+
+EXPORT_DLL void uart_set_rx_policy(uart_obj *uart, const uart_rx_policy *policy)
+{
+    pthread_mutex_lock(&uart->tx_lock);
+    if (!uart->io_pending) uart->io_next = uart->io;
+    uart->io_next.rx = *policy;
+    ring_store(&uart->io_pending, 1);
+    pthread_mutex_unlock(&uart->tx_lock);
+    io_post(uart);
+}
+
+EXPORT_DLL bool uart_io_preset(uart_io_profile *profile, const int preset, const int baud, const int message)
+{
+    return io_preset(profile, preset, baud, message);
+}
+
+// driver_queue is kept for uart_get_io_profile only, the tty layer's queues are fixed
+EXPORT_DLL bool uart_set_io_profile(uart_obj *uart, const uart_io_profile *profile)
+{
+    if (!io_valid(profile)) return false;
+    pthread_mutex_lock(&uart->tx_lock);
+    uart->io_next = *profile;
+    ring_store(&uart->io_pending, 1);
+    // the senders go by the new tx_queue at once; more room, maybe: the waiting ones look again
+    ring_store(&uart->tx.limit, (uint32_t)profile->tx_queue);
+    pthread_cond_broadcast(&uart->tx_space);
+    pthread_mutex_unlock(&uart->tx_lock);
+    io_post(uart);
+    return true;
+}
+
+EXPORT_DLL void uart_get_io_profile(uart_obj *uart, uart_io_profile *profile)
+{
+    pthread_mutex_lock(&uart->tx_lock);
+    if (uart->io_pending)
+        *profile = uart->io_next;
+    else
+    {
+        *profile = uart->io;
+        profile->rx = uart->rx_policy;
+    }
+    pthread_mutex_unlock(&uart->tx_lock);
+}
+
+EXPORT_DLL bool uart_set_rx_pool(uart_obj *uart, const int buffers)
+{
+    if ((buffers < 1) || (buffers > UART_RX_POOL_MAX) || (uart->ev_wake < 0)
+        || (NULL != uart->rx_pool) || (NULL != uart->rx_pool_next))
+        return false;
+
+    int fd = fcntl(uart->ev_wake, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) return false;
+    uart_rx_pool *pool = rx_pool_create(buffers, fd);
+    if (NULL == pool)
+    {
+        close(fd);
+        return false;
+    }
+
+    ring_fence();
+    uart->rx_pool_next = pool;
+    wake(uart);
+
+    // from a callback: the I/O thread switches right after the current batch
+    pthread_t io = NULL != uart->shard ? uart->shard->h_thread : uart->h_thread;
+    if (pthread_equal(pthread_self(), io)) return true;
+
+    pthread_mutex_lock(&uart->tx_lock);
+    while ((NULL != uart->rx_pool_next) && !uart->closed)
+        pthread_cond_wait(&uart->tx_space, &uart->tx_lock);
+    pthread_mutex_unlock(&uart->tx_lock);
+    return NULL != uart->rx_pool;
+}
+
+EXPORT_DLL void uart_rx_retain(const char *p)
+{
+    ring_fetch_add(&rx_buf_of(p)->refs, 1);
+}
+
+EXPORT_DLL void uart_rx_release(const char *p)
+{
+    rx_buf_release(p);
+}
+
+EXPORT_DLL bool uart_watch(uart_obj *uart,
+            const intptr_t   fd,
+            const int        events,
+            f_on_watch       on_watch,
+            void            *watch_param)
+{
+    uart_watch_entry *w = NULL;
+    bool r = false;
+
+    if ((uart->ep < 0) || (fd < 0)) return false;
+
+    // another thread may add a watch while a callback changes one
+    pthread_mutex_lock(&uart->tx_lock);
+    for (int i = 0; i < UART_MAX_WATCHES; i++)
+    {
+        uart_watch_entry *e = &uart->watches[i];
+        if ((NULL != e->on_watch) && (e->fd == fd))
+        {
+            w = e;
+            break;
+        }
+        if ((NULL == w) && (NULL == e->on_watch))
+        {
+            w = e;
+            w->src.uart = uart;
+            w->src.kind = src_last + i;
+        }
+    }
+
+    if (NULL == w) goto clean_up;
+
+    if (NULL == w->on_watch)
+    {
+        if (events == 0)
+        {
+            r = true;
+            goto clean_up;
+        }
+
+        struct epoll_event ev;
+        ev.events = watch_epoll_events(events);
+        ev.data.ptr = &w->src;
+        w->fd = fd;
+        w->events = events;
+        w->watch_param = watch_param;
+        w->on_watch = on_watch;
+        if (epoll_ctl(uart->ep, EPOLL_CTL_ADD, (int)fd, &ev) != 0)
+        {
+            dbg_print("uart_watch: epoll_ctl(ADD) errno = %d\n", errno);
+            w->on_watch = NULL;
+            goto clean_up;
+        }
+    }
+    else if (events == 0)
+    {
+        w->on_watch = NULL;
+        epoll_ctl(uart->ep, EPOLL_CTL_DEL, (int)fd, NULL);
+    }
+    else
+    {
+        struct epoll_event ev;
+        ev.events = watch_epoll_events(events);
+        ev.data.ptr = &w->src;
+        w->events = events;
+        w->watch_param = watch_param;
+        w->on_watch = on_watch;
+        if (epoll_ctl(uart->ep, EPOLL_CTL_MOD, (int)fd, &ev) != 0)
+        {
+            dbg_print("uart_watch: epoll_ctl(MOD) errno = %d\n", errno);
+            goto clean_up;
+        }
+    }
+    r = true;
+
+clean_up:
+    pthread_mutex_unlock(&uart->tx_lock);
+    return r;
+}
+
+EXPORT_DLL void uart_purge(uart_obj *uart, const bool rx, const bool tx)
+{
+    if (rx) ring_store(&uart->purge_rx, 1);
+    if (tx) ring_store(&uart->purge_tx, 1);
+
+    pthread_t io = NULL != uart->shard ? uart->shard->h_thread : uart->h_thread;
+    if (pthread_equal(pthread_self(), io))
+        purge(uart);
+    else
+        wake(uart);
+}
+
+EXPORT_DLL void uart_set_line_callback(uart_obj *uart,
+            f_on_comm_line  on_comm_line,
+            void           *comm_line_param)
+{
+    // the first poll reports changes from now on
+    line_read(uart, &uart->line_in, uart->line_count);
+    uart->line_in &= UART_LINE_INPUTS;
+    uart->comm_line_param = comm_line_param;
+    uart->on_comm_line = on_comm_line;
+    line_timer(uart, NULL != on_comm_line);
+}
+
+EXPORT_DLL bool uart_set_line(uart_obj *uart, const int line, const bool on)
+{
+    int r;
+    if (line == UART_LINE_BREAK)
+        r = ioctl(uart->fd, on ? TIOCSBRK : TIOCCBRK);
+    else
+    {
+        int m = line == UART_LINE_DTR ? TIOCM_DTR : line == UART_LINE_RTS ? TIOCM_RTS : 0;
+        if (m == 0) return false;
+        r = ioctl(uart->fd, on ? TIOCMBIS : TIOCMBIC, &m);
+    }
+    if (r != 0) return false;
+    uart->line_out = on ? uart->line_out | line : uart->line_out & ~line;
+    return true;
+}
+
+EXPORT_DLL int uart_get_line(uart_obj *uart)
+{
+    int line, count[4];
+    line_read(uart, &line, count);
+    return line | uart->line_out;
+}
+
+EXPORT_DLL int64_t uart_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+EXPORT_DLL int64_t uart_rx_time_us(uart_obj *uart, const int i)
+{
+    return rx_times_of(&uart->rx_times, i, uart->baud);
+}
+
+EXPORT_DLL uart_capture *uart_capture_open(const char *path, const int64_t ring_size)
+{
+    return capture_open(path, ring_size > 0 ? ring_size : CAPTURE_DEFAULT_RING);
+}
+
+EXPORT_DLL void uart_capture_close(uart_capture *capture)
+{
+    capture_close(capture);
+}
+
+EXPORT_DLL void uart_set_capture(uart_obj *uart, uart_capture *capture, const int port_id)
+{
+    uart->capture_port = port_id;
+    uart->capture = capture;
+}
+
+EXPORT_DLL bool uart_set_framing(uart_obj *uart,
+            const uart_framing *framing,
+            f_on_frame       on_frame,
+            void            *frame_param)
+{
+    uart_framer *fr = NULL;
+    if ((NULL != framing) && !frame_valid(framing))
+        return false;
+    if ((NULL != framing) && (framing->kind != frame_none))
+    {
+        if ((fr = frame_create(framing, on_frame, frame_param)) == NULL)
+            return false;
+    }
+    frame_free(uart->framer);
+    uart->framer = fr;
+    if (NULL != framing)
+        uart->framing = *framing;
+    else
+        memset(&uart->framing, 0, sizeof(uart->framing));
+    return true;
+}
+
+EXPORT_DLL int uart_frame_encode(const uart_framing *framing, const char *p, const int l, char *dst, const int max)
+{
+    return frame_encode(framing, p, l, dst, max);
+}
+
+EXPORT_DLL uint32_t uart_crc_init(const int kind)
+{
+    return crc_init(kind);
+}
+
+EXPORT_DLL uint32_t uart_crc_update(const int kind, const uint32_t crc, const char *p, const int l)
+{
+    return crc_update(kind, crc, p, l);
+}
+
+EXPORT_DLL uart_expect *uart_expect_create(const char *const *patterns, const int count, const int flags)
+{
+    return expect_create(patterns, count, flags);
+}
+
+EXPORT_DLL void uart_expect_free(uart_expect *expect)
+{
+    expect_free(expect);
+}
+
+EXPORT_DLL void uart_set_expect(uart_obj *uart, uart_expect *expect)
+{
+    pthread_mutex_lock(&uart->tx_lock);
+    expect_arm(&uart->expect, expect);
+    pthread_cond_broadcast(&uart->expect_match);
+    pthread_mutex_unlock(&uart->tx_lock);
+}
+
+EXPORT_DLL int uart_expect_wait(uart_obj *uart, const int timeout_ms, uart_expect_match *match)
+{
+    struct timespec deadline;
+    if (timeout_ms > 0)
+        deadline_after(&deadline, timeout_ms);
+
+    uart_expect_match m;
+    int r = -1;
+    bool last = timeout_ms == 0;
+    pthread_mutex_lock(&uart->tx_lock);
+    for (;;)
+    {
+        if (expect_pop(&uart->expect, &m))
+        {
+            r = m.pattern;
+            break;
+        }
+        if ((NULL == uart->expect.e) || uart->closed)
+        {
+            r = -2;
+            break;
+        }
+        if (last) break;
+        if (timeout_ms < 0)
+            pthread_cond_wait(&uart->expect_match, &uart->tx_lock);
+        else
+            last = pthread_cond_timedwait(&uart->expect_match, &uart->tx_lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&uart->tx_lock);
+    if ((r >= 0) && (NULL != match)) *match = m;
+    return r;
+}
+
+EXPORT_DLL void uart_get_stats(uart_obj *uart, uart_stats *stats)
+{
+    stats_icount(uart);
+    stats_snapshot(&uart->stats, &uart->stats_base, stats);
+}
+
+EXPORT_DLL void uart_reset_stats(uart_obj *uart)
+{
+    stats_icount(uart);
+    stats_reset(&uart->stats, &uart->stats_base);
+}
+
+static void shard_stop(uart_shard *shard)
+{
+    uint64_t one = 1;
+    if (shard->thread_started)
+    {
+        if (write(shard->ev_stop, &one, sizeof(one)) < 0)
+            dbg_print("shard_stop: write eventfd failed\n");
+        pthread_join(shard->h_thread, NULL);
+    }
+    if (shard->ev_stop >= 0) close(shard->ev_stop);
+    if (shard->ep >= 0) close(shard->ep);
+}
+
+EXPORT_DLL uart_reactor *uart_reactor_create(const int workers, const bool pin)
+{
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+
+    uart_reactor *reactor = (uart_reactor *)calloc(1, sizeof(uart_reactor));
+    if (NULL == reactor) return NULL;
+    reactor->workers = workers > 0 ? workers : cpus;
+    reactor->shards = (uart_shard *)calloc(reactor->workers, sizeof(uart_shard));
+    if (NULL == reactor->shards)
+    {
+        free(reactor);
+        return NULL;
+    }
+    pthread_mutex_init(&reactor->lock, NULL);
+    for (int i = 0; i < reactor->workers; i++)
+        reactor->shards[i].ep = reactor->shards[i].ev_stop = -1;
+
+    for (int i = 0; i < reactor->workers; i++)
+    {
+        uart_shard *shard = reactor->shards + i;
+        shard->reactor = reactor;
+        shard->ep = epoll_create1(EPOLL_CLOEXEC);
+        shard->ev_stop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if ((shard->ep < 0) || (shard->ev_stop < 0))
+            goto error;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(shard->ep, EPOLL_CTL_ADD, shard->ev_stop, &ev) != 0)
+            goto error;
+
+        if (pthread_create(&shard->h_thread, NULL, shard_thread, shard) != 0)
+            goto error;
+        shard->thread_started = true;
+
+        if (pin)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            if (pthread_setaffinity_np(shard->h_thread, sizeof(set), &set) != 0)
+                dbg_print("pthread_setaffinity_np failed\n");
+        }
+    }
+    return reactor;
+
+error:
+    dbg_print("uart_reactor_create: errno = %d\n", errno);
+    uart_reactor_destroy(reactor);
+    return NULL;
+}
+
+EXPORT_DLL void uart_reactor_destroy(uart_reactor *reactor)
+{
+    if (NULL == reactor) return;
+    for (int i = 0; i < reactor->workers; i++)
+        shard_stop(reactor->shards + i);
+    pthread_mutex_destroy(&reactor->lock);
+    free(reactor->shards);
+    free(reactor);
+}
+
+EXPORT_DLL uart_obj *uart_reactor_open(uart_reactor *reactor,
+            uart_obj *uart,
+            const char *dev,
+            int  baud,
+            const char *parity,
+            int  databits,
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param)
+{
+    uart_shard *shard = reactor->shards;
+
+    pthread_mutex_lock(&reactor->lock);
+    for (int i = 1; i < reactor->workers; i++)
+        if (reactor->shards[i].ports < shard->ports)
+            shard = reactor->shards + i;
+    shard->ports++;
+    pthread_mutex_unlock(&reactor->lock);
+
+    if (port_open(uart, shard, dev, baud, parity, databits, stopbits,
+                  on_comm_read, comm_read_param, on_comm_close, comm_close_param, true) != NULL)
+        return uart;
+
+    pthread_mutex_lock(&reactor->lock);
+    shard->ports--;
+    pthread_mutex_unlock(&reactor->lock);
+    return NULL;
+}
@@ -0,0 +1,122 @@
+#ifndef _uart_posix_h
+#define _uart_posix_h
+
+// POSIX (termios + epoll) backend, included through uart.h
+
+#include <pthread.h>
+
+#include "uart_ring.h"
+#include "uart_rx.h"
+#include "uart_profile.h"
+#include "uart_stats.h"
+#include "uart_frame.h"
+#include "uart_expect.h"
+
+typedef enum
+{
+    src_tty,
+    src_wake,
+    src_timer,
+    src_line,
+    src_tx_timer,
+    src_last
+} enum_sources;
+
+// epoll_event.data.ptr of each fd of a port
+typedef struct
+{
+    struct _uart_obj *uart;
+    int               kind;
+} uart_source;
+
+typedef struct _uart_shard uart_shard;
+
+// a watch's uart_source kind is src_last + its index
+typedef struct
+{
+    intptr_t        fd;
+    int             events;
+    f_on_watch      on_watch;       // NULL: entry free
+    void           *watch_param;
+    uart_source     src;
+} uart_watch_entry;
+
+struct _uart_obj
+{
+    char            comm[256];
+    bool            async_io;
+    int             fd;
+    int             ep;             // epoll instance watched by uart_thread
+    int             ev_wake;        // eventfd: write/shutdown requests
+    volatile uint32_t wakers;       // threads in wake(), finalize waits them out
+    volatile uint32_t wake_closing; // finalize is about to close ev_wake
+    int             ev_timer;       // timerfd: end of an RX policy wait
+    int             ev_line;        // timerfd: line polls while on_comm_line is set
+    int             ev_tx_timer;    // timerfd: end of a TX coalescing wait
+    uart_source     src[src_last];
+    uart_shard     *shard;          // reactor worker serving the port, NULL: own thread
+    pthread_t       h_thread;
+    bool            thread_started;
+    volatile bool   shutdown;
+    volatile bool   closed;
+    volatile bool   released;       // reactor: closed and on_comm_close returned
+    bool            in_armed;       // EPOLLIN is being watched
+    bool            out_armed;      // EPOLLOUT is being watched
+    int             baud;
+    f_on_comm_read   on_comm_read;
+    void           * comm_read_param;
+    f_on_comm_close  on_comm_close;
+    void            *comm_close_param;
+
+    uart_ring       tx;             // filled by uart_send, write() reads from it directly
+
+    // backpressure: senders blocked in uart_send_timeout, writable callback
+    pthread_mutex_t tx_lock;
+    pthread_cond_t  tx_space;
+    volatile uint32_t tx_waiters;
+    volatile uint32_t writable_armed;
+    volatile uint32_t tx_held;      // ev_tx_timer is armed: small sends leave the wake to it
+    int             writable_low;
+    f_on_comm_writable on_comm_writable;
+    void            *comm_writable_param;
+
+    uart_watch_entry watches[UART_MAX_WATCHES];
+
+    f_on_comm_line  on_comm_line;
+    void           *comm_line_param;
+    int             line_in;        // modem inputs at the last poll
+    int             line_out;       // DTR, RTS and BREAK as set
+    int             line_count[4];  // break, frame, parity and overrun counts at the last poll
+    volatile uint32_t purge_rx;     // uart_purge requests for the I/O thread
+    volatile uint32_t purge_tx;
+
+    uart_rx_policy  rx_policy;
+    uart_io_profile io;             // of the I/O thread, its rx policy is rx_policy; written under tx_lock
+    uart_io_profile io_next;        // set by uart_set_io_profile under tx_lock, taken by the I/O thread
+    volatile uint32_t io_pending;   // io_next is to be taken
+    volatile uint32_t tx_coalesce;  // io.tx_coalesce, for the senders
+    bool            rx_parked;      // RX not watched until ev_timer fires
+    char           *rx_buf;         // comm_read_buf, or a pool buffer (NULL: pool starved)
+    uart_rx_pool   *rx_pool;
+    uart_rx_pool * volatile rx_pool_next;   // set by uart_set_rx_pool, taken by the I/O thread
+    int             rx_held;        // bytes of the pending batch in rx_buf
+    uart_rx_times   rx_times;       // arrival of them, the first mark also drives rx_policy
+    uart_stats      stats;          // see uart_stats.h
+    uart_stats      stats_base;     // taken by uart_reset_stats
+    int64_t         tx_blocked_us;  // since when queued TX waits for the device, 0: it does not
+    int             tx_blocked_outq;    // bytes the driver had queued then
+    int             flow;           // enum_flow_control
+
+    uart_framer    *framer;         // uart_set_framing, NULL: batches to on_comm_read
+    uart_framing    framing;        // also for uart_send_frame
+
+    uart_capture   *capture;        // uart_set_capture
+    int             capture_port;
+
+    uart_expect_tap expect;         // uart_set_expect, under tx_lock
+    pthread_cond_t  expect_match;   // a match was queued, or the port closed
+
+    char            comm_read_buf[COMM_READ_BUF_SIZE];
+};
+
+#endif
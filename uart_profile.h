@@ -0,0 +1,86 @@
+#ifndef _uart_profile_h
+#define _uart_profile_h
+
+// I/O profile presets shared by the backends.
+//
+// Sizes follow the byte rate: a queue is given as the time the line takes to
+// move it, then kept within what the port and the driver can do. A message
+// size, when known, sets the floor of the queues and, with io_balanced, the
+// batch the RX policy waits for.
+
+#include <string.h>
+
+#include "uart_rx.h"
+
+#define IO_READ_SIZE        (COMM_READ_BUF_SIZE < 2048 ? COMM_READ_BUF_SIZE : 2048)   // but io_bulk
+#define IO_TX_QUEUE         (10 * 1024)     // TX queue of io_balanced, at least
+#define IO_DRIVER_QUEUE     (10 * 1024)     // Win32 driver queues, at least (but io_low_latency)
+#define IO_DRIVER_QUEUE_MAX (1024 * 1024)
+
+// the bytes the line moves in us at baud
+static inline int io_line_bytes(const int baud, const int64_t us)
+{
+    return (int)((int64_t)(baud > 0 ? baud : UART_DEFAULT_BAUD) / UART_BITS_PER_CHAR * us / 1000000);
+}
+
+static inline int io_max(const int a, const int b)
+{
+    return a > b ? a : b;
+}
+
+static inline int io_clamp(const int v, const int lo, const int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static inline bool io_preset(uart_io_profile *p, const int preset, const int baud, int message)
+{
+    if (message < 0) message = 0;
+    if (message > COMM_WRITE_BUF_SIZE) message = COMM_WRITE_BUF_SIZE;
+    memset(p, 0, sizeof(*p));
+    switch (preset)
+    {
+    case io_balanced:
+        p->read_size = IO_READ_SIZE;
+        p->tx_queue = io_clamp(io_line_bytes(baud, 100000), IO_TX_QUEUE, COMM_WRITE_BUF_SIZE);
+        // a message, or quiet for 4 characters; a late one still waits no longer than twice its time
+        if (message > 0)
+        {
+            p->rx.min_chunk = message < p->read_size ? message : p->read_size;
+            p->rx.idle_us = io_max((int)rx_bytes_to_us(4, baud), 200);
+            p->rx.max_hold_us = (int)rx_bytes_to_us(2 * message, baud) + 1000;
+        }
+        return true;
+    case io_low_latency:
+        // backpressure after 20 ms of the line, so that stale requests do not pile up
+        p->read_size = IO_READ_SIZE;
+        p->tx_queue = io_clamp(io_max(4 * message, io_line_bytes(baud, 20000)), 256, COMM_WRITE_BUF_SIZE);
+        p->driver_queue = io_clamp(io_max(4 * message, io_line_bytes(baud, 10000)), 1024, IO_DRIVER_QUEUE_MAX);
+        return true;
+    case io_bulk:
+        p->read_size = COMM_READ_BUF_SIZE;
+        p->tx_queue = COMM_WRITE_BUF_SIZE;
+        p->driver_queue = io_clamp(io_line_bytes(baud, 500000), IO_DRIVER_QUEUE, IO_DRIVER_QUEUE_MAX);
+        p->rx.min_chunk = io_clamp(io_max(message, io_line_bytes(baud, 20000)), 1, p->read_size);
+        p->rx.idle_us = io_max((int)rx_bytes_to_us(32, baud), 1000);
+        p->rx.max_hold_us = 50000;
+        // small sends go out together, 5 ms of the line at a time at most
+        p->tx_coalesce = io_clamp(io_line_bytes(baud, 5000), 64, p->tx_queue / 2);
+        p->tx_delay_us = 5000;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// the profile is one a port can run with
+static inline bool io_valid(const uart_io_profile *p)
+{
+    return (p->read_size >= 1) && (p->read_size <= COMM_READ_BUF_SIZE)
+        && (p->tx_queue >= 1) && (p->tx_queue <= COMM_WRITE_BUF_SIZE)
+        && (p->driver_queue >= 0) && (p->driver_queue <= IO_DRIVER_QUEUE_MAX)
+        && (p->rx.min_chunk >= 0) && (p->rx.idle_us >= 0) && (p->rx.max_hold_us >= 0)
+        && (p->tx_coalesce >= 0) && (p->tx_coalesce <= p->tx_queue) && (p->tx_delay_us >= 0);
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef _uart_ring_h
+#define _uart_ring_h
+
+// Lock free byte ring between the threads calling uart_send (producers) and
+// the I/O thread (the only consumer), which writes straight out of the ring.
+//
+// Positions run over [0, 2 * UART_RING_SIZE) so that a full ring can be told
+// from an empty one without a power of 2 size.
+//
+// In MPSC mode producers claim space by CAS on `reserve`, copy without any
+// lock, then publish `head` in claim order. A vectored write claims all of its
+// segments at once, so nothing another producer writes lands between them.
+//
+// Producers fill it up to `limit` bytes (the port's tx_queue), which may be
+// lowered or raised while it is in use.
+
+#include <stdint.h>
+#include <string.h>
+
+#define UART_RING_SIZE      COMM_WRITE_BUF_SIZE
+#define UART_RING_CACHELINE 64
+
+#ifdef _MSC_VER
+#include <intrin.h>
+
+static __forceinline uint32_t ring_load(volatile uint32_t *p)
+{
+    uint32_t v = *p;
+    _ReadWriteBarrier();
+    return v;
+}
+
+static __forceinline void ring_store(volatile uint32_t *p, const uint32_t v)
+{
+    _ReadWriteBarrier();
+    *p = v;
+}
+
+static __forceinline bool ring_cas(volatile uint32_t *p, uint32_t *expected, const uint32_t v)
+{
+    uint32_t old = (uint32_t)_InterlockedCompareExchange((volatile long *)p, (long)v, (long)*expected);
+    if (old == *expected) return true;
+    *expected = old;
+    return false;
+}
+
+static __forceinline uint32_t ring_fetch_add(volatile uint32_t *p, const int32_t v)
+{
+    return (uint32_t)_InterlockedExchangeAdd((volatile long *)p, (long)v);
+}
+
+#define ring_fence() MemoryBarrier()
+#define ring_pause() _mm_pause()
+#define ring_yield() SwitchToThread()
+#else
+#include <sched.h>
+
+#define ring_load(p)            __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ring_store(p, v)        __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ring_cas(p, expected, v) \
+    __atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define ring_fetch_add(p, v)    __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define ring_fence()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__i386__) || defined(__x86_64__)
+#define ring_pause() __builtin_ia32_pause()
+#else
+#define ring_pause() do { } while (0)
+#endif
+#define ring_yield() sched_yield()
+#endif
+
+// One time init of what threads share, e.g. a lookup table: true: the caller
+// builds it, then calls ring_once_done; false: it is built. Other callers wait
+// for it meanwhile.
+static inline bool ring_once(volatile uint32_t *once)
+{
+    for (;;)
+    {
+        uint32_t state = ring_load(once);
+        if (state == 2) return false;
+        if ((state == 0) && ring_cas(once, &state, 1)) return true;
+        ring_yield();
+    }
+}
+
+static inline void ring_once_done(volatile uint32_t *once)
+{
+    ring_store(once, 2);
+}
+
+typedef struct
+{
+    volatile uint32_t head;         // published by producers
+    volatile uint32_t reserve;      // claimed by producers, == head when idle
+    char     pad0[UART_RING_CACHELINE - 2 * sizeof(uint32_t)];
+    volatile uint32_t tail;         // released by the consumer
+    char     pad1[UART_RING_CACHELINE - sizeof(uint32_t)];
+    bool     mpsc;
+    volatile uint32_t limit;        // 1 .. UART_RING_SIZE
+    char     buf[UART_RING_SIZE];
+} uart_ring;
+
+static inline uint32_t ring_add(const uint32_t pos, const uint32_t n)
+{
+    uint32_t r = pos + n;
+    return r >= 2 * UART_RING_SIZE ? r - 2 * UART_RING_SIZE : r;
+}
+
+static inline uint32_t ring_dist(const uint32_t from, const uint32_t to)
+{
+    return to >= from ? to - from : to + 2 * UART_RING_SIZE - from;
+}
+
+static inline uint32_t ring_index(const uint32_t pos)
+{
+    return pos >= UART_RING_SIZE ? pos - UART_RING_SIZE : pos;
+}
+
+static inline void ring_init(uart_ring *r, const bool mpsc)
+{
+    r->head = r->reserve = r->tail = 0;
+    r->mpsc = mpsc;
+    r->limit = UART_RING_SIZE;
+}
+
+// bytes waiting for the consumer
+static inline uint32_t ring_used(uart_ring *r)
+{
+    return ring_dist(ring_load(&r->tail), ring_load(&r->head));
+}
+
+// what producers can still add with the ring filled up to pos
+static inline uint32_t ring_room(uart_ring *r, const uint32_t pos)
+{
+    const uint32_t used = ring_dist(ring_load(&r->tail), pos);
+    const uint32_t limit = ring_load(&r->limit);
+    return used < limit ? limit - used : 0;
+}
+
+static inline void ring_copy_in(uart_ring *r, const uint32_t pos, const char *p, const uint32_t l)
+{
+    const uint32_t i = ring_index(pos);
+    const uint32_t first = UART_RING_SIZE - i < l ? UART_RING_SIZE - i : l;
+    memcpy(r->buf + i, p, first);
+    memcpy(r->buf, p + first, l - first);
+}
+
+// Claims l bytes at *pos for a producer, any thread in MPSC mode, a single
+// thread otherwise. Returns the bytes claimed: l, or 0 when it does not fit,
+// unless partial is set, in which case as much as fits.
+static inline uint32_t ring_claim(uart_ring *r, const uint32_t l, const bool partial, uint32_t *pos)
+{
+    uint32_t space;
+    uint32_t n;
+
+    if (!r->mpsc)
+    {
+        *pos = r->head;
+        space = ring_room(r, *pos);
+        if (space >= l) return l;
+        return partial ? space : 0;
+    }
+
+    *pos = ring_load(&r->reserve);
+    do
+    {
+        space = ring_room(r, *pos);
+        n = l;
+        if (space < n)
+        {
+            if (!partial || (space == 0)) return 0;
+            n = space;
+        }
+    } while (!ring_cas(&r->reserve, pos, ring_add(*pos, n)));
+    return n;
+}
+
+// the n bytes claimed at pos are copied in: hands them to the consumer
+static inline void ring_publish(uart_ring *r, const uint32_t pos, const uint32_t n)
+{
+    const uint32_t next = ring_add(pos, n);
+    if (!r->mpsc)
+    {
+        r->reserve = next;
+        ring_store(&r->head, next);
+        return;
+    }
+
+    // earlier claims publish first; the claimer ahead may have been preempted
+    for (int spin = 0; ring_load(&r->head) != pos; spin++)
+    {
+        if (spin < 64)
+            ring_pause();
+        else
+            ring_yield();
+    }
+    ring_store(&r->head, next);
+}
+
+// Returns the number of bytes queued: l, or 0 when it does not fit, unless
+// partial is set, in which case as much as fits is taken.
+static inline uint32_t ring_write(uart_ring *r, const char *p, const uint32_t l, const bool partial)
+{
+    uint32_t pos;
+    const uint32_t n = ring_claim(r, l, partial, &pos);
+    if (n == 0) return 0;
+    ring_copy_in(r, pos, p, n);
+    ring_publish(r, pos, n);
+    return n;
+}
+
+// the count segments of v, l bytes together, back to back; all or nothing
+static inline uint32_t ring_writev(uart_ring *r, const uart_iovec *v, const int count, const uint32_t l)
+{
+    uint32_t pos;
+    if ((l == 0) || (ring_claim(r, l, false, &pos) == 0)) return 0;
+    uint32_t at = pos;
+    for (int i = 0; i < count; i++)
+    {
+        if (v[i].l <= 0) continue;
+        ring_copy_in(r, at, v[i].p, (uint32_t)v[i].l);
+        at = ring_add(at, (uint32_t)v[i].l);
+    }
+    ring_publish(r, pos, l);
+    return l;
+}
+
+static inline bool ring_put(uart_ring *r, const char *p, const uint32_t l)
+{
+    return ring_write(r, p, l, false) == l;
+}
+
+static inline uint32_t ring_put_some(uart_ring *r, const char *p, const uint32_t l)
+{
+    return ring_write(r, p, l, true);
+}
+
+// consumer: the contiguous readable block at tail, valid until ring_consume
+static inline const char *ring_peek(uart_ring *r, uint32_t *l)
+{
+    const uint32_t tail = r->tail;
+    const uint32_t used = ring_dist(tail, ring_load(&r->head));
+    const uint32_t i = ring_index(tail);
+    *l = UART_RING_SIZE - i < used ? UART_RING_SIZE - i : used;
+    return r->buf + i;
+}
+
+static inline void ring_consume(uart_ring *r, const uint32_t n)
+{
+    ring_store(&r->tail, ring_add(r->tail, n));
+}
+
+#endif
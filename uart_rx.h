@@ -0,0 +1,205 @@
+#ifndef _uart_rx_h
+#define _uart_rx_h
+
+// RX delivery policy shared by the backends.
+//
+// Received bytes are held in comm_read_buf and handed to on_comm_read as one
+// batch when the first of these fires:
+//   * min_chunk bytes are held (or the buffer is full),
+//   * the line has been quiet for idle_us (0: as soon as the driver queue is drained),
+//   * the first held byte is max_hold_us old (0: no limit).
+//
+// While a batch is held the port stops watching for RX and reads again when
+// the wait returned by rx_policy_wait expires, so a slow trickle costs one read
+// per idle period instead of one per byte. The idle limit is checked with that
+// granularity: a batch goes out between idle_us and 2 * idle_us after its last byte.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// bits per character used to turn a baud rate into a byte rate
+#define UART_BITS_PER_CHAR  10
+#define UART_DEFAULT_BAUD   115200
+
+static inline int64_t rx_bytes_to_us(const int bytes, const int baud)
+{
+    return (int64_t)bytes * UART_BITS_PER_CHAR * 1000000 / (baud > 0 ? baud : UART_DEFAULT_BAUD);
+}
+
+// 0: deliver the held batch now; otherwise wait this long (us) before reading again.
+// got: the last read returned data. queue: driver RX queue size, never wait
+// longer than it takes the line to fill half of it.
+static inline int64_t rx_policy_wait(const uart_rx_policy *p,
+                                     const int     held,
+                                     const int64_t first_us,
+                                     const int64_t now,
+                                     const bool    got,
+                                     const int     baud,
+                                     const int     queue)
+{
+    if ((held <= 0) || (p->idle_us <= 0) || (held >= p->min_chunk) || !got)
+        return 0;
+
+    int64_t wait = p->idle_us;
+    int64_t safe = rx_bytes_to_us(queue / 2, baud);
+    if (wait > safe) wait = safe;
+
+    if (p->max_hold_us > 0)
+    {
+        int64_t left = first_us + p->max_hold_us - now;
+        if (left <= 0) return 0;
+        if (wait > left) wait = left;
+    }
+    return wait > 0 ? wait : 0;
+}
+
+// Arrival times of the held batch: when each read returned, and how far into
+// the batch it reached. Past UART_RX_MARKS reads the last mark moves along.
+#define UART_RX_MARKS   16
+
+typedef struct
+{
+    int     count;
+    int     end[UART_RX_MARKS];
+    int64_t us[UART_RX_MARKS];
+} uart_rx_times;
+
+// a read returning at now took the batch from held to held + n bytes
+static inline void rx_times_add(uart_rx_times *t, const int held, const int n, const int64_t now)
+{
+    if (held == 0) t->count = 0;
+    int k = t->count < UART_RX_MARKS ? t->count++ : UART_RX_MARKS - 1;
+    t->end[k] = held + n;
+    t->us[k] = now;
+}
+
+// Byte i came with the first read that reached past it. The bytes of a read
+// are taken to have come in back to back at the byte rate until it returned,
+// but not before the read ahead of it returned.
+static inline int64_t rx_times_of(const uart_rx_times *t, int i, const int baud)
+{
+    if (t->count == 0) return 0;
+    if (i < 0) i = 0;
+    if (i >= t->end[t->count - 1]) i = t->end[t->count - 1] - 1;
+
+    int k = 0;
+    while (t->end[k] <= i) k++;
+    int64_t us = t->us[k] - rx_bytes_to_us(t->end[k] - 1 - i, baud);
+    if ((k > 0) && (us < t->us[k - 1])) us = t->us[k - 1];
+    return us;
+}
+
+// Zero-copy RX (uart_set_rx_pool): the batch is read straight into a buffer
+// of a per-port pool, which on_comm_read receives and keeps until it drops the
+// last reference with uart_rx_release. Meanwhile the I/O thread reads into the
+// next free buffer. With none left the port stops reading until one comes back.
+//
+// The pool outlives the port while buffers are lent out: each lent buffer and
+// the port hold a reference on it, the last one frees it.
+
+#define UART_RX_POOL_MAX    64
+
+#ifdef _WIN32
+typedef HANDLE uart_wake_handle;    // a duplicate of the port's ev_write event, or of rx_wake
+#else
+typedef int    uart_wake_handle;    // a duplicate of the port's eventfd
+#endif
+
+typedef struct _uart_rx_pool uart_rx_pool;
+
+typedef struct
+{
+    uart_rx_pool     *pool;
+    volatile uint32_t refs;         // 0: free
+    char              data[COMM_READ_BUF_SIZE];
+} uart_rx_buf;
+
+struct _uart_rx_pool
+{
+    volatile uint32_t refs;         // the port, plus one per buffer in use
+    volatile uint32_t starved;      // the I/O thread waits for a free buffer
+    uart_wake_handle  wake;
+    int               count;
+    int               next;         // I/O thread: where to look for a free buffer
+    uart_rx_buf       bufs[1];      // count of them
+};
+
+static inline uart_rx_buf *rx_buf_of(const char *p)
+{
+    return (uart_rx_buf *)(p - offsetof(uart_rx_buf, data));
+}
+
+static inline uart_rx_pool *rx_pool_create(const int count, uart_wake_handle wake)
+{
+    uart_rx_pool *pool = (uart_rx_pool *)calloc(1, sizeof(uart_rx_pool) + (count - 1) * sizeof(uart_rx_buf));
+    if (NULL == pool) return NULL;
+    pool->refs = 1;
+    pool->wake = wake;
+    pool->count = count;
+    for (int i = 0; i < count; i++)
+        pool->bufs[i].pool = pool;
+    return pool;
+}
+
+static inline void rx_pool_unref(uart_rx_pool *pool)
+{
+    if (ring_fetch_add(&pool->refs, -1) != 1) return;
+#ifdef _WIN32
+    CloseHandle(pool->wake);
+#else
+    close(pool->wake);
+#endif
+    free(pool);
+}
+
+// I/O thread: a free buffer, or NULL after marking the pool starved
+static inline char *rx_pool_get(uart_rx_pool *pool)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int n = 0; n < pool->count; n++)
+        {
+            uart_rx_buf *b = pool->bufs + pool->next;
+            pool->next = pool->next + 1 < pool->count ? pool->next + 1 : 0;
+            if (ring_load(&b->refs) != 0) continue;
+
+            ring_store(&pool->starved, 0);
+            b->refs = 1;
+            ring_fetch_add(&pool->refs, 1);
+            return b->data;
+        }
+
+        // look once more after publishing the flag, a release in between
+        // may not have seen it
+        ring_store(&pool->starved, 1);
+        ring_fence();
+    }
+    return NULL;
+}
+
+static inline void rx_buf_release(const char *p)
+{
+    uart_rx_buf *b = rx_buf_of(p);
+    uart_rx_pool *pool = b->pool;
+
+    if (ring_fetch_add(&b->refs, -1) != 1) return;
+
+    ring_fence();
+    if (ring_load(&pool->starved))
+    {
+#ifdef _WIN32
+        SetEvent(pool->wake);
+#else
+        uint64_t one = 1;
+        ssize_t r = write(pool->wake, &one, sizeof(one));
+        (void)r;
+#endif
+    }
+    rx_pool_unref(pool);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _uart_stats_h
+#define _uart_stats_h
+
+// Per port counters behind uart_get_stats, shared by the backends.
+//
+// The I/O thread is the only writer of most of them and bumps them with
+// relaxed loads and stores, no locked instruction on the hot path; the few
+// that producers touch (tx_dropped, tx_high_water, tx_wakeups) take relaxed
+// atomic adds. uart_reset_stats moves a baseline instead of zeroing the
+// counters under their writer, so readers and the writer never have to meet.
+
+#include "uart_ring.h"
+#include "uart_rx.h"
+
+#ifdef _MSC_VER
+// aligned 64 bit loads and stores are atomic on x64 (a 32 bit build may tear a count)
+#define stat_load(p)        (*(volatile uint64_t *)(p))
+#define stat_store(p, v)    (*(volatile uint64_t *)(p) = (v))
+#define stat_add(p, v)      _InterlockedExchangeAdd64((volatile __int64 *)(p), (__int64)(v))
+#define stat_cas(p, expected, v) \
+    (_InterlockedCompareExchange64((volatile __int64 *)(p), (__int64)(v), (__int64)*(expected)) == (__int64)*(expected))
+#else
+#define stat_load(p)        __atomic_load_n(p, __ATOMIC_RELAXED)
+#define stat_store(p, v)    __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define stat_add(p, v)      __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define stat_cas(p, expected, v) \
+    __atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#endif
+
+// single writer (the I/O thread)
+#define stat_bump(p, v)     stat_store(p, stat_load(p) + (v))
+
+#define UART_STATS_COUNT    (sizeof(uart_stats) / sizeof(uint64_t))
+
+static inline void stat_max(uint64_t *p, const uint64_t v)
+{
+    uint64_t cur = stat_load(p);
+    while ((v > cur) && !stat_cas(p, &cur, v))
+        cur = stat_load(p);
+}
+
+// TX waited for the device from *since (the first write that would block, or
+// that is left pending) to now, when one got through
+static inline void stat_tx_unblocked(uart_stats *s, int64_t *since, const int64_t now)
+{
+    uint64_t us = (uint64_t)(now - *since);
+    *since = 0;
+    stat_bump(&s->tx_pending_us, us);
+    if (us > stat_load(&s->tx_pending_max_us))
+        stat_store(&s->tx_pending_max_us, us);
+}
+
+// Of a TX wait of us, the part sending sent bytes at the baud rate does not
+// account for. The driver's queue was full all along, so the line was held.
+static inline void stat_tx_throttled(uart_stats *s, const int64_t us, const int sent, const int baud)
+{
+    const int64_t busy = rx_bytes_to_us(sent, baud);
+    if (us > busy) stat_bump(&s->tx_throttled_us, (uint64_t)(us - busy));
+}
+
+// live - base; the high-water marks are not counts and are taken as they are
+static inline void stats_snapshot(uart_stats *live, const uart_stats *base, uart_stats *out)
+{
+    uint64_t *l = (uint64_t *)live;
+    const uint64_t *b = (const uint64_t *)base;
+    uint64_t *o = (uint64_t *)out;
+    for (unsigned i = 0; i < UART_STATS_COUNT; i++)
+        o[i] = stat_load(&l[i]) - b[i];
+    out->tx_high_water = stat_load(&live->tx_high_water);
+    out->tx_pending_max_us = stat_load(&live->tx_pending_max_us);
+}
+
+static inline void stats_reset(uart_stats *live, uart_stats *base)
+{
+    uint64_t *l = (uint64_t *)live;
+    uint64_t *b = (uint64_t *)base;
+    for (unsigned i = 0; i < UART_STATS_COUNT; i++)
+        b[i] = stat_load(&l[i]);
+    stat_store(&live->tx_high_water, (uint64_t)0);
+    stat_store(&live->tx_pending_max_us, (uint64_t)0);
+}
+
+#endif
@@ -1,16 +1,44 @@
 // http://msdn.microsoft.com/en-us/library/ms810467.aspx
 //
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <stdint.h>
 
-#include "uart_win32.h"
+#include "uart.h"
+#include "uart_capture.h"
 
 int port_dbg_print(const char *s, ...);
 
 #define dbg_print dummy // port_dbg_print // dummy //printf
 
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+
+// driver queue sizes given to SetupComm, at least: uart_config grows them
+// to 100 ms at the baud rate
+#define BUF_SIZE    10240
+
+// a reactor worker waits on its stop/change event plus the events of each port
+#define SHARD_MAX_PORTS ((MAXIMUM_WAIT_OBJECTS - 1) / ev_last)
+
+struct _uart_shard
+{
+    uart_reactor   *reactor;
+    HANDLE          h_thread;
+    DWORD           thread_id;
+    HANDLE          ev_change;      // ports added, or the reactor stops
+    volatile bool   stop;
+    int             count;          // ports, protected by the reactor lock
+    uart_obj       *ports[SHARD_MAX_PORTS];
+};
+
+struct _uart_reactor
+{
+    int             workers;
+    SRWLOCK         lock;
+    uart_shard     *shards;
+};
 
 #ifdef MAKE_DLL
 
@@ -27,12 +55,58 @@ void dummy(...)
 {
 }
 
+static void rx_pool_drop(p_uart_obj uart)
+{
+    if (NULL != uart->rx_pool)
+    {
+        if (NULL != uart->rx_buf) rx_buf_release(uart->rx_buf);
+        rx_pool_unref(uart->rx_pool);
+    }
+    if (NULL != uart->rx_pool_next) rx_pool_unref(uart->rx_pool_next);
+    uart->rx_pool = uart->rx_pool_next = NULL;
+    uart->rx_buf = uart->comm_read_buf;
+}
+
 static int finalize(p_uart_obj uart)
 {
     CloseHandle(uart->h_comm);
+
+    // the blocked read of uart_rx_loop fails now, a wait for a pool buffer
+    // ends on rx_wake; let it go before its buffer does
+    if (NULL != uart->h_comm_state)
+    {
+        uart->rx_stop = true;
+        SetEvent(uart->rx_wake);
+        if (GetCurrentThreadId() != GetThreadId(uart->h_comm_state))
+            WaitForSingleObject(uart->h_comm_state, 1000);
+        CloseHandle(uart->h_comm_state);
+        uart->h_comm_state = NULL;
+    }
+    rx_pool_drop(uart);
+    frame_free(uart->framer);
+    uart->framer = NULL;
     for (int i = 0; i < ev_last; i++)
         CloseHandle(uart->events[i]);
-    DeleteCriticalSection(&uart->cs);
+    CloseHandle(uart->rx_wake);
+    for (int i = 0; i < UART_MAX_WATCHES; i++)
+    {
+        uart_watch_entry *w = &uart->watches[i];
+        if (NULL != w->ev)
+        {
+            if (NULL != w->on_watch)
+                WSAEventSelect((SOCKET)w->fd, NULL, 0);
+            WSACloseEvent(w->ev);
+        }
+        w->on_watch = NULL;
+        w->ev = NULL;
+    }
+
+    // release blocked senders and expect waiters
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    uart->closed = true;
+    WakeAllConditionVariable(&uart->tx_space);
+    WakeAllConditionVariable(&uart->expect_match);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
     return 0;
 }
 
@@ -43,66 +117,105 @@ static int fatal(p_uart_obj uart, const char *msg)
     return -1;
 }
 
-static bool comm_read2(p_uart_obj uart, char b)
+// between two batches: switch to a pool given by uart_set_rx_pool
+static void rx_pool_adopt(p_uart_obj uart)
 {
-    COMSTAT comStat;
-    DWORD   dwErrors;
-    bool first = true;
+    if ((NULL == uart->rx_pool_next) || (uart->rx_held > 0) || (NULL != uart->rx_pool))
+        return;
+    uart->rx_pool = uart->rx_pool_next;
+    uart->rx_buf = rx_pool_get(uart->rx_pool);
+
+    // lets uart_set_rx_pool return
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    uart->rx_pool_next = NULL;
+    WakeAllConditionVariable(&uart->tx_space);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+}
 
-    uart->comm_read_buf[0] = b;
+// the batch through the expect automaton, ahead of the framer
+static void rx_expect(p_uart_obj uart, const int l)
+{
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    if ((NULL != uart->expect.e) && (expect_feed(&uart->expect, uart->rx_buf, l, &uart->rx_times, uart->baud) > 0))
+        WakeAllConditionVariable(&uart->expect_match);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+}
 
-    // Get and clear current errors on the port.
-    if (!ClearCommError(uart->h_comm, &dwErrors, &comStat) || (comStat.cbInQue == 0))
+static void rx_deliver(p_uart_obj uart)
+{
+    int l = uart->rx_held;
+    if (l <= 0) return;
+
+    uart->rx_held = 0;
+    stat_bump(&uart->stats.rx_bytes, l);
+    stat_bump(&uart->stats.rx_chunks, 1);
+    if (NULL != uart->capture)
+        capture_append(uart->capture, CAPTURE_RX, uart->capture_port, rx_times_of(&uart->rx_times, 0, uart->baud),
+                       uart->rx_buf, l);
+    if (NULL != uart->expect.e)
+        rx_expect(uart, l);
+    if (NULL != uart->framer)
     {
-        uart->on_comm_read(uart->comm_read_param, uart->comm_read_buf, 1);
-        return true;
+        // frames are handed over from rx_buf, which stays the port's
+        frame_feed(uart->framer, &uart->stats, uart->rx_buf, l);
+        return;
+    }
+    if (NULL == uart->rx_pool)
+    {
+        uart->on_comm_read(uart->comm_read_param, uart->comm_read_buf, l);
+        rx_pool_adopt(uart);
+        return;
     }
 
-    dbg_print("comStat.cbInQue = %d, \n", (int)comStat.cbInQue);
+    // the buffer is the consumer's now, until uart_rx_release
+    char *p = uart->rx_buf;
+    uart->on_comm_read(uart->comm_read_param, p, l);
+    uart->rx_buf = rx_pool_get(uart->rx_pool);
+}
 
-    DWORD to_read;
-    DWORD read;
+// room left in the batch; when read_size dropped below what is held, that goes out first
+static int rx_space(p_uart_obj uart)
+{
+    const int size = uart->io.read_size;
+    if (uart->rx_held >= size) rx_deliver(uart);
+    return size - uart->rx_held;
+}
 
-    uart->comm_read_buf[0] = b;
-    to_read = MIN(COMM_READ_BUF_SIZE - 1, comStat.cbInQue);
-    while (to_read > 0)
-    {
-        if (!ReadFile(uart->h_comm, first ? uart->comm_read_buf + 1 : uart->comm_read_buf,
-                      to_read, &read, &uart->o_read))
-        {
-            if (GetLastError() == ERROR_IO_PENDING)
-            {
-                if (WaitForSingleObject(uart->o_read.hEvent, INFINITE) != WAIT_OBJECT_0)
-                {
-                    dbg_print("ReadFile wait error\n");
-                    return false;
-                }
-                continue;
-            }
-            else
-            {
-                dbg_print("ReadFile ERROR_IO_PENDING\n");
-                return false;
-            }
-        }
-        if (to_read != read)
-        {
-            dbg_print("to_read != read: %ld, %ld\n", to_read, read);
-            return false;
-        }
-        uart->on_comm_read(uart->comm_read_param, uart->comm_read_buf, first ? to_read + 1 : to_read);
-        comStat.cbInQue -= to_read;
-        to_read = MIN(COMM_READ_BUF_SIZE, comStat.cbInQue);
-        first = false;
-    }
+// deliver the held batch, or stop waiting for EV_RXCHAR until the RX policy wait is over
+static void rx_schedule(p_uart_obj uart, const bool got)
+{
+    int64_t now = uart_time_us();
+    int64_t wait = rx_policy_wait(&uart->rx_policy, uart->rx_held, uart->rx_times.us[0],
+                                  now, got, uart->baud, uart->comm_buf);
+    if (wait == 0)
+        rx_deliver(uart);
+    uart->rx_parked = wait > 0;
+    uart->rx_park_until = now + wait;
+}
 
-    return true;
+static DWORD rx_wait_ms(p_uart_obj uart)
+{
+    if (!uart->rx_parked) return INFINITE;
+    int64_t left = uart->rx_park_until - uart_time_us();
+    return left > 0 ? (DWORD)((left + 999) / 1000) : 0;
+}
+
+// the errors ClearCommError reported into the stats
+static void stats_errors(p_uart_obj uart, const DWORD errors)
+{
+    if (errors == 0) return;
+    if (errors & CE_BREAK) stat_bump(&uart->stats.breaks, 1);
+    if (errors & CE_FRAME) stat_bump(&uart->stats.framing_errors, 1);
+    if (errors & CE_RXPARITY) stat_bump(&uart->stats.parity_errors, 1);
+    if (errors & CE_OVERRUN) stat_bump(&uart->stats.overruns, 1);
+    if (errors & CE_RXOVER) stat_bump(&uart->stats.rx_overflows, 1);
 }
 
 static bool comm_read(p_uart_obj uart)
 {
     COMSTAT comStat;
     DWORD   dwErrors;
+    bool    got = false;
 
     // Get and clear current errors on the port.
     if (!ClearCommError(uart->h_comm, &dwErrors, &comStat))
@@ -110,31 +223,32 @@ static bool comm_read(p_uart_obj uart)
         dbg_print("error: ClearCommError\n");
         return false;
     }
+    stats_errors(uart, dwErrors);
 
     dbg_print("comStat.cbInQue = %d, \n", (int)comStat.cbInQue);
 
     if (comStat.cbInQue == 0)
-    {
         dbg_print("warn: comStat.cbInQue == 0\n");
-        return true;
-    }
 
     DWORD to_read;
     DWORD read;
 
-    static int wait = 0;
-    if (wait) return true;
-    wait = 1;
-
-    to_read = MIN(COMM_READ_BUF_SIZE, comStat.cbInQue);
+    rx_pool_adopt(uart);
+    to_read = MIN((DWORD)rx_space(uart), comStat.cbInQue);
     while (to_read > 0)
     {
+        // pool starved: EV_RXCHAR is not waited for until uart_rx_release sets ev_write
+        if ((NULL == uart->rx_buf) && ((uart->rx_buf = rx_pool_get(uart->rx_pool)) == NULL))
+            return true;
+
         ResetEvent(uart->o_read.hEvent);
-        if (!ReadFile(uart->h_comm, uart->comm_read_buf, to_read, &read, &uart->o_read))
+        stat_bump(&uart->stats.rx_syscalls, 1);
+        if (!ReadFile(uart->h_comm, uart->rx_buf + uart->rx_held, to_read, &read, &uart->o_read))
         {
             if (GetLastError() == ERROR_IO_PENDING)
             {
-                if (WaitForSingleObject(uart->o_read.hEvent, 500) != WAIT_OBJECT_0)
+                if ((WaitForSingleObject(uart->o_read.hEvent, 500) != WAIT_OBJECT_0)
+                    || !GetOverlappedResult(uart->h_comm, &uart->o_read, &read, FALSE))
                 {
                     dbg_print("ReadFile wait error\n");
                     return false;
@@ -147,55 +261,163 @@ static bool comm_read(p_uart_obj uart)
             }
         }
 
-        if (read == 0) continue;
+        if (read == 0) break;
 
-        uart->on_comm_read(uart->comm_read_param, uart->comm_read_buf, to_read);
-        comStat.cbInQue -= to_read;
-        to_read = MIN(COMM_READ_BUF_SIZE, comStat.cbInQue);
+        rx_times_add(&uart->rx_times, uart->rx_held, read, uart_time_us());
+        uart->rx_held += read;
+        got = true;
+        if (uart->rx_held >= uart->io.read_size)
+            rx_deliver(uart);
+        comStat.cbInQue -= MIN(read, comStat.cbInQue);
+        to_read = MIN((DWORD)rx_space(uart), comStat.cbInQue);
     }
 
-    wait = 0;
-
+    rx_schedule(uart, got);
     return true;
 }
 
-static bool comm_write(p_uart_obj uart, bool &pending)
+// called by the I/O thread after TX bytes left the ring
+static void tx_released(p_uart_obj uart)
 {
-    bool r = true;
-    DWORD to_write;
-    DWORD write;
+    // pairs with the waiter count taken before the space check in uart_send_timeout
+    ring_fence();
+    if (ring_load(&uart->tx_waiters) > 0)
+    {
+        AcquireSRWLockExclusive(&uart->tx_lock);
+        WakeAllConditionVariable(&uart->tx_space);
+        ReleaseSRWLockExclusive(&uart->tx_lock);
+    }
+
+    if ((NULL != uart->on_comm_writable) && ring_load(&uart->writable_armed))
+    {
+        uint32_t used = ring_used(&uart->tx);
+        if ((int)used <= uart->writable_low)
+        {
+            ring_store(&uart->writable_armed, 0);
+            uart->on_comm_writable(uart->comm_writable_param, ring_room(&uart->tx, ring_load(&uart->tx.head)));
+        }
+    }
+}
+
+// uart_purge requests, on the I/O thread
+static void purge(p_uart_obj uart)
+{
+    if (ring_load(&uart->purge_rx))
+    {
+        ring_store(&uart->purge_rx, 0);
+        PurgeComm(uart->h_comm, PURGE_RXCLEAR);
+        // in sync mode the batch belongs to the thread of uart_rx_loop
+        if (uart->async_io) uart->rx_held = 0;
+    }
+    if (ring_load(&uart->purge_tx))
+    {
+        ring_store(&uart->purge_tx, 0);
+        PurgeComm(uart->h_comm, PURGE_TXABORT | PURGE_TXCLEAR);
+        if (uart->write_pending)
+        {
+            // the aborted write completes right away, its block is dropped anyway
+            DWORD transfered;
+            GetOverlappedResult(uart->h_comm, &uart->o_write, &transfered, TRUE);
+            stat_tx_unblocked(&uart->stats, &uart->tx_blocked_us, uart_time_us());
+            uart->write_pending = false;
+            ring_store(&uart->tx_held, 0);
+            ResetEvent(uart->events[ev_comm_write]);
+        }
+        uint32_t l;
+        while ((ring_peek(&uart->tx, &l), l) > 0)
+            ring_consume(&uart->tx, l);
+        tx_released(uart);
+    }
+}
 
-    if (pending) goto ret;
+// the bytes in the driver's output queue, 0 if unknown
+static int comm_outq(p_uart_obj uart)
+{
+    DWORD errors;
+    COMSTAT comStat;
+    if (!ClearCommError(uart->h_comm, &errors, &comStat)) return 0;
+    stats_errors(uart, errors);
+    return (int)comStat.cbOutQue;
+}
+
+// The pending write completed: the wait into the stats, and what of it sending
+// the bytes that left the queue meanwhile does not explain as throttled.
+static void tx_unblocked(p_uart_obj uart, const DWORD transfered)
+{
+    const int64_t now = uart_time_us();
+    const int sent = uart->tx_blocked_outq + (int)transfered - comm_outq(uart);
+    if (sent > 0)
+        stat_tx_throttled(&uart->stats, now - uart->tx_blocked_us, sent, uart->baud);
+    stat_tx_unblocked(&uart->stats, &uart->tx_blocked_us, now);
+}
 
-    EnterCriticalSection(&uart->cs);
+// the block handed to WriteFile stays in the ring until the write completes
+static bool comm_write(p_uart_obj uart)
+{
+    DWORD write;
+    bool r = true;
 
-    to_write = uart->write_buf_used;
-    if (to_write <= 0) goto ret;
-    memcpy(uart->comm_write_send_buf, uart->comm_write_buf, to_write);
-    uart->write_buf_used = 0;
+    if (uart->write_pending) return true;
 
-    dbg_print("sending %d bytes...\n", (int)to_write);
-    if (!WriteFile(uart->h_comm, uart->comm_write_send_buf, to_write, &write, &uart->o_write))
+    while (true)
     {
-        pending = GetLastError() == ERROR_IO_PENDING;
-        r = pending;
+        uint32_t to_write;
+        const char *p = ring_peek(&uart->tx, &to_write);
+        if (to_write == 0) break;
+
+        dbg_print("sending %d bytes...\n", (int)to_write);
+        stat_bump(&uart->stats.tx_syscalls, 1);
+        if (!WriteFile(uart->h_comm, p, to_write, &write, &uart->o_write))
+        {
+            uart->write_pending = GetLastError() == ERROR_IO_PENDING;
+            r = uart->write_pending;
+            if (uart->write_pending) ring_store(&uart->tx_held, 1);
+            if (uart->write_pending && (uart->tx_blocked_us == 0))
+            {
+                uart->tx_blocked_us = uart_time_us();
+                uart->tx_blocked_outq = comm_outq(uart);
+            }
+            if (uart->write_pending && (NULL != uart->capture))
+                capture_append(uart->capture, CAPTURE_TX, uart->capture_port, uart_time_us(), p, to_write);
+            break;
+        }
+        if (uart->tx_blocked_us != 0)
+            stat_tx_unblocked(&uart->stats, &uart->tx_blocked_us, uart_time_us());
+        stat_bump(&uart->stats.tx_bytes, write);
+        stat_bump(&uart->stats.tx_chunks, 1);
+        if (NULL != uart->capture)
+            capture_append(uart->capture, CAPTURE_TX, uart->capture_port, uart_time_us(), p, write);
+        ring_consume(&uart->tx, write);
     }
-    else;
 
-ret:
-    LeaveCriticalSection(&uart->cs);
+    tx_released(uart);
     return r;
 }
 
+static int modem_lines(uart_obj *uart)
+{
+    DWORD m = 0;
+    GetCommModemStatus(uart->h_comm, &m);
+    return ((m & MS_CTS_ON) ? UART_LINE_CTS : 0) | ((m & MS_DSR_ON) ? UART_LINE_DSR : 0)
+        | ((m & MS_RING_ON) ? UART_LINE_RI : 0) | ((m & MS_RLSD_ON) ? UART_LINE_DCD : 0);
+}
+
 static bool handle_comm_event(uart_obj *uart, const DWORD event)
 {
+    int happened = 0;
+
     // A line-status error occurred. Line-status errors are CE_FRAME, CE_OVERRUN, and CE_RXPARITY.
-    if (event & EV_ERR)
+    if (event & (EV_ERR | EV_BREAK))
     {
         DWORD errors;
         dbg_print("event: EV_ERR\n");
         if (ClearCommError(uart->h_comm, &errors, NULL))
         {
+            stats_errors(uart, errors);
+            happened = ((errors & CE_BREAK) ? UART_LINE_BREAK : 0)
+                | ((errors & CE_FRAME) ? UART_LINE_FRAMING : 0)
+                | ((errors & CE_RXPARITY) ? UART_LINE_PARITY : 0)
+                | ((errors & (CE_OVERRUN | CE_RXOVER)) ? UART_LINE_OVERRUN : 0);
 #define check_error(err) if (errors & err) dbg_print("error cleared: " #err "\n")
 
             check_error(CE_BREAK);
@@ -263,103 +485,290 @@ static bool handle_comm_event(uart_obj *uart, const DWORD event)
         dbg_print("event: EV_TXEMPTY\n");
     }
 
+    if ((NULL != uart->on_comm_line) && (event & (EV_ERR | EV_BREAK | EV_CTS | EV_DSR | EV_RING | EV_RLSD)))
+    {
+        int line = modem_lines(uart);
+        int changed = line ^ uart->line_in;
+        uart->line_in = line;
+        // a ring pulse may be over before the status is read
+        if (event & EV_RING) changed |= UART_LINE_RI;
+        if ((changed | happened) != 0)
+            uart->on_comm_line(uart->comm_line_param, line | happened, changed);
+    }
+
     return true;
 
 error:
     return false;
 }
 
+// Without async_io, reads block in the driver, which does the batching of the
+// RX policy through COMMTIMEOUTS (see rx_timeouts), so every read is delivered as is.
 static DWORD WINAPI uart_rx_loop(uart_obj* uart)
 {
     DWORD len = 0;
-    char b = 0;
 
-    while (ReadFile(uart->h_comm, &b, 1, &len, NULL))
+    while (!uart->closed && !uart->rx_stop)
     {
-        if (len)
-            comm_read2(uart, b);
-        else
-            Sleep(10);
+        // the I/O thread changes them under tx_lock, see io_adopt
+        AcquireSRWLockShared(&uart->tx_lock);
+        const uart_rx_policy policy = uart->rx_policy;
+        DWORD to_read = uart->io.read_size;
+        ReleaseSRWLockShared(&uart->tx_lock);
+        if ((policy.idle_us > 0) && (policy.min_chunk > 0))
+            to_read = MIN(to_read, (DWORD)policy.min_chunk);
+
+        rx_pool_adopt(uart);
+        if ((NULL == uart->rx_buf) && ((uart->rx_buf = rx_pool_get(uart->rx_pool)) == NULL))
+        {
+            // pool starved: uart_rx_release sets rx_wake, the pool's wake handle here
+            WaitForSingleObject(uart->rx_wake, INFINITE);
+            continue;
+        }
+
+        stat_bump(&uart->stats.rx_syscalls, 1);
+        if (!ReadFile(uart->h_comm, uart->rx_buf, to_read, &len, &uart->o_read))
+        {
+            if (GetLastError() != ERROR_IO_PENDING)
+                break;
+            if (!GetOverlappedResult(uart->h_comm, &uart->o_read, &len, TRUE))
+                break;
+        }
+
+        if (len == 0) continue;
+        rx_times_add(&uart->rx_times, 0, len, uart_time_us());
+        uart->rx_held = len;
+        rx_deliver(uart);
     }
 
     return 0;
 }
 
-static bool wait_comm_event(uart_obj *uart, DWORD &event, bool &pending)
+static void rx_timeouts(p_uart_obj uart, COMMTIMEOUTS *timeout)
+{
+    const uart_rx_policy *policy = &uart->rx_policy;
+
+    if (uart->async_io)
+    {
+        // only what cbInQue reports is read
+        timeout->ReadIntervalTimeout = MAXDWORD;
+        timeout->ReadTotalTimeoutMultiplier = 0;
+        timeout->ReadTotalTimeoutConstant = 0;
+    }
+    else if (policy->idle_us > 0)
+    {
+        // return after an idle gap, or max_hold_us into the read (0: not used)
+        timeout->ReadIntervalTimeout = (DWORD)((policy->idle_us + 999) / 1000);
+        timeout->ReadTotalTimeoutMultiplier = 0;
+        timeout->ReadTotalTimeoutConstant = (DWORD)((policy->max_hold_us + 999) / 1000);
+    }
+    else
+    {
+        // wait for the first byte, then return whatever is there
+        timeout->ReadIntervalTimeout = MAXDWORD;
+        timeout->ReadTotalTimeoutMultiplier = MAXDWORD;
+        timeout->ReadTotalTimeoutConstant = MAXDWORD - 1;
+    }
+    timeout->WriteTotalTimeoutMultiplier = 10;
+    timeout->WriteTotalTimeoutConstant = 1000;
+}
+
+// the profile of uart_set_io_profile or uart_set_rx_policy, on the I/O thread
+static void io_adopt(p_uart_obj uart)
+{
+    if (!ring_load(&uart->io_pending)) return;
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    const bool resize = uart->io_next.driver_queue != uart->io.driver_queue;
+    uart->io = uart->io_next;
+    uart->rx_policy = uart->io.rx;
+    ring_store(&uart->tx_coalesce, (uint32_t)uart->io.tx_coalesce);
+    ring_store(&uart->io_pending, 0);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+
+    COMMTIMEOUTS timeout;
+    rx_timeouts(uart, &timeout);
+    SetCommTimeouts(uart->h_comm, &timeout);
+    // SetupComm, and the XON/XOFF limits that follow the queue size
+    if (resize) uart_config(uart, 0, "", 0, 0);
+}
+
+static bool wait_comm_event(uart_obj *uart)
 {
     if (!uart->async_io) return true;
 
-    if (pending) return true;
+    if (uart->event_pending) return true;
 
-    while (true)
+    // while a batch is held EV_RXCHAR is not waited for (see rx_timer), nor
+    // while the RX pool is starved
+    while (!uart->rx_parked && (NULL != uart->rx_buf))
     {
-        if (!WaitCommEvent(uart->h_comm, &event, &uart->o_event))
+        if (!WaitCommEvent(uart->h_comm, &uart->comm_event, &uart->o_event))
         {
-            pending = GetLastError() == ERROR_IO_PENDING;
-            dbg_print("WaitCommEvent pending: %d\n", pending);
-            return pending;
+            uart->event_pending = GetLastError() == ERROR_IO_PENDING;
+            dbg_print("WaitCommEvent pending: %d\n", uart->event_pending);
+            return uart->event_pending;
         }
         else
         {
-            if (!handle_comm_event(uart, event))
+            if (!handle_comm_event(uart, uart->comm_event))
                 return false;
         }
     }
+    return true;
 }
 
-static DWORD WINAPI uart_thread(uart_obj* uart)
+// the RX policy wait is over: take what arrived meanwhile
+static bool rx_timer(uart_obj *uart)
+{
+    uart->rx_parked = false;
+    if (!comm_read(uart))
+        return false;
+    return wait_comm_event(uart);
+}
+
+// handles events[index] being signaled; false: the port failed
+static bool uart_event(uart_obj *uart, const int index)
 {
-    // Misc. variables
     DWORD transfered = 0;
 
-    bool  shutdown = false;
-    DWORD event = 0;
-    bool  event_pending = false;
-    bool  write_pending = false;
+    switch (index)
+    {
+    case ev_shutdown:
+        uart->shutdown = true;
+        return true;
+    case ev_comm_event:
+        // read event
+        uart->event_pending = false;
+        if (!GetOverlappedResult(uart->h_comm, &uart->o_event, &transfered, FALSE))
+        {
+            dbg_print("error: GetOverlappedResult\n");
+            return false;
+        }
+        ResetEvent(uart->events[ev_comm_event]);
+        if (!handle_comm_event(uart, uart->comm_event))
+            return false;
+        return wait_comm_event(uart);
+    case ev_comm_write:
+        ResetEvent(uart->events[ev_comm_write]);
+        // the event is also set by writes that completed synchronously
+        if (uart->write_pending)
+        {
+            uart->write_pending = false;
+            // pairs with the fence in tx_put: a send either sees the flag down and
+            // sets ev_write, or its bytes are in the ring for comm_write below
+            ring_store(&uart->tx_held, 0);
+            ring_fence();
+            if (!GetOverlappedResult(uart->h_comm, &uart->o_write, &transfered, FALSE))
+            {
+                dbg_print("error: GetOverlappedResult\n");
+                return false;
+            }
+            tx_unblocked(uart, transfered);
+            stat_bump(&uart->stats.tx_bytes, transfered);
+            stat_bump(&uart->stats.tx_chunks, 1);
+            ring_consume(&uart->tx, transfered);
+        }
+        return comm_write(uart);
+    case ev_write:
+        purge(uart);
+        io_adopt(uart);
+        // a pool buffer came back or a pool is to be installed
+        if (uart->async_io && ((NULL == uart->rx_buf) || (NULL != uart->rx_pool_next)))
+        {
+            if (!comm_read(uart) || !wait_comm_event(uart))
+                return false;
+        }
+        return comm_write(uart);
+    default:
+        return false;
+    }
+}
+
+static long watch_network_events(const int events)
+{
+    return ((events & UART_WATCH_IN) ? FD_READ | FD_ACCEPT | FD_CLOSE : 0)
+        | ((events & UART_WATCH_OUT) ? FD_WRITE | FD_CONNECT : 0);
+}
+
+// the event of a socket given to uart_watch is signaled
+static void watch_event(uart_obj *uart, const int index)
+{
+    uart_watch_entry *w = &uart->watches[index];
+    WSANETWORKEVENTS ne;
+
+    if (NULL == w->on_watch) return;
+    if (WSAEnumNetworkEvents((SOCKET)w->fd, w->ev, &ne) != 0)
+    {
+        w->on_watch(w->watch_param, w->fd, UART_WATCH_ERR | (w->events & UART_WATCH_IN));
+        return;
+    }
+
+    int events = 0;
+    if (ne.lNetworkEvents & (FD_READ | FD_ACCEPT | FD_CLOSE)) events |= UART_WATCH_IN;
+    if (ne.lNetworkEvents & (FD_WRITE | FD_CONNECT)) events |= UART_WATCH_OUT;
+    if (((ne.lNetworkEvents & FD_CLOSE) && (ne.iErrorCode[FD_CLOSE_BIT] != 0))
+        || ((ne.lNetworkEvents & FD_CONNECT) && (ne.iErrorCode[FD_CONNECT_BIT] != 0)))
+        events |= UART_WATCH_ERR;
+    events &= w->events | UART_WATCH_ERR;
+    if (events != 0)
+        w->on_watch(w->watch_param, w->fd, events);
+}
+
+static void port_close(uart_obj *uart, const enum_comm_close reason)
+{
+    rx_deliver(uart);
+    finalize(uart);
+    if (NULL != uart->on_comm_close)
+        uart->on_comm_close(uart->comm_close_param, reason);
+}
+
+static DWORD WINAPI uart_thread(uart_obj* uart)
+{
     DWORD r = 0;
     enum_comm_close reason = cc_shutdown;
+    HANDLE handles[ev_last + UART_MAX_WATCHES];
+    int watch_index[UART_MAX_WATCHES];
 
-    if (!wait_comm_event(uart, event, event_pending))
+    if (!wait_comm_event(uart))
         goto error;
 
-    while (!shutdown)
+    while (!uart->shutdown)
     {
-        DWORD Event = WaitForMultipleObjects(sizeof(uart->events) / sizeof(uart->events[0]),
-            uart->events, FALSE, INFINITE);
-        dbg_print("Event = %d\n", (int)Event - WAIT_OBJECT_0);
-        switch (Event)
+        DWORD timeout = rx_wait_ms(uart);
+        if (timeout == 0)
         {
-        case WAIT_OBJECT_0 + ev_shutdown:
-            shutdown = true;
-            break;
-        case WAIT_OBJECT_0 + ev_comm_event:
-            // read event
-            event_pending = false;
-            if (!GetOverlappedResult(uart->h_comm, &uart->o_event, &transfered, FALSE))
-            {
-                dbg_print("error: GetOverlappedResult\n");
-                goto error;
-            }
-            ResetEvent(uart->events[ev_comm_event]);
-            if (!handle_comm_event(uart, event))
+            if (!rx_timer(uart))
                 goto error;
-            if (!wait_comm_event(uart, event, event_pending))
-                goto error;
-            break;
-        case WAIT_OBJECT_0 + ev_comm_write:
-            write_pending = false;
-            ResetEvent(uart->events[ev_comm_write]);
-            if (!comm_write(uart, write_pending))
-                goto error;
-            break;
-        case WAIT_OBJECT_0 + ev_write:
-            if (!comm_write(uart, write_pending))
+            continue;
+        }
+
+        // the watches may have changed in any callback, rebuild the wait list
+        DWORD n = ev_last;
+        memcpy(handles, uart->events, sizeof(uart->events));
+        for (int i = 0; i < UART_MAX_WATCHES; i++)
+        {
+            if (NULL == uart->watches[i].on_watch) continue;
+            watch_index[n - ev_last] = i;
+            handles[n++] = uart->watches[i].ev;
+        }
+
+        DWORD Event = WaitForMultipleObjects(n, handles, FALSE, timeout);
+        dbg_print("Event = %d\n", (int)Event - WAIT_OBJECT_0);
+        if (Event == WAIT_TIMEOUT)
+        {
+            if (!rx_timer(uart))
                 goto error;
-            break;
-        default:
+            continue;
+        }
+        if (Event - WAIT_OBJECT_0 >= n)
             goto error;
+        if (Event - WAIT_OBJECT_0 >= ev_last)
+        {
+            watch_event(uart, watch_index[Event - WAIT_OBJECT_0 - ev_last]);
+            continue;
         }
-
+        if (!uart_event(uart, Event - WAIT_OBJECT_0))
+            goto error;
     }
 
     goto clean_up;
@@ -370,13 +779,137 @@ error:
 
 clean_up:
 
-    finalize(uart);
-    if (NULL != uart->on_comm_close)
-        uart->on_comm_close(uart->comm_close_param, reason);
-
+    port_close(uart, reason);
     return r;
 }
 
+// Removes the ports that failed or were shut down from the shard, starts
+// waiting on the ones just added, and rebuilds the wait list. Returns the
+// number of ports left.
+static int shard_sync(uart_shard *shard, uart_obj **ports, HANDLE *handles)
+{
+    uart_reactor *reactor = shard->reactor;
+    int count;
+
+    while (true)
+    {
+        uart_obj *gone[SHARD_MAX_PORTS];
+        int n = 0;
+
+        AcquireSRWLockExclusive(&reactor->lock);
+        for (int i = 0; i < shard->count; )
+        {
+            uart_obj *uart = shard->ports[i];
+            if (!uart->failed && !uart->shutdown && !shard->stop)
+            {
+                i++;
+                continue;
+            }
+            gone[n++] = uart;
+            shard->ports[i] = shard->ports[--shard->count];
+        }
+        count = shard->count;
+        memcpy(ports, shard->ports, count * sizeof(ports[0]));
+        ReleaseSRWLockExclusive(&reactor->lock);
+
+        // callbacks run without the reactor lock, they may open more ports
+        for (int i = 0; i < n; i++)
+        {
+            port_close(gone[i], gone[i]->failed ? cc_error : cc_shutdown);
+
+            AcquireSRWLockExclusive(&gone[i]->tx_lock);
+            gone[i]->released = true;
+            WakeAllConditionVariable(&gone[i]->tx_space);
+            ReleaseSRWLockExclusive(&gone[i]->tx_lock);
+        }
+
+        // overlapped I/O is cancelled when the thread that issued it exits,
+        // so the first WaitCommEvent of a port is issued here
+        bool again = false;
+        for (int i = 0; i < count; i++)
+        {
+            if (ports[i]->attached) continue;
+            ports[i]->attached = true;
+            if (!wait_comm_event(ports[i]))
+                ports[i]->failed = again = true;
+        }
+        if (!again) break;
+    }
+
+    handles[0] = shard->ev_change;
+    for (int i = 0; i < count; i++)
+        memcpy(handles + 1 + i * ev_last, ports[i]->events, sizeof(ports[i]->events));
+    return count;
+}
+
+static DWORD WINAPI shard_thread(uart_shard *shard)
+{
+    uart_obj *ports[SHARD_MAX_PORTS];
+    HANDLE    handles[MAXIMUM_WAIT_OBJECTS];
+    int       count = shard_sync(shard, ports, handles);
+
+    while (!shard->stop)
+    {
+        bool changed = false;
+        DWORD timeout = INFINITE;
+
+        for (int i = 0; i < count; i++)
+        {
+            uart_obj *uart = ports[i];
+            if (uart->rx_parked && (rx_wait_ms(uart) == 0) && !rx_timer(uart))
+                uart->failed = changed = true;
+            timeout = MIN(timeout, rx_wait_ms(uart));
+        }
+        if (changed)
+        {
+            count = shard_sync(shard, ports, handles);
+            continue;
+        }
+
+        const DWORD n = 1 + count * ev_last;
+        DWORD first = WaitForMultipleObjects(n, handles, FALSE, timeout);
+        if (first == WAIT_TIMEOUT) continue;
+        first -= WAIT_OBJECT_0;
+        if (first >= n)
+        {
+            dbg_print("shard: WaitForMultipleObjects failed\n");
+            for (int i = 0; i < count; i++)
+                ports[i]->failed = true;
+            count = shard_sync(shard, ports, handles);
+            continue;
+        }
+
+        // only the lowest signaled handle is reported: poll the ones after it
+        // too, so that a busy port does not starve those behind it
+        for (DWORD i = first; i < n; i++)
+        {
+            if ((i != first) && (WaitForSingleObject(handles[i], 0) != WAIT_OBJECT_0))
+                continue;
+            if (i == 0)
+            {
+                changed = true;
+                continue;
+            }
+
+            uart_obj *uart = ports[(i - 1) / ev_last];
+            if (uart->failed || uart->shutdown)
+            {
+                // uart_shutdown sets the flag before the event: the port goes now
+                changed = true;
+                continue;
+            }
+            if (!uart_event(uart, (i - 1) % ev_last))
+                uart->failed = true;
+            changed = changed || uart->failed || uart->shutdown;
+        }
+        if (changed)
+            count = shard_sync(shard, ports, handles);
+    }
+
+    shard_sync(shard, ports, handles);
+    return 0;
+}
+
 EXPORT_DLL int uart_config(uart_obj *uart,
             int  baud,          // baudrate
             const char *parity, // parity    "none", "even", "odd", "mark", and "space"
@@ -388,11 +921,11 @@ EXPORT_DLL int uart_config(uart_obj *uart,
     dcb.DCBlength = sizeof(DCB);
     if (!GetCommState(uart->h_comm, &dcb))
     {
-        fatal(uart, "GetCommState()");
+        dbg_print("uart_config: GetCommState() error %d\n", (int)GetLastError());
         return 1;
     }
 
-    static char sdcb[500] = {'\0'};
+    char sdcb[500] = {'\0'};
     char s[100];
     if (baud > 0)
     {
@@ -420,9 +953,9 @@ EXPORT_DLL int uart_config(uart_obj *uart,
     }
     dbg_print("dcb = %s\n", sdcb);
 
-    if (!BuildCommDCBA(sdcb, &dcb))
+    if ((sdcb[0] != '\0') && !BuildCommDCBA(sdcb, &dcb))
     {
-        fatal(uart, "BuildCommDCB()");
+        dbg_print("uart_config: BuildCommDCB(%s) error %d\n", sdcb, (int)GetLastError());
         return 2;
     }
 
@@ -438,40 +971,87 @@ EXPORT_DLL int uart_config(uart_obj *uart,
     dbg_print("XonLim = %d\n", (int)dcb.XonLim);
     dbg_print("XoffLim = %d\n", (int)dcb.XoffLim);
 
-    dcb.fOutxCtsFlow = FALSE;
-    dcb.fOutxDsrFlow = FALSE;
-    dcb.fRtsControl = RTS_CONTROL_DISABLE;
-    dcb.fDtrControl = RTS_CONTROL_DISABLE;
-    dcb.fOutX = FALSE;
-    dcb.fInX = FALSE;
+    // the queues hold 100 ms at the baud rate unless the I/O profile says
+    // otherwise, so that the far end gets XOFF or RTS off with room left for
+    // what it still sends meanwhile
+    AcquireSRWLockShared(&uart->tx_lock);
+    const int queue = uart->io.driver_queue;
+    ReleaseSRWLockShared(&uart->tx_lock);
+    int buf = queue > 0 ? queue : MAX(BUF_SIZE, (int)(dcb.BaudRate / UART_BITS_PER_CHAR / 10));
+    if ((buf != uart->comm_buf) && SetupComm(uart->h_comm, buf, buf))
+        uart->comm_buf = buf;
+
+    dcb.fOutxCtsFlow = uart->flow == flow_rtscts;
+    dcb.fOutxDsrFlow = uart->flow == flow_dsrdtr;
+    if (uart->flow == flow_rtscts)
+        dcb.fRtsControl = RTS_CONTROL_HANDSHAKE;
+    else
+        dcb.fRtsControl = (uart->line_out & UART_LINE_RTS) ? RTS_CONTROL_ENABLE : RTS_CONTROL_DISABLE;
+    if (uart->flow == flow_dsrdtr)
+        dcb.fDtrControl = DTR_CONTROL_HANDSHAKE;
+    else
+        dcb.fDtrControl = (uart->line_out & UART_LINE_DTR) ? DTR_CONTROL_ENABLE : DTR_CONTROL_DISABLE;
+    dcb.fOutX = uart->flow == flow_xonxoff;
+    dcb.fInX = uart->flow == flow_xonxoff;
+    dcb.XonChar = 0x11;
+    dcb.XoffChar = 0x13;
+    dcb.fTXContinueOnXoff = TRUE;
     dcb.fBinary = TRUE;
     dcb.fDsrSensitivity = FALSE;
 
-    //dcb.XonLim = 0;
-    //dcb.XoffLim = 0;
     //dcb.ByteSize = 8;
 
-    #define BUF_SIZE    10240
-    SetupComm(uart->h_comm, BUF_SIZE, BUF_SIZE);
-    dcb.XonLim = BUF_SIZE / 4;
-    dcb.XoffLim = BUF_SIZE / 4;
+    dcb.XonLim = (WORD)(uart->comm_buf / 4);
+    dcb.XoffLim = (WORD)(uart->comm_buf / 4);
 
     if (!SetCommState(uart->h_comm, &dcb))
     {
-        fatal(uart, "SetCommState()");
+        dbg_print("uart_config: SetCommState() error %d\n", (int)GetLastError());
         return 3;
     }
-
-    // flush the port
-    PurgeComm(uart->h_comm, PURGE_RXCLEAR | PURGE_TXCLEAR | PURGE_RXABORT | PURGE_TXABORT);
+    uart->baud = dcb.BaudRate;
     return 0;
 }
 
-EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
-            const int portnr,
-            int  baud,          // baudrate
-            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
-            int  databits,      // databits
+EXPORT_DLL int uart_set_flow(uart_obj *uart, const int flow)
+{
+    if ((flow < flow_none) || (flow > flow_xonxoff)) return 4;
+    const int old = uart->flow;
+    uart->flow = flow;
+    const int r = uart_config(uart, 0, "", 0, 0);
+    if (r != 0) uart->flow = old;
+    return r;
+}
+
+EXPORT_DLL int uart_get_flow(uart_obj *uart)
+{
+    return uart->flow;
+}
+
+EXPORT_DLL void uart_get_config(uart_obj *uart,
+            int         *baud,
+            const char **parity,
+            int         *databits,
+            int         *stopbits)
+{
+    static const char *parities[] = {"none", "odd", "even", "mark", "space"};
+    DCB dcb;
+    memset(&dcb, 0, sizeof(DCB));
+    dcb.DCBlength = sizeof(DCB);
+    GetCommState(uart->h_comm, &dcb);
+
+    *baud = uart->baud;
+    *parity = dcb.Parity <= SPACEPARITY ? parities[dcb.Parity] : "none";
+    *databits = dcb.ByteSize;
+    *stopbits = dcb.StopBits == TWOSTOPBITS ? 2 : dcb.StopBits == ONE5STOPBITS ? 15 : 1;
+}
+
+// opens and configures the port, leaving it to the caller to start serving it
+static uart_obj *port_open(uart_obj *uart,
+            const char *dev,
+            int  baud,
+            const char *parity,
+            int  databits,
             int  stopbits,
             f_on_comm_read   on_comm_read,
             void            *comm_read_param,
@@ -480,32 +1060,41 @@ EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
             const bool       async_io)
 {
     memset(uart, 0, sizeof(*uart));
+    uart->rx_buf = uart->comm_read_buf;
     uart->on_comm_read = on_comm_read;
     uart->comm_read_param = comm_read_param;
     uart->comm_close_param = comm_close_param;
     uart->async_io = async_io;
+    ring_init(&uart->tx, true);
+    io_preset(&uart->io, io_balanced, baud, 0);
+    uart->tx.limit = uart->io.tx_queue;
+    uart->tx_coalesce = uart->io.tx_coalesce;
+    InitializeSRWLock(&uart->tx_lock);
+    InitializeConditionVariable(&uart->tx_space);
+    InitializeConditionVariable(&uart->expect_match);
 
     uart->events[ev_shutdown] = CreateEvent(NULL, FALSE, FALSE, NULL);
     uart->events[ev_comm_event] = CreateEvent(NULL, TRUE, FALSE, NULL);  // manual reset for OVERLAPPED
     uart->events[ev_comm_write] = CreateEvent(NULL, TRUE, FALSE, NULL);
     uart->events[ev_write] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    uart->rx_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
 
     uart->o_event.hEvent = uart->events[ev_comm_event];
     uart->o_write.hEvent = uart->events[ev_comm_write];
     uart->o_read.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-    sprintf(uart->comm, "\\\\.\\COM%d", portnr);
+    // "COM12" needs the device namespace prefix
+    if (strncmp(dev, "\\\\.\\", 4) == 0)
+        snprintf(uart->comm, sizeof(uart->comm), "%s", dev);
+    else
+        snprintf(uart->comm, sizeof(uart->comm), "\\\\.\\%s", dev);
 
     // set the timeout values
     COMMTIMEOUTS timeout;
-    timeout.ReadIntervalTimeout = MAXDWORD;
-    timeout.ReadTotalTimeoutMultiplier = 0;
-    timeout.ReadTotalTimeoutConstant = 0;
-    timeout.WriteTotalTimeoutMultiplier = 10;
-    timeout.WriteTotalTimeoutConstant = 1000;
+    rx_timeouts(uart, &timeout);
 
-    DWORD flags = FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
-    if (async_io) flags |= FILE_FLAG_OVERLAPPED;
+    // overlapped in both modes: a blocked read must not hold up writes
+    DWORD flags = FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED;
 
     // get a handle to the port
     uart->h_comm = CreateFileA(uart->comm,              // communication port string (COMX)
@@ -522,8 +1111,6 @@ EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
         return NULL;
     }
 
-    InitializeCriticalSection(&uart->cs);
-
     // configure
     if (!SetCommTimeouts(uart->h_comm, &timeout))
     {
@@ -548,11 +1135,37 @@ EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
         return NULL;
     }
 
+    SetupComm(uart->h_comm, BUF_SIZE, BUF_SIZE);
+    uart->comm_buf = BUF_SIZE;
     if (uart_config(uart, baud, parity, databits, stopbits) != 0)
+    {
+        fatal(uart, "uart_config()");
         return NULL;
+    }
+
+    // flush the port
+    PurgeComm(uart->h_comm, PURGE_RXCLEAR | PURGE_TXCLEAR | PURGE_RXABORT | PURGE_TXABORT);
 
     // on_comm_close is enabled now
     uart->on_comm_close = on_comm_close;
+    return uart;
+}
+
+EXPORT_DLL uart_obj *uart_open_dev(uart_obj *uart,
+            const char *dev,
+            int  baud,          // baudrate
+            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
+            int  databits,      // databits
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param,
+            const bool       async_io)
+{
+    if (port_open(uart, dev, baud, parity, databits, stopbits,
+                  on_comm_read, comm_read_param, on_comm_close, comm_close_param, async_io) == NULL)
+        return NULL;
 
     uart->h_thread = CreateThread(
       NULL,     // _In_opt_   LPSECURITY_ATTRIBUTES lpThreadAttributes,
@@ -584,8 +1197,48 @@ EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
     return uart;
 }
 
+EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
+            const int portnr,
+            int  baud,          // baudrate
+            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
+            int  databits,      // databits
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param,
+            const bool       async_io)
+{
+    char dev[32];
+    sprintf(dev, "COM%d", portnr);
+    return uart_open_dev(uart, dev, baud, parity, databits, stopbits,
+                         on_comm_read, comm_read_param, on_comm_close, comm_close_param, async_io);
+}
+
 EXPORT_DLL void uart_shutdown(uart_obj *uart)
 {
+    if ((NULL != uart->shard) && uart->released) return;
+
+    // senders waiting for room give up now, not once the port has closed
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    uart->shutdown = true;
+    WakeAllConditionVariable(&uart->tx_space);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+
+    if (NULL != uart->shard)
+    {
+        SetEvent(uart->events[ev_shutdown]);
+
+        // called from a callback on the worker: the port closes once it returns
+        if (GetCurrentThreadId() == uart->shard->thread_id) return;
+
+        AcquireSRWLockExclusive(&uart->tx_lock);
+        while (!uart->released)
+            SleepConditionVariableSRW(&uart->tx_space, &uart->tx_lock, INFINITE, 0);
+        ReleaseSRWLockExclusive(&uart->tx_lock);
+        return;
+    }
+
     SetEvent(uart->events[ev_shutdown]);
 #ifndef MAKE_DLL
     switch (WaitForSingleObject(uart->h_thread, 1000))
@@ -599,7 +1252,54 @@ EXPORT_DLL void uart_shutdown(uart_obj *uart)
 #endif
 }
 
-EXPORT_DLL void uart_send(uart_obj *uart, const char *buf, const int l)
+// r of l bytes went into the ring: arms the writable callback, wakes the thread
+static int tx_queued(uart_obj *uart, const int r, const int l)
+{
+    stat_max(&uart->stats.tx_high_water, ring_used(&uart->tx));
+    if (r < l)
+    {
+        dbg_print("comm_write_buf overflow: %d of %d bytes taken\n", r, l);
+        ring_store(&uart->writable_armed, 1);
+    }
+    else if ((NULL != uart->on_comm_writable) && ((int)ring_used(&uart->tx) > uart->writable_low))
+        ring_store(&uart->writable_armed, 1);
+
+    // coalescing: the completion of the write in flight takes these
+    // (tx_delay_us does not apply, the write is in flight)
+    const int coalesce = (int)ring_load(&uart->tx_coalesce);
+    if ((coalesce > 0) && (r == l))
+    {
+        ring_fence();
+        // held, only the send taking the queue to tx_coalesce wakes the thread
+        const int used = (int)ring_used(&uart->tx);
+        if (ring_load(&uart->tx_held) && ((used < coalesce) || (used - l >= coalesce)))
+            return r;
+    }
+    dbg_print("uart_send SetEvent\n");
+    stat_add(&uart->stats.tx_wakeups, 1);
+    SetEvent(uart->events[ev_write]);
+    return r;
+}
+
+// queues what fits, or all or nothing
+static int tx_put(uart_obj *uart, const char *buf, const int l, const bool partial)
+{
+    return tx_queued(uart, (int)ring_write(&uart->tx, buf, l, partial), l);
+}
+
+// all count segments of v, l bytes, or nothing
+static int tx_putv(uart_obj *uart, const uart_iovec *v, const int count, const int l)
+{
+    return tx_queued(uart, (int)ring_writev(&uart->tx, v, count, (uint32_t)l), l);
+}
+
+EXPORT_DLL void uart_flush(uart_obj *uart)
+{
+    stat_add(&uart->stats.tx_wakeups, 1);
+    SetEvent(uart->events[ev_write]);
+}
+
+EXPORT_DLL int uart_send(uart_obj *uart, const char *buf, const int l)
 {
 #ifdef _DEBUG
     printf("send %d byte(s):", l);
@@ -607,22 +1307,567 @@ EXPORT_DLL void uart_send(uart_obj *uart, const char *buf, const int l)
     printf("\n");
 #endif
 
-    if (l < 1) return;
+    if (l < 1)
+    {
+        // arms the writable callback, the I/O thread checks the mark right away
+        if (NULL == uart->on_comm_writable) return 0;
+        ring_store(&uart->writable_armed, 1);
+        SetEvent(uart->events[ev_write]);
+        return 0;
+    }
+
+    int r = tx_put(uart, buf, l, true);
+    if (r < l)
+        stat_add(&uart->stats.tx_dropped, (uint64_t)(l - r));
+    return r;
+}
+
+// the bytes of v past sent: a single segment may go in parts, several only whole
+static int tx_put_rest(uart_obj *uart, const uart_iovec *v, const int count, const int l, const int sent,
+                       const bool partial)
+{
+    if (count == 1) return tx_put(uart, v->p + sent, l - sent, partial);
+    return tx_putv(uart, v, count, l);
+}
 
-    EnterCriticalSection(&uart->cs);
-    if (uart->write_buf_used + l <= COMM_WRITE_BUF_SIZE)
+// uart_send_timeout, or with partial false a whole frame
+static int tx_send(uart_obj *uart, const uart_iovec *v, const int count, const int l, const int timeout_ms,
+                   const bool partial)
+{
+    int sent = tx_put_rest(uart, v, count, l, 0, partial);
+    if (sent >= l)
+        return sent;
+    if (timeout_ms == 0)
     {
-        memcpy(uart->comm_write_buf + uart->write_buf_used, buf, l);
-        uart->write_buf_used += l;
+        stat_add(&uart->stats.tx_dropped, (uint64_t)(l - sent));
+        return sent;
     }
-    else
-        dbg_print("comm_write_buf overflow\n");
-    LeaveCriticalSection(&uart->cs);
-    dbg_print("uart_send SetEvent\n");
-    SetEvent(uart->events[ev_write]);
+
+    const ULONGLONG deadline = GetTickCount64() + (timeout_ms > 0 ? timeout_ms : 0);
+
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    ring_fetch_add(&uart->tx_waiters, 1);
+    while (!uart->closed && !uart->shutdown)
+    {
+        sent += tx_put_rest(uart, v, count, l, sent, partial);
+        if (sent >= l) break;
+
+        DWORD wait = INFINITE;
+        if (timeout_ms > 0)
+        {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) break;
+            wait = (DWORD)(deadline - now);
+        }
+        SleepConditionVariableSRW(&uart->tx_space, &uart->tx_lock, wait, 0);
+    }
+    ring_fetch_add(&uart->tx_waiters, -1);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+    if (sent < l)
+        stat_add(&uart->stats.tx_dropped, (uint64_t)(l - sent));
+    return sent;
+}
+
+EXPORT_DLL int uart_send_timeout(uart_obj *uart, const char *buf, const int l, const int timeout_ms)
+{
+    if (l < 1) return 0;
+    uart_iovec v = {buf, l};
+    return tx_send(uart, &v, 1, l, timeout_ms, true);
+}
+
+EXPORT_DLL int uart_sendv(uart_obj *uart, const uart_iovec *v, const int count, const int timeout_ms)
+{
+    int64_t l = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (v[i].l < 0) return 0;
+        l += v[i].l;
+    }
+    if (l < 1) return 0;
+    // would never fit
+    if (l > ring_load(&uart->tx.limit))
+    {
+        stat_add(&uart->stats.tx_dropped, (uint64_t)l);
+        return 0;
+    }
+    return tx_send(uart, v, count, (int)l, timeout_ms, false);
+}
+
+EXPORT_DLL int uart_send_frame(uart_obj *uart, const char *p, const int l, const int timeout_ms)
+{
+    // the worst case encoding, no more than the TX buffer takes
+    const int64_t worst = UART_FRAME_ENCODE_MAX((int64_t)l);
+    const int queue = (int)ring_load(&uart->tx.limit);
+    const int max = worst < queue ? (int)worst : queue;
+    char small[UART_FRAME_STACK];
+    char *frame = max <= UART_FRAME_STACK ? small : (char *)malloc(max);
+    if (NULL == frame) return -1;
+    int n = frame_encode(&uart->framing, p, l, frame, max);
+    if (n > 0)
+    {
+        uart_iovec v = {frame, n};
+        n = tx_send(uart, &v, 1, n, timeout_ms, false) == n ? l : 0;
+    }
+    if (frame != small) free(frame);
+    return n;
+}
+
+EXPORT_DLL void uart_set_writable_callback(uart_obj *uart,
+            f_on_comm_writable on_comm_writable,
+            void              *comm_writable_param,
+            const int          low_watermark)
+{
+    uart->writable_low = low_watermark;
+    uart->comm_writable_param = comm_writable_param;
+    uart->on_comm_writable = on_comm_writable;
+}
+
+EXPORT_DLL void uart_set_single_producer(uart_obj *uart, const bool single)
+{
+    uart->tx.mpsc = !single;
 }
 
 EXPORT_DLL int get_uart_obj_size()
 {
     return sizeof(uart_obj);
 }
+
+// the I/O thread takes io_next: right here, or at its next wake
+static void io_post(p_uart_obj uart)
+{
+    DWORD io = NULL != uart->shard ? uart->shard->thread_id : GetThreadId(uart->h_thread);
+    if (GetCurrentThreadId() == io)
+        io_adopt(uart);
+    else
+        SetEvent(uart->events[ev_write]);
+}
+
+EXPORT_DLL void uart_set_rx_policy(uart_obj *uart, const uart_rx_policy *policy)
+{
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    if (!uart->io_pending) uart->io_next = uart->io;
+    uart->io_next.rx = *policy;
+    ring_store(&uart->io_pending, 1);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+    io_post(uart);
+}
+
+EXPORT_DLL bool uart_io_preset(uart_io_profile *profile, const int preset, const int baud, const int message)
+{
+    return io_preset(profile, preset, baud, message);
+}
+
+EXPORT_DLL bool uart_set_io_profile(uart_obj *uart, const uart_io_profile *profile)
+{
+    if (!io_valid(profile)) return false;
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    uart->io_next = *profile;
+    ring_store(&uart->io_pending, 1);
+    // the senders go by the new tx_queue at once; more room, maybe: the waiting ones look again
+    ring_store(&uart->tx.limit, (uint32_t)profile->tx_queue);
+    WakeAllConditionVariable(&uart->tx_space);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+    io_post(uart);
+    return true;
+}
+
+EXPORT_DLL void uart_get_io_profile(uart_obj *uart, uart_io_profile *profile)
+{
+    AcquireSRWLockShared(&uart->tx_lock);
+    if (uart->io_pending)
+        *profile = uart->io_next;
+    else
+    {
+        *profile = uart->io;
+        profile->rx = uart->rx_policy;
+    }
+    ReleaseSRWLockShared(&uart->tx_lock);
+}
+
+EXPORT_DLL bool uart_set_rx_pool(uart_obj *uart, const int buffers)
+{
+    HANDLE wake;
+
+    if ((buffers < 1) || (buffers > UART_RX_POOL_MAX) || uart->closed
+        || (NULL != uart->rx_pool) || (NULL != uart->rx_pool_next))
+        return false;
+
+    // the thread that reads waits for a buffer to come back
+    HANDLE reader = uart->async_io ? uart->events[ev_write] : uart->rx_wake;
+    if (!DuplicateHandle(GetCurrentProcess(), reader, GetCurrentProcess(), &wake,
+                         0, FALSE, DUPLICATE_SAME_ACCESS))
+        return false;
+    uart_rx_pool *pool = rx_pool_create(buffers, wake);
+    if (NULL == pool)
+    {
+        CloseHandle(wake);
+        return false;
+    }
+
+    MemoryBarrier();
+    uart->rx_pool_next = pool;
+    SetEvent(uart->events[ev_write]);
+
+    // from a callback: the I/O thread switches right after the current batch
+    const DWORD self = GetCurrentThreadId();
+    if (NULL != uart->shard ? self == uart->shard->thread_id
+        : (self == GetThreadId(uart->h_thread))
+          || ((NULL != uart->h_comm_state) && (self == GetThreadId(uart->h_comm_state))))
+        return true;
+
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    while ((NULL != uart->rx_pool_next) && !uart->closed)
+        SleepConditionVariableSRW(&uart->tx_space, &uart->tx_lock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+    return NULL != uart->rx_pool;
+}
+
+EXPORT_DLL void uart_rx_retain(const char *p)
+{
+    ring_fetch_add(&rx_buf_of(p)->refs, 1);
+}
+
+EXPORT_DLL void uart_rx_release(const char *p)
+{
+    rx_buf_release(p);
+}
+
+EXPORT_DLL bool uart_watch(uart_obj *uart,
+            const intptr_t   fd,
+            const int        events,
+            f_on_watch       on_watch,
+            void            *watch_param)
+{
+    uart_watch_entry *w = NULL;
+    bool r = false;
+
+    // a reactor worker has no room left in its wait list
+    if ((NULL != uart->shard) || uart->closed) return false;
+
+    // another thread may add a watch while a callback changes one
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    for (int i = 0; i < UART_MAX_WATCHES; i++)
+    {
+        uart_watch_entry *e = &uart->watches[i];
+        if ((NULL != e->on_watch) && (e->fd == fd))
+        {
+            w = e;
+            break;
+        }
+        if ((NULL == w) && (NULL == e->on_watch))
+            w = e;
+    }
+
+    if (NULL == w) goto clean_up;
+
+    if (events == 0)
+    {
+        if (NULL != w->on_watch)
+        {
+            w->on_watch = NULL;
+            WSAEventSelect((SOCKET)fd, NULL, 0);
+        }
+        r = true;
+        goto clean_up;
+    }
+
+    if ((NULL == w->ev) && ((w->ev = WSACreateEvent()) == WSA_INVALID_EVENT))
+    {
+        w->ev = NULL;
+        goto clean_up;
+    }
+    // also sets the socket non-blocking
+    if (WSAEventSelect((SOCKET)fd, w->ev, watch_network_events(events)) != 0)
+    {
+        dbg_print("uart_watch: WSAEventSelect error %d\n", WSAGetLastError());
+        goto clean_up;
+    }
+    w->fd = fd;
+    w->events = events;
+    w->watch_param = watch_param;
+    MemoryBarrier();
+    w->on_watch = on_watch;
+    r = true;
+
+clean_up:
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+
+    // let the I/O thread wait on the new set
+    if (r) SetEvent(uart->events[ev_write]);
+    return r;
+}
+
+EXPORT_DLL void uart_purge(uart_obj *uart, const bool rx, const bool tx)
+{
+    if (rx) ring_store(&uart->purge_rx, 1);
+    if (tx) ring_store(&uart->purge_tx, 1);
+
+    DWORD io = NULL != uart->shard ? uart->shard->thread_id : GetThreadId(uart->h_thread);
+    if (GetCurrentThreadId() == io)
+        purge(uart);
+    else
+        SetEvent(uart->events[ev_write]);
+}
+
+EXPORT_DLL void uart_set_line_callback(uart_obj *uart,
+            f_on_comm_line  on_comm_line,
+            void           *comm_line_param)
+{
+    uart->line_in = modem_lines(uart);
+    uart->comm_line_param = comm_line_param;
+    uart->on_comm_line = on_comm_line;
+}
+
+EXPORT_DLL bool uart_set_line(uart_obj *uart, const int line, const bool on)
+{
+    DWORD f;
+    switch (line)
+    {
+    case UART_LINE_DTR: f = on ? SETDTR : CLRDTR; break;
+    case UART_LINE_RTS: f = on ? SETRTS : CLRRTS; break;
+    case UART_LINE_BREAK: f = on ? SETBREAK : CLRBREAK; break;
+    default: return false;
+    }
+    if (!EscapeCommFunction(uart->h_comm, f)) return false;
+    uart->line_out = on ? uart->line_out | line : uart->line_out & ~line;
+    return true;
+}
+
+EXPORT_DLL int uart_get_line(uart_obj *uart)
+{
+    return modem_lines(uart) | uart->line_out;
+}
+
+EXPORT_DLL int64_t uart_time_us(void)
+{
+    static LARGE_INTEGER freq = {0};
+    LARGE_INTEGER c;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&c);
+    return (int64_t)(c.QuadPart / freq.QuadPart * 1000000
+                     + c.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+}
+
+EXPORT_DLL int64_t uart_rx_time_us(uart_obj *uart, const int i)
+{
+    return rx_times_of(&uart->rx_times, i, uart->baud);
+}
+
+EXPORT_DLL uart_capture *uart_capture_open(const char *path, const int64_t ring_size)
+{
+    return capture_open(path, ring_size > 0 ? ring_size : CAPTURE_DEFAULT_RING);
+}
+
+EXPORT_DLL void uart_capture_close(uart_capture *capture)
+{
+    capture_close(capture);
+}
+
+EXPORT_DLL void uart_set_capture(uart_obj *uart, uart_capture *capture, const int port_id)
+{
+    uart->capture_port = port_id;
+    uart->capture = capture;
+}
+
+EXPORT_DLL bool uart_set_framing(uart_obj *uart,
+            const uart_framing *framing,
+            f_on_frame       on_frame,
+            void            *frame_param)
+{
+    uart_framer *fr = NULL;
+    if ((NULL != framing) && !frame_valid(framing))
+        return false;
+    if ((NULL != framing) && (framing->kind != frame_none))
+    {
+        if ((fr = frame_create(framing, on_frame, frame_param)) == NULL)
+            return false;
+    }
+    frame_free(uart->framer);
+    uart->framer = fr;
+    if (NULL != framing)
+        uart->framing = *framing;
+    else
+        memset(&uart->framing, 0, sizeof(uart->framing));
+    return true;
+}
+
+EXPORT_DLL int uart_frame_encode(const uart_framing *framing, const char *p, const int l, char *dst, const int max)
+{
+    return frame_encode(framing, p, l, dst, max);
+}
+
+EXPORT_DLL uint32_t uart_crc_init(const int kind)
+{
+    return crc_init(kind);
+}
+
+EXPORT_DLL uint32_t uart_crc_update(const int kind, const uint32_t crc, const char *p, const int l)
+{
+    return crc_update(kind, crc, p, l);
+}
+
+EXPORT_DLL uart_expect *uart_expect_create(const char *const *patterns, const int count, const int flags)
+{
+    return expect_create(patterns, count, flags);
+}
+
+EXPORT_DLL void uart_expect_free(uart_expect *expect)
+{
+    expect_free(expect);
+}
+
+EXPORT_DLL void uart_set_expect(uart_obj *uart, uart_expect *expect)
+{
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    expect_arm(&uart->expect, expect);
+    WakeAllConditionVariable(&uart->expect_match);
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+}
+
+EXPORT_DLL int uart_expect_wait(uart_obj *uart, const int timeout_ms, uart_expect_match *match)
+{
+    const ULONGLONG deadline = GetTickCount64() + (timeout_ms > 0 ? timeout_ms : 0);
+
+    uart_expect_match m;
+    int r = -1;
+    AcquireSRWLockExclusive(&uart->tx_lock);
+    for (;;)
+    {
+        if (expect_pop(&uart->expect, &m))
+        {
+            r = m.pattern;
+            break;
+        }
+        if ((NULL == uart->expect.e) || uart->closed)
+        {
+            r = -2;
+            break;
+        }
+
+        DWORD wait = INFINITE;
+        if (timeout_ms >= 0)
+        {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) break;
+            wait = (DWORD)(deadline - now);
+        }
+        SleepConditionVariableSRW(&uart->expect_match, &uart->tx_lock, wait, 0);
+    }
+    ReleaseSRWLockExclusive(&uart->tx_lock);
+    if ((r >= 0) && (NULL != match)) *match = m;
+    return r;
+}
+
+EXPORT_DLL void uart_get_stats(uart_obj *uart, uart_stats *stats)
+{
+    stats_snapshot(&uart->stats, &uart->stats_base, stats);
+}
+
+EXPORT_DLL void uart_reset_stats(uart_obj *uart)
+{
+    stats_reset(&uart->stats, &uart->stats_base);
+}
+
+EXPORT_DLL uart_reactor *uart_reactor_create(const int workers, const bool pin)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int cpus = MIN((int)info.dwNumberOfProcessors, (int)(sizeof(DWORD_PTR) * 8));
+    if (cpus < 1) cpus = 1;
+
+    uart_reactor *reactor = (uart_reactor *)calloc(1, sizeof(uart_reactor));
+    if (NULL == reactor) return NULL;
+    reactor->workers = workers > 0 ? workers : cpus;
+    reactor->shards = (uart_shard *)calloc(reactor->workers, sizeof(uart_shard));
+    if (NULL == reactor->shards)
+    {
+        free(reactor);
+        return NULL;
+    }
+    InitializeSRWLock(&reactor->lock);
+
+    for (int i = 0; i < reactor->workers; i++)
+    {
+        uart_shard *shard = reactor->shards + i;
+        shard->reactor = reactor;
+        shard->ev_change = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (NULL == shard->ev_change)
+            goto error;
+
+        shard->h_thread = CreateThread(NULL, 0, LPTHREAD_START_ROUTINE(shard_thread), shard,
+                                       0, &shard->thread_id);
+        if (NULL == shard->h_thread)
+            goto error;
+
+        if (pin)
+            SetThreadAffinityMask(shard->h_thread, (DWORD_PTR)1 << (i % cpus));
+    }
+    return reactor;
+
+error:
+    dbg_print("uart_reactor_create: error %d\n", (int)GetLastError());
+    uart_reactor_destroy(reactor);
+    return NULL;
+}
+
+EXPORT_DLL void uart_reactor_destroy(uart_reactor *reactor)
+{
+    if (NULL == reactor) return;
+    for (int i = 0; i < reactor->workers; i++)
+    {
+        uart_shard *shard = reactor->shards + i;
+        if (NULL != shard->h_thread)
+        {
+            shard->stop = true;
+            SetEvent(shard->ev_change);
+            WaitForSingleObject(shard->h_thread, INFINITE);
+            CloseHandle(shard->h_thread);
+        }
+        if (NULL != shard->ev_change)
+            CloseHandle(shard->ev_change);
+    }
+    free(reactor->shards);
+    free(reactor);
+}
+
+EXPORT_DLL uart_obj *uart_reactor_open(uart_reactor *reactor,
+            uart_obj *uart,
+            const char *dev,
+            int  baud,
+            const char *parity,
+            int  databits,
+            int  stopbits,
+            f_on_comm_read   on_comm_read,
+            void            *comm_read_param,
+            f_on_comm_close  on_comm_close,
+            void            *comm_close_param)
+{
+    if (port_open(uart, dev, baud, parity, databits, stopbits,
+                  on_comm_read, comm_read_param, on_comm_close, comm_close_param, true) == NULL)
+        return NULL;
+
+    uart_shard *shard = NULL;
+    AcquireSRWLockExclusive(&reactor->lock);
+    for (int i = 0; i < reactor->workers; i++)
+    {
+        uart_shard *s = reactor->shards + i;
+        if ((s->count < SHARD_MAX_PORTS) && ((NULL == shard) || (s->count < shard->count)))
+            shard = s;
+    }
+    if (NULL != shard)
+    {
+        uart->shard = shard;
+        shard->ports[shard->count++] = uart;
+    }
+    ReleaseSRWLockExclusive(&reactor->lock);
+
+    if (NULL == shard)
+    {
+        uart->on_comm_close = NULL;
+        fatal(uart, "reactor full");
+        return NULL;
+    }
+
+    SetEvent(shard->ev_change);
+    return uart;
+}
@@ -1,32 +1,18 @@
 #ifndef _uart_win32_h
 #define _uart_win32_h
 
-#include <windows.h>
-
-#define COMM_READ_BUF_SIZE      (2 * 1024)
-#define COMM_WRITE_BUF_SIZE     (10 * 1024)
-
-#ifdef MAKE_DLL
-#ifdef __cplusplus
-#define EXPORT_DLL extern "C" __declspec(dllexport) __stdcall
-#else
-#define EXPORT_DLL __declspec(dllexport) __stdcall
-#endif
-#define CB_CALL __stdcall
-#else
-#define EXPORT_DLL
-#define CB_CALL
-#endif
+// Win32 backend, included through uart.h
 
-#if  _MSC_VER > 1800
-#define gets gets_s
-#endif
+// winsock2.h has to come before windows.h
+#include <winsock2.h>
+#include <windows.h>
 
-typedef enum
-{
-    cc_shutdown,
-    cc_error
-} enum_comm_close;
+#include "uart_ring.h"
+#include "uart_rx.h"
+#include "uart_profile.h"
+#include "uart_stats.h"
+#include "uart_frame.h"
+#include "uart_expect.h"
 
 typedef enum
 {
@@ -37,55 +23,96 @@ typedef enum
     ev_last
 } enum_events;
 
-typedef CB_CALL void (*f_on_comm_read)(void *param, const char *p, const int l);
-typedef CB_CALL void (*f_on_comm_close)(void *param, const enum_comm_close reason);
+typedef struct _uart_shard uart_shard;
 
-typedef struct _uart_obj
+// a socket given to uart_watch, signaled through its WSAEventSelect event
+typedef struct
+{
+    intptr_t        fd;
+    int             events;
+    f_on_watch      on_watch;       // NULL: entry free
+    void           *watch_param;
+    HANDLE          ev;
+} uart_watch_entry;
+
+struct _uart_obj
 {
     char            comm[256];
     bool            async_io;
     HANDLE          h_comm;
     HANDLE          h_thread;
-    HANDLE          h_comm_state;
+    HANDLE          h_comm_state;   // the thread of uart_rx_loop, without async_io
+    HANDLE          rx_wake;        // for it: a pool buffer came back, or rx_stop
+    volatile bool   rx_stop;        // uart_rx_loop returns, set by finalize
     OVERLAPPED      o_event;
     OVERLAPPED      o_write;
     OVERLAPPED      o_read;
     HANDLE          events[ev_last];
+    DWORD           comm_event;     // filled by WaitCommEvent
+    bool            event_pending;
+    bool            write_pending;
+    uart_shard     *shard;          // reactor worker serving the port, NULL: own thread
+    bool            attached;       // the worker has started waiting on the port
+    volatile bool   shutdown;
+    volatile bool   failed;
+    volatile bool   closed;
+    volatile bool   released;       // reactor: closed and on_comm_close returned
+    int             baud;
     f_on_comm_read   on_comm_read;
     void           * comm_read_param;
     f_on_comm_close  on_comm_close;
     void            *comm_close_param;
 
-    CRITICAL_SECTION cs;
-    char            comm_write_buf[COMM_WRITE_BUF_SIZE];
-    char            comm_write_send_buf[COMM_WRITE_BUF_SIZE];
-    DWORD           write_buf_used;
+    uart_ring       tx;             // filled by uart_send, WriteFile reads from it directly
+
+    // backpressure: senders blocked in uart_send_timeout, writable callback
+    SRWLOCK         tx_lock;
+    CONDITION_VARIABLE tx_space;
+    volatile uint32_t tx_waiters;
+    volatile uint32_t writable_armed;
+    volatile uint32_t tx_held;      // a WriteFile is in flight: small sends leave the wake to its completion
+    int             writable_low;
+    f_on_comm_writable on_comm_writable;
+    void            *comm_writable_param;
+
+    uart_watch_entry watches[UART_MAX_WATCHES];
+
+    f_on_comm_line  on_comm_line;
+    void           *comm_line_param;
+    int             line_in;        // modem inputs at the last comm event
+    int             line_out;       // DTR, RTS and BREAK as set
+    volatile uint32_t purge_rx;     // uart_purge requests for the I/O thread
+    volatile uint32_t purge_tx;
+
+    uart_rx_policy  rx_policy;
+    uart_io_profile io;             // of the I/O thread, its rx policy is rx_policy; written under tx_lock
+    uart_io_profile io_next;        // set by uart_set_io_profile under tx_lock, taken by the I/O thread
+    volatile uint32_t io_pending;   // io_next is to be taken
+    volatile uint32_t tx_coalesce;  // io.tx_coalesce, for the senders
+    bool            rx_parked;      // EV_RXCHAR not waited for until rx_park_until
+    int64_t         rx_park_until;
+    char           *rx_buf;         // comm_read_buf, or a pool buffer (NULL: pool starved)
+    uart_rx_pool   *rx_pool;
+    uart_rx_pool * volatile rx_pool_next;   // set by uart_set_rx_pool, taken by the I/O thread
+    int             rx_held;        // bytes of the pending batch in rx_buf
+    uart_rx_times   rx_times;       // arrival of them, the first mark also drives rx_policy
+    uart_stats      stats;          // see uart_stats.h
+    uart_stats      stats_base;     // taken by uart_reset_stats
+    int64_t         tx_blocked_us;  // since when queued TX waits for the device, 0: it does not
+    int             tx_blocked_outq;    // bytes the driver had queued then
+    int             flow;           // enum_flow_control
+    int             comm_buf;       // driver queue sizes given to SetupComm
+
+    uart_framer    *framer;         // uart_set_framing, NULL: batches to on_comm_read
+    uart_framing    framing;        // also for uart_send_frame
+
+    uart_capture   *capture;        // uart_set_capture
+    int             capture_port;
+
+    uart_expect_tap expect;         // uart_set_expect, under tx_lock
+    CONDITION_VARIABLE expect_match;    // a match was queued, or the port closed
 
     char            comm_read_buf[COMM_READ_BUF_SIZE];
-} uart_obj, *p_uart_obj;
-
-EXPORT_DLL uart_obj *uart_open(uart_obj *uart,
-            const int portnr,
-            int  baud,          // baudrate
-            const char *parity, // parity    "none", "even", "odd", "mark", and "space"
-            int  databits,      // databits
-            int  stopbits,
-            f_on_comm_read   on_comm_read,
-            void            *comm_read_param,
-            f_on_comm_close  on_comm_close,
-            void            *comm_close_param,
-            const bool       async_io);
-
-EXPORT_DLL void uart_send(uart_obj *uart, const char *buf, const int l);
-
-EXPORT_DLL void uart_shutdown(uart_obj *uart);
-
-EXPORT_DLL int get_uart_obj_size(void);
-
-EXPORT_DLL int uart_config(uart_obj *uart,
-            int  baud,
-            const char *parity,
-            int  databits,
-            int  stopbits);
+};
 
 #endif